@@ -1,7 +1,14 @@
 // swift-tools-version:5.1
 
+import Foundation
 import PackageDescription
 
+// zstd compression of large blob transfers in the Bazel backend links against the system libzstd, so it is only built
+// when LLBUILD2_ENABLE_ZSTD is set in the environment.
+let enableZstd = ProcessInfo.processInfo.environment["LLBUILD2_ENABLE_ZSTD"] != nil
+let zstdDependencies: [Target.Dependency] = enableZstd ? ["CZstd"] : []
+let zstdSettings: [SwiftSetting] = enableZstd ? [.define("LLBUILD2_ZSTD")] : []
+
 let package = Package(
     name: "llbuild2",
     platforms: [
@@ -12,6 +19,7 @@ let package = Package(
         .library(name: "llbuild2Ninja", targets: ["LLBNinja"]),
         .library(name: "llbuild2BuildSystem", targets: ["LLBBuildSystem"]),
         .library(name: "llbuild2Util", targets: ["LLBUtil", "LLBBuildSystemUtil"]),
+        .library(name: "llbuild2Metrics", targets: ["LLBSwiftMetrics"]),
     ],
     dependencies: [
         .package(url: "https://github.com/apple/swift-argument-parser.git", from: "0.0.1"),
@@ -22,6 +30,7 @@ let package = Package(
         .package(url: "https://github.com/apple/swift-protobuf.git", from: "1.8.0"),
         .package(url: "https://github.com/grpc/grpc-swift.git", from: "1.0.0"),
         .package(url: "https://github.com/apple/swift-log.git", from: "1.2.0"),
+        .package(url: "https://github.com/apple/swift-metrics.git", from: "2.0.0"),
     ],
     targets: [
         // Core build functionality
@@ -34,6 +43,16 @@ let package = Package(
             dependencies: ["llbuild2", "LLBUtil"]
         ),
 
+        // Export of the llbuild2 metrics to swift-metrics
+        .target(
+            name: "LLBSwiftMetrics",
+            dependencies: ["llbuild2", "Metrics"]
+        ),
+        .testTarget(
+            name: "LLBSwiftMetricsTests",
+            dependencies: ["LLBSwiftMetrics", "llbuild2", "Metrics"]
+        ),
+
         // Bazel RemoteAPI Protocol
         .target(
             name: "BazelRemoteAPI",
@@ -43,11 +62,11 @@ let package = Package(
         // Ninja Build support
         .target(
             name: "LLBNinja",
-            dependencies: ["llbuild2", "LLBUtil", "Ninja"]
+            dependencies: ["llbuild2", "LLBUtil", "Ninja", "SwiftProtobuf", "SwiftToolsSupport-auto"]
         ),
         .testTarget(
             name: "LLBNinjaTests",
-            dependencies: ["LLBNinja", "SwiftToolsSupport-auto"]
+            dependencies: ["LLBNinja", "LLBBuildSystemUtil", "SwiftToolsSupport-auto"]
         ),
 
         // Utility classes, including concrete/default implementations of core
@@ -64,7 +83,18 @@ let package = Package(
         // Bazel CAS/Execution Backend
         .target(
             name: "LLBBazelBackend",
-            dependencies: ["llbuild2", "BazelRemoteAPI", "Crypto", "GRPC"]
+            dependencies: ["llbuild2", "BazelRemoteAPI", "Crypto", "GRPC", "Logging"] + zstdDependencies,
+            swiftSettings: zstdSettings
+        ),
+        .testTarget(
+            name: "LLBBazelBackendTests",
+            dependencies: ["LLBBazelBackend", "BazelRemoteAPI", "GRPC"],
+            swiftSettings: zstdSettings
+        ),
+        .systemLibrary(
+            name: "CZstd",
+            pkgConfig: "libzstd",
+            providers: [.brew(["zstd"]), .apt(["libzstd-dev"])]
         ),
 
         // Build system support
@@ -92,7 +122,7 @@ let package = Package(
         // Command line tools
         .target(
             name: "LLBCommands",
-            dependencies: ["LLBNinja", "ArgumentParser"]
+            dependencies: ["LLBNinja", "LLBBuildSystemUtil", "ArgumentParser", "SwiftToolsSupport-auto"]
         ),
 
         // llcastool implementation
@@ -107,6 +137,10 @@ let package = Package(
                 "LLBUtil",
             ]
         ),
+        .testTarget(
+            name: "LLBCASToolTests",
+            dependencies: ["LLBCASTool", "llbuild2", "LLBUtil", "SwiftToolsSupport-auto"]
+        ),
 
 
         // Executable multi-tool
@@ -116,6 +150,13 @@ let package = Package(
             path: "Sources/Tools/llbuild2-tool"
         ),
 
+        // Microbenchmarks of the core components.
+        .target(
+            name: "llbuild2-benchmark",
+            dependencies: ["llbuild2", "LLBUtil", "LLBBazelBackend", "ArgumentParser", "SwiftToolsSupport-auto"],
+            path: "Sources/Tools/llbuild2-benchmark"
+        ),
+
         // `llcastool` executable.
         .target(
             name: "llcastool",
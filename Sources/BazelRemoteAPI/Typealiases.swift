@@ -15,3 +15,25 @@ public typealias ServerCapabilities = Build_Bazel_Remote_Execution_V2_ServerCapa
 
 
 public typealias FindMissingBlobsRequest = Build_Bazel_Remote_Execution_V2_FindMissingBlobsRequest
+public typealias BatchReadBlobsRequest = Build_Bazel_Remote_Execution_V2_BatchReadBlobsRequest
+public typealias BatchUpdateBlobsRequest = Build_Bazel_Remote_Execution_V2_BatchUpdateBlobsRequest
+
+
+public typealias ActionCacheClient = Build_Bazel_Remote_Execution_V2_ActionCacheClient
+public typealias ActionResult = Build_Bazel_Remote_Execution_V2_ActionResult
+public typealias OutputFile = Build_Bazel_Remote_Execution_V2_OutputFile
+public typealias GetActionResultRequest = Build_Bazel_Remote_Execution_V2_GetActionResultRequest
+public typealias UpdateActionResultRequest = Build_Bazel_Remote_Execution_V2_UpdateActionResultRequest
+
+
+public typealias ExecutionClient = Build_Bazel_Remote_Execution_V2_ExecutionClient
+public typealias ExecuteRequest = Build_Bazel_Remote_Execution_V2_ExecuteRequest
+public typealias ExecuteResponse = Build_Bazel_Remote_Execution_V2_ExecuteResponse
+public typealias WaitExecutionRequest = Build_Bazel_Remote_Execution_V2_WaitExecutionRequest
+public typealias RemoteAction = Build_Bazel_Remote_Execution_V2_Action
+public typealias RemoteCommand = Build_Bazel_Remote_Execution_V2_Command
+public typealias RemoteDirectory = Build_Bazel_Remote_Execution_V2_Directory
+public typealias FileNode = Build_Bazel_Remote_Execution_V2_FileNode
+public typealias DirectoryNode = Build_Bazel_Remote_Execution_V2_DirectoryNode
+public typealias SymlinkNode = Build_Bazel_Remote_Execution_V2_SymlinkNode
+public typealias RemoteTree = Build_Bazel_Remote_Execution_V2_Tree
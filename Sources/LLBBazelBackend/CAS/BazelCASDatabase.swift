@@ -12,6 +12,8 @@ import llbuild2
 
 import BazelRemoteAPI
 import GRPC
+import NIO
+import NIOConcurrencyHelpers
 import SwiftProtobuf
 import TSCBasic
 
@@ -21,75 +23,130 @@ public final class LLBBazelCASDatabase {
     /// Threads capable of running futures.
     public var group: LLBFuturesDispatchGroup
 
-    private let connection: ClientConnection
-    private let headers: [GRPCHeader]
+    let connection: ClientConnection
+    let headers: [LLBBazelConnection.GRPCHeader]
     private let bytestreamClient: Google_Bytestream_ByteStreamClient
-    private let bytestreamUUID = UUID()
     private let casClient: ContentAddressableStorageClient
-    private let instance: String?
+    let instance: String?
+
+    /// The maximum size of the data sent in each ByteStream write request.
+    private let byteStreamChunkSize: Int
+
+    /// The number of times a failed ByteStream transfer is resumed before giving up.
+    private let byteStreamRetries: Int
+
+    /// The time window during which concurrent requests are coalesced into batch RPCs, or nil if batching is disabled.
+    private let batchWindow: TimeAmount?
+
+    /// Coalesces concurrent `contains` requests into FindMissingBlobs calls.
+    private var containsBatcher: LLBBlobBatcher<Digest, Bool>?
+
+    /// Batchers for reading and writing small blobs, created once the server capabilities are known.
+    private struct TransferBatchers {
+        /// The maximum size that a single blob can contribute to a batch.
+        let maxBatchSize: Int
+        let read: LLBBlobBatcher<Digest, LLBCASObject?>
+        let update: LLBBlobBatcher<(Digest, Data), LLBDataID>
+    }
+
+    private let transferBatchersLock = Lock()
+    private var transferBatchersFuture: LLBFuture<TransferBatchers?>?
+
+    /// Whether ByteStream transfers are compressed if the server supports it.
+    private let useCompression: Bool
+
+    /// The threads that write downloaded files, so that the event loops never wait for the file system.
+    private let threadPool: NIOThreadPool
+    private let fileIO: NonBlockingFileIO
+
+    /// The compressor used by ByteStream transfers, negotiated once with the server.
+    private enum ByteStreamCompression {
+        case identity
+        case zstd
+    }
+
+    private let capabilitiesLock = Lock()
+    private var capabilitiesFuture: LLBFuture<ServerCapabilities>?
+    private var compressionFuture: LLBFuture<ByteStreamCompression>?
+
+    /// gRPC limits messages to 4MiB by default, so this is used as a cap for batch requests even if the server
+    /// advertises a larger (or no) limit.
+    static let maxBatchTotalSize = 4 * 1024 * 1024
+
+    /// Estimated size of the per-blob metadata (digest and status) that is sent along with each blob in a batch.
+    static let batchEntryOverhead = 128
 
     public enum Error: Swift.Error {
         case callFailed(GRPCStatus)
         case unexpectedConnectionString(String)
         case badURL
         case incompleteWrite
+        case batchRequestFailed(Google_Rpc_Status)
+        case incompleteRead
+        /// The database was released while a batch was waiting to be sent.
+        case databaseReleased
     }
 
-    private typealias GRPCHeader = (key: String, value: String)
-
     /// Connect to a Bazel RE2 CAS database
-    public init(group: LLBFuturesDispatchGroup, url: URL) throws {
+    ///
+    /// - Parameters:
+    ///     - group: The event loop group to use for the connection.
+    ///     - url: The bazel:// URL of the server.
+    ///     - batchWindow: The time window during which concurrent small requests are coalesced into the
+    ///           FindMissingBlobs, BatchReadBlobs and BatchUpdateBlobs RPCs. If nil, each request is sent on its own.
+    ///     - byteStreamChunkSize: The maximum size of each chunk sent when uploading large blobs.
+    ///     - byteStreamRetries: The number of times a failed upload or download of a large blob is resumed.
+    ///     - useCompression: Whether large blobs are transferred through the zstd `compressed-blobs` ByteStream
+    ///           resources when the server advertises support for them. It has no effect unless the package was built
+    ///           with zstd (`LLBUILD2_ENABLE_ZSTD`).
+    public init(
+        group: LLBFuturesDispatchGroup,
+        url: URL,
+        batchWindow: TimeAmount? = .milliseconds(2),
+        byteStreamChunkSize: Int = 1024 * 1024,
+        byteStreamRetries: Int = 3,
+        useCompression: Bool = true
+    ) throws {
         assert(url.scheme == "bazel")
+        precondition(byteStreamChunkSize > 0)
 
         self.group = group
+        self.batchWindow = batchWindow
+        self.byteStreamChunkSize = byteStreamChunkSize
+        self.byteStreamRetries = byteStreamRetries
+        self.useCompression = useCompression
+        self.threadPool = NIOThreadPool(numberOfThreads: 2)
+        threadPool.start()
+        self.fileIO = NonBlockingFileIO(threadPool: threadPool)
 
-        // Parse headers from the URL
-        if let query = url.query {
-            guard let items = LLBBazelCASDatabase.extractQueryItems(query) else {
-                throw Error.unexpectedConnectionString(query)
-            }
-            headers = items
-        } else {
-            headers = []
-        }
-
-        // Extract instance from the URL
-        self.instance = url.path.isEmpty ? nil : String(url.path.dropFirst())
+        let bazelConnection = try LLBBazelConnection(group: group, url: url)
+        self.connection = bazelConnection.connection
+        self.headers = bazelConnection.headers
+        self.instance = bazelConnection.instance
 
-
-        // Cleanup the URL for GRPC connection
-        guard let frontend = URL(string: "grpc://\(url.host ?? "localhost"):\(url.port ?? 8980)") else {
-            throw Error.badURL
-        }
-
-        // Create the GRPC connection
-        let configuration = ClientConnection.Configuration(
-            target: try frontend.toConnectionTarget(),
-            eventLoopGroup: group
-        )
-        self.connection = ClientConnection(configuration: configuration)
         self.bytestreamClient = Google_Bytestream_ByteStreamClient(channel: connection)
         self.bytestreamClient.defaultCallOptions.customMetadata.add(contentsOf: headers)
         self.casClient = ContentAddressableStorageClient(channel: connection)
         self.casClient.defaultCallOptions.customMetadata.add(contentsOf: headers)
-    }
 
-    private static func extractQueryItems(_ query: String) -> [GRPCHeader]? {
-        guard let components = NSURLComponents(string: "?" + query) else {
-            return nil
-        }
-        guard let queryItems = components.queryItems else {
-            return nil
-        }
-        var results: [GRPCHeader] = []
-        for item in queryItems {
-            guard let value = item.value else {
-                // A query item missing a value is unexpected.
-                return nil
+        if let batchWindow = batchWindow {
+            // The batchers outlive the database while a flush is scheduled, so they fail the pending batch once the
+            // database is gone instead of keeping it alive.
+            self.containsBatcher = LLBBlobBatcher(
+                group: group,
+                window: batchWindow,
+                maxBatchSize: LLBBazelCASDatabase.maxBatchTotalSize
+            ) { [weak self] digests in
+                guard let self = self else {
+                    return group.next().makeFailedFuture(Error.databaseReleased)
+                }
+                return self.findMissingBlobs(digests)
             }
-            results.append((item.name, value))
         }
-        return results
+    }
+
+    deinit {
+        try? threadPool.syncShutdownGracefully()
     }
 
     public func serverCapabilities() -> LLBFuture<ServerCapabilities> {
@@ -107,6 +164,105 @@ public final class LLBBazelCASDatabase {
 
         return client.getCapabilities(request).response
     }
+
+    /// Returns the server capabilities, which are only requested once.
+    private func cachedServerCapabilities() -> LLBFuture<ServerCapabilities> {
+        return capabilitiesLock.withLock {
+            if let capabilitiesFuture = capabilitiesFuture {
+                return capabilitiesFuture
+            }
+            let future = serverCapabilities()
+            capabilitiesFuture = future
+            return future
+        }
+    }
+
+    /// Returns the compressor to use for ByteStream transfers: zstd if it is enabled and the server lists it in its
+    /// `supported_compressors`, and no compression otherwise.
+    private func byteStreamCompression() -> LLBFuture<ByteStreamCompression> {
+        #if LLBUILD2_ZSTD
+        let zstdAvailable = true
+        #else
+        let zstdAvailable = false
+        #endif
+        guard useCompression, zstdAvailable else {
+            return group.next().makeSucceededFuture(.identity)
+        }
+
+        let capabilities = cachedServerCapabilities()
+        return capabilitiesLock.withLock {
+            if let compressionFuture = compressionFuture {
+                return compressionFuture
+            }
+
+            let future = capabilities.map { capabilities -> ByteStreamCompression in
+                capabilities.cacheCapabilities.supportsZstdCompression ? .zstd : .identity
+            }.recover { _ in
+                // Servers that can't report their capabilities are only expected to support uncompressed transfers.
+                return .identity
+            }
+            compressionFuture = future
+            return future
+        }
+    }
+}
+
+extension Build_Bazel_Remote_Execution_V2_CacheCapabilities {
+    static let supportedCompressorsFieldNumber: UInt64 = 6
+    static let zstdCompressor: UInt64 = 1
+
+    /// Whether `supported_compressors` lists zstd. The vendored REAPI protos predate the field (and its `Compressor`
+    /// enum), so it is read from the unknown fields until the protos are synced with upstream and regenerated.
+    var supportsZstdCompression: Bool {
+        var bytes = unknownFields.data
+        while let tag = Self.readVarint(&bytes) {
+            let isCompressors = tag >> 3 == Self.supportedCompressorsFieldNumber
+            switch tag & 7 {
+            case 0:
+                // A single enum value.
+                guard let value = Self.readVarint(&bytes) else {
+                    return false
+                }
+                if isCompressors && value == Self.zstdCompressor {
+                    return true
+                }
+            case 1:
+                bytes = bytes.dropFirst(8)
+            case 2:
+                // Length delimited, which is how repeated enums are packed.
+                guard let length = Self.readVarint(&bytes), length <= UInt64(bytes.count) else {
+                    return false
+                }
+                var payload = bytes.prefix(Int(length))
+                bytes = bytes.dropFirst(Int(length))
+                while isCompressors, let value = Self.readVarint(&payload) {
+                    if value == Self.zstdCompressor {
+                        return true
+                    }
+                }
+            case 5:
+                bytes = bytes.dropFirst(4)
+            default:
+                // Groups are deprecated and never used by the REAPI.
+                return false
+            }
+        }
+        return false
+    }
+
+    /// Reads a protobuf varint from the front of `bytes`, or returns nil if there is none.
+    private static func readVarint(_ bytes: inout Data) -> UInt64? {
+        var value: UInt64 = 0
+        var shift: UInt64 = 0
+        while let byte = bytes.popFirst(), shift < 64 {
+            value |= UInt64(byte & 0x7f) << shift
+            if byte & 0x80 == 0 {
+                return value
+            }
+            shift += 7
+        }
+        return nil
+    }
 }
 
 extension LLBBazelCASDatabase: LLBCASDatabase {
@@ -115,108 +271,753 @@ extension LLBBazelCASDatabase: LLBCASDatabase {
     }
 
     public func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> {
-        var request: FindMissingBlobsRequest
-        if let instance = instance {
-            request = .with {
-                $0.instanceName = instance
-            }
-        } else {
-            request = FindMissingBlobsRequest()
+        let digest: Digest
+        do {
+            try ctx.cancellationToken?.checkCancelled()
+            digest = try id.asBazelDigest()
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
+
+        if let containsBatcher = containsBatcher {
+            return containsBatcher.submit(digest, size: digest.hash.utf8.count + LLBBazelCASDatabase.batchEntryOverhead)
         }
+
+        return findMissingBlobs([digest]).flatMapThrowing { try $0[0].get() }
+    }
+
+    public func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        let digest: Digest
         do {
-            request.blobDigests.append(try id.asBazelDigest())
+            // Transfers of cancelled builds aren't started, which stops large trees from being transferred object by
+            // object after the build is cancelled. Streamed transfers that already started stop between chunks.
+            try ctx.cancellationToken?.checkCancelled()
+            digest = try id.asBazelDigest()
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
 
-            return casClient.findMissingBlobs(request).response.map {
-                return $0.missingBlobDigests.isEmpty
+        return transferBatchers().flatMap { batchers in
+            let size = Int(digest.sizeBytes) + LLBBazelCASDatabase.batchEntryOverhead
+            if let batchers = batchers, size <= batchers.maxBatchSize {
+                return batchers.read.submit(digest, size: size)
             }
+            return self.streamingGet(digest: digest, ctx)
+        }
+    }
+
+    public func identify(refs: [LLBDataID] = [], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        do {
+            // Identify the serialized object, so that the ID matches the one returned by `put`.
+            let objData = try LLBCASObject(refs: refs, data: data).toData()
+            let id = try Digest(with: objData).asDataID()
+            return group.next().makeSucceededFuture(id)
         } catch {
             return group.next().makeFailedFuture(error)
         }
     }
 
-    public func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+    public func put(refs: [LLBDataID] = [], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        let objData: Data
         do {
-            let resourcePrefix: String
-            if let instance = instance {
-                resourcePrefix = "\(instance)/"
-            } else {
-                resourcePrefix = ""
+            try ctx.cancellationToken?.checkCancelled()
+            let object = LLBCASObject(refs: refs, data: data)
+            objData = try object.toData()
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
+        let digest = Digest(with: objData)
+
+        return transferBatchers().flatMap { batchers in
+            let size = objData.count + LLBBazelCASDatabase.batchEntryOverhead
+            if let batchers = batchers, size <= batchers.maxBatchSize {
+                return batchers.update.submit((digest, objData), size: size)
             }
-            let digest = try id.asBazelDigest()
-            let resource = "\(resourcePrefix)blobs/\(digest.hash)/\(digest.sizeBytes)"
+            return self.streamingPut(digest: digest, data: objData, ctx.cancellationToken)
+        }
+    }
 
-            let request =  Google_Bytestream_ReadRequest.with {
-                $0.resourceName = resource
-                $0.readOffset = 0
+    public func put(knownID id: LLBDataID, refs: [LLBDataID] = [], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        // Bazel DataIDs are intrinsically tied to the internal protobuf storage
+        // While it is possible a client could have it already, we'd have to go
+        // through the motions to confirm anyway.
+        return put(refs: refs, data: data, ctx)
+    }
+}
+
+extension LLBBazelCASDatabase: LLBBatchPutCASDatabase {
+    /// Writes the objects with as few BatchUpdateBlobs calls as the batch size limit allows, without waiting for the
+    /// batch window. Objects that are too large to be batched are uploaded with the ByteStream API, and if batching is
+    /// disabled each object is written on its own.
+    public func batchPut(_ objects: [LLBCASObject], _ ctx: Context) -> LLBFuture<[LLBDataID]> {
+        let blobs: [(Digest, Data)]
+        do {
+            blobs = try objects.map { object in
+                let objData = try object.toData()
+                return (Digest(with: objData), objData)
             }
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
 
-            var buffer = LLBByteBufferAllocator().buffer(capacity: Int(digest.sizeBytes))
-            let call = bytestreamClient.read(request) { response in
-                buffer.writeBytes(response.data)
+        return transferBatchers().flatMap { batchers in
+            guard let maxBatchSize = batchers?.maxBatchSize else {
+                let futures = objects.map { self.put(refs: $0.refs, data: $0.data, ctx) }
+                return LLBFuture.whenAllSucceed(futures, on: self.group.next())
             }
-            return call.status.flatMapThrowing { status -> LLBCASObject? in
-                guard status.code == .ok else {
-                    return nil
+
+            var futures = [LLBFuture<LLBDataID>?](repeating: nil, count: blobs.count)
+            var batch = [Int]()
+            var batchSize = 0
+
+            func sendBatch() {
+                guard !batch.isEmpty else {
+                    return
                 }
+                let response = self.batchUpdateBlobs(batch.map { blobs[$0] })
+                for (position, index) in batch.enumerated() {
+                    futures[index] = response.flatMapThrowing { try $0[position].get() }
+                }
+                batch = []
+                batchSize = 0
+            }
 
-                return try LLBCASObject(from: buffer)
+            for (index, (digest, objData)) in blobs.enumerated() {
+                let size = objData.count + LLBBazelCASDatabase.batchEntryOverhead
+                guard size <= maxBatchSize else {
+                    futures[index] = self.streamingPut(digest: digest, data: objData, ctx.cancellationToken)
+                    continue
+                }
+                if batchSize + size > maxBatchSize {
+                    sendBatch()
+                }
+                batch.append(index)
+                batchSize += size
             }
+            sendBatch()
+
+            return LLBFuture.whenAllSucceed(futures.map { $0! }, on: self.group.next())
+        }
+    }
+}
+
+// MARK:- Transfer implementations
+
+extension LLBBazelCASDatabase {
+    private var resourcePrefix: String {
+        if let instance = instance {
+            return "\(instance)/"
+        } else {
+            return ""
+        }
+    }
+
+    /// Reads a single object using the ByteStream API. The object is decoded as it is received, so that only its data
+    /// is buffered, not also its serialized form. Objects are returned in memory, so large files should be downloaded
+    /// with `download(_:to:_:)` instead.
+    private func streamingGet(digest: Digest, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        var data = LLBByteBufferAllocator().buffer(capacity: Int(digest.sizeBytes))
+        let decoder = LLBCASObjectStreamDecoder { chunk in
+            data.writeBytes(chunk)
+        }
+        return resumableRead(digest: digest, ctx.cancellationToken) { chunk in
+            try decoder.decode(chunk)
+        }.flatMapThrowing { found -> LLBCASObject? in
+            guard found else {
+                return nil
+            }
+            return LLBCASObject(refs: try decoder.finish(), data: data)
+        }
+    }
+
+    /// Writes a single blob using the ByteStream API. The blob is sent in chunks of `byteStreamChunkSize` bytes, and
+    /// the upload is resumed from the committed size reported by QueryWriteStatus if the write fails. If the server
+    /// supports it, the chunks are compressed with zstd as they are sent.
+    private func streamingPut(digest: Digest, data: Data, _ token: LLBCancellationToken?) -> LLBFuture<LLBDataID> {
+        return byteStreamCompression().flatMap { compression -> LLBFuture<Int64> in
+            switch compression {
+            case .identity:
+                // Each upload uses its own UUID, so that concurrent uploads of the same blob don't interfere with each
+                // other and the partial upload can be queried if the write needs to be resumed.
+                let resource = "\(self.resourcePrefix)uploads/\(UUID())/blobs/\(digest.hash)/\(digest.sizeBytes)"
+                return self.resumableWrite(resource: resource, data: data, offset: 0, retriesLeft: self.byteStreamRetries, token)
+            case .zstd:
+                return self.compressedWrite(digest: digest, data: data, retriesLeft: self.byteStreamRetries, token).map { committedSize in
+                    // Servers report -1 if the blob already existed and the upload was cut short.
+                    committedSize == -1 ? Int64(data.count) : committedSize
+                }
+            }
+        }.flatMapThrowing { committedSize in
+            guard committedSize == data.count else {
+                throw Error.incompleteWrite
+            }
+
+            return try digest.asDataID()
+        }
+    }
+
+    /// Downloads the data of an object into a file at `path`, without holding the object in memory. The object is
+    /// decoded as it is received, so the file only has the data of the object, not its refs. Returns false if the
+    /// object does not exist.
+    public func download(_ id: LLBDataID, to path: AbsolutePath, _ ctx: Context) -> LLBFuture<Bool> {
+        let digest: Digest
+        do {
+            digest = try id.asBazelDigest()
         } catch {
             return group.next().makeFailedFuture(error)
         }
+        return download(digest, to: path, decodingObject: true, ctx)
     }
 
-    public func identify(refs: [LLBDataID] = [], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+    /// Downloads a raw blob into a file at `path`, without holding it in memory. Unlike `download(_:to:_:)`, the digest
+    /// refers to a raw blob (as used by the remote execution API, for the outputs of remote actions) instead of a
+    /// serialized CAS object, and the blob is written as it is. Returns false if the blob does not exist.
+    func downloadRawBlob(digest: Digest, to path: AbsolutePath, _ ctx: Context) -> LLBFuture<Bool> {
+        return download(digest, to: path, decodingObject: false, ctx)
+    }
+
+    /// Streams a blob into a file. The file is opened, written and closed on the thread pool of the database, and the
+    /// chunks are written in order, each after the previous one, so the event loops never wait for the file system.
+    private func download(_ digest: Digest, to path: AbsolutePath, decodingObject: Bool, _ ctx: Context) -> LLBFuture<Bool> {
+        if let reason = ctx.cancellationToken?.reason {
+            return group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+        }
+
+        let eventLoop = group.next()
+        let flags = NIOFileHandle.Flags.posix(flags: O_CREAT | O_TRUNC, mode: S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+        return fileIO.openFile(path: path.pathString, mode: .write, flags: flags, eventLoop: eventLoop).flatMap { handle in
+            let lock = Lock()
+            var written = eventLoop.makeSucceededFuture(())
+            let write = { (chunk: Data) in
+                var buffer = LLBByteBufferAllocator().buffer(capacity: chunk.count)
+                buffer.writeBytes(chunk)
+                lock.withLockVoid {
+                    written = written.flatMap {
+                        self.fileIO.write(fileHandle: handle, buffer: buffer, eventLoop: eventLoop)
+                    }
+                }
+            }
+            let decoder = decodingObject ? LLBCASObjectStreamDecoder(write) : nil
+
+            let downloaded = self.resumableRead(digest: digest, ctx.cancellationToken) { chunk in
+                if let decoder = decoder {
+                    try decoder.decode(chunk)
+                } else {
+                    write(chunk)
+                }
+            }.flatMapThrowing { found -> Bool in
+                if found {
+                    _ = try decoder?.finish()
+                }
+                return found
+            }.flatMap { found in
+                lock.withLock { written }.map { found }
+            }
+
+            return downloaded.flatMap { found in
+                self.threadPool.runIfActive(eventLoop: eventLoop) { try handle.close() }.map { found }
+            }.flatMapError { error in
+                self.threadPool.runIfActive(eventLoop: eventLoop) { try? handle.close() }.flatMapThrowing { throw error }
+            }
+        }
+    }
+
+    /// Reads a blob using the ByteStream API, handing each received chunk to `consumer`. If the read fails with a
+    /// transient error or ends early, it is resumed from the received offset, so `consumer` sees every byte of the
+    /// blob exactly once. Other errors fail the read right away.
+    /// The read is cancelled between chunks if the token is cancelled, or if `consumer` throws. Returns false if the
+    /// blob does not exist.
+    private func resumableRead(
+        digest: Digest,
+        _ token: LLBCancellationToken?,
+        consumer: @escaping (Data) throws -> Void
+    ) -> LLBFuture<Bool> {
+        return byteStreamCompression().flatMap { compression in
+            self.resumableRead(
+                digest: digest,
+                compression: compression,
+                offset: 0,
+                retriesLeft: self.byteStreamRetries,
+                token,
+                consumer: consumer
+            )
+        }
+    }
+
+    private func resumableRead(
+        digest: Digest,
+        compression: ByteStreamCompression,
+        offset: Int64,
+        retriesLeft: Int,
+        _ token: LLBCancellationToken?,
+        consumer: @escaping (Data) throws -> Void
+    ) -> LLBFuture<Bool> {
+        if let reason = token?.reason {
+            return group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+        }
+
+        let resource: String
+        let decompressor: LLBZstdDecompressor?
+        switch compression {
+        case .identity:
+            resource = "\(resourcePrefix)blobs/\(digest.hash)/\(digest.sizeBytes)"
+            decompressor = nil
+        case .zstd:
+            resource = "\(resourcePrefix)compressed-blobs/zstd/\(digest.hash)/\(digest.sizeBytes)"
+            do {
+                // Resumed reads start a new compressed stream, so each attempt has its own decompressor.
+                decompressor = try LLBZstdDecompressor()
+            } catch {
+                return group.next().makeFailedFuture(error)
+            }
+        }
+
+        // Offsets refer to the uncompressed blob, even for compressed reads.
+        let request =  Google_Bytestream_ReadRequest.with {
+            $0.resourceName = resource
+            $0.readOffset = offset
+        }
+
+        // The handler is invoked serially on the call's event loop, so there is no need to synchronize the offset.
+        var receivedOffset = offset
+        var handlerError: Swift.Error? = nil
+        var call: ServerStreamingCall<Google_Bytestream_ReadRequest, Google_Bytestream_ReadResponse>! = nil
+        call = bytestreamClient.read(request) { response in
+            guard handlerError == nil else {
+                return
+            }
+
+            do {
+                let data = try decompressor?.decompress(response.data) ?? response.data
+                receivedOffset += Int64(data.count)
+                try consumer(data)
+            } catch {
+                // The rest of the blob isn't needed once the consumer or the decompression fail.
+                handlerError = error
+                call.cancel(promise: nil)
+            }
+        }
+        cancel(on: token, until: call.status) {
+            call.cancel(promise: nil)
+        }
+
+        return call.status.flatMap { status -> LLBFuture<Bool> in
+            if let reason = token?.reason {
+                return self.group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+            }
+            if let handlerError = handlerError {
+                return self.group.next().makeFailedFuture(handlerError)
+            }
+
+            switch status.code {
+            case .ok:
+                // A server may end the stream early without an error, which the transport can't detect, so check the
+                // (decoded) size. Short reads are resumed from where they stopped; for compressed reads, the offset
+                // counts the decompressed bytes, and the resumed read starts a new compressed stream.
+                if receivedOffset == digest.sizeBytes {
+                    return self.group.next().makeSucceededFuture(true)
+                }
+                guard receivedOffset < digest.sizeBytes, receivedOffset > offset, retriesLeft > 0 else {
+                    return self.group.next().makeFailedFuture(Error.incompleteRead)
+                }
+                return self.resumableRead(
+                    digest: digest,
+                    compression: compression,
+                    offset: receivedOffset,
+                    retriesLeft: retriesLeft - 1,
+                    token,
+                    consumer: consumer
+                )
+            case .notFound:
+                return self.group.next().makeSucceededFuture(false)
+            default:
+                guard LLBBazelCASDatabase.isTransient(status.code), retriesLeft > 0 else {
+                    return self.group.next().makeFailedFuture(Error.callFailed(status))
+                }
+                return self.resumableRead(
+                    digest: digest,
+                    compression: compression,
+                    offset: receivedOffset,
+                    retriesLeft: retriesLeft - 1,
+                    token,
+                    consumer: consumer
+                )
+            }
+        }
+    }
+
+    /// Whether a failed call may succeed if it is retried. Other codes, such as `permissionDenied` or
+    /// `invalidArgument`, won't change on their own.
+    private static func isTransient(_ code: GRPCStatus.Code) -> Bool {
+        switch code {
+        case .unavailable, .deadlineExceeded, .resourceExhausted, .aborted:
+            return true
+        default:
+            return false
+        }
+    }
+
+    /// Runs `cancel` if the token is cancelled before `future` completes, which stops the transfers of cancelled builds
+    /// between chunks.
+    private func cancel<T>(on token: LLBCancellationToken?, until future: LLBFuture<T>, _ cancel: @escaping () -> Void) {
+        guard let token = token else {
+            return
+        }
+        let handle = token.onCancel { _ in
+            cancel()
+        }
+        future.whenComplete { _ in
+            token.remove(handle)
+        }
+    }
+
+    /// Writes `data` to `resource` starting at `offset`, returning the committed size reported by the server. On
+    /// failure, the server is asked for the committed size of the upload and the write is resumed from there.
+    private func resumableWrite(
+        resource: String,
+        data: Data,
+        offset: Int,
+        retriesLeft: Int,
+        _ token: LLBCancellationToken?
+    ) -> LLBFuture<Int64> {
+        let call = bytestreamClient.write()
+        cancel(on: token, until: call.response) {
+            call.cancel(promise: nil)
+        }
+
+        return sendChunks(call, resource: resource, data: data, offset: offset, token).flatMap {
+            call.response
+        }.map {
+            $0.committedSize
+        }.flatMapError { error in
+            call.cancel(promise: nil)
+
+            if let reason = token?.reason {
+                return self.group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+            }
+            guard retriesLeft > 0 else {
+                return self.group.next().makeFailedFuture(error)
+            }
+
+            return self.queryWriteStatus(resource).flatMap { status in
+                if status.complete {
+                    return self.group.next().makeSucceededFuture(status.committedSize)
+                }
+                return self.resumableWrite(
+                    resource: resource,
+                    data: data,
+                    offset: Int(status.committedSize),
+                    retriesLeft: retriesLeft - 1,
+                    token
+                )
+            }
+        }
+    }
+
+    /// Sends `data` starting at `offset` in chunks, waiting for each chunk to be written before sending the next one so
+    /// that large blobs are not buffered in full by the transport. Uploads of cancelled builds stop between chunks.
+    private func sendChunks(
+        _ call: ClientStreamingCall<Google_Bytestream_WriteRequest, Google_Bytestream_WriteResponse>,
+        resource: String,
+        data: Data,
+        offset: Int,
+        _ token: LLBCancellationToken?
+    ) -> LLBFuture<Void> {
+        if let reason = token?.reason {
+            return group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+        }
+
+        let end = min(offset + byteStreamChunkSize, data.count)
+        let request = Google_Bytestream_WriteRequest.with {
+            $0.resourceName = resource
+            $0.writeOffset = Int64(offset)
+            $0.finishWrite = end == data.count
+            $0.data = data[(data.startIndex + offset)..<(data.startIndex + end)]
+        }
+
+        return call.sendMessage(request).flatMap {
+            if end == data.count {
+                return call.sendEnd()
+            }
+            return self.sendChunks(call, resource: resource, data: data, offset: end, token)
+        }
+    }
+
+    /// Writes `data` to the zstd `compressed-blobs` resource of the digest, compressing each chunk as it is sent,
+    /// and returns the committed size reported by the server. A compressed upload can't be resumed in the middle of
+    /// its compressed stream, so failed uploads are restarted from the beginning.
+    private func compressedWrite(digest: Digest, data: Data, retriesLeft: Int, _ token: LLBCancellationToken?) -> LLBFuture<Int64> {
+        let resource = "\(resourcePrefix)uploads/\(UUID())/compressed-blobs/zstd/\(digest.hash)/\(digest.sizeBytes)"
+        let compressor: LLBZstdCompressor
         do {
-            let id = try Digest(with: data.readableBytesView).asDataID()
-            return group.next().makeSucceededFuture(id)
+            compressor = try LLBZstdCompressor()
         } catch {
             return group.next().makeFailedFuture(error)
         }
+
+        let call = bytestreamClient.write()
+        cancel(on: token, until: call.response) {
+            call.cancel(promise: nil)
+        }
+
+        return sendCompressedChunks(call, resource: resource, data: data, compressor: compressor, offset: 0, writeOffset: 0, token).flatMap {
+            call.response
+        }.map {
+            $0.committedSize
+        }.flatMapError { error in
+            call.cancel(promise: nil)
+
+            if let reason = token?.reason {
+                return self.group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+            }
+            guard retriesLeft > 0 else {
+                return self.group.next().makeFailedFuture(error)
+            }
+            return self.compressedWrite(digest: digest, data: data, retriesLeft: retriesLeft - 1, token)
+        }
     }
 
-    public func put(refs: [LLBDataID] = [], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+    /// Compresses and sends `data` starting at `offset` in chunks of `byteStreamChunkSize` uncompressed bytes, waiting
+    /// for each chunk to be written before compressing the next one. The write offset of the first request is the
+    /// uncompressed offset, and the following ones add the size of the compressed data sent so far.
+    private func sendCompressedChunks(
+        _ call: ClientStreamingCall<Google_Bytestream_WriteRequest, Google_Bytestream_WriteResponse>,
+        resource: String,
+        data: Data,
+        compressor: LLBZstdCompressor,
+        offset: Int,
+        writeOffset: Int64,
+        _ token: LLBCancellationToken?
+    ) -> LLBFuture<Void> {
+        if let reason = token?.reason {
+            return group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+        }
+
+        let end = min(offset + byteStreamChunkSize, data.count)
+        let isLastChunk = end == data.count
+        let compressed: Data
         do {
-            let resourcePrefix: String
+            compressed = try compressor.compress(data[(data.startIndex + offset)..<(data.startIndex + end)], finish: isLastChunk)
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
+
+        let sent: LLBFuture<Void>
+        if compressed.isEmpty && !isLastChunk {
+            // The compressor is still buffering the input, so there is nothing to send yet.
+            sent = group.next().makeSucceededFuture(())
+        } else {
+            let request = Google_Bytestream_WriteRequest.with {
+                $0.resourceName = resource
+                $0.writeOffset = writeOffset
+                $0.finishWrite = isLastChunk
+                $0.data = compressed
+            }
+            sent = call.sendMessage(request)
+        }
+
+        return sent.flatMap {
+            if isLastChunk {
+                return call.sendEnd()
+            }
+            return self.sendCompressedChunks(
+                call,
+                resource: resource,
+                data: data,
+                compressor: compressor,
+                offset: end,
+                writeOffset: writeOffset + Int64(compressed.count),
+                token
+            )
+        }
+    }
+
+    /// Returns the status of a partial upload. If the server doesn't know about the upload, it is reported as an upload
+    /// with nothing committed, so that it will be restarted from the beginning.
+    private func queryWriteStatus(_ resource: String) -> LLBFuture<Google_Bytestream_QueryWriteStatusResponse> {
+        let request = Google_Bytestream_QueryWriteStatusRequest.with {
+            $0.resourceName = resource
+        }
+
+        return bytestreamClient.queryWriteStatus(request).response.recover { _ in
+            Google_Bytestream_QueryWriteStatusResponse()
+        }
+    }
+
+    /// Checks for the presence of multiple blobs with a single FindMissingBlobs call, returning whether each of the
+    /// blobs is present.
+    private func findMissingBlobs(_ digests: [Digest]) -> LLBFuture<[Result<Bool, Swift.Error>]> {
+        let request = FindMissingBlobsRequest.with {
             if let instance = instance {
-                resourcePrefix = "\(instance)/"
-            } else {
-                resourcePrefix = ""
+                $0.instanceName = instance
             }
+            $0.blobDigests = Array(Set(digests))
+        }
 
-            let object = LLBCASObject(refs: refs, data: data)
-            let objData = try object.toData()
+        return casClient.findMissingBlobs(request).response.map { response in
+            let missing = Set(response.missingBlobDigests)
+            return digests.map { .success(!missing.contains($0)) }
+        }
+    }
 
-            let digest = Digest(with: objData)
-            let resource = "\(resourcePrefix)uploads/\(bytestreamUUID)/blobs/\(digest.hash)/\(digest.sizeBytes)"
+    /// Reads multiple small blobs with a single BatchReadBlobs call.
+    private func batchReadBlobs(_ digests: [Digest]) -> LLBFuture<[Result<LLBCASObject?, Swift.Error>]> {
+        let request = BatchReadBlobsRequest.with {
+            if let instance = instance {
+                $0.instanceName = instance
+            }
+            $0.digests = Array(Set(digests))
+        }
 
-            let request =  Google_Bytestream_WriteRequest.with {
-                $0.resourceName = resource
-                $0.writeOffset = 0
-                $0.finishWrite = true
-                $0.data = objData
+        return casClient.batchReadBlobs(request).response.map { response in
+            // The server is not required to respond in the same order as the request.
+            var results = [Digest: Result<LLBCASObject?, Swift.Error>]()
+            for blobResponse in response.responses {
+                switch Google_Rpc_Code(rawValue: Int(blobResponse.status.code)) {
+                case .ok:
+                    results[blobResponse.digest] = Result {
+                        try LLBCASObject(from: LLBByteBuffer.withBytes(ArraySlice(blobResponse.data)))
+                    }
+                case .notFound:
+                    results[blobResponse.digest] = .success(nil)
+                default:
+                    results[blobResponse.digest] = .failure(Error.batchRequestFailed(blobResponse.status))
+                }
             }
+            // Digests that the server left out of the response are errors, not missing blobs, so that a truncated
+            // response isn't mistaken for a cache miss.
+            return digests.map { results[$0] ?? .failure(Error.incompleteRead) }
+        }
+    }
 
-            let call = bytestreamClient.write()
-            _ = call.sendMessage(request)
-            _ = call.sendEnd()
-            return call.response.flatMapThrowing { response in
-                guard response.committedSize == objData.count else {
-                    throw Error.incompleteWrite
+    /// Writes multiple small blobs with a single BatchUpdateBlobs call.
+    private func batchUpdateBlobs(_ blobs: [(Digest, Data)]) -> LLBFuture<[Result<LLBDataID, Swift.Error>]> {
+        var seenDigests = Set<Digest>()
+        let request = BatchUpdateBlobsRequest.with {
+            if let instance = instance {
+                $0.instanceName = instance
+            }
+            $0.requests = blobs.compactMap { (digest, data) in
+                guard seenDigests.insert(digest).inserted else {
+                    return nil
+                }
+                return BatchUpdateBlobsRequest.Request.with {
+                    $0.digest = digest
+                    $0.data = data
                 }
+            }
+        }
 
-                return try digest.asDataID()
+        return casClient.batchUpdateBlobs(request).response.map { response in
+            var statuses = [Digest: Google_Rpc_Status]()
+            for blobResponse in response.responses {
+                statuses[blobResponse.digest] = blobResponse.status
+            }
+            return blobs.map { (digest, _) in
+                guard let status = statuses[digest] else {
+                    return .failure(Error.incompleteWrite)
+                }
+                guard Google_Rpc_Code(rawValue: Int(status.code)) == .ok else {
+                    return .failure(Error.batchRequestFailed(status))
+                }
+                return Result { try digest.asDataID() }
             }
-        } catch {
-            return group.next().makeFailedFuture(error)
         }
     }
 
-    public func put(knownID id: LLBDataID, refs: [LLBDataID] = [], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
-        // Bazel DataIDs are intrinsically tied to the internal protobuf storage
-        // While it is possible a client could have it already, we'd have to go
-        // through the motions to confirm anyway.
-        return put(refs: refs, data: data, ctx)
+    /// Returns the batchers for small blob transfers, or nil if batching is disabled or the server capabilities could
+    /// not be determined. The batch size limit is taken from the `maxBatchTotalSizeBytes` server capability.
+    private func transferBatchers() -> LLBFuture<TransferBatchers?> {
+        return transferBatchersLock.withLock {
+            if let transferBatchersFuture = transferBatchersFuture {
+                return transferBatchersFuture
+            }
+
+            let future: LLBFuture<TransferBatchers?>
+            if let batchWindow = batchWindow {
+                let group = self.group
+                future = cachedServerCapabilities().map { [weak self] capabilities -> TransferBatchers? in
+                    guard let self = self else {
+                        return nil
+                    }
+                    let serverLimit = Int(capabilities.cacheCapabilities.maxBatchTotalSizeBytes)
+                    // A limit of 0 means that the server does not impose a limit.
+                    let maxBatchSize = serverLimit > 0
+                        ? min(serverLimit, LLBBazelCASDatabase.maxBatchTotalSize)
+                        : LLBBazelCASDatabase.maxBatchTotalSize
+
+                    return TransferBatchers(
+                        maxBatchSize: maxBatchSize,
+                        read: LLBBlobBatcher(group: group, window: batchWindow, maxBatchSize: maxBatchSize) { [weak self] in
+                            guard let self = self else {
+                                return group.next().makeFailedFuture(Error.databaseReleased)
+                            }
+                            return self.batchReadBlobs($0)
+                        },
+                        update: LLBBlobBatcher(group: group, window: batchWindow, maxBatchSize: maxBatchSize) { [weak self] in
+                            guard let self = self else {
+                                return group.next().makeFailedFuture(Error.databaseReleased)
+                            }
+                            return self.batchUpdateBlobs($0)
+                        }
+                    )
+                }.recover { _ in
+                    // If the capabilities can't be retrieved, fall back to streaming each blob.
+                    return nil
+                }
+            } else {
+                future = group.next().makeSucceededFuture(nil)
+            }
+
+            transferBatchersFuture = future
+            return future
+        }
+    }
+}
+
+// MARK:- Raw blob access
+
+extension LLBBazelCASDatabase {
+    /// The maximum number of digests sent in a single FindMissingBlobs call.
+    static let maxFindMissingBlobsCount = 10_000
+
+    /// Returns the subset of the given digests that are not present in the CAS. Unlike `contains`, the digests refer to
+    /// raw blobs (as used by the remote execution API) instead of serialized CAS objects.
+    func findMissingRawBlobs(_ digests: [Digest]) -> LLBFuture<Set<Digest>> {
+        let uniqueDigests = Array(Set(digests))
+        let chunks = stride(from: 0, to: uniqueDigests.count, by: LLBBazelCASDatabase.maxFindMissingBlobsCount).map {
+            Array(uniqueDigests[$0..<min($0 + LLBBazelCASDatabase.maxFindMissingBlobsCount, uniqueDigests.count)])
+        }
+
+        let futures = chunks.map { chunk in
+            findMissingBlobs(chunk).flatMapThrowing { results in
+                try zip(chunk, results).compactMap { (digest, result) in
+                    try result.get() ? nil : digest
+                }
+            }
+        }
+        return LLBFuture.whenAllSucceed(futures, on: group.next()).map { Set($0.joined()) }
+    }
+
+    /// Uploads a raw blob to the CAS, using a batch request if it is small enough.
+    func putRawBlob(digest: Digest, data: Data) -> LLBFuture<Void> {
+        return transferBatchers().flatMap { batchers in
+            let size = data.count + LLBBazelCASDatabase.batchEntryOverhead
+            if let batchers = batchers, size <= batchers.maxBatchSize {
+                return batchers.update.submit((digest, data), size: size).map { _ in () }
+            }
+            return self.streamingPut(digest: digest, data: data, nil).map { _ in () }
+        }
+    }
+
+    /// Downloads a raw blob from the CAS, returning nil if it does not exist.
+    func getRawBlob(digest: Digest) -> LLBFuture<Data?> {
+        var data = Data(capacity: Int(digest.sizeBytes))
+        return resumableRead(digest: digest, nil) { chunk in
+            data.append(chunk)
+        }.map { found in
+            found ? data : nil
+        }
     }
 }
 
@@ -235,16 +1036,3 @@ public struct LLBBazelCASDatabaseScheme: LLBCASDatabaseScheme {
 public func registerCASSchemes() {
     LLBCASDatabaseSpec.register(schemeType: LLBBazelCASDatabaseScheme.self)
 }
-
-extension URL {
-    func toConnectionTarget() throws -> ConnectionTarget {
-        // FIXME: Support unix scheme?
-        guard let host = self.host else {
-            throw StringError("no host in url \(self)")
-        }
-        guard let port = self.port else {
-            throw StringError("no port in url \(self)")
-        }
-        return .hostAndPort(host, port)
-    }
-}
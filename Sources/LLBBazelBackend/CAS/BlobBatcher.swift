@@ -0,0 +1,128 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+
+import NIO
+import NIOConcurrencyHelpers
+
+
+/// Coalesces requests submitted concurrently within a short time window into a single batch, so that they can be sent
+/// to the server using one of the batch RPCs instead of one round trip per request. A batch is sent as soon as the
+/// window expires, or earlier if adding another request would exceed the maximum batch size or count.
+final class LLBBlobBatcher<Request, Response> {
+    /// Sends a batch of requests, returning one result per request in the same order as the requests.
+    typealias SendBatch = ([Request]) -> LLBFuture<[Result<Response, Swift.Error>]>
+
+    enum Error: Swift.Error {
+        case unexpectedResponseCount(expected: Int, actual: Int)
+    }
+
+    private struct Entry {
+        let request: Request
+        let size: Int
+        let promise: LLBPromise<Response>
+    }
+
+    private let group: LLBFuturesDispatchGroup
+    private let window: TimeAmount
+    private let maxBatchSize: Int
+    private let maxBatchCount: Int
+    private let sendBatch: SendBatch
+
+    /// The lock protecting the pending batch state.
+    private let lock = Lock()
+    private var pending = [Entry]()
+    private var pendingSize = 0
+    private var scheduledFlush: Scheduled<Void>?
+
+    init(
+        group: LLBFuturesDispatchGroup,
+        window: TimeAmount,
+        maxBatchSize: Int,
+        maxBatchCount: Int = 1000,
+        sendBatch: @escaping SendBatch
+    ) {
+        self.group = group
+        self.window = window
+        self.maxBatchSize = maxBatchSize
+        self.maxBatchCount = maxBatchCount
+        self.sendBatch = sendBatch
+    }
+
+    /// Submits a request to be sent in the next batch. The size is the contribution of the request to the total size
+    /// of the batch, and is expected to be at most `maxBatchSize`.
+    func submit(_ request: Request, size: Int) -> LLBFuture<Response> {
+        let promise = group.next().makePromise(of: Response.self)
+        let entry = Entry(request: request, size: size, promise: promise)
+
+        let readyBatches: [[Entry]] = lock.withLock {
+            var readyBatches = [[Entry]]()
+
+            // If the new request doesn't fit in the pending batch, send the pending batch first.
+            if !pending.isEmpty && pendingSize + size > maxBatchSize {
+                readyBatches.append(takePending())
+            }
+
+            pending.append(entry)
+            pendingSize += size
+
+            if pendingSize >= maxBatchSize || pending.count >= maxBatchCount {
+                readyBatches.append(takePending())
+            } else if scheduledFlush == nil {
+                scheduledFlush = group.next().scheduleTask(in: window) {
+                    self.flushPending()
+                }
+            }
+
+            return readyBatches
+        }
+
+        for batch in readyBatches {
+            send(batch)
+        }
+
+        return promise.futureResult
+    }
+
+    /// Returns the pending batch and resets the pending state. Must be called while holding the lock.
+    private func takePending() -> [Entry] {
+        scheduledFlush?.cancel()
+        scheduledFlush = nil
+
+        let batch = pending
+        pending = []
+        pendingSize = 0
+        return batch
+    }
+
+    private func flushPending() {
+        let batch = lock.withLock { takePending() }
+        if !batch.isEmpty {
+            send(batch)
+        }
+    }
+
+    private func send(_ batch: [Entry]) {
+        sendBatch(batch.map { $0.request }).whenComplete { result in
+            switch result {
+            case .success(let responses):
+                guard responses.count == batch.count else {
+                    let error = Error.unexpectedResponseCount(expected: batch.count, actual: responses.count)
+                    batch.forEach { $0.promise.fail(error) }
+                    return
+                }
+                for (entry, response) in zip(batch, responses) {
+                    entry.promise.completeWith(response)
+                }
+            case .failure(let error):
+                batch.forEach { $0.promise.fail(error) }
+            }
+        }
+    }
+}
@@ -0,0 +1,125 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+
+/// Decodes a serialized `LLBCASObject` as its chunks are received, handing the contents of its data to a consumer
+/// instead of buffering the serialized object. Objects are stored as `LLBPBCASObject` messages, whose data is a
+/// single length delimited field; the other fields (the refs) are small, and are kept until the object is finished.
+final class LLBCASObjectStreamDecoder {
+    enum Error: Swift.Error {
+        case malformedObject
+    }
+
+    /// The field number of `data` in `LLBPBCASObject`.
+    static let dataFieldNumber: UInt64 = 2
+
+    private let consumer: (Data) throws -> Void
+
+    /// The received bytes that couldn't be decoded yet, because they end in the middle of a field.
+    private var pending = Data()
+
+    /// The number of bytes of the data field that the consumer hasn't been given yet.
+    private var remainingData = 0
+
+    /// The serialized fields of the object other than its data.
+    private var otherFields = Data()
+
+    init(_ consumer: @escaping (Data) throws -> Void) {
+        self.consumer = consumer
+    }
+
+    /// Decodes the next chunk of the serialized object.
+    func decode(_ chunk: Data) throws {
+        if pending.isEmpty && remainingData >= chunk.count {
+            // The common case of a chunk in the middle of the data is passed through without copying it.
+            remainingData -= chunk.count
+            try consumer(chunk)
+            return
+        }
+
+        pending.append(chunk)
+        while !pending.isEmpty {
+            if remainingData > 0 {
+                let count = min(remainingData, pending.count)
+                try consumer(pending.prefix(count))
+                pending = Data(pending.dropFirst(count))
+                remainingData -= count
+                continue
+            }
+
+            var cursor = pending[...]
+            guard let tag = try readVarint(&cursor) else {
+                return
+            }
+            switch tag & 7 {
+            case 0:
+                guard try readVarint(&cursor) != nil else {
+                    return
+                }
+            case 1, 5:
+                let size = tag & 7 == 1 ? 8 : 4
+                guard cursor.count >= size else {
+                    return
+                }
+                cursor = cursor.dropFirst(size)
+            case 2:
+                guard let length = try readVarint(&cursor) else {
+                    return
+                }
+                guard length <= UInt64(Int.max) else {
+                    throw Error.malformedObject
+                }
+                if tag >> 3 == Self.dataFieldNumber {
+                    pending = Data(cursor)
+                    remainingData = Int(length)
+                    continue
+                }
+                guard cursor.count >= Int(length) else {
+                    return
+                }
+                cursor = cursor.dropFirst(Int(length))
+            default:
+                // Groups are deprecated, and never used by the CAS objects.
+                throw Error.malformedObject
+            }
+
+            otherFields.append(pending.prefix(pending.count - cursor.count))
+            pending = Data(cursor)
+        }
+    }
+
+    /// Checks that the whole object was received, and returns its refs.
+    func finish() throws -> [LLBDataID] {
+        guard pending.isEmpty, remainingData == 0 else {
+            throw Error.malformedObject
+        }
+        return try LLBCASObject(from: LLBByteBuffer.withBytes(ArraySlice(otherFields))).refs
+    }
+
+    /// Reads a varint from the front of `bytes`, or returns nil if it isn't complete yet.
+    private func readVarint(_ bytes: inout Data.SubSequence) throws -> UInt64? {
+        var value: UInt64 = 0
+        var shift: UInt64 = 0
+        var cursor = bytes
+        while let byte = cursor.popFirst() {
+            guard shift < 64 else {
+                throw Error.malformedObject
+            }
+            value |= UInt64(byte & 0x7f) << shift
+            if byte & 0x80 == 0 {
+                bytes = cursor
+                return value
+            }
+            shift += 7
+        }
+        return nil
+    }
+}
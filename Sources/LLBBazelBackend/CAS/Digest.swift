@@ -19,9 +19,28 @@ typealias Digest = Build_Bazel_Remote_Execution_V2_Digest
 /// A Bazel digest.
 extension Digest {
     public init<D>(with bytes: D) where D : DataProtocol {
-        // Translate to SHA256.
-        var hashFunction = Crypto.SHA256()
+        var builder = DigestBuilder()
+        builder.update(bytes)
+        self = builder.finalize()
+    }
+
+    func asDataID() throws -> LLBDataID {
+        return LLBDataID(directHash: Array(try self.serializedData()))
+    }
+}
+
+/// Computes a Bazel digest incrementally, so that large contents can be digested without holding them in memory.
+struct DigestBuilder {
+    private var hashFunction = Crypto.SHA256()
+    private var size: Int64 = 0
+
+    mutating func update<D>(_ bytes: D) where D : DataProtocol {
         hashFunction.update(data: bytes)
+        size += Int64(bytes.count)
+    }
+
+    func finalize() -> Digest {
+        // Translate to SHA256.
         let cryptoDigest = hashFunction.finalize()
 
         var hashBytes = Data()
@@ -29,15 +48,12 @@ extension Digest {
             hashBytes.append(contentsOf: ptr)
         }
 
-        self = .with {
+        let size = self.size
+        return .with {
             $0.hash = hexEncode(hashBytes)
-            $0.sizeBytes = Int64(bytes.count)
+            $0.sizeBytes = size
         }
     }
-
-    func asDataID() throws -> LLBDataID {
-        return LLBDataID(directHash: Array(try self.serializedData()))
-    }
 }
 
 extension LLBDataID {
@@ -0,0 +1,142 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+// zstd is only linked when the package is built with LLBUILD2_ENABLE_ZSTD set, see Package.swift.
+#if LLBUILD2_ZSTD
+import CZstd
+
+enum LLBZstdError: Swift.Error {
+    case allocationFailed
+    case zstd(String)
+
+    /// Throws if `code`, the result of a zstd function, is an error code.
+    static func check(_ code: Int) throws {
+        if ZSTD_isError(code) != 0 {
+            throw LLBZstdError.zstd(String(cString: ZSTD_getErrorName(code)))
+        }
+    }
+}
+
+/// Compresses a stream of data into a single zstd frame, one part at a time, so that the compressed output can be sent
+/// while the rest of the input is still being compressed.
+final class LLBZstdCompressor {
+    private let stream: OpaquePointer
+
+    init() throws {
+        guard let stream = ZSTD_createCCtx() else {
+            throw LLBZstdError.allocationFailed
+        }
+        self.stream = stream
+    }
+
+    deinit {
+        ZSTD_freeCCtx(stream)
+    }
+
+    /// Compresses the next part of the input, returning the compressed data that is ready, which may be empty. The
+    /// frame is completed by the part for which `finish` is set, after which the compressor must not be used again.
+    func compress(_ input: Data, finish: Bool) throws -> Data {
+        var output = Data()
+        var chunk = [UInt8](repeating: 0, count: ZSTD_CStreamOutSize())
+        let directive = finish ? ZSTD_e_end : ZSTD_e_continue
+
+        try input.withUnsafeBytes { (inputBytes: UnsafeRawBufferPointer) in
+            var inBuffer = ZSTD_inBuffer(src: inputBytes.baseAddress, size: inputBytes.count, pos: 0)
+            while true {
+                var written = 0
+                let remaining = try chunk.withUnsafeMutableBytes { (chunkBytes: UnsafeMutableRawBufferPointer) -> Int in
+                    var outBuffer = ZSTD_outBuffer(dst: chunkBytes.baseAddress, size: chunkBytes.count, pos: 0)
+                    let remaining = ZSTD_compressStream2(stream, &outBuffer, &inBuffer, directive)
+                    try LLBZstdError.check(remaining)
+                    written = outBuffer.pos
+                    return remaining
+                }
+                output.append(contentsOf: chunk[..<written])
+
+                // The last part is done once the frame is flushed, and the other parts once the input is consumed.
+                if finish ? remaining == 0 : inBuffer.pos == inBuffer.size {
+                    return
+                }
+            }
+        }
+        return output
+    }
+}
+
+/// Decompresses zstd data as it arrives, without needing the whole compressed stream.
+final class LLBZstdDecompressor {
+    private let stream: OpaquePointer
+
+    init() throws {
+        guard let stream = ZSTD_createDCtx() else {
+            throw LLBZstdError.allocationFailed
+        }
+        self.stream = stream
+    }
+
+    deinit {
+        ZSTD_freeDCtx(stream)
+    }
+
+    /// Decompresses the next part of the compressed stream, returning the data that could be decoded so far.
+    func decompress(_ input: Data) throws -> Data {
+        var output = Data()
+        var chunk = [UInt8](repeating: 0, count: ZSTD_DStreamOutSize())
+
+        try input.withUnsafeBytes { (inputBytes: UnsafeRawBufferPointer) in
+            var inBuffer = ZSTD_inBuffer(src: inputBytes.baseAddress, size: inputBytes.count, pos: 0)
+            var outputFull = false
+            // Keep going while there is input left, or while the output buffer was filled, since zstd may be holding
+            // back more decoded data.
+            while inBuffer.pos < inBuffer.size || outputFull {
+                var written = 0
+                try chunk.withUnsafeMutableBytes { (chunkBytes: UnsafeMutableRawBufferPointer) in
+                    var outBuffer = ZSTD_outBuffer(dst: chunkBytes.baseAddress, size: chunkBytes.count, pos: 0)
+                    try LLBZstdError.check(ZSTD_decompressStream(stream, &outBuffer, &inBuffer))
+                    written = outBuffer.pos
+                }
+                output.append(contentsOf: chunk[..<written])
+                outputFull = written == chunk.count
+            }
+        }
+        return output
+    }
+}
+
+#else
+
+enum LLBZstdError: Swift.Error {
+    /// The package was built without zstd.
+    case unavailable
+}
+
+/// Stand-in for builds without zstd, in which `LLBBazelCASDatabase` never negotiates compression.
+final class LLBZstdCompressor {
+    init() throws {
+        throw LLBZstdError.unavailable
+    }
+
+    func compress(_ input: Data, finish: Bool) throws -> Data {
+        throw LLBZstdError.unavailable
+    }
+}
+
+/// Stand-in for builds without zstd, in which `LLBBazelCASDatabase` never negotiates compression.
+final class LLBZstdDecompressor {
+    init() throws {
+        throw LLBZstdError.unavailable
+    }
+
+    func decompress(_ input: Data) throws -> Data {
+        throw LLBZstdError.unavailable
+    }
+}
+
+#endif
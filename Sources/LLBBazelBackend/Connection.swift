@@ -0,0 +1,86 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+
+import GRPC
+import TSCBasic
+
+
+/// A GRPC connection to a Bazel remote API server, described by a bazel:// URL. The URL path is used as the instance
+/// name, and the query items are sent as headers with every call.
+struct LLBBazelConnection {
+    typealias GRPCHeader = (key: String, value: String)
+
+    let connection: ClientConnection
+    let headers: [GRPCHeader]
+    let instance: String?
+
+    init(group: LLBFuturesDispatchGroup, url: URL) throws {
+        assert(url.scheme == "bazel")
+
+        // Parse headers from the URL
+        if let query = url.query {
+            guard let items = LLBBazelConnection.extractQueryItems(query) else {
+                throw LLBBazelCASDatabase.Error.unexpectedConnectionString(query)
+            }
+            headers = items
+        } else {
+            headers = []
+        }
+
+        // Extract instance from the URL
+        self.instance = url.path.isEmpty ? nil : String(url.path.dropFirst())
+
+
+        // Cleanup the URL for GRPC connection
+        guard let frontend = URL(string: "grpc://\(url.host ?? "localhost"):\(url.port ?? 8980)") else {
+            throw LLBBazelCASDatabase.Error.badURL
+        }
+
+        // Create the GRPC connection
+        let configuration = ClientConnection.Configuration(
+            target: try frontend.toConnectionTarget(),
+            eventLoopGroup: group
+        )
+        self.connection = ClientConnection(configuration: configuration)
+    }
+
+    private static func extractQueryItems(_ query: String) -> [GRPCHeader]? {
+        guard let components = NSURLComponents(string: "?" + query) else {
+            return nil
+        }
+        guard let queryItems = components.queryItems else {
+            return nil
+        }
+        var results: [GRPCHeader] = []
+        for item in queryItems {
+            guard let value = item.value else {
+                // A query item missing a value is unexpected.
+                return nil
+            }
+            results.append((item.name, value))
+        }
+        return results
+    }
+}
+
+extension URL {
+    func toConnectionTarget() throws -> ConnectionTarget {
+        // FIXME: Support unix scheme?
+        guard let host = self.host else {
+            throw StringError("no host in url \(self)")
+        }
+        guard let port = self.port else {
+            throw StringError("no port in url \(self)")
+        }
+        return .hostAndPort(host, port)
+    }
+}
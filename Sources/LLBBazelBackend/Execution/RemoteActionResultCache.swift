@@ -0,0 +1,281 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+
+import BazelRemoteAPI
+import GRPC
+import Logging
+import NIOConcurrencyHelpers
+import SwiftProtobuf
+
+
+/// An `LLBActionResultCache` backed by the action cache of a Bazel remote API server, so that actions executed by any
+/// client of the server (including other remote execution clients, such as Bazel) aren't executed again.
+///
+/// Requests are converted into remote execution actions the same way `LLBRemoteExecutor` converts them, which only
+/// needs the digests of the inputs. The executor remembers the digests of the input files, so only the files that it
+/// never converted before are read by a lookup, and their contents aren't kept. Cache hits are imported like the results of remote executions, so they are lazy
+/// outputs if the executor has `lazyOutputs`. Successful executions are published with their outputs, which are
+/// uploaded to the remote CAS together with the action and its command, but not with the inputs.
+public final class LLBRemoteActionResultCache: LLBActionResultCache {
+    /// The executor that converts the requests and imports the cached results.
+    public let executor: LLBRemoteExecutor
+
+    /// The maximum number of looked up actions that are kept until their result is published, after which the least
+    /// recently used ones are forgotten and converted again when published.
+    public let maxPendingActions: Int
+
+    private let actionCacheClient: ActionCacheClient
+
+    /// The blobs of an action that was looked up, which are uploaded if its result is published.
+    private struct PendingAction {
+        let digest: Digest
+        let blobs: [Digest: Data]
+    }
+
+    private let lock = Lock()
+    private let pendingActions: LLBBoundedLRU<LLBDataID, PendingAction>
+
+    public init(executor: LLBRemoteExecutor, maxPendingActions: Int = 10_000) {
+        self.executor = executor
+        self.maxPendingActions = maxPendingActions
+        self.pendingActions = LLBBoundedLRU(capacity: maxPendingActions)
+        self.actionCacheClient = ActionCacheClient(channel: executor.database.connection)
+        self.actionCacheClient.defaultCallOptions.customMetadata.add(contentsOf: executor.database.headers)
+    }
+
+    /// Creates a cache for the server that hosts `database`, for actions that are executed by other executors.
+    public convenience init(database: LLBBazelCASDatabase, lazyOutputs: Bool = false) {
+        self.init(executor: LLBRemoteExecutor(database: database, lazyOutputs: lazyOutputs))
+    }
+
+    public func lookup(_ request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse?> {
+        // The remote execution API has no way to represent pre-actions, so those actions are never cached.
+        guard request.actionSpec.preActions.isEmpty else {
+            return ctx.group.next().makeSucceededFuture(nil)
+        }
+
+        return pendingAction(for: request, ctx).flatMap { action in
+            let lookupRequest = GetActionResultRequest.with {
+                if let instance = self.executor.database.instance {
+                    $0.instanceName = instance
+                }
+                $0.actionDigest = action.digest
+                $0.inlineStdout = true
+                $0.inlineStderr = true
+            }
+            return self.actionCacheClient.getActionResult(lookupRequest).response
+        }.flatMap { result -> LLBFuture<LLBActionExecutionResponse?> in
+            // Only successful results are used, so that failures are reported by an actual execution.
+            guard result.exitCode == 0 else {
+                return ctx.group.next().makeSucceededFuture(nil)
+            }
+            return self.executor.makeResponse(request, result, ctx).map { Optional($0) }
+        }.recover { error in
+            // Any failure is treated as a miss, including outputs that were evicted from the remote CAS, so that the
+            // action is executed instead. Only the failures other than actual misses are worth logging.
+            if (error as? GRPCStatus)?.code != .notFound {
+                ctx.logger?.debug("remote action cache lookup failed: \(error)")
+            }
+            return nil
+        }
+    }
+
+    public func update(_ request: LLBActionExecutionRequest, response: LLBActionExecutionResponse, _ ctx: Context) -> LLBFuture<Void> {
+        guard request.actionSpec.preActions.isEmpty, response.exitCode == 0 else {
+            return ctx.group.next().makeSucceededFuture(())
+        }
+
+        let blobs = LLBRemoteExecutor.BlobCollector()
+        let client = LLBCASFSClient(ctx.db)
+
+        let action = pendingAction(for: request, remove: true, ctx)
+        let result: LLBFuture<ActionResult>
+        do {
+            result = try makeResult(request, response, blobs, client, ctx)
+        } catch {
+            return ctx.group.next().makeFailedFuture(error)
+        }
+
+        return action.and(result).flatMap { action, result -> LLBFuture<Void> in
+            for data in action.blobs.values {
+                blobs.add(data)
+            }
+            return self.executor.upload(blobs, ctx).flatMap {
+                let updateRequest = UpdateActionResultRequest.with {
+                    if let instance = self.executor.database.instance {
+                        $0.instanceName = instance
+                    }
+                    $0.actionDigest = action.digest
+                    $0.actionResult = result
+                }
+                return self.actionCacheClient.updateActionResult(updateRequest).response.map { _ in () }
+            }
+        }.flatMapErrorThrowing { error in
+            // The build doesn't wait for the update, which reports the failure to the build event delegate.
+            ctx.logger?.debug("remote action cache update failed: \(error)")
+            throw error
+        }
+    }
+
+    // MARK: - Actions
+
+    /// Returns the action digest of the request, along with the blobs of the action and its command. Actions are kept
+    /// from their lookup until their result is published, so that their inputs are only converted once.
+    private func pendingAction(for request: LLBActionExecutionRequest, remove: Bool = false, _ ctx: Context) -> LLBFuture<PendingAction> {
+        let key: LLBDataID
+        do {
+            key = try request.actionResultCacheKey()
+        } catch {
+            return ctx.group.next().makeFailedFuture(error)
+        }
+
+        let pending: PendingAction? = lock.withLock {
+            return remove ? pendingActions.removeValue(forKey: key) : pendingActions[key]
+        }
+        if let pending = pending {
+            return ctx.group.next().makeSucceededFuture(pending)
+        }
+
+        let blobs = LLBRemoteExecutor.BlobCollector()
+        return executor.makeAction(request, blobs, ctx).flatMapThrowing { digest in
+            guard let actionData = blobs.data(for: digest) else {
+                throw LLBRemoteExecutor.Error.missingBlob(digest.hash)
+            }
+            let commandDigest = try RemoteAction(serializedData: actionData).commandDigest
+            var actionBlobs = [digest: actionData]
+            actionBlobs[commandDigest] = blobs.data(for: commandDigest)
+
+            let pending = PendingAction(digest: digest, blobs: actionBlobs)
+            if !remove {
+                self.lock.withLockVoid {
+                    self.pendingActions.insert(pending, for: key)
+                }
+            }
+            return pending
+        }
+    }
+
+    // MARK: - Results
+
+    /// Converts the response into an action result, adding the contents of its outputs and logs to `blobs`.
+    private func makeResult(
+        _ request: LLBActionExecutionRequest,
+        _ response: LLBActionExecutionResponse,
+        _ blobs: LLBRemoteExecutor.BlobCollector,
+        _ client: LLBCASFSClient,
+        _ ctx: Context
+    ) throws -> LLBFuture<ActionResult> {
+        let workingDirectory = request.actionSpec.workingDirectory
+
+        // Unconditional outputs that the action didn't create can't be converted, and are left out of the result so
+        // that they are imported as missing files again.
+        let outputs = zip(request.outputs, response.outputs).map { ($0, $1, false) }
+            + zip(request.unconditionalOutputs, response.unconditionalOutputs).map { ($0, $1, true) }
+        let outputFutures: [LLBFuture<(String, LLBRemoteExecutor.RemoteNode)?>] = try outputs.map { output, id, optional in
+            let path = try LLBRemoteExecutor.relativeToWorkingDirectory(output.path, workingDirectory)
+            let node = executor.convert(id, client, blobs, ctx).map { Optional((path, $0)) }
+            return optional ? node.recover { _ in nil } : node
+        }
+
+        let outputsFuture = LLBFuture.whenAllSucceed(outputFutures, on: ctx.group.next())
+        return outputsFuture.and(logs(request, response, ctx)).flatMap { nodes, logs in
+            var outputFiles = [OutputFile]()
+            var treeFutures = [LLBFuture<Build_Bazel_Remote_Execution_V2_OutputDirectory>]()
+            for case let (path, node)? in nodes {
+                switch node {
+                case .file(let digest, let isExecutable):
+                    outputFiles.append(OutputFile.with {
+                        $0.path = path
+                        $0.digest = digest
+                        $0.isExecutable = isExecutable
+                    })
+                case .directory(let digest):
+                    treeFutures.append(self.makeTree(digest, blobs, ctx).map { treeDigest in
+                        Build_Bazel_Remote_Execution_V2_OutputDirectory.with {
+                            $0.path = path
+                            $0.treeDigest = treeDigest
+                        }
+                    })
+                case .symlink:
+                    // Outputs are always captured as files or directories, so this can't happen for valid outputs.
+                    continue
+                }
+            }
+
+            return LLBFuture.whenAllSucceed(treeFutures, on: ctx.group.next()).map { outputDirectories in
+                ActionResult.with {
+                    $0.outputFiles = outputFiles
+                    $0.outputDirectories = outputDirectories
+                    $0.exitCode = 0
+                    if !logs.isEmpty {
+                        $0.stdoutDigest = blobs.add(logs)
+                    }
+                }
+            }
+        }
+    }
+
+    /// Returns the logs of the action without the base logs of the request, which are added back by the requests that
+    /// hit the result.
+    private func logs(_ request: LLBActionExecutionRequest, _ response: LLBActionExecutionResponse, _ ctx: Context) -> LLBFuture<Data> {
+        let baseLogs: LLBFuture<LLBCASObject?> = request.hasBaseLogsID
+            ? ctx.db.get(request.baseLogsID, ctx)
+            : ctx.group.next().makeSucceededFuture(nil)
+
+        return ctx.db.get(response.stdoutID, ctx).and(baseLogs).map { logs, baseLogs in
+            guard let logs = logs?.data.readableBytesView else {
+                return Data()
+            }
+            if let baseLogs = baseLogs?.data.readableBytesView, logs.starts(with: baseLogs) {
+                return Data(logs.dropFirst(baseLogs.count))
+            }
+            return Data(logs)
+        }
+    }
+
+    /// Assembles the tree of an output directory from its directories. Directories that were converted by earlier
+    /// actions aren't in `blobs`, and are fetched from the remote CAS, where they were uploaded.
+    private func makeTree(
+        _ rootDigest: Digest,
+        _ blobs: LLBRemoteExecutor.BlobCollector,
+        _ ctx: Context
+    ) -> LLBFuture<Digest> {
+        func directory(_ digest: Digest) -> LLBFuture<RemoteDirectory> {
+            let data: LLBFuture<Data>
+            if let known = blobs.data(for: digest) {
+                data = ctx.group.next().makeSucceededFuture(known)
+            } else {
+                data = executor.outputs.fetch(digest)
+            }
+            return data.flatMapThrowing { try RemoteDirectory(serializedData: $0) }
+        }
+
+        func collect(_ digest: Digest) -> LLBFuture<[Digest: RemoteDirectory]> {
+            return directory(digest).flatMap { root in
+                let children = root.directories.map { collect($0.digest) }
+                return LLBFuture.whenAllSucceed(children, on: ctx.group.next()).map { children in
+                    children.reduce(into: [digest: root]) { all, child in
+                        all.merge(child, uniquingKeysWith: { first, _ in first })
+                    }
+                }
+            }
+        }
+
+        return collect(rootDigest).flatMapThrowing { directories in
+            let tree = RemoteTree.with {
+                $0.root = directories[rootDigest]!
+                $0.children = directories.filter { $0.key != rootDigest }.sorted { $0.key.hash < $1.key.hash }.map { $0.value }
+            }
+            return try blobs.add(tree.serializedData())
+        }
+    }
+}
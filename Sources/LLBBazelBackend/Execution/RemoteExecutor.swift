@@ -0,0 +1,737 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+
+import BazelRemoteAPI
+import GRPC
+import NIOConcurrencyHelpers
+import SwiftProtobuf
+import TSCBasic
+
+
+/// An executor that runs actions using the Execution service of a Bazel remote API server.
+///
+/// The inputs of each request are converted into a remote execution input root, and only the blobs that the server's
+/// CAS is missing are uploaded. The digests of input files are computed by reading their contents in chunks, and the
+/// files are only read in full if they have to be uploaded, a few at a time. Since llbuild2 CAS objects are not stored
+/// in the same format as remote execution blobs, the outputs of successful actions are downloaded and imported into the
+/// context's database, like the local executor does after running an action.
+///
+/// With `lazyOutputs`, outputs are left in the remote CAS instead, and the executor returns lazy outputs that refer to
+/// them (see `LLBRemoteOutputs`). Actions that consume them run on the same server without transferring their contents
+/// again, so only the outputs that are materialized are ever downloaded.
+public final class LLBRemoteExecutor: LLBExecutor {
+    public enum Error: Swift.Error {
+        case unsupportedPreActions
+        case overlappingInputs(String)
+        case outputOutsideWorkingDirectory(String)
+        case executionFailed(Google_Rpc_Status)
+        case callFailed(GRPCStatus)
+        case missingBlob(String)
+        case invalidTree(String)
+    }
+
+    /// The CAS of the remote execution server, used to upload inputs and download outputs.
+    public let database: LLBBazelCASDatabase
+
+    /// Whether the server should re-execute actions even if their results are in its action cache.
+    public let skipCacheLookup: Bool
+
+    /// The number of times the operation stream is resumed with WaitExecution if it ends before the operation is done.
+    public let waitRetries: Int
+
+    /// Whether outputs are left in the remote CAS instead of being imported.
+    public let lazyOutputs: Bool
+
+    /// Imports and resolves the outputs of the executor. Pass it as the lazy output resolver of the build engine, and
+    /// to the `LLBMaterializingExecutor` of the actions that run locally.
+    public let outputs: LLBRemoteOutputs
+
+    /// The maximum number of uploaded inputs that are remembered, after which the least recently used ones are
+    /// forgotten and converted again when used.
+    public let maxUploadedInputs: Int
+
+    /// The maximum number of input file digests that are remembered, after which the least recently used ones are
+    /// forgotten and computed again from the contents of the files.
+    public let maxFileDigests: Int
+
+    private let executionClient: ExecutionClient
+
+    /// The converted form of input artifacts that have already been uploaded to the remote CAS, so that they aren't
+    /// converted again when used by other actions. The server may still evict them, in which case the execution fails
+    /// with the missing digests and they are forgotten.
+    private let uploadedInputsLock = Lock()
+    private let uploadedInputs: LLBBoundedLRU<LLBDataID, RemoteNode>
+
+    /// The digests of the input files that were converted, whether or not they were uploaded, so that converting the
+    /// same file again (e.g. to look up an action in the action cache) doesn't read it.
+    private let fileDigestsLock = Lock()
+    private let fileDigests: LLBBoundedLRU<LLBDataID, Digest>
+
+    /// Creates an executor for the server that hosts `database`.
+    public init(
+        database: LLBBazelCASDatabase,
+        skipCacheLookup: Bool = false,
+        waitRetries: Int = 3,
+        lazyOutputs: Bool = false,
+        maxUploadedInputs: Int = 100_000,
+        maxFileDigests: Int = 1_000_000
+    ) {
+        self.database = database
+        self.skipCacheLookup = skipCacheLookup
+        self.waitRetries = waitRetries
+        self.lazyOutputs = lazyOutputs
+        self.maxUploadedInputs = maxUploadedInputs
+        self.uploadedInputs = LLBBoundedLRU(capacity: maxUploadedInputs)
+        self.maxFileDigests = maxFileDigests
+        self.fileDigests = LLBBoundedLRU(capacity: maxFileDigests)
+        self.outputs = LLBRemoteOutputs(database: database)
+        self.executionClient = ExecutionClient(channel: database.connection)
+        self.executionClient.defaultCallOptions.customMetadata.add(contentsOf: database.headers)
+    }
+
+    public func execute(request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse> {
+        guard request.actionSpec.preActions.isEmpty else {
+            // The remote execution API has no way to run commands in the same environment before the action.
+            return ctx.group.next().makeFailedFuture(Error.unsupportedPreActions)
+        }
+
+        return execute(request, blobs: BlobCollector(), ctx).flatMapError { error in
+            // Inputs that were uploaded by earlier actions may have been evicted from the remote CAS since. The server
+            // reports them as missing, in which case they are forgotten and the action is uploaded again, once.
+            guard let missing = LLBRemoteExecutor.missingDigests(error) else {
+                return ctx.group.next().makeFailedFuture(error)
+            }
+            self.forgetUploadedInputs(missing)
+            return self.execute(request, blobs: BlobCollector(reuseUploadedInputs: false), ctx)
+        }
+    }
+
+    private func execute(
+        _ request: LLBActionExecutionRequest,
+        blobs: BlobCollector,
+        _ ctx: Context
+    ) -> LLBFuture<LLBActionExecutionResponse> {
+        return makeAction(request, blobs, ctx).flatMap { actionDigest in
+            ctx.traced("upload action inputs", category: .cas) {
+                self.upload(blobs, ctx)
+            }.map { actionDigest }
+        }.flatMap { actionDigest in
+            ctx.traced("remote execution", category: .execution) {
+                self.execute(actionDigest: actionDigest, cancellationToken: ctx.cancellationToken)
+            }
+        }.flatMap { response in
+            ctx.traced("download action outputs", category: .cas) {
+                self.makeResponse(request, response.result, ctx)
+            }
+        }
+    }
+
+    // MARK: - Input conversion
+
+    /// Converts the request into a remote execution action, adding the action, its command and its inputs to `blobs`.
+    /// Returns the digest of the action.
+    func makeAction(_ request: LLBActionExecutionRequest, _ blobs: BlobCollector, _ ctx: Context) -> LLBFuture<Digest> {
+        let commandDigest: Digest
+        do {
+            commandDigest = try blobs.add(makeCommand(request).serializedData())
+        } catch {
+            return ctx.group.next().makeFailedFuture(error)
+        }
+
+        return makeInputRoot(request.inputs, blobs, ctx).flatMapThrowing { inputRootDigest -> Digest in
+            let action = RemoteAction.with {
+                $0.commandDigest = commandDigest
+                $0.inputRootDigest = inputRootDigest
+            }
+            return try blobs.add(action.serializedData())
+        }
+    }
+
+    /// The remote execution representation of an input artifact.
+    enum RemoteNode {
+        case file(Digest, isExecutable: Bool)
+        case directory(Digest)
+        case symlink(String)
+    }
+
+    /// The contents of a blob that may need to be uploaded.
+    enum Blob {
+        /// A blob that was created in memory, such as a directory or a command.
+        case data(Data)
+
+        /// An input file, which is only read if the remote CAS doesn't have it.
+        case file(LLBCASBlob)
+    }
+
+    /// Collects the blobs that make up an action, so that only the missing ones are uploaded.
+    final class BlobCollector {
+        /// Whether inputs that were already uploaded are reused without converting them. When false, every input is
+        /// converted, so that all of its blobs are checked and uploaded if missing.
+        let reuseUploadedInputs: Bool
+
+        let lock = Lock()
+        var blobs = [Digest: Blob]()
+        var convertedInputs = [LLBDataID: RemoteNode]()
+
+        init(reuseUploadedInputs: Bool = true) {
+            self.reuseUploadedInputs = reuseUploadedInputs
+        }
+
+        @discardableResult
+        func add(_ data: Data) -> Digest {
+            let digest = Digest(with: data)
+            lock.withLockVoid {
+                blobs[digest] = .data(data)
+            }
+            return digest
+        }
+
+        func add(_ digest: Digest, file: LLBCASBlob) {
+            lock.withLockVoid {
+                // Blobs that are already in memory don't need to be read again.
+                if blobs[digest] == nil {
+                    blobs[digest] = .file(file)
+                }
+            }
+        }
+
+        /// Returns the contents of a blob that was created in memory.
+        func data(for digest: Digest) -> Data? {
+            return lock.withLock {
+                guard case .data(let data)? = blobs[digest] else {
+                    return nil
+                }
+                return data
+            }
+        }
+
+        func converted(_ id: LLBDataID, _ node: RemoteNode) {
+            lock.withLockVoid {
+                convertedInputs[id] = node
+            }
+        }
+    }
+
+    /// A directory of the input root that is being assembled from the request inputs.
+    private final class DirectoryBuilder {
+        var nodes = [String: RemoteNode]()
+        var directories = [String: DirectoryBuilder]()
+
+        func insert(_ node: RemoteNode, at components: ArraySlice<String>, path: String) throws {
+            guard let name = components.first else {
+                throw Error.overlappingInputs(path)
+            }
+
+            if components.count == 1 {
+                guard nodes[name] == nil, directories[name] == nil else {
+                    throw Error.overlappingInputs(path)
+                }
+                nodes[name] = node
+                return
+            }
+
+            // Inputs nested inside of directory inputs can't be merged without their contents.
+            guard nodes[name] == nil else {
+                throw Error.overlappingInputs(path)
+            }
+            let directory = directories[name] ?? DirectoryBuilder()
+            directories[name] = directory
+            try directory.insert(node, at: components.dropFirst(), path: path)
+        }
+
+        func build(_ blobs: BlobCollector) throws -> Digest {
+            var nodes = self.nodes
+            for (name, directory) in directories {
+                nodes[name] = .directory(try directory.build(blobs))
+            }
+            return try blobs.add(LLBRemoteExecutor.makeDirectory(nodes).serializedData())
+        }
+    }
+
+    /// Creates a directory proto for the given entries, sorted by name as required by the remote execution API.
+    private static func makeDirectory(_ nodes: [String: RemoteNode]) -> RemoteDirectory {
+        return RemoteDirectory.with { directory in
+            for (name, node) in nodes.sorted(by: { $0.key < $1.key }) {
+                switch node {
+                case .file(let digest, let isExecutable):
+                    directory.files.append(FileNode.with {
+                        $0.name = name
+                        $0.digest = digest
+                        $0.isExecutable = isExecutable
+                    })
+                case .directory(let digest):
+                    directory.directories.append(DirectoryNode.with {
+                        $0.name = name
+                        $0.digest = digest
+                    })
+                case .symlink(let target):
+                    directory.symlinks.append(SymlinkNode.with {
+                        $0.name = name
+                        $0.target = target
+                    })
+                }
+            }
+        }
+    }
+
+    private func makeInputRoot(_ inputs: [LLBActionInput], _ blobs: BlobCollector, _ ctx: Context) -> LLBFuture<Digest> {
+        let client = LLBCASFSClient(ctx.db)
+        let nodeFutures = inputs.map { convert($0.dataID, client, blobs, ctx) }
+
+        return LLBFuture.whenAllSucceed(nodeFutures, on: ctx.group.next()).flatMapThrowing { nodes in
+            let root = DirectoryBuilder()
+            for (input, node) in zip(inputs, nodes) {
+                let components = input.path.split(separator: "/").map(String.init)
+                try root.insert(node, at: components[...], path: input.path)
+            }
+            return try root.build(blobs)
+        }
+    }
+
+    /// Converts an artifact from the llbuild2 CAS into its remote execution form, adding its contents to `blobs`.
+    ///
+    /// Only the artifacts themselves can be lazy outputs, so the entries of their trees are converted without
+    /// `isArtifact`, which skips that lookup.
+    func convert(
+        _ id: LLBDataID,
+        _ client: LLBCASFSClient,
+        _ blobs: BlobCollector,
+        isArtifact: Bool = true,
+        _ ctx: Context
+    ) -> LLBFuture<RemoteNode> {
+        if blobs.reuseUploadedInputs, let node = uploadedInputsLock.withLock({ uploadedInputs[id] }) {
+            return ctx.group.next().makeSucceededFuture(node)
+        }
+
+        let lazyOutput = isArtifact
+            ? outputs.lazyOutput(id, ctx)
+            : ctx.group.next().makeSucceededFuture(nil)
+        return lazyOutput.flatMap { output -> LLBFuture<RemoteNode> in
+            // Lazy outputs are already in the remote CAS, except for the directories of their trees, which the remote
+            // execution API doesn't store separately.
+            switch output {
+            case .file(let node)?:
+                return ctx.group.next().makeSucceededFuture(.file(node.digest, isExecutable: node.isExecutable))
+            case .directory(let tree)?:
+                do {
+                    for child in tree.children {
+                        blobs.add(try child.serializedData())
+                    }
+                    return ctx.group.next().makeSucceededFuture(.directory(blobs.add(try tree.root.serializedData())))
+                } catch {
+                    return ctx.group.next().makeFailedFuture(error)
+                }
+            case nil:
+                return self.convertContents(id, client, blobs, ctx)
+            }
+        }.map { remoteNode in
+            blobs.converted(id, remoteNode)
+            return remoteNode
+        }
+    }
+
+    /// Converts an artifact stored as a file tree, uploading its contents.
+    private func convertContents(_ id: LLBDataID, _ client: LLBCASFSClient, _ blobs: BlobCollector, _ ctx: Context) -> LLBFuture<RemoteNode> {
+        return client.load(id, ctx).flatMap { (node: LLBCASFSNode) -> LLBFuture<RemoteNode> in
+            switch node.type() {
+            case .directory:
+                guard let tree = node.tree else {
+                    return ctx.group.next().makeFailedFuture(Error.invalidTree("\(id)"))
+                }
+
+                let entryFutures: [LLBFuture<(String, RemoteNode)>] = tree.files.map { entry in
+                    guard let match = tree.lookup(entry.name) else {
+                        return ctx.group.next().makeFailedFuture(Error.invalidTree("\(id)/\(entry.name)"))
+                    }
+                    return self.convert(match.id, client, blobs, isArtifact: false, ctx).map { (entry.name, $0) }
+                }
+
+                return LLBFuture.whenAllSucceed(entryFutures, on: ctx.group.next()).flatMapThrowing { entries in
+                    let nodes = Dictionary(entries, uniquingKeysWith: { first, _ in first })
+                    return .directory(try blobs.add(LLBRemoteExecutor.makeDirectory(nodes).serializedData()))
+                }
+            default:
+                guard let blob = node.blob else {
+                    return ctx.group.next().makeFailedFuture(Error.invalidTree("\(id)"))
+                }
+
+                let type = node.type()
+                if type == .symlink {
+                    return blob.read(ctx).map { .symlink(String(decoding: $0, as: UTF8.self)) }
+                }
+                return self.digest(of: id, blob, ctx).map { digest in
+                    blobs.add(digest, file: blob)
+                    return .file(digest, isExecutable: type == .executable)
+                }
+            }
+        }
+    }
+
+    /// The size of the chunks in which input files are read to compute their digests.
+    static let digestChunkSize = 4 * 1024 * 1024
+
+    /// Returns the digest of the file with the given ID. Files that weren't converted before are read in chunks, so
+    /// that large files are never held in memory.
+    private func digest(of id: LLBDataID, _ blob: LLBCASBlob, _ ctx: Context) -> LLBFuture<Digest> {
+        if let digest = fileDigestsLock.withLock({ fileDigests[id] }) {
+            return ctx.group.next().makeSucceededFuture(digest)
+        }
+
+        func digest(from offset: Int, _ builder: DigestBuilder) -> LLBFuture<Digest> {
+            guard offset < blob.size else {
+                return ctx.group.next().makeSucceededFuture(builder.finalize())
+            }
+            let end = min(offset + LLBRemoteExecutor.digestChunkSize, blob.size)
+            return blob.read(range: offset..<end, ctx).flatMap { chunk in
+                var builder = builder
+                builder.update(Data(chunk))
+                return digest(from: end, builder)
+            }
+        }
+        return digest(from: 0, DigestBuilder()).map { digest in
+            self.fileDigestsLock.withLockVoid {
+                self.fileDigests.insert(digest, for: id)
+            }
+            return digest
+        }
+    }
+
+    /// The maximum number of input files that are read and uploaded at the same time.
+    static let maxConcurrentFileUploads = 8
+
+    /// Uploads the blobs that are missing from the remote CAS. Input files are read when they are uploaded, at most
+    /// `maxConcurrentFileUploads` at a time, so that only the contents of a few files are in memory at once.
+    func upload(_ blobs: BlobCollector, _ ctx: Context) -> LLBFuture<Void> {
+        let (allBlobs, convertedInputs) = blobs.lock.withLock { (blobs.blobs, blobs.convertedInputs) }
+
+        return database.findMissingRawBlobs(Array(allBlobs.keys)).flatMap { missing -> LLBFuture<Void> in
+            var uploads = [LLBFuture<Void>]()
+            var files = [(Digest, LLBCASBlob)]()
+            for digest in missing {
+                switch allBlobs[digest]! {
+                case .data(let data):
+                    uploads.append(self.database.putRawBlob(digest: digest, data: data))
+                case .file(let file):
+                    files.append((digest, file))
+                }
+            }
+            uploads.append(self.uploadFiles(files, ctx))
+            return LLBFuture.whenAllSucceed(uploads, on: ctx.group.next()).map { _ in () }
+        }.map {
+            self.uploadedInputsLock.withLockVoid {
+                for (id, node) in convertedInputs {
+                    self.uploadedInputs.insert(node, for: id)
+                }
+            }
+        }
+    }
+
+    /// Reads and uploads the files, keeping at most `maxConcurrentFileUploads` of them in flight.
+    private func uploadFiles(_ files: [(Digest, LLBCASBlob)], _ ctx: Context) -> LLBFuture<Void> {
+        let lock = Lock()
+        var next = 0
+
+        func uploadNext() -> LLBFuture<Void> {
+            let index: Int? = lock.withLock {
+                guard next < files.count else {
+                    return nil
+                }
+                next += 1
+                return next - 1
+            }
+            guard let current = index else {
+                return ctx.group.next().makeSucceededFuture(())
+            }
+            let (digest, file) = files[current]
+            return file.read(ctx).flatMap { contents in
+                self.database.putRawBlob(digest: digest, data: Data(contents))
+            }.flatMap {
+                uploadNext()
+            }
+        }
+
+        let workers = (0..<min(files.count, LLBRemoteExecutor.maxConcurrentFileUploads)).map { _ in uploadNext() }
+        return LLBFuture.whenAllSucceed(workers, on: ctx.group.next()).map { _ in () }
+    }
+
+    /// Forgets the uploaded inputs that refer to any of the digests. Directories that contain them are only forgotten
+    /// if they are missing too, which is why retried actions don't reuse uploaded inputs at all.
+    private func forgetUploadedInputs(_ digests: Set<Digest>) {
+        uploadedInputsLock.withLockVoid {
+            uploadedInputs.removeAll { _, node in
+                switch node {
+                case .file(let digest, _), .directory(let digest):
+                    return digests.contains(digest)
+                case .symlink:
+                    return false
+                }
+            }
+        }
+    }
+
+    /// Returns the digests of the blobs that an execution failed on because they were missing from the remote CAS,
+    /// which the server reports as a FAILED_PRECONDITION with MISSING violations, or nil for any other error.
+    static func missingDigests(_ error: Swift.Error) -> Set<Digest>? {
+        guard case Error.executionFailed(let status)? = error as? Error,
+              Google_Rpc_Code(rawValue: Int(status.code)) == .failedPrecondition else {
+            return nil
+        }
+
+        let violations = status.details.compactMap {
+            try? Google_Rpc_PreconditionFailure(unpackingAny: $0)
+        }.flatMap { $0.violations }
+
+        // Subjects of missing blobs are of the form "blobs/{hash}/{size}".
+        let digests: [Digest] = violations.filter { $0.type == "MISSING" }.compactMap { violation in
+            let components = violation.subject.split(separator: "/")
+            guard components.count == 3, components[0] == "blobs", let size = Int64(components[2]) else {
+                return nil
+            }
+            return Digest.with {
+                $0.hash = String(components[1])
+                $0.sizeBytes = size
+            }
+        }
+        return digests.isEmpty ? nil : Set(digests)
+    }
+
+    // MARK: - Execution
+
+    /// Returns the path relative to the working directory of the action, since that is what remote execution output
+    /// paths are relative to.
+    static func relativeToWorkingDirectory(_ path: String, _ workingDirectory: String) throws -> String {
+        if workingDirectory.isEmpty {
+            return path
+        }
+        let prefix = workingDirectory.hasSuffix("/") ? workingDirectory : workingDirectory + "/"
+        guard path.hasPrefix(prefix) else {
+            throw Error.outputOutsideWorkingDirectory(path)
+        }
+        return String(path.dropFirst(prefix.count))
+    }
+
+    private func makeCommand(_ request: LLBActionExecutionRequest) throws -> RemoteCommand {
+        let workingDirectory = request.actionSpec.workingDirectory
+        let allOutputs = request.outputs + request.unconditionalOutputs
+
+        let outputFiles = try allOutputs.filter { $0.type == .file }.map {
+            try LLBRemoteExecutor.relativeToWorkingDirectory($0.path, workingDirectory)
+        }
+        let outputDirectories = try allOutputs.filter { $0.type == .directory }.map {
+            try LLBRemoteExecutor.relativeToWorkingDirectory($0.path, workingDirectory)
+        }
+
+        return RemoteCommand.with {
+            $0.arguments = request.actionSpec.arguments
+            $0.environmentVariables = request.actionSpec.environment.sorted { $0.name < $1.name }.map { variable in
+                RemoteCommand.EnvironmentVariable.with {
+                    $0.name = variable.name
+                    $0.value = variable.value
+                }
+            }
+            $0.outputFiles = Array(Set(outputFiles)).sorted()
+            $0.outputDirectories = Array(Set(outputDirectories)).sorted()
+            $0.workingDirectory = workingDirectory
+        }
+    }
+
+    private func execute(actionDigest: Digest, cancellationToken: LLBCancellationToken?) -> LLBFuture<ExecuteResponse> {
+        if let reason = cancellationToken?.reason {
+            return database.group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+        }
+
+        let request = ExecuteRequest.with {
+            if let instance = database.instance {
+                $0.instanceName = instance
+            }
+            $0.actionDigest = actionDigest
+            $0.skipCacheLookup = skipCacheLookup
+        }
+
+        // The operation handler is invoked serially on the call's event loop.
+        var lastOperation: Google_Longrunning_Operation?
+        let call = executionClient.execute(request) { operation in
+            lastOperation = operation
+        }
+        return cancellable(call, cancellationToken).flatMap { status in
+            self.complete(lastOperation, status: status, retriesLeft: self.waitRetries, cancellationToken: cancellationToken)
+        }
+    }
+
+    /// Returns the status of the call, cancelling the call if the build is cancelled before it completes. Cancelling
+    /// the call lets the server stop the execution, if no other client is waiting on it.
+    private func cancellable<Request, Response>(
+        _ call: ServerStreamingCall<Request, Response>,
+        _ cancellationToken: LLBCancellationToken?
+    ) -> LLBFuture<GRPCStatus> {
+        guard let token = cancellationToken else {
+            return call.status
+        }
+        let handle = token.onCancel { _ in
+            call.cancel(promise: nil)
+        }
+        return call.status.flatMapThrowing { status in
+            token.remove(handle)
+            try token.checkCancelled()
+            return status
+        }
+    }
+
+    /// Extracts the execute response from the final operation. If the stream ended before the operation was done, the
+    /// operation is waited upon again with WaitExecution.
+    private func complete(
+        _ operation: Google_Longrunning_Operation?,
+        status: GRPCStatus,
+        retriesLeft: Int,
+        cancellationToken: LLBCancellationToken?
+    ) -> LLBFuture<ExecuteResponse> {
+        let eventLoop = database.group.next()
+
+        guard let operation = operation else {
+            return eventLoop.makeFailedFuture(Error.callFailed(status))
+        }
+
+        guard operation.done else {
+            guard retriesLeft > 0 else {
+                return eventLoop.makeFailedFuture(Error.callFailed(status))
+            }
+
+            let request = WaitExecutionRequest.with {
+                $0.name = operation.name
+            }
+            var lastOperation: Google_Longrunning_Operation? = operation
+            let call = executionClient.waitExecution(request) { operation in
+                lastOperation = operation
+            }
+            return cancellable(call, cancellationToken).flatMap { status in
+                self.complete(lastOperation, status: status, retriesLeft: retriesLeft - 1, cancellationToken: cancellationToken)
+            }
+        }
+
+        switch operation.result {
+        case .error(let status)?:
+            return eventLoop.makeFailedFuture(Error.executionFailed(status))
+        case .response(let any)?:
+            do {
+                let response = try ExecuteResponse(unpackingAny: any)
+                guard Google_Rpc_Code(rawValue: Int(response.status.code)) == .ok else {
+                    return eventLoop.makeFailedFuture(Error.executionFailed(response.status))
+                }
+                return eventLoop.makeSucceededFuture(response)
+            } catch {
+                return eventLoop.makeFailedFuture(error)
+            }
+        case nil:
+            return eventLoop.makeFailedFuture(Error.callFailed(status))
+        }
+    }
+
+    // MARK: - Output import
+
+    func makeResponse(_ request: LLBActionExecutionRequest, _ result: ActionResult, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse> {
+        let exitCode = Int(result.exitCode)
+
+        let stdoutFuture = logs(request, result, ctx).flatMap { logs in
+            ctx.db.put(data: .withBytes(logs[...]), ctx)
+        }
+
+        let outputFutures: [LLBFuture<LLBDataID>]
+        // Only import outputs if the action exited successfully.
+        if exitCode == 0 {
+            outputFutures = request.outputs.map {
+                importOutput($0, request, result, ctx)
+            }
+        } else {
+            outputFutures = []
+        }
+        let outputsFuture = LLBFuture.whenAllSucceed(outputFutures, on: ctx.group.next())
+
+        let unconditionalOutputFutures = request.unconditionalOutputs.map {
+            importOutput($0, request, result, allowNonExistentFiles: true, ctx)
+        }
+        let unconditionalOutputsFuture = LLBFuture.whenAllSucceed(unconditionalOutputFutures, on: ctx.group.next())
+
+        return outputsFuture.and(unconditionalOutputsFuture).and(stdoutFuture).map { outputs, stdoutID in
+            return LLBActionExecutionResponse(
+                outputs: outputs.0,
+                unconditionalOutputs: outputs.1,
+                exitCode: exitCode,
+                stdoutID: stdoutID
+            )
+        }
+    }
+
+    /// Returns the combined stdout and stderr of the action, prefixed by the base logs of the request.
+    private func logs(_ request: LLBActionExecutionRequest, _ result: ActionResult, _ ctx: Context) -> LLBFuture<[UInt8]> {
+        let baseLogContents: LLBFuture<[UInt8]>
+        if request.hasBaseLogsID {
+            baseLogContents = ctx.db.get(request.baseLogsID, ctx).flatMapThrowing { object -> [UInt8] in
+                if let object = object {
+                    return Array(object.data.readableBytesView)
+                } else {
+                    throw StringError("No logs available for base")
+                }
+            }
+        } else {
+            baseLogContents = ctx.group.next().makeSucceededFuture([])
+        }
+
+        let stdout = result.hasStdoutDigest && result.stdoutRaw.isEmpty
+            ? outputs.fetch(result.stdoutDigest)
+            : ctx.group.next().makeSucceededFuture(result.stdoutRaw)
+        let stderr = result.hasStderrDigest && result.stderrRaw.isEmpty
+            ? outputs.fetch(result.stderrDigest)
+            : ctx.group.next().makeSucceededFuture(result.stderrRaw)
+
+        return baseLogContents.and(stdout).and(stderr).map { logs, stderr in
+            return logs.0 + Array(logs.1) + Array(stderr)
+        }
+    }
+
+    private func importOutput(
+        _ output: LLBActionOutput,
+        _ request: LLBActionExecutionRequest,
+        _ result: ActionResult,
+        allowNonExistentFiles: Bool = false,
+        _ ctx: Context
+    ) -> LLBFuture<LLBDataID> {
+        let relativePath: String
+        do {
+            relativePath = try LLBRemoteExecutor.relativeToWorkingDirectory(output.path, request.actionSpec.workingDirectory)
+        } catch {
+            return ctx.group.next().makeFailedFuture(error)
+        }
+
+        switch output.type {
+        case .directory:
+            if let outputDirectory = result.outputDirectories.first(where: { $0.path == relativePath }) {
+                if lazyOutputs {
+                    return outputs.makeLazyDirectory(treeDigest: outputDirectory.treeDigest, ctx)
+                }
+                return outputs.importDirectory(treeDigest: outputDirectory.treeDigest, ctx)
+            }
+            // If we didn't find an output artifact that was a directory, create an empty CASTree to represent it.
+            return LLBCASFileTree.create(files: [], in: ctx.db, ctx).map { $0.id }
+        default:
+            if let outputFile = result.outputFiles.first(where: { $0.path == relativePath }) {
+                if lazyOutputs {
+                    return outputs.makeLazyFile(digest: outputFile.digest, isExecutable: outputFile.isExecutable, ctx)
+                }
+                return outputs.importFile(digest: outputFile.digest, isExecutable: outputFile.isExecutable, ctx)
+            }
+            if allowNonExistentFiles {
+                return ctx.db.put(data: .init(bytes: []), ctx)
+            }
+            return ctx.group.next().makeFailedFuture(Error.missingBlob(output.path))
+        }
+    }
+}
@@ -0,0 +1,377 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+
+import BazelRemoteAPI
+import Dispatch
+import NIOConcurrencyHelpers
+import SwiftProtobuf
+import TSCBasic
+
+
+/// The outputs of remote actions, either imported into the context's database or left in the remote CAS as lazy
+/// outputs.
+///
+/// A lazy output is the ID of a small marker object in the context's database, which holds the remote execution digests
+/// of the output (the file digest, or the digest of the tree of an output directory) instead of its contents. Remote
+/// actions consume lazy outputs directly from the remote CAS, so intermediate outputs never reach the client. Their
+/// contents are only downloaded when they are materialized: when a local action consumes them (through
+/// `LLBMaterializingExecutor`), when they are merged, or when the client requests them through
+/// `LLBBuildEngine.materialize`.
+///
+/// Since the markers are stored in the database, lazy outputs can be recorded in persistent function and action result
+/// caches, and resolved by other resolvers (e.g. after a restart) as long as the remote CAS keeps the outputs. Markers
+/// refer to a tag object, unlike the plain files of file trees, which have no refs and are read as they are. Consumers
+/// that don't resolve lazy outputs fail to load markers as file trees instead of reading them as file contents.
+///
+/// Whether an ID is a marker is remembered for regular contents too, so that inputs are only read from the database to
+/// check for markers the first time they are seen.
+public final class LLBRemoteOutputs: LLBLazyOutputResolver {
+    public enum Error: Swift.Error {
+        case missingBlob(String)
+        case invalidTree(String)
+    }
+
+    /// The remote execution form of a lazy output.
+    enum Output {
+        case file(FileNode)
+        case directory(RemoteTree)
+    }
+
+    /// What the marker of a lazy output holds. Trees can be large, so only their digests are kept, and the trees
+    /// themselves are cached.
+    private enum LazyOutput {
+        case file(FileNode)
+        case directory(treeDigest: Digest)
+    }
+
+    /// Prefixes the digests of lazy outputs in their markers, followed by a byte for their kind. It is also the contents
+    /// of the tag object that markers refer to. The first byte isn't a valid protobuf tag, so markers can't be decoded
+    /// as file tree metadata.
+    private static let idDomain = Array("llbuild2-remote-output\0".utf8)
+    private static let fileKind: UInt8 = 0
+    private static let directoryKind: UInt8 = 1
+
+    /// The CAS that holds the contents of the outputs.
+    public let database: LLBBazelCASDatabase
+
+    /// The maximum number of lazy outputs, trees and materialized outputs kept in memory, after which the least
+    /// recently used ones are forgotten and read again from their markers or the remote CAS.
+    public let maxCachedEntries: Int
+
+    /// Runs the file system operations of staged outputs, which must not block the event loops.
+    private let queue = DispatchQueue(label: "org.swift.llbuild2-\(LLBRemoteOutputs.self)", attributes: .concurrent)
+
+    private let lock = Lock()
+    /// The lazy outputs by ID, and nil for the IDs that are known to refer to regular contents.
+    private let lazyOutputs: LLBBoundedLRU<LLBDataID, LazyOutput?>
+    private let trees: LLBBoundedLRU<Digest, RemoteTree>
+    private let materialized: LLBBoundedLRU<LLBDataID, LLBFuture<LLBDataID>>
+
+    /// The ID of the tag object in each database, along with the database, so that its identifier isn't reused by
+    /// another database while the tag is known.
+    private var tags = [ObjectIdentifier: (db: LLBCASDatabase, id: LLBFuture<LLBDataID>)]()
+
+    public init(database: LLBBazelCASDatabase, maxCachedEntries: Int = 100_000) {
+        self.database = database
+        self.maxCachedEntries = maxCachedEntries
+        self.lazyOutputs = LLBBoundedLRU(capacity: maxCachedEntries)
+        self.trees = LLBBoundedLRU(capacity: maxCachedEntries)
+        self.materialized = LLBBoundedLRU(capacity: maxCachedEntries)
+    }
+
+    // MARK: - Lazy outputs
+
+    /// Returns a lazy output for a file of the remote CAS.
+    func makeLazyFile(digest: Digest, isExecutable: Bool, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        let node = FileNode.with {
+            $0.digest = digest
+            $0.isExecutable = isExecutable
+        }
+        do {
+            return record(.file(node), kind: LLBRemoteOutputs.fileKind, payload: try node.serializedData(), ctx)
+        } catch {
+            return ctx.group.next().makeFailedFuture(error)
+        }
+    }
+
+    /// Returns a lazy output for an output directory, given the digest of its tree. Only the tree is downloaded, which
+    /// is needed to pass the directory to other actions.
+    func makeLazyDirectory(treeDigest: Digest, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return fetchTree(treeDigest).flatMap { _ in
+            do {
+                let payload = try treeDigest.serializedData()
+                return self.record(.directory(treeDigest: treeDigest), kind: LLBRemoteOutputs.directoryKind, payload: payload, ctx)
+            } catch {
+                return ctx.group.next().makeFailedFuture(error)
+            }
+        }
+    }
+
+    /// Stores the marker of a lazy output in the context's database, so that the same remote output always has the
+    /// same ID, and caches the output under that ID.
+    private func record(_ output: LazyOutput, kind: UInt8, payload: Data, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        let bytes = LLBRemoteOutputs.idDomain + [kind] + Array(payload)
+        return tag(ctx).flatMap { tagID in
+            ctx.db.put(refs: [tagID], data: LLBByteBuffer.withBytes(bytes[...]), ctx)
+        }.map { id in
+            self.cache(output, for: id)
+            return id
+        }
+    }
+
+    /// Returns the ID of the tag object that markers refer to, storing it in the context's database once.
+    private func tag(_ ctx: Context) -> LLBFuture<LLBDataID> {
+        let key = ObjectIdentifier(ctx.db)
+        let (future, isNew): (LLBFuture<LLBDataID>, Bool) = lock.withLock {
+            if let tag = tags[key] {
+                return (tag.id, false)
+            }
+            let id = ctx.db.put(refs: [], data: LLBByteBuffer.withBytes(LLBRemoteOutputs.idDomain[...]), ctx)
+            tags[key] = (db: ctx.db, id: id)
+            return (id, true)
+        }
+        if isNew {
+            future.whenFailure { _ in
+                self.lock.withLockVoid {
+                    self.tags[key] = nil
+                }
+            }
+        }
+        return future
+    }
+
+    private func cache(_ output: LazyOutput?, for id: LLBDataID) {
+        lock.withLockVoid {
+            lazyOutputs.insert(output, for: id)
+        }
+    }
+
+    /// Returns the remote form of the output if the ID refers to a lazy output. IDs that aren't cached are read from the
+    /// database to check whether they are markers.
+    func lazyOutput(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Output?> {
+        let lazyOutput: LLBFuture<LazyOutput?>
+        if let cached = lock.withLock({ lazyOutputs[id] }) {
+            lazyOutput = ctx.group.next().makeSucceededFuture(cached)
+        } else {
+            lazyOutput = ctx.db.get(id, ctx).map { object in
+                guard let object = object else {
+                    // Missing objects may still be written, so they aren't remembered.
+                    return nil
+                }
+                let output = LLBRemoteOutputs.decodeMarker(object)
+                self.cache(output, for: id)
+                return output
+            }
+        }
+
+        return lazyOutput.flatMap { output in
+            switch output {
+            case .file(let node)?:
+                return ctx.group.next().makeSucceededFuture(.file(node))
+            case .directory(let treeDigest)?:
+                return self.fetchTree(treeDigest).map { .directory($0) }
+            case nil:
+                return ctx.group.next().makeSucceededFuture(nil)
+            }
+        }
+    }
+
+    /// Returns the lazy output that the object is the marker of, or nil if it holds regular contents.
+    private static func decodeMarker(_ object: LLBCASObject) -> LazyOutput? {
+        let bytes = object.data.readableBytesView
+        guard object.refs.count == 1, bytes.count > idDomain.count, bytes.starts(with: idDomain) else {
+            return nil
+        }
+        let payload = Data(bytes.dropFirst(idDomain.count + 1))
+        switch bytes[bytes.startIndex + idDomain.count] {
+        case fileKind:
+            return (try? FileNode(serializedData: payload)).map { .file($0) }
+        case directoryKind:
+            return (try? Digest(serializedData: payload)).map { .directory(treeDigest: $0) }
+        default:
+            return nil
+        }
+    }
+
+    public func lazyOutputType(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBArtifactType?> {
+        return lazyOutput(id, ctx).map { output in
+            switch output {
+            case .file?:
+                return .file
+            case .directory?:
+                return .directory
+            case nil:
+                return nil
+            }
+        }
+    }
+
+    public func materialize(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        if let future = lock.withLock({ materialized[id] }) {
+            return future
+        }
+
+        let future = lazyOutput(id, ctx).flatMap { output -> LLBFuture<LLBDataID> in
+            switch output {
+            case .file(let node)?:
+                return self.importFile(digest: node.digest, isExecutable: node.isExecutable, ctx)
+            case .directory(let tree)?:
+                return self.importDirectory(tree, ctx)
+            case nil:
+                return ctx.group.next().makeSucceededFuture(id)
+            }
+        }
+
+        lock.withLockVoid {
+            materialized.insert(future, for: id)
+        }
+        future.whenFailure { _ in
+            self.lock.withLockVoid {
+                if self.materialized[id] === future {
+                    self.materialized.removeValue(forKey: id)
+                }
+            }
+        }
+        return future
+    }
+
+    // MARK: - Import
+
+    /// Downloads a file of the remote CAS and imports it into the context's database.
+    func importFile(digest: Digest, isExecutable: Bool, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return staged(ctx) { stagingPath in
+            self.download(digest, to: stagingPath, isExecutable: isExecutable, ctx)
+        }
+    }
+
+    /// Downloads the tree of an output directory and imports it into the context's database.
+    func importDirectory(treeDigest: Digest, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return fetchTree(treeDigest).flatMap { tree in
+            self.importDirectory(tree, ctx)
+        }
+    }
+
+    private func importDirectory(_ tree: RemoteTree, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return staged(ctx) { stagingPath in
+            self.stage(tree, at: stagingPath, ctx)
+        }
+    }
+
+    /// Writes an output to a temporary path with `write` and imports it, so that it's stored in the same format that
+    /// the local executor produces.
+    private func staged(_ ctx: Context, _ write: @escaping (AbsolutePath) -> LLBFuture<Void>) -> LLBFuture<LLBDataID> {
+        let stagingDirectory = AbsolutePath(NSTemporaryDirectory()).appending(component: "llbuild2-remote-\(UUID())")
+        let stagingPath = stagingDirectory.appending(component: "output")
+
+        return blocking(ctx) {
+            try localFileSystem.createDirectory(stagingDirectory, recursive: true)
+        }.flatMap {
+            write(stagingPath)
+        }.flatMap {
+            LLBCASFileTree.import(path: stagingPath, to: ctx.db, stats: LLBCASFileTree.ImportProgressStats(), ctx)
+        }.always { _ in
+            self.queue.async {
+                try? localFileSystem.removeFileTree(stagingDirectory)
+            }
+        }
+    }
+
+    /// Runs `body` on the file system queue.
+    private func blocking<T>(_ ctx: Context, _ body: @escaping () throws -> T) -> LLBFuture<T> {
+        let promise = ctx.group.next().makePromise(of: T.self)
+        queue.async {
+            promise.completeWith(Result { try body() })
+        }
+        return promise.futureResult
+    }
+
+    /// Streams a file of the remote CAS to `path`, without holding its contents in memory.
+    private func download(_ digest: Digest, to path: AbsolutePath, isExecutable: Bool, _ ctx: Context) -> LLBFuture<Void> {
+        return database.downloadRawBlob(digest: digest, to: path, ctx).flatMapBlocking(onto: queue) { found in
+            guard found else {
+                throw Error.missingBlob(digest.hash)
+            }
+            if isExecutable {
+                try localFileSystem.chmod(.executable, path: path)
+            }
+        }
+    }
+
+    /// Downloads a small blob of the remote CAS, such as a tree or the logs of an action, into memory.
+    func fetch(_ digest: Digest) -> LLBFuture<Data> {
+        return database.getRawBlob(digest: digest).flatMapThrowing { data in
+            guard let data = data else {
+                throw Error.missingBlob(digest.hash)
+            }
+            return data
+        }
+    }
+
+    private func fetchTree(_ digest: Digest) -> LLBFuture<RemoteTree> {
+        if let tree = lock.withLock({ trees[digest] }) {
+            return database.group.next().makeSucceededFuture(tree)
+        }
+
+        return fetch(digest).flatMapThrowing { data in
+            let tree = try RemoteTree(serializedData: data)
+            self.lock.withLockVoid {
+                self.trees.insert(tree, for: digest)
+            }
+            return tree
+        }
+    }
+
+    /// Writes the contents of an output directory tree at `path`. The directories and symlinks are created on the file
+    /// system queue, and then the files are downloaded into them in parallel.
+    private func stage(_ tree: RemoteTree, at path: AbsolutePath, _ ctx: Context) -> LLBFuture<Void> {
+        var children = [Digest: RemoteDirectory]()
+        for child in tree.children {
+            guard let data = try? child.serializedData() else {
+                continue
+            }
+            children[Digest(with: data)] = child
+        }
+
+        var directories = [AbsolutePath]()
+        var symlinks = [(path: AbsolutePath, target: String)]()
+        var files = [(path: AbsolutePath, node: FileNode)]()
+        var pending = [(tree.root, path)]
+        while let entry = pending.popLast() {
+            let (directory, directoryPath) = entry
+            directories.append(directoryPath)
+            files += directory.files.map { (path: directoryPath.appending(component: $0.name), node: $0) }
+            symlinks += directory.symlinks.map { (path: directoryPath.appending(component: $0.name), target: $0.target) }
+            for subdirectory in directory.directories {
+                guard let child = children[subdirectory.digest] else {
+                    return ctx.group.next().makeFailedFuture(Error.invalidTree(subdirectory.name))
+                }
+                pending.append((child, directoryPath.appending(component: subdirectory.name)))
+            }
+        }
+
+        return blocking(ctx) {
+            for directory in directories {
+                try localFileSystem.createDirectory(directory, recursive: true)
+            }
+            for symlink in symlinks {
+                try localFileSystem.createSymbolicLink(
+                    symlink.path,
+                    pointingAt: AbsolutePath(symlink.target, relativeTo: symlink.path.parentDirectory),
+                    relative: !symlink.target.hasPrefix("/")
+                )
+            }
+        }.flatMap {
+            let downloads = files.map { self.download($0.node.digest, to: $0.path, isExecutable: $0.node.isExecutable, ctx) }
+            return LLBFuture.whenAllSucceed(downloads, on: ctx.group.next()).map { _ in () }
+        }
+    }
+}
@@ -0,0 +1,239 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+
+import BazelRemoteAPI
+import GRPC
+import Logging
+import TSCUtility
+
+
+/// An `LLBFunctionCache` implementation backed by the action cache of a Bazel remote API server, so that function
+/// results can be shared between all of the clients of the server.
+///
+/// Each key is stored as a synthetic action digest derived from its stable hash value and the cache version, and its
+/// value is stored in the stdout of the action result. Small values are also stored inline as an output file of the
+/// action result, so that cache hits don't need another round trip to fetch the value from the CAS. A local cache is
+/// consulted before the remote one and is populated with the remote hits, so that each key is fetched at most once.
+///
+/// The cache owns its connection to the server, which is closed by `close()`.
+public final class LLBBazelFunctionCache: LLBFunctionCache {
+    /// Threads capable of running futures.
+    public let group: LLBFuturesDispatchGroup
+
+    /// The local cache in front of the remote cache.
+    public let localCache: LLBFunctionCache
+
+    private let connection: ClientConnection
+    private let actionCacheClient: ActionCacheClient
+    private let casClient: ContentAddressableStorageClient
+    private let instance: String?
+    private let version: String
+    private let inlineValueLimit: Int
+
+    /// The path of the output file used to store values inline.
+    private static let inlineValuePath = "value"
+
+    /// Connect to the action cache of a Bazel remote API server.
+    ///
+    /// - Parameters:
+    ///     - group: The event loop group to use for the connection.
+    ///     - url: The bazel:// URL of the server, in the same format used by `LLBBazelCASDatabase`.
+    ///     - version: Caches with different versions don't share any entries.
+    ///     - localCache: The cache to consult before the remote cache. Defaults to an in-memory cache.
+    ///     - inlineValueLimit: The maximum size of the values that are stored inline in the remote cache.
+    public init(
+        group: LLBFuturesDispatchGroup,
+        url: URL,
+        version: String = "default",
+        localCache: LLBFunctionCache? = nil,
+        inlineValueLimit: Int = 16 * 1024
+    ) throws {
+        self.group = group
+        self.version = version
+        self.inlineValueLimit = inlineValueLimit
+        self.localCache = localCache ?? LLBInMemoryFunctionCache(group: group, inlineValueLimit: inlineValueLimit)
+
+        let bazelConnection = try LLBBazelConnection(group: group, url: url)
+        self.connection = bazelConnection.connection
+        self.instance = bazelConnection.instance
+        self.actionCacheClient = ActionCacheClient(channel: connection)
+        self.actionCacheClient.defaultCallOptions.customMetadata.add(contentsOf: bazelConnection.headers)
+        self.casClient = ContentAddressableStorageClient(channel: connection)
+        self.casClient.defaultCallOptions.customMetadata.add(contentsOf: bazelConnection.headers)
+    }
+
+    /// Closes the connection to the server. The cache can't be used afterwards.
+    public func close() -> LLBFuture<Void> {
+        return connection.close()
+    }
+
+    public func get(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBDataID?> {
+        return getEntry(key: key, ctx).map { $0?.id }
+    }
+
+    public func update(key: LLBKey, value: LLBDataID, _ ctx: Context) -> LLBFuture<Void> {
+        return update(key: key, entry: LLBFunctionCacheEntry(id: value), ctx)
+    }
+
+    public func getEntry(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunctionCacheEntry?> {
+        return localCache.getEntry(key: key, ctx).flatMap { localEntry in
+            if let localEntry = localEntry {
+                return self.group.next().makeSucceededFuture(localEntry)
+            }
+
+            return self.remoteGet(key: key, ctx).flatMap { remoteEntry in
+                guard let remoteEntry = remoteEntry else {
+                    return self.group.next().makeSucceededFuture(nil)
+                }
+                return self.localCache.update(key: key, entry: remoteEntry, ctx).map { remoteEntry }
+            }
+        }
+    }
+
+    public func update(key: LLBKey, entry: LLBFunctionCacheEntry, _ ctx: Context) -> LLBFuture<Void> {
+        let remoteResult = remoteUpdate(key: key, entry: entry, ctx)
+        return localCache.update(key: key, entry: entry, ctx).and(remoteResult).map { _ in () }
+    }
+
+    /// The action digest under which the value for the key is stored.
+    private func actionDigest(for key: LLBKey) -> Digest {
+        let stableHashValue = LLBInternedKey(key).stableHashValue
+        return Digest(with: Array("llbuild2-function-cache/\(version)/".utf8) + stableHashValue.bytes)
+    }
+
+    /// Fetches the value for the key from the remote cache. Any failure to reach the remote cache is treated as a
+    /// cache miss, so that an unavailable cache causes the function to be evaluated instead of failing the build.
+    private func remoteGet(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunctionCacheEntry?> {
+        let request = GetActionResultRequest.with {
+            if let instance = instance {
+                $0.instanceName = instance
+            }
+            $0.actionDigest = actionDigest(for: key)
+            $0.inlineStdout = true
+            $0.inlineOutputFiles = [LLBBazelFunctionCache.inlineValuePath]
+        }
+
+        return actionCacheClient.getActionResult(request).response.flatMap { actionResult -> LLBFuture<LLBFunctionCacheEntry?> in
+            // Servers are free to not inline stdout, in which case the ID of the value is fetched from the CAS.
+            let valueBytes: LLBFuture<Data>
+            if actionResult.stdoutRaw.isEmpty && actionResult.hasStdoutDigest {
+                valueBytes = self.fetchBlob(actionResult.stdoutDigest)
+            } else {
+                valueBytes = self.group.next().makeSucceededFuture(actionResult.stdoutRaw)
+            }
+
+            return valueBytes.flatMapThrowing { valueBytes in
+                let id = try LLBDataID(from: LLBByteBuffer.withBytes(ArraySlice(valueBytes)))
+
+                // The same goes for the inline value, which is otherwise loaded from the CAS by the caller.
+                let inlineValue = actionResult.outputFiles.first {
+                    $0.path == LLBBazelFunctionCache.inlineValuePath && !$0.contents.isEmpty
+                }
+                let object = try inlineValue.map { try LLBCASObject(from: LLBByteBuffer.withBytes(ArraySlice($0.contents))) }
+                return LLBFunctionCacheEntry(id: id, object: object)
+            }
+        }.recover { error in
+            if let status = error as? GRPCStatus, status.code == .notFound {
+                return nil
+            }
+            ctx.logger?.debug("remote function cache lookup for \(key.logDescription()) failed: \(error)")
+            return nil
+        }
+    }
+
+    /// Stores the value for the key in the remote cache. As with lookups, failures are not propagated since the local
+    /// cache has already been updated.
+    ///
+    /// Servers may check that the outputs of an action result are in the CAS, and clients may fetch them from there
+    /// instead of using the inlined contents, so stdout and the inline value are written to the CAS before the action
+    /// result that refers to them is published.
+    private func remoteUpdate(key: LLBKey, entry: LLBFunctionCacheEntry, _ ctx: Context) -> LLBFuture<Void> {
+        let valueBytes: Data
+        var inlineValue: OutputFile? = nil
+        do {
+            valueBytes = Data(try entry.id.toBytes().readableBytesView)
+            if let object = entry.object, object.data.readableBytes <= inlineValueLimit {
+                let objectData = try object.toData()
+                inlineValue = OutputFile.with {
+                    $0.path = LLBBazelFunctionCache.inlineValuePath
+                    $0.digest = Digest(with: objectData)
+                    $0.contents = objectData
+                }
+            }
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
+
+        let request = UpdateActionResultRequest.with {
+            if let instance = instance {
+                $0.instanceName = instance
+            }
+            $0.actionDigest = actionDigest(for: key)
+            $0.actionResult = ActionResult.with {
+                $0.stdoutRaw = valueBytes
+                $0.stdoutDigest = Digest(with: valueBytes)
+                if let inlineValue = inlineValue {
+                    $0.outputFiles = [inlineValue]
+                }
+            }
+        }
+
+        var blobs = [(request.actionResult.stdoutDigest, valueBytes)]
+        if let inlineValue = inlineValue {
+            blobs.append((inlineValue.digest, inlineValue.contents))
+        }
+        return uploadBlobs(blobs).flatMap {
+            self.actionCacheClient.updateActionResult(request).response.map { _ in () }
+        }.recover { error in
+            ctx.logger?.debug("remote function cache update for \(key.logDescription()) failed: \(error)")
+        }
+    }
+
+    /// Writes the blobs of an action result to the remote CAS.
+    private func uploadBlobs(_ blobs: [(Digest, Data)]) -> LLBFuture<Void> {
+        let request = BatchUpdateBlobsRequest.with {
+            if let instance = instance {
+                $0.instanceName = instance
+            }
+            $0.requests = blobs.map { digest, data in
+                BatchUpdateBlobsRequest.Request.with {
+                    $0.digest = digest
+                    $0.data = data
+                }
+            }
+        }
+        return casClient.batchUpdateBlobs(request).response.flatMapThrowing { response in
+            for blobResponse in response.responses where Google_Rpc_Code(rawValue: Int(blobResponse.status.code)) != .ok {
+                throw LLBBazelCASDatabase.Error.batchRequestFailed(blobResponse.status)
+            }
+        }
+    }
+
+    /// Reads a small blob, such as the stdout of an action result, from the remote CAS.
+    private func fetchBlob(_ digest: Digest) -> LLBFuture<Data> {
+        let request = BatchReadBlobsRequest.with {
+            if let instance = instance {
+                $0.instanceName = instance
+            }
+            $0.digests = [digest]
+        }
+        return casClient.batchReadBlobs(request).response.flatMapThrowing { response in
+            guard let blobResponse = response.responses.first(where: { $0.digest == digest }) else {
+                throw LLBBazelCASDatabase.Error.incompleteRead
+            }
+            guard Google_Rpc_Code(rawValue: Int(blobResponse.status.code)) == .ok else {
+                throw LLBBazelCASDatabase.Error.batchRequestFailed(blobResponse.status)
+            }
+            return blobResponse.data
+        }
+    }
+}
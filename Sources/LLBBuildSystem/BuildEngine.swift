@@ -32,14 +32,20 @@ fileprivate class LLBBuildEngineDelegate: LLBEngineDelegate {
         configuredTargetDelegate: LLBConfiguredTargetDelegate?,
         ruleLookupDelegate: LLBRuleLookupDelegate?,
         registrationDelegate: LLBSerializableRegistrationDelegate?,
-        dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate?
+        dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate?,
+        fullInputValidation: Bool,
+        lazyOutputResolver: LLBLazyOutputResolver?,
+        actionResultCache: LLBActionResultCache?
     ) {
         self.buildFunctionLookupDelegate = buildFunctionLookupDelegate
         self.registrationDelegate = registrationDelegate
         self.functionMap = LLBBuildFunctionMap(
             configuredTargetDelegate: configuredTargetDelegate,
             ruleLookupDelegate: ruleLookupDelegate,
-            dynamicActionExecutorDelegate: dynamicActionExecutorDelegate
+            dynamicActionExecutorDelegate: dynamicActionExecutorDelegate,
+            fullInputValidation: fullInputValidation,
+            lazyOutputResolver: lazyOutputResolver,
+            actionResultCache: actionResultCache
         )
     }
 
@@ -71,6 +77,7 @@ fileprivate class LLBBuildEngineDelegate: LLBEngineDelegate {
 public final class LLBBuildEngine {
     private let coreEngine: LLBEngine
     private let delegate: LLBEngineDelegate
+    private let lazyOutputResolver: LLBLazyOutputResolver?
 
     /// Builds a new instance of an LLBBuildEngine.
     ///
@@ -90,6 +97,27 @@ public final class LLBBuildEngine {
     ///           from the identifier encoded in the action key.
     ///     - executor: The executor that will execute the actions.
     ///     - functionCache: The function cache that acts as the memoization layer for the core llbuild2 engine.
+    ///     - detectCycles: Whether the engine should check for dependency cycles when keys are requested. Only disable
+    ///           for trusted builds that are known to be acyclic, as cycles will otherwise never complete.
+    ///     - maxResidentEntries: The maximum number of evaluated keys to keep in memory, or nil to keep all of them.
+    ///           Evicted keys are reloaded from the function cache when requested again.
+    ///     - earlyCutoff: Whether the engine should skip evaluating keys whose dependencies are unchanged after the
+    ///           results are invalidated.
+    ///     - maxEvaluationTraces: The maximum number of evaluation traces to keep in early cutoff mode, or nil to keep
+    ///           all of them. The least recently used traces are dropped once the limit is reached.
+    ///     - scheduler: The scheduler that chooses the event loop on which each key is evaluated.
+    ///     - fullInputValidation: Whether every action checks the type of each of its inputs against the database. By
+    ///           default, only inputs with an unknown type are checked, and the outputs of actions are trusted to have
+    ///           their declared types. Enable to debug executors or delegates that produce inconsistent data IDs.
+    ///     - lazyOutputResolver: The resolver for the lazy outputs of the executor, if it leaves outputs in remote
+    ///           storage instead of importing them into `db`. Lazy outputs are only fetched when they are merged, or
+    ///           when they are explicitly materialized.
+    ///     - actionResultCache: The cache of action results that is checked before executing each command action, with
+    ///           the results of successful executions being added to it. Since it's keyed by the contents of the
+    ///           execution requests instead of the build keys, it can be shared by engines with any configuration, such
+    ///           as through `LLBRemoteActionResultCache`. Dynamic actions are always executed.
+    ///     - keepGoing: Whether the build continues after a requested key fails. By default, a failed build cancels the
+    ///           `cancellationToken` of its context, which stops the evaluations and actions that are still running.
     public init(
         group: LLBFuturesDispatchGroup,
         db: LLBCASDatabase,
@@ -99,24 +127,68 @@ public final class LLBBuildEngine {
         registrationDelegate: LLBSerializableRegistrationDelegate? = nil,
         dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate? = nil,
         executor: LLBExecutor,
-        functionCache: LLBFunctionCache? = nil
+        functionCache: LLBFunctionCache? = nil,
+        detectCycles: Bool = true,
+        maxResidentEntries: Int? = nil,
+        earlyCutoff: Bool = false,
+        maxEvaluationTraces: Int? = nil,
+        scheduler: LLBEngineScheduler = LLBRoundRobinEngineScheduler(),
+        fullInputValidation: Bool = false,
+        lazyOutputResolver: LLBLazyOutputResolver? = nil,
+        actionResultCache: LLBActionResultCache? = nil,
+        keepGoing: Bool = false
     ) {
+        self.lazyOutputResolver = lazyOutputResolver
         self.delegate = LLBBuildEngineDelegate(
             buildFunctionLookupDelegate: buildFunctionLookupDelegate,
             configuredTargetDelegate: configuredTargetDelegate,
             ruleLookupDelegate: ruleLookupDelegate,
             registrationDelegate: registrationDelegate,
-            dynamicActionExecutorDelegate: dynamicActionExecutorDelegate
+            dynamicActionExecutorDelegate: dynamicActionExecutorDelegate,
+            fullInputValidation: fullInputValidation,
+            lazyOutputResolver: lazyOutputResolver,
+            actionResultCache: actionResultCache
         )
         self.coreEngine = LLBEngine(
             group: group,
             delegate: delegate,
             db: db,
             executor: executor,
-            functionCache: functionCache
+            functionCache: functionCache,
+            detectCycles: detectCycles,
+            maxResidentEntries: maxResidentEntries,
+            earlyCutoff: earlyCutoff,
+            maxEvaluationTraces: maxEvaluationTraces,
+            scheduler: scheduler,
+            keepGoing: keepGoing
         )
     }
 
+    /// Statistics about the results currently held in memory by the engine.
+    public var stats: LLBEngineStats {
+        return coreEngine.stats
+    }
+
+    /// Drops all of the completed results, so that keys are evaluated again on their next request.
+    public func invalidateResults() {
+        coreEngine.invalidateResults()
+    }
+
+    /// Drops the evaluation traces of early cutoff mode, so that their values can be freed.
+    public func clearEvaluationTraces() {
+        coreEngine.clearEvaluationTraces()
+    }
+
+    /// Returns the ID of the contents of an artifact, fetching them into the database if the artifact is a lazy output
+    /// of the executor. Use it for the artifacts that the client needs on disk, such as the requested top-level
+    /// artifacts; intermediate artifacts are only fetched if an action needs their contents.
+    public func materialize(_ artifactValue: LLBArtifactValue, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        guard let resolver = lazyOutputResolver else {
+            return ctx.group.next().makeSucceededFuture(artifactValue.dataID)
+        }
+        return resolver.materialize(artifactValue.dataID, ctx)
+    }
+
     /// Requests the evaluation of a build key, returning an abstract build value.
     public func build(_ key: LLBBuildKey, _ ctx: Context) -> LLBFuture<LLBBuildValue> {
         return self.coreEngine.build(key: key, ctx).flatMapThrowing { value -> LLBBuildValue in
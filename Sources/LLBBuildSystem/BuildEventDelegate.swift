@@ -65,6 +65,20 @@ public protocol LLBBuildEventDelegate {
 
     /// Invoked when an action has completed.
     func actionExecutionCompleted(action: LLBBuildEventActionDescription)
+
+    /// Invoked when the action result cache of the engine has been checked for an action, before it is executed. On a
+    /// hit, the cached result is used and the action isn't executed.
+    func actionResultCacheLookupCompleted(action: LLBBuildEventActionDescription, hit: Bool)
+
+    /// Invoked when the result of an action couldn't be stored in the action result cache of the engine. The build
+    /// doesn't wait for the update and isn't failed by it, so this is the only report of the failure.
+    func actionResultCacheUpdateFailed(action: LLBBuildEventActionDescription, error: Error)
+}
+
+public extension LLBBuildEventDelegate {
+    func actionResultCacheLookupCompleted(action: LLBBuildEventActionDescription, hit: Bool) {}
+
+    func actionResultCacheUpdateFailed(action: LLBBuildEventActionDescription, error: Error) {}
 }
 
 /// Support storing and retrieving a build event delegate instance from a Context.
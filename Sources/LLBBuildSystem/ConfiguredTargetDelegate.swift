@@ -56,4 +56,16 @@ public protocol LLBConfiguredTargetDelegate {
     /// function that is needed to evaluate a ConfiguredTarget will need to be implemented by the client and returned
     /// through the LLBBuildFunctionLookupDelegate implementation.
     func configuredTarget(for key: LLBConfiguredTargetKey, _ fi: LLBBuildFunctionInterface, _ ctx: Context) throws -> LLBFuture<LLBConfiguredTarget>
+
+    /// Returns the dependencies of the configured target for the given key that are known before the configured target
+    /// is available (e.g. from a quick scan of the build file), so that they can be evaluated in parallel with
+    /// `configuredTarget(for:)`. Only dependencies that the configured target will declare should be returned, since
+    /// they are evaluated regardless. Defaults to none.
+    func prefetchedDependencies(for key: LLBConfiguredTargetKey, _ ctx: Context) -> [LLBTargetDependency]
+}
+
+public extension LLBConfiguredTargetDelegate {
+    func prefetchedDependencies(for key: LLBConfiguredTargetKey, _ ctx: Context) -> [LLBTargetDependency] {
+        return []
+    }
 }
@@ -16,7 +16,10 @@ class LLBBuildFunctionMap {
     init(
         configuredTargetDelegate: LLBConfiguredTargetDelegate?,
         ruleLookupDelegate: LLBRuleLookupDelegate?,
-        dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate?
+        dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate?,
+        fullInputValidation: Bool = false,
+        lazyOutputResolver: LLBLazyOutputResolver? = nil,
+        actionResultCache: LLBActionResultCache? = nil
     ) {
         self.functionMap = [
             LLBArtifact.identifier: ArtifactFunction(),
@@ -36,7 +39,10 @@ class LLBBuildFunctionMap {
             ActionIDKey.identifier: ActionIDFunction(),
             LLBActionKey.identifier: ActionFunction(),
             LLBActionExecutionKey.identifier: ActionExecutionFunction(
-                dynamicActionExecutorDelegate: dynamicActionExecutorDelegate
+                dynamicActionExecutorDelegate: dynamicActionExecutorDelegate,
+                fullInputValidation: fullInputValidation,
+                lazyOutputResolver: lazyOutputResolver,
+                actionResultCache: actionResultCache
             ),
         ]
     }
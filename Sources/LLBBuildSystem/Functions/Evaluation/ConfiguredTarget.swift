@@ -11,6 +11,9 @@ import llbuild2
 extension LLBConfiguredTargetKey: LLBBuildKey {}
 extension LLBConfiguredTargetValue: LLBBuildValue {}
 
+// Configured targets are decoded by every evaluation that depends on them.
+extension LLBConfiguredTargetValue: LLBCachedDecodedValue {}
+
 public enum LLBConfiguredTargetError: Error {
     /// Internal error if a configured target was requested and no delegate was configured.
     case noDelegate
@@ -109,6 +112,18 @@ final class ConfiguredTargetFunction: LLBBuildFunction<LLBConfiguredTargetKey, L
         guard let delegate = configuredTargetDelegate else {
             return ctx.group.next().makeFailedFuture(LLBConfiguredTargetError.noDelegate)
         }
+
+        // Start evaluating the dependencies that are known upfront, so that they are evaluated in parallel with the
+        // configured target. The requests below are deduplicated by the engine once the target declares them.
+        for dependency in delegate.prefetchedDependencies(for: key, ctx) {
+            switch dependency {
+            case let .single(label, configurationKey):
+                _ = fi.requestDependency(dependencyKey(label, configurationKey, of: key), ctx)
+            case let .list(labels, configurationKey):
+                _ = fi.requestDependencies(labels.map { dependencyKey($0, configurationKey, of: key) }, ctx)
+            }
+        }
+
         do {
             return try delegate.configuredTarget(for: key, fi, ctx).flatMap { configuredTarget in
                 var namedProviderMapFutures = [LLBFuture<NamedProviderMapType>]()
@@ -119,22 +134,10 @@ final class ConfiguredTargetFunction: LLBBuildFunction<LLBConfiguredTargetKey, L
                     let namedProviderMapFuture: LLBFuture<NamedProviderMapType>
                     switch type {
                     case let .single(label, configurationKey):
-                        let dependencyKey = LLBConfiguredTargetKey(
-                            rootID: key.rootID,
-                            label: label,
-                            // If there was no configurationKey specified, use this targets configuration.
-                            configurationKey: configurationKey ?? key.configurationKey
-                        )
+                        let dependencyKey = self.dependencyKey(label, configurationKey, of: key)
                         namedProviderMapFuture = fi.requestDependency(dependencyKey, ctx).map { NamedProviderMapType.single(name, $0) }
                     case let .list(labels, configurationKey):
-                        let dependencyKeys = labels.map {
-                            LLBConfiguredTargetKey(
-                                rootID: key.rootID,
-                                label: $0,
-                                // If there was no configurationKey specified, use this targets configuration.
-                                configurationKey: configurationKey ?? key.configurationKey
-                            )
-                        }
+                        let dependencyKeys = labels.map { self.dependencyKey($0, configurationKey, of: key) }
                         namedProviderMapFuture = fi.requestDependencies(dependencyKeys, ctx).map { NamedProviderMapType.list(name, $0) }
                     }
                     
@@ -171,4 +174,17 @@ final class ConfiguredTargetFunction: LLBBuildFunction<LLBConfiguredTargetKey, L
             return ctx.group.next().makeFailedFuture(LLBConfiguredTargetError.delegateError(error))
         }
     }
+
+    private func dependencyKey(
+        _ label: LLBLabel,
+        _ configurationKey: LLBConfigurationKey?,
+        of key: LLBConfiguredTargetKey
+    ) -> LLBConfiguredTargetKey {
+        return LLBConfiguredTargetKey(
+            rootID: key.rootID,
+            label: label,
+            // If there was no configurationKey specified, use this targets configuration.
+            configurationKey: configurationKey ?? key.configurationKey
+        )
+    }
 }
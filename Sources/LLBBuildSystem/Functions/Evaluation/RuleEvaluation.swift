@@ -129,17 +129,22 @@ public final class RuleEvaluationFunction: LLBBuildFunction<LLBRuleEvaluationKey
                 }.flatMap { providers in
                     // Upload the static write contents directly into the CAS and associate the dataIDs to the
                     // artifacts. This needs to happen before we serialize the actions, otherwise we risk actions
-                    // serializing artifacts that have not yet been updated to contain origin reference.
-                    let staticWritesFutures: [LLBFuture<Void>] = ruleContext.staticWriteActions.map { (path, contents) in
-                        ctx.db.put(data: LLBByteBuffer.withBytes(ArraySlice<UInt8>(contents)), ctx).flatMapThrowing { dataID in
-                            guard let artifact = ruleContext.declaredArtifacts[path],
+                    // serializing artifacts that have not yet been updated to contain origin reference. All of the
+                    // contents are written in a single batch.
+                    let staticWrites = ruleContext.staticWriteActions.map { $0 }
+                    let staticWriteObjects = staticWrites.map { (_, contents) in
+                        LLBCASObject(refs: [], data: LLBByteBuffer.withBytes(ArraySlice<UInt8>(contents)))
+                    }
+                    let staticWritesFuture: LLBFuture<Void> = ctx.db.put(objects: staticWriteObjects, ctx).flatMapThrowing { dataIDs in
+                        for (staticWrite, dataID) in zip(staticWrites, dataIDs) {
+                            guard let artifact = ruleContext.declaredArtifacts[staticWrite.key],
                                   artifact.originType == nil else {
                                 throw LLBRuleEvaluationError.artifactAlreadyInitialized
                             }
                             artifact.updateID(dataID: dataID)
                         }
                     }
-                    let actionKeysFuture: LLBFuture<[LLBDataID]> = LLBFuture.whenAllSucceed(staticWritesFutures, on: ctx.group.next()).flatMapThrowing { _ in
+                    let actionKeysFuture: LLBFuture<[LLBDataID]> = staticWritesFuture.flatMapThrowing { _ in
                         // Ensure all artifacts have been updated to contain an origin reference, before the actions
                         // are serialized but after static writes have been uploaded.
                         for artifact in ruleContext.declaredArtifacts.values {
@@ -148,17 +153,17 @@ public final class RuleEvaluationFunction: LLBBuildFunction<LLBRuleEvaluationKey
                             }
                         }
                     }.flatMap { _ in
-                        let actionKeyFutures: [LLBFuture<LLBDataID>]
+                        let actionKeyObjects: [LLBCASObject]
                         do {
-                            // Store the action keys in the CAS
-                            actionKeyFutures = try ruleContext.registeredActions.map { actionKey in
-                                ctx.db.put(data: try actionKey.toBytes(), ctx)
+                            // Store the action keys in the CAS, in a single batch.
+                            actionKeyObjects = try ruleContext.registeredActions.map { actionKey in
+                                LLBCASObject(refs: [], data: try actionKey.toBytes())
                             }
                         } catch {
                             return ctx.group.next().makeFailedFuture(error)
                         }
 
-                        return LLBFuture.whenAllSucceed(actionKeyFutures, on: ctx.group.next())
+                        return ctx.db.put(objects: actionKeyObjects, ctx)
                     }
 
                     return actionKeysFuture.flatMapThrowing { actionIDs in
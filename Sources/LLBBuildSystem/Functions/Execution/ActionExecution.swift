@@ -7,6 +7,7 @@
 // See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
 
 import llbuild2
+import NIOConcurrencyHelpers
 import SwiftProtobuf
 import TSFCASFileTree
 
@@ -179,11 +180,65 @@ public enum LLBActionExecutionError: Error {
     case invalidInput(String)
 }
 
+/// The action inputs whose types are known to match the database, either because they were already checked or because
+/// they were produced by earlier actions with that type.
+final class ValidatedInputs {
+    private struct Entry: Hashable {
+        let dataID: LLBDataID
+        let type: LLBArtifactType
+    }
+
+    /// The maximum number of entries, after which the least recently used inputs are forgotten and validated again.
+    let maxEntries: Int
+
+    private let lock = Lock()
+    private let entries: LLBBoundedLRU<Entry, Void>
+
+    init(maxEntries: Int = 1_000_000) {
+        self.maxEntries = maxEntries
+        self.entries = LLBBoundedLRU(capacity: maxEntries)
+    }
+
+    func contains(_ dataID: LLBDataID, type: LLBArtifactType) -> Bool {
+        return lock.withLock { entries[Entry(dataID: dataID, type: type)] != nil }
+    }
+
+    func insert<S: Sequence>(_ inputs: S) where S.Element == (LLBDataID, LLBArtifactType) {
+        lock.withLockVoid {
+            for (dataID, type) in inputs {
+                entries.insert((), for: Entry(dataID: dataID, type: type))
+            }
+        }
+    }
+}
+
 final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLBActionExecutionValue> {
     let dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate?
 
-    init(dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate?) {
+    /// Whether every input of every action is checked against the database, instead of only the unknown ones.
+    let fullInputValidation: Bool
+    let validatedInputs = ValidatedInputs()
+
+    /// Resolves the lazy outputs of executors that leave outputs in remote storage, if any.
+    let lazyOutputResolver: LLBLazyOutputResolver?
+
+    /// The cache of the results of identical requests, which is checked before executing command actions, if any.
+    let actionResultCache: LLBActionResultCache?
+
+    /// Memoizes the merges of directories across evaluations, so that merges of layers that barely changed only redo
+    /// the work for the directories that did.
+    let treeMerger = LLBTreeMerger()
+
+    init(
+        dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate?,
+        fullInputValidation: Bool = false,
+        lazyOutputResolver: LLBLazyOutputResolver? = nil,
+        actionResultCache: LLBActionResultCache? = nil
+    ) {
         self.dynamicActionExecutorDelegate = dynamicActionExecutorDelegate
+        self.fullInputValidation = fullInputValidation
+        self.lazyOutputResolver = lazyOutputResolver
+        self.actionResultCache = actionResultCache
     }
 
     override func evaluate(
@@ -208,6 +263,7 @@ final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLB
                     owner: actionExecutionKey.owner
                 )
                 return self.evaluateCommand(
+                    actionExecutionKey: actionExecutionKey,
                     commandKey: commandKey,
                     chainedLogsID: chainedLogsID,
                     requestExtras: requestExtras,
@@ -229,9 +285,18 @@ final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLB
     }
 
     private func validateInputs(_ inputs: [LLBActionInput], _ ctx: Context) -> LLBFuture<Void> {
+        // Inputs are usually the outputs of earlier actions, or shared with other actions, so only the ones whose type
+        // isn't known yet are loaded from the database.
+        let pendingInputs = fullInputValidation
+            ? inputs
+            : inputs.filter { !validatedInputs.contains($0.dataID, type: $0.type) }
+        guard !pendingInputs.isEmpty else {
+            return ctx.group.next().makeSucceededFuture(())
+        }
+
         let client = LLBCASFSClient(ctx.db)
 
-        let validationFutures = inputs.map { input in
+        let validationFutures = pendingInputs.map { input in
             client.load(input.dataID, ctx).flatMapThrowing { node in
                 switch input.type {
                 case .directory:
@@ -245,6 +310,16 @@ final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLB
                 case .UNRECOGNIZED(let value):
                     throw LLBActionExecutionError.invalidInput("Unrecognized input type: \(value)")
                 }
+            }.flatMapError { error -> LLBFuture<Void> in
+                // Lazy outputs don't have file tree contents, so their type is checked by the resolver instead.
+                guard let resolver = self.lazyOutputResolver else {
+                    return ctx.group.next().makeFailedFuture(error)
+                }
+                return resolver.lazyOutputType(input.dataID, ctx).flatMapThrowing { type in
+                    guard type == input.type else {
+                        throw error
+                    }
+                }
             }.flatMapErrorThrowing { error in
                 if case .noEntry = error as? LLBCASFSClient.Error {
                     throw LLBActionExecutionError.invalidInput(
@@ -255,10 +330,13 @@ final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLB
             }
         }
 
-        return LLBFuture.whenAllSucceed(validationFutures, on: ctx.group.next()).map { _ in }
+        return LLBFuture.whenAllSucceed(validationFutures, on: ctx.group.next()).map { _ in
+            self.validatedInputs.insert(pendingInputs.lazy.map { ($0.dataID, $0.type) })
+        }
     }
 
     private func evaluateCommand(
+        actionExecutionKey: LLBActionExecutionKey,
         commandKey: LLBCommandActionExecution,
         chainedLogsID: LLBDataID?,
         requestExtras: LLBActionExecutionRequestExtras,
@@ -283,7 +361,7 @@ final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLB
 
         let resultFuture: LLBFuture<LLBActionExecutionResponse>
         if commandKey.dynamicIdentifier.isEmpty {
-            resultFuture = fi.spawn(actionExecutionRequest, ctx)
+            resultFuture = spawn(actionExecutionRequest, action: actionExecutionKey, fi, ctx)
         } else if let dynamicExecutor = dynamicActionExecutorDelegate?.dynamicActionExecutor(for: commandKey.dynamicIdentifier) {
             resultFuture = dynamicExecutor.execute(request: actionExecutionRequest, fi, ctx)
 
@@ -310,10 +388,47 @@ final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLB
                 }
             }
 
+            // The outputs have the declared types, so actions that consume them don't need to validate them.
+            self.validatedInputs.insert(zip(executionResponse.outputs, commandKey.outputs.lazy.map { $0.type }))
+            self.validatedInputs.insert(
+                zip(executionResponse.unconditionalOutputs, commandKey.unconditionalOutputs.lazy.map { $0.type })
+            )
+
             return LLBActionExecutionValue(from: executionResponse)
         }
     }
 
+    /// Executes the request, unless the action result cache has the response of an identical request. Dynamic actions
+    /// aren't cached, since their results depend on the implementation of the action as well as on the request.
+    private func spawn(
+        _ request: LLBActionExecutionRequest,
+        action: LLBActionExecutionKey,
+        _ fi: LLBBuildFunctionInterface,
+        _ ctx: Context
+    ) -> LLBFuture<LLBActionExecutionResponse> {
+        guard let actionResultCache = actionResultCache else {
+            return fi.spawn(request, ctx)
+        }
+
+        return actionResultCache.lookup(request, ctx).flatMap { cachedResponse in
+            ctx.buildEventDelegate?.actionResultCacheLookupCompleted(action: action, hit: cachedResponse != nil)
+            if let cachedResponse = cachedResponse {
+                return ctx.group.next().makeSucceededFuture(cachedResponse)
+            }
+
+            return fi.spawn(request, ctx).map { response in
+                // Only successful executions are published. The build doesn't wait for them to be, since the response
+                // is already known, so failures to publish are only reported to the build event delegate.
+                if response.exitCode == 0 {
+                    actionResultCache.update(request, response: response, ctx).whenFailure { error in
+                        ctx.buildEventDelegate?.actionResultCacheUpdateFailed(action: action, error: error)
+                    }
+                }
+                return response
+            }
+        }
+    }
+
     private func evaluateMergeTrees(
         mergeTreesKey: LLBMergeTreesActionExecution,
         chainedLogsID: LLBDataID?,
@@ -328,25 +443,25 @@ final class ActionExecutionFunction: LLBBuildFunction<LLBActionExecutionKey, LLB
             )
         }
 
-        let client = LLBCASFSClient(ctx.db)
-
-        var prependedTrees = [LLBFuture<LLBCASFileTree>]()
-
-        for input in inputs {
-            prependedTrees.append(client.wrap(input.dataID, path: input.path, ctx))
-        }
-
-        // Skip merging if there is a single prepended tree.
-        if prependedTrees.count == 1 {
-            return prependedTrees[0].map {
-                LLBActionExecutionValue(outputs: [$0.id], stdoutID: chainedLogsID, stderrID: chainedLogsID)
-            }
+        // Merging needs the contents of the trees, so lazy inputs are materialized first.
+        let materializedInputs: LLBFuture<[LLBActionInput]>
+        if let resolver = lazyOutputResolver {
+            materializedInputs = LLBFuture.whenAllSucceed(inputs.map { input in
+                resolver.materialize(input.dataID, ctx).map { dataID -> LLBActionInput in
+                    var input = input
+                    input.dataID = dataID
+                    return input
+                }
+            }, on: ctx.group.next())
+        } else {
+            materializedInputs = ctx.group.next().makeSucceededFuture(inputs)
         }
 
-        return LLBFuture.whenAllSucceed(prependedTrees, on: ctx.group.next()).flatMap { trees in
-            return LLBCASFileTree.merge(trees: trees, in: ctx.db, ctx)
+        return materializedInputs.flatMap { inputs in
+            self.treeMerger.merge(inputs, ctx)
         }.map {
-            return LLBActionExecutionValue(outputs: [$0.id], stdoutID: chainedLogsID, stderrID: chainedLogsID)
+            self.validatedInputs.insert(CollectionOfOne(($0, LLBArtifactType.directory)))
+            return LLBActionExecutionValue(outputs: [$0], stdoutID: chainedLogsID, stderrID: chainedLogsID)
         }
     }
 }
@@ -0,0 +1,186 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import NIOConcurrencyHelpers
+import TSFCASFileTree
+
+public enum LLBTreeMergerError: Error {
+    /// A tree listed an entry that it couldn't look up.
+    case invalidTree(LLBDataID)
+}
+
+/// Merges file trees while memoizing the merge of every directory, so that merging layers that mostly didn't change
+/// only walks and uploads the directories that did.
+///
+/// Trees are merged in order, like `LLBCASFileTree.merge`: entries of later trees replace the entries of earlier trees
+/// with the same name, except that two directories with the same name are merged recursively. Entries that only exist
+/// in one of the trees are reused as they are, so unchanged subtrees are shared with the inputs. All the layers are
+/// merged in a single pass per directory, so each merged directory is only written once.
+public final class LLBTreeMerger {
+    /// The result of merging directories.
+    private struct MergedTree {
+        let id: LLBDataID
+        let aggregateSize: UInt64
+    }
+
+    private struct WrapKey: Hashable {
+        let id: LLBDataID
+        let path: String
+    }
+
+    /// The memoized results for a database. The memo retains its database, so that the identifier it is found by
+    /// can't be reused by another database while the memo exists.
+    private final class Memo {
+        let db: LLBCASDatabase
+        let merges: LLBBoundedLRU<[LLBDataID], LLBFuture<MergedTree>>
+        let wraps: LLBBoundedLRU<WrapKey, LLBFuture<LLBDataID>>
+
+        init(db: LLBCASDatabase, maxMemoizedResults: Int) {
+            self.db = db
+            self.merges = LLBBoundedLRU(capacity: maxMemoizedResults)
+            self.wraps = LLBBoundedLRU(capacity: maxMemoizedResults)
+        }
+    }
+
+    /// The maximum number of memoized merges, and of memoized wraps, per database. Once reached, the least recently
+    /// used results are discarded.
+    public let maxMemoizedResults: Int
+
+    private let lock = Lock()
+    private var memos = [ObjectIdentifier: Memo]()
+
+    public init(maxMemoizedResults: Int = 100_000) {
+        self.maxMemoizedResults = maxMemoizedResults
+    }
+
+    /// Merges the inputs, each placed at its path, into a single tree and returns its ID.
+    public func merge(_ inputs: [LLBActionInput], _ ctx: Context) -> LLBFuture<LLBDataID> {
+        let memo: Memo = lock.withLock {
+            if let memo = memos[ObjectIdentifier(ctx.db)] {
+                return memo
+            }
+            let memo = Memo(db: ctx.db, maxMemoizedResults: maxMemoizedResults)
+            memos[ObjectIdentifier(ctx.db)] = memo
+            return memo
+        }
+
+        let wrapped = inputs.map { wrap($0.dataID, path: $0.path, memo, ctx) }
+        guard !wrapped.isEmpty else {
+            return LLBCASFileTree.create(files: [], in: memo.db, ctx).map { $0.id }
+        }
+
+        return LLBFuture.whenAllSucceed(wrapped, on: ctx.group.next()).flatMap { layers in
+            self.mergeDirectories(layers, memo, ctx).map { $0.id }
+        }
+    }
+
+    /// Returns the ID of a tree that contains `id` at `path`.
+    private func wrap(_ id: LLBDataID, path: String, _ memo: Memo, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return memoized(WrapKey(id: id, path: path), in: \.wraps, of: memo) {
+            LLBCASFSClient(memo.db).wrap(id, path: path, ctx).map { $0.id }
+        }
+    }
+
+    /// Merges the directories, which are given in order from the lowest to the topmost layer.
+    private func mergeDirectories(_ allLayers: [LLBDataID], _ memo: Memo, _ ctx: Context) -> LLBFuture<MergedTree> {
+        // Merging a directory with itself doesn't change it, so repeated layers only need to be merged once.
+        var layers = [LLBDataID]()
+        for id in allLayers where id != layers.last {
+            layers.append(id)
+        }
+
+        return memoized(layers, in: \.merges, of: memo) {
+            let client = LLBCASFSClient(memo.db)
+            let trees = layers.map { self.loadTree($0, client, ctx) }
+            return LLBFuture.whenAllSucceed(trees, on: ctx.group.next()).flatMap { trees in
+                self.merge(trees, memo, ctx)
+            }
+        }
+    }
+
+    private func merge(_ trees: [LLBCASFileTree], _ memo: Memo, _ ctx: Context) -> LLBFuture<MergedTree> {
+        if trees.count == 1 {
+            return ctx.group.next().makeSucceededFuture(
+                MergedTree(id: trees[0].id, aggregateSize: UInt64(clamping: trees[0].aggregateSize))
+            )
+        }
+
+        // The entries with each name, from the lowest to the topmost layer.
+        var layeredEntries = [String: [LLBDirectoryEntryID]]()
+        for tree in trees {
+            for entry in tree.files {
+                guard let match = tree.lookup(entry.name) else {
+                    return ctx.group.next().makeFailedFuture(LLBTreeMergerError.invalidTree(tree.id))
+                }
+                layeredEntries[entry.name, default: []].append(LLBDirectoryEntryID(info: match.info, id: match.id))
+            }
+        }
+
+        var entries = [LLBFuture<LLBDirectoryEntryID>]()
+        for (_, layers) in layeredEntries {
+            let top = layers.last!
+
+            // The topmost entry replaces everything below it, unless it is a directory, in which case it is merged
+            // with the directories right below it, up to the first entry that isn't a directory.
+            let directories = layers.reversed().prefix(while: { $0.info.type == .directory })
+            guard directories.count > 1 else {
+                entries.append(ctx.group.next().makeSucceededFuture(top))
+                continue
+            }
+
+            entries.append(mergeDirectories(directories.reversed().map { $0.id }, memo, ctx).map { merged in
+                var info = top.info
+                info.size = merged.aggregateSize
+                return LLBDirectoryEntryID(info: info, id: merged.id)
+            })
+        }
+
+        return LLBFuture.whenAllSucceed(entries, on: ctx.group.next()).flatMap { files in
+            LLBCASFileTree.create(files: files.sorted { $0.info.name < $1.info.name }, in: memo.db, ctx)
+        }.map { tree in
+            MergedTree(id: tree.id, aggregateSize: UInt64(clamping: tree.aggregateSize))
+        }
+    }
+
+    private func loadTree(_ id: LLBDataID, _ client: LLBCASFSClient, _ ctx: Context) -> LLBFuture<LLBCASFileTree> {
+        return client.load(id, ctx).flatMapThrowing { node in
+            guard let tree = node.tree else {
+                throw LLBTreeMergerError.invalidTree(id)
+            }
+            return tree
+        }
+    }
+
+    /// Returns the memoized result for the key, or starts computing it. Results that fail are forgotten, so that they
+    /// are computed again by the next merge.
+    private func memoized<Key: Hashable, Value>(
+        _ key: Key,
+        in results: KeyPath<Memo, LLBBoundedLRU<Key, LLBFuture<Value>>>,
+        of memo: Memo,
+        _ compute: () -> LLBFuture<Value>
+    ) -> LLBFuture<Value> {
+        if let result = lock.withLock({ memo[keyPath: results][key] }) {
+            return result
+        }
+
+        let result = compute()
+        lock.withLockVoid {
+            memo[keyPath: results].insert(result, for: key)
+        }
+        result.whenFailure { _ in
+            self.lock.withLockVoid {
+                let memoized = memo[keyPath: results]
+                if memoized[key] === result {
+                    memoized.removeValue(forKey: key)
+                }
+            }
+        }
+        return result
+    }
+}
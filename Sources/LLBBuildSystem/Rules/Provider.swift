@@ -50,8 +50,9 @@ extension LLBProviderMap {
     }
 
     public func getOptional<P: LLBProvider>(_ type: P.Type = P.self) throws -> P? {
+        let identifier = P.polymorphicIdentifier
         for anyProvider in providers {
-            if anyProvider.typeIdentifier == P.polymorphicIdentifier {
+            if anyProvider.typeIdentifier == identifier {
                 let byteBuffer = LLBByteBuffer.withBytes(ArraySlice<UInt8>(anyProvider.serializedBytes))
                 return try P.init(from: byteBuffer)
             }
@@ -77,6 +77,10 @@ public class LLBRuleContext {
 
     private let targetDependencies: [String: RuleContextTargetDependencyType]
 
+    // Providers decoded so far, keyed by dependency name, index in the dependency and provider type, so that each
+    // provider is decoded on first use and only once. Access is synchronized through the queue.
+    private var decodedProviders = [String: LLBProvider?]()
+
     private let artifactRoots: [String]
 
     /// The function interface for evaluating requests.
@@ -130,8 +134,7 @@ public class LLBRuleContext {
             throw LLBRuleContextError.dependencyTypeMismatch
         }
 
-        // This is so cool, type inference FTW.
-        return try providerMap.get()
+        return try requiredProvider(P.self, for: name, index: 0, in: providerMap)
     }
 
     /// Returns the providers of the specified type, for the given dependency name, or throws if any of the dependencies
@@ -145,7 +148,7 @@ public class LLBRuleContext {
             throw LLBRuleContextError.dependencyTypeMismatch
         }
 
-        return try providerMaps.map { try $0.get() }
+        return try providerMaps.enumerated().map { try requiredProvider(P.self, for: name, index: $0, in: $1) }
     }
 
     /// Returns the provider of the specified type, for the given dependency name, or nil if none exists. This API
@@ -159,8 +162,7 @@ public class LLBRuleContext {
             throw LLBRuleContextError.dependencyTypeMismatch
         }
 
-        // This is so cool, type inference FTW.
-        return try providerMap.getOptional()
+        return try decodedProvider(P.self, for: name, index: 0, in: providerMap)
     }
 
     /// Returns the providers of the specified type, for the given dependency name, if the dependency provides the
@@ -175,7 +177,37 @@ public class LLBRuleContext {
             throw LLBRuleContextError.dependencyTypeMismatch
         }
 
-        return try providerMaps.compactMap { try $0.getOptional() }
+        return try providerMaps.enumerated().compactMap { try decodedProvider(P.self, for: name, index: $0, in: $1) }
+    }
+
+    private func requiredProvider<P: LLBProvider>(
+        _ type: P.Type,
+        for name: String,
+        index: Int,
+        in providerMap: LLBProviderMap
+    ) throws -> P {
+        guard let provider = try decodedProvider(P.self, for: name, index: index, in: providerMap) else {
+            throw LLBProviderMapError.providerTypeNotFound(P.polymorphicIdentifier)
+        }
+        return provider
+    }
+
+    private func decodedProvider<P: LLBProvider>(
+        _ type: P.Type,
+        for name: String,
+        index: Int,
+        in providerMap: LLBProviderMap
+    ) throws -> P? {
+        let key = "\(name)/\(index)/\(P.polymorphicIdentifier)"
+        if let cached = queue.sync(execute: { decodedProviders[key] }) {
+            return cached as? P
+        }
+
+        let provider = try providerMap.getOptional(P.self)
+        queue.sync {
+            _ = decodedProviders.updateValue(provider.map { $0 as LLBProvider }, forKey: key)
+        }
+        return provider
     }
 
     /// Returns a the requested configuration fragment if available on the configuration, or nil otherwise.
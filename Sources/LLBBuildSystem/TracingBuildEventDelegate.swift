@@ -0,0 +1,78 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import NIOConcurrencyHelpers
+
+/// A build event delegate that records target evaluations, actions and action executions as spans in a tracer, and
+/// optionally forwards all of the events to another delegate.
+public final class LLBTracingBuildEventDelegate: LLBBuildEventDelegate {
+    public let tracer: LLBTracer
+    private let delegate: LLBBuildEventDelegate?
+
+    /// The spans in progress, keyed by label or action identifier. Identical actions may be in flight at the same
+    /// time, so each key keeps a list of spans.
+    private let lock = Lock()
+    private var targetSpans = [LLBLabel: [LLBTraceSpan]]()
+    private var actionSpans = [String: [LLBTraceSpan]]()
+    private var executionSpans = [String: [LLBTraceSpan]]()
+
+    public init(tracer: LLBTracer, forwardingTo delegate: LLBBuildEventDelegate? = nil) {
+        self.tracer = tracer
+        self.delegate = delegate
+    }
+
+    public func targetEvaluationRequested(label: LLBLabel) {
+        let span = tracer.startSpan("evaluate \(label.canonical)", category: .analysis)
+        lock.withLockVoid { targetSpans[label, default: []].append(span) }
+        delegate?.targetEvaluationRequested(label: label)
+    }
+
+    public func targetEvaluationCompleted(label: LLBLabel) {
+        lock.withLock { targetSpans[label]?.popLast() }?.end()
+        delegate?.targetEvaluationCompleted(label: label)
+    }
+
+    public func actionScheduled(action: LLBBuildEventActionDescription) {
+        let span = tracer.startSpan(
+            "action \(action.mnemonic)", category: .evaluation, arguments: ["description": action.description]
+        )
+        let identifier = action.identifier
+        lock.withLockVoid { actionSpans[identifier, default: []].append(span) }
+        delegate?.actionScheduled(action: action)
+    }
+
+    public func actionCompleted(action: LLBBuildEventActionDescription, result: LLBActionResult) {
+        let identifier = action.identifier
+        lock.withLock { actionSpans[identifier]?.popLast() }?.end()
+        delegate?.actionCompleted(action: action, result: result)
+    }
+
+    public func actionExecutionStarted(action: LLBBuildEventActionDescription) {
+        let span = tracer.startSpan(
+            "execute \(action.mnemonic)", category: .execution, arguments: ["description": action.description]
+        )
+        let identifier = action.identifier
+        lock.withLockVoid { executionSpans[identifier, default: []].append(span) }
+        delegate?.actionExecutionStarted(action: action)
+    }
+
+    public func actionExecutionCompleted(action: LLBBuildEventActionDescription) {
+        let identifier = action.identifier
+        lock.withLock { executionSpans[identifier]?.popLast() }?.end()
+        delegate?.actionExecutionCompleted(action: action)
+    }
+
+    public func actionResultCacheLookupCompleted(action: LLBBuildEventActionDescription, hit: Bool) {
+        delegate?.actionResultCacheLookupCompleted(action: action, hit: hit)
+    }
+
+    public func actionResultCacheUpdateFailed(action: LLBBuildEventActionDescription, error: Error) {
+        delegate?.actionResultCacheUpdateFailed(action: action, error: error)
+    }
+}
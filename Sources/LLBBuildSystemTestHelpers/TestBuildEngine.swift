@@ -39,6 +39,8 @@ public class LLBTestBuildEngine {
         ruleLookupDelegate: LLBRuleLookupDelegate? = nil,
         dynamicActionExecutorDelegate: LLBDynamicActionExecutorDelegate? = nil,
         executor: LLBExecutor? = nil,
+        lazyOutputResolver: LLBLazyOutputResolver? = nil,
+        actionResultCache: LLBActionResultCache? = nil,
         registrationHandler: @escaping (LLBSerializableRegistry) -> Void = { _ in }
     ) {
 
@@ -50,7 +52,9 @@ public class LLBTestBuildEngine {
             ruleLookupDelegate: ruleLookupDelegate,
             registrationDelegate: RegistrationDelegateWrapper(handler: registrationHandler),
             dynamicActionExecutorDelegate: dynamicActionExecutorDelegate,
-            executor: executor ?? LLBNullExecutor()
+            executor: executor ?? LLBNullExecutor(),
+            lazyOutputResolver: lazyOutputResolver,
+            actionResultCache: actionResultCache
         )
     }
 
@@ -63,4 +67,9 @@ public class LLBTestBuildEngine {
     public func build<V: LLBBuildValue>(_ key: LLBBuildKey, as valueType: V.Type = V.self, _ ctx: Context) -> LLBFuture<V> {
         return self.engine.build(key, ctx)
     }
+
+    /// Returns the ID of the contents of an artifact, materializing it if it's a lazy output.
+    public func materialize(_ artifactValue: LLBArtifactValue, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return self.engine.materialize(artifactValue, ctx)
+    }
 }
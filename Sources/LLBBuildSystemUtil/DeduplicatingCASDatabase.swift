@@ -0,0 +1,125 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import NIOConcurrencyHelpers
+
+/// A bounded set of IDs that are known to be present in a CAS database, shared between the databases that deduplicate
+/// writes to it.
+///
+/// The IDs are trusted over the database itself, so a set must only be shared by wrappers of the same database, and
+/// only for as long as that database keeps the objects: a set that outlives an eviction makes the wrappers skip writes
+/// of objects that are gone. Long-lived sets are only valid for databases that never evict.
+public final class LLBKnownDataIDs {
+    /// The maximum number of IDs remembered. Once reached, the least recently used IDs are forgotten, which only costs
+    /// extra `contains` calls.
+    public let capacity: Int
+
+    private let lock = Lock()
+    private let ids: LLBBoundedLRU<LLBDataID, Void>
+
+    public init(capacity: Int = 1_000_000) {
+        self.capacity = capacity
+        self.ids = LLBBoundedLRU(capacity: capacity)
+    }
+
+    public func contains(_ id: LLBDataID) -> Bool {
+        return lock.withLock { ids[id] != nil }
+    }
+
+    public func insert(_ id: LLBDataID) {
+        lock.withLockVoid {
+            ids.insert((), for: id)
+        }
+    }
+}
+
+/// A CAS database wrapper that only writes objects that the underlying database doesn't already contain.
+///
+/// Each object is first identified locally, and then checked against the IDs known to be present and the underlying
+/// database. By default, each wrapper has its own set of known IDs, which lives as long as the wrapper. Concurrent
+/// writes of the same object share a single upload. This is most useful when the underlying database is remote and the
+/// same outputs are produced over and over, where checking for presence is much cheaper than uploading the contents.
+public final class LLBDeduplicatingCASDatabase: LLBCASDatabase {
+    public let database: LLBCASDatabase
+    public let knownIDs: LLBKnownDataIDs
+
+    public var group: LLBFuturesDispatchGroup {
+        return database.group
+    }
+
+    private let lock = Lock()
+    private var inFlight = [LLBDataID: LLBFuture<LLBDataID>]()
+
+    public init(_ database: LLBCASDatabase, knownIDs: LLBKnownDataIDs = LLBKnownDataIDs()) {
+        self.database = database
+        self.knownIDs = knownIDs
+    }
+
+    public func supportedFeatures() -> LLBFuture<LLBCASFeatures> {
+        return database.supportedFeatures()
+    }
+
+    public func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> {
+        if knownIDs.contains(id) {
+            return group.next().makeSucceededFuture(true)
+        }
+        return database.contains(id, ctx)
+    }
+
+    public func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        return database.get(id, ctx)
+    }
+
+    public func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return database.identify(refs: refs, data: data, ctx)
+    }
+
+    public func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return database.identify(refs: refs, data: data, ctx).flatMap { id in
+            self.put(knownID: id, refs: refs, data: data, ctx)
+        }
+    }
+
+    public func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        if knownIDs.contains(id) {
+            return group.next().makeSucceededFuture(id)
+        }
+
+        // Register the write before starting it, since the underlying database may complete it synchronously.
+        let (future, promise): (LLBFuture<LLBDataID>, LLBPromise<LLBDataID>?) = lock.withLock {
+            if let future = inFlight[id] {
+                return (future, nil)
+            }
+            let promise = group.next().makePromise(of: LLBDataID.self)
+            inFlight[id] = promise.futureResult
+            return (promise.futureResult, promise)
+        }
+
+        guard let newPromise = promise else {
+            return future
+        }
+
+        future.whenComplete { _ in
+            self.lock.withLockVoid {
+                self.inFlight[id] = nil
+            }
+        }
+
+        newPromise.completeWith(database.contains(id, ctx).flatMap { contained -> LLBFuture<LLBDataID> in
+            if contained {
+                return self.group.next().makeSucceededFuture(id)
+            }
+            return self.database.put(knownID: id, refs: refs, data: data, ctx)
+        }.map { storedID -> LLBDataID in
+            self.knownIDs.insert(storedID)
+            return storedID
+        })
+        return future
+    }
+}
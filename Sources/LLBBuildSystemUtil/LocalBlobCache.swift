@@ -0,0 +1,183 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+#if canImport(Darwin)
+import Darwin
+#else
+import Glibc
+#endif
+
+import Foundation
+import llbuild2
+import TSCBasic
+import Dispatch
+import NIOConcurrencyHelpers
+
+public enum LLBLocalBlobCacheError: Error {
+    case missingBlob(LLBDataID)
+    case ioError(String, errno: Int32)
+}
+
+/// A content-addressed cache of file contents on local disk, keyed by the `LLBDataID` of the file in the CAS.
+///
+/// Files are materialized by cloning (where the file system supports it) or hard-linking the cached copy, so that each
+/// file is only written to disk once regardless of how many actions use it. Cached files are read-only, since a hard
+/// link shares its contents with the cache: actions that modify their inputs in place will fail instead of corrupting
+/// the cache. If neither a clone nor a link is possible (e.g. when the output base is in another file system), the
+/// file is copied.
+public final class LLBLocalBlobCache {
+    /// The directory where the cached files are stored.
+    public let path: AbsolutePath
+
+    private let queue = DispatchQueue(label: "org.swift.llbuild2-\(LLBLocalBlobCache.self)", attributes: .concurrent)
+
+    /// Files that are being written into the cache, so that concurrent requests for the same file share the write.
+    private let lock = Lock()
+    private var inFlight = [String: LLBFuture<AbsolutePath>]()
+
+    public init(path: AbsolutePath) throws {
+        self.path = path
+        try localFileSystem.createDirectory(path, recursive: true)
+    }
+
+    /// Materializes the artifact with the given ID at `destination`, which must not exist. Files are cloned or linked
+    /// from the cache, and directories are recreated with each of their files materialized from the cache.
+    public func materialize(_ id: LLBDataID, at destination: AbsolutePath, _ ctx: Context) -> LLBFuture<Void> {
+        let client = LLBCASFSClient(ctx.db)
+        return client.load(id, ctx).flatMap { node in
+            self.materialize(node, id: id, at: destination, client, ctx)
+        }
+    }
+
+    private func materialize(_ node: LLBCASFSNode, id: LLBDataID, at destination: AbsolutePath, _ client: LLBCASFSClient, _ ctx: Context) -> LLBFuture<Void> {
+        switch node.type() {
+        case .directory:
+            guard let tree = node.tree else {
+                return ctx.group.next().makeFailedFuture(LLBLocalBlobCacheError.missingBlob(id))
+            }
+            return run(ctx) {
+                try localFileSystem.createDirectory(destination, recursive: true)
+            }.flatMap {
+                let entryFutures: [LLBFuture<Void>] = tree.files.map { entry in
+                    guard let match = tree.lookup(entry.name) else {
+                        return ctx.group.next().makeFailedFuture(LLBLocalBlobCacheError.missingBlob(id))
+                    }
+                    return client.load(match.id, ctx).flatMap { entryNode in
+                        self.materialize(entryNode, id: match.id, at: destination.appending(component: entry.name), client, ctx)
+                    }
+                }
+                return LLBFuture.whenAllSucceed(entryFutures, on: ctx.group.next()).map { _ in () }
+            }
+
+        case .symlink:
+            guard let blob = node.blob else {
+                return ctx.group.next().makeFailedFuture(LLBLocalBlobCacheError.missingBlob(id))
+            }
+            return blob.read(ctx).flatMapBlocking(onto: queue) { target in
+                let target = String(decoding: target, as: UTF8.self)
+                guard symlink(target, destination.pathString) == 0 else {
+                    throw LLBLocalBlobCacheError.ioError("symlink \(destination)", errno: errno)
+                }
+            }
+
+        default:
+            let executable = node.type() == .executable
+            return cachedFile(for: node, id: id, executable: executable, ctx).flatMapBlocking(onto: queue) { cachedPath in
+                try LLBLocalBlobCache.cloneOrLink(cachedPath, to: destination)
+            }
+        }
+    }
+
+    /// Returns the path of the cached copy of a file, writing it into the cache if needed.
+    private func cachedFile(for node: LLBCASFSNode, id: LLBDataID, executable: Bool, _ ctx: Context) -> LLBFuture<AbsolutePath> {
+        // Executable and non-executable files with the same contents are cached separately, since links share their
+        // permissions.
+        let name = executable ? "\(id)-x" : "\(id)"
+        let cachedPath = path.appending(component: name)
+
+        return run(ctx) {
+            localFileSystem.exists(cachedPath)
+        }.flatMap { exists in
+            if exists {
+                return ctx.group.next().makeSucceededFuture(cachedPath)
+            }
+            return self.writeCachedFile(for: node, id: id, name: name, at: cachedPath, executable: executable, ctx)
+        }
+    }
+
+    /// Writes the contents of a file into the cache, sharing the write with concurrent requests for the same file.
+    private func writeCachedFile(
+        for node: LLBCASFSNode,
+        id: LLBDataID,
+        name: String,
+        at cachedPath: AbsolutePath,
+        executable: Bool,
+        _ ctx: Context
+    ) -> LLBFuture<AbsolutePath> {
+        return lock.withLock {
+            if let future = inFlight[name] {
+                return future
+            }
+
+            guard let blob = node.blob else {
+                return ctx.group.next().makeFailedFuture(LLBLocalBlobCacheError.missingBlob(id))
+            }
+
+            let future = blob.read(ctx).flatMapBlocking(onto: queue) { contents -> AbsolutePath in
+                // Write to a temporary file and move it into place, so that partially written files are never visible.
+                let temporaryPath = self.path.appending(component: "\(name).\(UUID()).tmp")
+                try localFileSystem.writeFileContents(temporaryPath, bytes: ByteString(contents))
+                guard chmod(temporaryPath.pathString, executable ? 0o555 : 0o444) == 0 else {
+                    throw LLBLocalBlobCacheError.ioError("chmod \(temporaryPath)", errno: errno)
+                }
+                guard rename(temporaryPath.pathString, cachedPath.pathString) == 0 else {
+                    throw LLBLocalBlobCacheError.ioError("rename \(temporaryPath)", errno: errno)
+                }
+                return cachedPath
+            }
+            inFlight[name] = future
+            future.whenComplete { _ in
+                self.lock.withLockVoid {
+                    self.inFlight[name] = nil
+                }
+            }
+            return future
+        }
+    }
+
+    /// Runs blocking file system work on the cache's queue, off the event loops.
+    private func run<T>(_ ctx: Context, _ body: @escaping () throws -> T) -> LLBFuture<T> {
+        let promise = ctx.group.next().makePromise(of: T.self)
+        queue.async {
+            promise.completeWith(Result { try body() })
+        }
+        return promise.futureResult
+    }
+
+    /// Creates `destination` as a clone of `source` if the file system supports it, or as a hard link otherwise. Falls
+    /// back to copying the file if neither is possible.
+    private static func cloneOrLink(_ source: AbsolutePath, to destination: AbsolutePath) throws {
+        #if canImport(Darwin)
+        if clonefile(source.pathString, destination.pathString, 0) == 0 {
+            return
+        }
+        #endif
+
+        if link(source.pathString, destination.pathString) == 0 {
+            return
+        }
+
+        // EEXIST means that another action already materialized the same path, which is fine since paths are unique
+        // per artifact.
+        if errno == EEXIST {
+            return
+        }
+
+        try FileManager.default.copyItem(atPath: source.pathString, toPath: destination.pathString)
+    }
+}
@@ -0,0 +1,294 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+import llbuild2
+import Dispatch
+import NIOConcurrencyHelpers
+
+/// Resources that are reserved on the host machine while an action runs.
+public struct LLBLocalExecutionResources: Equatable {
+    /// The number of CPU slots.
+    public var cpus: Int
+
+    /// The amount of memory, in bytes.
+    public var memory: Int
+
+    public init(cpus: Int = 1, memory: Int = 0) {
+        self.cpus = cpus
+        self.memory = memory
+    }
+
+    /// The resources of the host machine.
+    public static var host: LLBLocalExecutionResources {
+        return LLBLocalExecutionResources(
+            cpus: ProcessInfo.processInfo.activeProcessorCount,
+            memory: Int(clamping: ProcessInfo.processInfo.physicalMemory)
+        )
+    }
+
+    fileprivate func fits(in available: LLBLocalExecutionResources) -> Bool {
+        return cpus <= available.cpus && memory <= available.memory
+    }
+
+    /// Clamps the request to the capacity, so that requests larger than the whole machine can still run (alone).
+    fileprivate func clamped(to capacity: LLBLocalExecutionResources) -> LLBLocalExecutionResources {
+        return LLBLocalExecutionResources(cpus: min(max(cpus, 0), capacity.cpus), memory: min(max(memory, 0), capacity.memory))
+    }
+
+    fileprivate static func +(lhs: Self, rhs: Self) -> Self {
+        return LLBLocalExecutionResources(cpus: lhs.cpus + rhs.cpus, memory: lhs.memory + rhs.memory)
+    }
+
+    fileprivate static func -(lhs: Self, rhs: Self) -> Self {
+        return LLBLocalExecutionResources(cpus: lhs.cpus - rhs.cpus, memory: lhs.memory - rhs.memory)
+    }
+}
+
+/// Schedules blocking work (such as running and waiting on processes) on a dedicated set of threads, limiting the
+/// amount of concurrent work to the configured CPU and memory capacity. Work that doesn't fit in the available
+/// resources waits in a priority queue, where higher priorities run first and equal priorities run in submission order.
+/// Work that doesn't need resources (see `run`) is limited to `maxConcurrentRuns` items at a time, and waits in
+/// submission order, so that neither kind of work can exhaust the threads of the dispatch queue.
+///
+/// None of the work runs on the event loops; only the completion of the returned futures does.
+public final class LLBLocalExecutionScheduler {
+    /// The total resources available for scheduled work.
+    public let capacity: LLBLocalExecutionResources
+
+    /// The maximum number of work items submitted through `run` that run at the same time.
+    public let maxConcurrentRuns: Int
+
+    private let queue = DispatchQueue(label: "org.swift.llbuild2-\(LLBLocalExecutionScheduler.self)", attributes: .concurrent)
+
+    private struct PendingWork {
+        let priority: Int
+        let sequence: Int
+        let resources: LLBLocalExecutionResources
+        let run: () -> Void
+
+        /// Whether this work should run before `other`.
+        func precedes(_ other: PendingWork) -> Bool {
+            if priority != other.priority {
+                return priority > other.priority
+            }
+            return sequence < other.sequence
+        }
+    }
+
+    /// The lock protecting the available resources and the pending queues.
+    private let lock = Lock()
+    private var available: LLBLocalExecutionResources
+    private var pending = [PendingWork]()
+    private var nextSequence = 0
+
+    /// The number of work items submitted through `run` that are running, and the ones that are waiting, in a queue
+    /// made of two stacks: new items are pushed onto `waitingRunsIn`, and taken from `waitingRunsOut`, which is refilled
+    /// from the reversed `waitingRunsIn` when empty.
+    private var activeRuns = 0
+    private var waitingRunsIn = [() -> Void]()
+    private var waitingRunsOut = [() -> Void]()
+
+    /// - Parameters:
+    ///     - capacity: The total resources available for scheduled work.
+    ///     - maxConcurrentRuns: The maximum number of work items submitted through `run` that run at the same time.
+    ///           Defaults to twice the number of CPU slots, since that work mostly waits on the file system.
+    public init(capacity: LLBLocalExecutionResources = .host, maxConcurrentRuns: Int? = nil) {
+        precondition(capacity.cpus > 0, "the scheduler needs at least one CPU slot")
+        precondition(maxConcurrentRuns.map { $0 > 0 } ?? true, "the scheduler needs to run at least one work item")
+        self.capacity = capacity
+        self.maxConcurrentRuns = maxConcurrentRuns ?? 2 * capacity.cpus
+        self.available = capacity
+    }
+
+    /// The number of work items waiting for resources.
+    public var pendingCount: Int {
+        return lock.withLock { pending.count }
+    }
+
+    /// Schedules `body` to run once `resources` are available, reserving them until it completes.
+    public func schedule<T>(
+        resources: LLBLocalExecutionResources = LLBLocalExecutionResources(),
+        priority: Int = 0,
+        group: LLBFuturesDispatchGroup,
+        _ body: @escaping () throws -> T
+    ) -> LLBFuture<T> {
+        let promise = group.next().makePromise(of: T.self)
+        let resources = resources.clamped(to: capacity)
+
+        let run = {
+            self.queue.async {
+                promise.completeWith(Result { try body() })
+                self.release(resources)
+            }
+        }
+
+        let ready: [() -> Void] = lock.withLock {
+            push(PendingWork(priority: priority, sequence: nextSequence, resources: resources, run: run))
+            nextSequence += 1
+            return takeReady()
+        }
+        ready.forEach { $0() }
+
+        return promise.futureResult
+    }
+
+    /// Runs blocking work that doesn't need any resources, such as preparing the files of an action, on the threads
+    /// of the scheduler without waiting for the scheduled work. At most `maxConcurrentRuns` of them run at the same
+    /// time, in submission order.
+    public func run<T>(group: LLBFuturesDispatchGroup, _ body: @escaping () throws -> T) -> LLBFuture<T> {
+        let promise = group.next().makePromise(of: T.self)
+
+        let run = {
+            self.queue.async {
+                promise.completeWith(Result { try body() })
+                self.finishRun()
+            }
+        }
+
+        let shouldRun: Bool = lock.withLock {
+            guard activeRuns < maxConcurrentRuns else {
+                waitingRunsIn.append(run)
+                return false
+            }
+            activeRuns += 1
+            return true
+        }
+        if shouldRun {
+            run()
+        }
+
+        return promise.futureResult
+    }
+
+    /// Starts the next waiting work item submitted through `run`, if any.
+    private func finishRun() {
+        let next: (() -> Void)? = lock.withLock {
+            if waitingRunsOut.isEmpty {
+                waitingRunsOut = waitingRunsIn.reversed()
+                waitingRunsIn.removeAll()
+            }
+            guard let next = waitingRunsOut.popLast() else {
+                activeRuns -= 1
+                return nil
+            }
+            return next
+        }
+        next?()
+    }
+
+    private func release(_ resources: LLBLocalExecutionResources) {
+        let ready: [() -> Void] = lock.withLock {
+            available = available + resources
+            return takeReady()
+        }
+        ready.forEach { $0() }
+    }
+
+    /// Reserves resources for the work at the front of the queue while it fits. The first item that doesn't fit blocks
+    /// the ones behind it, so that large actions aren't starved by a stream of small ones. Must be called while
+    /// holding the lock.
+    private func takeReady() -> [() -> Void] {
+        var ready = [() -> Void]()
+        while let next = pending.first, next.resources.fits(in: available) {
+            available = available - next.resources
+            ready.append(pop().run)
+        }
+        return ready
+    }
+
+    // MARK: - Binary heap
+
+    private func push(_ work: PendingWork) {
+        pending.append(work)
+        var index = pending.count - 1
+        while index > 0 {
+            let parent = (index - 1) / 2
+            guard pending[index].precedes(pending[parent]) else {
+                break
+            }
+            pending.swapAt(index, parent)
+            index = parent
+        }
+    }
+
+    private func pop() -> PendingWork {
+        let first = pending[0]
+        let last = pending.removeLast()
+        guard !pending.isEmpty else {
+            return first
+        }
+
+        pending[0] = last
+        var index = 0
+        while true {
+            let left = 2 * index + 1
+            let right = left + 1
+            var best = index
+            if left < pending.count && pending[left].precedes(pending[best]) {
+                best = left
+            }
+            if right < pending.count && pending[right].precedes(pending[best]) {
+                best = right
+            }
+            if best == index {
+                break
+            }
+            pending.swapAt(index, best)
+            index = best
+        }
+        return first
+    }
+}
+
+/// Estimates the priority of local actions from the durations of previous executions of the same command, so that the
+/// longest running actions start first.
+///
+/// This is a longest-processing-time-first heuristic, not a critical path estimate: the executor doesn't know which
+/// actions depend on each other, so the priority is the exponential moving average of the action's own duration, and
+/// not the length of the longest path of actions that wait on it. Long actions are often on the critical path, and
+/// starting them first keeps them from running alone at the end of the build. Actions that haven't been seen before
+/// get the highest priority, since they may be long too.
+///
+/// At most `maxEntries` commands are remembered, after which the least recently used ones are forgotten.
+public final class LLBActionDurationEstimator {
+    /// The maximum number of commands whose durations are remembered.
+    public let maxEntries: Int
+
+    private let lock = Lock()
+    private let durations: LLBBoundedLRU<[String], Double>
+
+    public init(maxEntries: Int = 100_000) {
+        precondition(maxEntries > 0, "the estimator needs room for at least one command")
+        self.maxEntries = maxEntries
+        self.durations = LLBBoundedLRU(capacity: maxEntries)
+    }
+
+    /// The priority of the request, which is its estimated duration in milliseconds. Actions that haven't been seen
+    /// before get the highest priority, since nothing is known about them.
+    public func priority(for request: LLBActionExecutionRequest) -> Int {
+        guard let estimate = lock.withLock({ durations[request.actionSpec.arguments] }) else {
+            return Int.max
+        }
+        return Int(estimate * 1000)
+    }
+
+    /// Records the duration of an execution of the request, in seconds, as an exponential moving average.
+    public func record(_ request: LLBActionExecutionRequest, duration: Double) {
+        lock.withLockVoid {
+            let key = request.actionSpec.arguments
+            let average = durations[key].map { $0 * 0.7 + duration * 0.3 } ?? duration
+            durations.insert(average, for: key)
+        }
+    }
+
+    /// The number of commands whose durations are remembered.
+    public var count: Int {
+        return lock.withLock { durations.count }
+    }
+}
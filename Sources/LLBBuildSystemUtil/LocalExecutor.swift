@@ -10,6 +10,7 @@ import Foundation
 import llbuild2
 import TSCBasic
 import Dispatch
+import NIOConcurrencyHelpers
 
 public enum LLBLocalExecutorError: Error {
     case unimplemented(String)
@@ -37,141 +38,167 @@ final public class LLBLocalExecutor: LLBExecutor {
     let delegateCallbackQueue: DispatchQueue = DispatchQueue(label: "org.swift.llbuild2-\(LLBLocalExecutor.self)-delegate")
     let delegate: LLBLocalExecutorDelegate?
     weak var statsObserver: LLBLocalExecutorStatsObserver?
+    let scheduler: LLBLocalExecutionScheduler
+    let durationEstimator: LLBActionDurationEstimator
+    let resourceEstimator: ((LLBActionExecutionRequest) -> LLBLocalExecutionResources)?
+    let blobCache: LLBLocalBlobCache?
 
+    /// Whether output files that the database already contains are skipped instead of being uploaded again.
+    let deduplicateOutputs: Bool
+
+    /// Returns how an action runs in a persistent worker, or nil to run it in a new process.
+    let workerSelector: ((LLBActionExecutionRequest) -> LLBPersistentWorkerSpec?)?
+    let workerPool: LLBPersistentWorkerPool
+
+    /// The processes of the background pre-actions, which keep running across actions.
+    let backgroundProcesses = LLBBackgroundProcesses()
+
+    /// How long cancelled processes have to exit after SIGTERM before they are killed.
+    let terminationGracePeriod: DispatchTimeInterval
+
+    /// Creates a local executor.
+    ///
+    /// - Parameters:
+    ///     - outputBase: The directory where actions are run.
+    ///     - scheduler: The scheduler that limits how many processes run concurrently. Executors can share a scheduler
+    ///           to share the machine's resources. Defaults to a scheduler with the resources of the host.
+    ///     - durationEstimator: Provides the priority of each action from its previous durations, so that the longest
+    ///           actions start first.
+    ///     - resourceEstimator: Returns the resources reserved by each action. Defaults to one CPU slot per action.
+    ///     - blobCache: If set, inputs are materialized by cloning or linking files from this cache instead of writing
+    ///           their contents for every action. Cached files are read-only, so actions can't modify their inputs.
+    ///     - deduplicateOutputs: Whether output files that the database already contains are skipped instead of being
+    ///           uploaded again. This costs an extra `contains` check per new object, which pays off for remote databases.
+    ///           The IDs known to be present are only remembered while importing the outputs of a single action, so
+    ///           outputs are uploaded again once the database evicted them, and each action uses its own `ctx.db`.
+    ///     - workerSelector: Returns how an action runs in a persistent worker, or nil to run it in a new process. See
+    ///           `LLBPersistentWorkerSpec.flagfileWorkers(for:)` for the Bazel conventions.
+    ///     - workerPool: The pool of persistent workers, which can be shared between executors.
+    ///     - terminationGracePeriod: How long the processes of cancelled actions have to exit after SIGTERM before
+    ///           they are sent SIGKILL.
     public init(
         outputBase: AbsolutePath,
         delegate: LLBLocalExecutorDelegate? = nil,
-        statsObserver: LLBLocalExecutorStatsObserver? = nil
+        statsObserver: LLBLocalExecutorStatsObserver? = nil,
+        scheduler: LLBLocalExecutionScheduler? = nil,
+        durationEstimator: LLBActionDurationEstimator? = nil,
+        resourceEstimator: ((LLBActionExecutionRequest) -> LLBLocalExecutionResources)? = nil,
+        blobCache: LLBLocalBlobCache? = nil,
+        deduplicateOutputs: Bool = true,
+        workerSelector: ((LLBActionExecutionRequest) -> LLBPersistentWorkerSpec?)? = nil,
+        workerPool: LLBPersistentWorkerPool? = nil,
+        terminationGracePeriod: DispatchTimeInterval = .seconds(5)
     ) {
         self.outputBase = outputBase
         self.delegate = delegate
         self.statsObserver = statsObserver
+        self.scheduler = scheduler ?? LLBLocalExecutionScheduler()
+        self.durationEstimator = durationEstimator ?? LLBActionDurationEstimator()
+        self.resourceEstimator = resourceEstimator
+        self.blobCache = blobCache
+        self.deduplicateOutputs = deduplicateOutputs
+        self.workerSelector = workerSelector
+        self.workerPool = workerPool ?? LLBPersistentWorkerPool()
+        self.terminationGracePeriod = terminationGracePeriod
+    }
+
+    /// Terminates the processes of the background pre-actions. Persistent workers belong to the worker pool, which
+    /// terminates them when it is shut down or released.
+    public func shutdown() {
+        backgroundProcesses.terminateAll()
     }
 
     public func execute(request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse> {
-        var inputFutures = [LLBFuture<Void>]()
+        if let reason = ctx.cancellationToken?.reason {
+            return ctx.group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
+        }
+
         let client = LLBCASFSClient(ctx.db)
 
-        for input in request.inputs {
-            // Create the parent directory for each of the inputs, so that they can be exported there.
-            let fullInputPath = outputBase.appending(RelativePath(input.path))
-            do {
+        // The filesystem work that prepares the action runs on the scheduler's threads, instead of blocking the event
+        // loops, but doesn't take any of its resources.
+        return scheduler.run(group: ctx.group) { () -> [(LLBActionInput, AbsolutePath)] in
+            var missingInputs = [(LLBActionInput, AbsolutePath)]()
+            for input in request.inputs {
+                // Create the parent directory for each of the inputs, so that they can be exported there.
+                let fullInputPath = self.outputBase.appending(RelativePath(input.path))
                 try localFileSystem.createDirectory(fullInputPath.parentDirectory, recursive: true)
-            } catch {
-                return ctx.group.next().makeFailedFuture(error)
-            }
 
-            // This is a local optimization, if the file has already been exported, don't export it again. Because
-            // we're not supporting incremental builds locally (by creating a new output base for each invocation) we're
-            // not running a risk of the files having other contents. This assumes that the paths for all artifacts
-            // in a build are unique, i.e. there are no 2 artifacts that share the same path.
-            if !localFileSystem.exists(fullInputPath) {
-                if input.type == .directory {
-                    let stats = LLBCASFileTree.ExportProgressStats()
-                    statsObserver?.startObserving(stats)
-                    inputFutures.append(
-                        LLBCASFileTree.export(
-                            input.dataID,
-                            from: ctx.db,
-                            to: .init(fullInputPath.pathString),
-                            ctx
-                        ).always { _ in
-                            self.statsObserver?.stopObserving(stats)
+                // This is a local optimization, if the file has already been exported, don't export it again. Because
+                // we're not supporting incremental builds locally (by creating a new output base for each invocation)
+                // we're not running a risk of the files having other contents. This assumes that the paths for all
+                // artifacts in a build are unique, i.e. there are no 2 artifacts that share the same path.
+                if !localFileSystem.exists(fullInputPath) {
+                    missingInputs.append((input, fullInputPath))
+                }
+            }
+            return missingInputs
+        }.flatMap { missingInputs -> LLBFuture<[Void]> in
+            let inputFutures = missingInputs.map { (input, fullInputPath) -> LLBFuture<Void> in
+                if let blobCache = self.blobCache {
+                    return blobCache.materialize(input.dataID, at: fullInputPath, ctx).flatMapErrorThrowing { error in
+                        if case LLBLocalBlobCacheError.missingBlob = error {
+                            throw LLBLocalExecutorError.missingInput(input)
                         }
-                    )
+                        throw error
+                    }
+                } else if input.type == .directory {
+                    let stats = LLBCASFileTree.ExportProgressStats()
+                    self.statsObserver?.startObserving(stats)
+                    return LLBCASFileTree.export(
+                        input.dataID,
+                        from: ctx.db,
+                        to: .init(fullInputPath.pathString),
+                        ctx
+                    ).always { _ in
+                        self.statsObserver?.stopObserving(stats)
+                    }
                 } else {
-                    inputFutures.append(
-                        client.load(input.dataID, ctx).flatMap { (node: LLBCASFSNode) -> LLBFuture<(LLBByteBufferView, LLBFileType)> in
-                            guard let blob = node.blob else {
-                                return ctx.group.next().makeFailedFuture(LLBLocalExecutorError.missingInput(input))
-                            }
-                            return blob.read(ctx).map { ($0, node.type()) }
-                        }.flatMapThrowing { (data, type) in
+                    return client.load(input.dataID, ctx).flatMap { (node: LLBCASFSNode) -> LLBFuture<(LLBByteBufferView, LLBFileType)> in
+                        guard let blob = node.blob else {
+                            return ctx.group.next().makeFailedFuture(LLBLocalExecutorError.missingInput(input))
+                        }
+                        return blob.read(ctx).map { ($0, node.type()) }
+                    }.flatMap { (data, type) in
+                        self.scheduler.run(group: ctx.group) {
                             try localFileSystem.writeFileContents(fullInputPath, bytes: ByteString(data))
                             if type == .executable {
                                 try localFileSystem.chmod(.executable, path: fullInputPath)
                             }
                         }
-                    )
-                }
-            }
-        }
-
-        return LLBFuture.whenAllSucceed(inputFutures, on: ctx.group.next()).flatMapThrowing { _ in
-            // For each of the declared outputs, make sure that the parent directory exists.
-            for output in request.outputs {
-                try localFileSystem.createDirectory(
-                    self.outputBase.appending(RelativePath(output.path)).parentDirectory,
-                    recursive: true
-                )
-            }
-        }.flatMapThrowing { _ -> TSCBasic.Process in
-            let environment = request.actionSpec.environment.reduce(into: [String: String]()) { (dict, pair) in
-                dict[pair.name] = pair.value
-            }
-
-            // Execute the pre-actions of the request.
-            for preActionSpec in request.actionSpec.preActions {
-                let preActionEnvironment = preActionSpec.environment.reduce(into: environment) { (dict, pair) in
-                    dict[pair.name] = pair.value
-                }
-
-                let preActionProcess = TSCBasic.Process(
-                    arguments: preActionSpec.arguments,
-                    environment: preActionEnvironment,
-                    workingDirectory: self.outputBase.appending(RelativePath(request.actionSpec.workingDirectory)),
-                    outputRedirection: .collect,
-                    verbose: false,
-                    startNewProcessGroup: false
-                )
-
-                try preActionProcess.launch()
-
-                if preActionSpec.background {
-                    throw LLBLocalExecutorError.unimplemented("preAction background mode is not yet implemented.")
-                } else {
-                    // If the pre-action is not in background mode, wait until it finishes.
-                    let result = try preActionProcess.waitUntilExit()
-                    guard case .terminated(code: let code) = result.exitStatus, code == 0 else {
-                        throw LLBLocalExecutorError.preActionFailure(try result.utf8stderrOutput())
                     }
                 }
             }
-
-            // Execute the main action of the request.
-            let arguments = request.actionSpec.arguments
-            let workingDir = self.outputBase.appending(RelativePath(request.actionSpec.workingDirectory))
-            let process = TSCBasic.Process(
-                arguments: arguments,
-                environment: environment,
-                workingDirectory: workingDir,
-                outputRedirection: .collect(redirectStderr: true),
-                verbose: false,
-                startNewProcessGroup: false
-            )
-
-            self.delegateCallbackQueue.async {
-                self.delegate?.launchingProcess(arguments: arguments, workingDir: workingDir, environment: environment)
-            }
-
-            try process.launch()
-            return process
-        }.flatMapBlocking(onto: DispatchQueue.global()) { process in
-            try process.waitUntilExit()
-        }.flatMapThrowing { result -> (Int, [UInt8]) in
-            self.delegateCallbackQueue.async {
-                self.delegate?.finishedProcess(with: result)
+            return LLBFuture.whenAllSucceed(inputFutures, on: ctx.group.next())
+        }.flatMap { _ in
+            self.scheduler.run(group: ctx.group) {
+                // For each of the declared outputs, make sure that the parent directory exists.
+                for output in request.outputs {
+                    try localFileSystem.createDirectory(
+                        self.outputBase.appending(RelativePath(output.path)).parentDirectory,
+                        recursive: true
+                    )
+                }
             }
+        }.flatMap { _ -> LLBFuture<(Int, [UInt8])> in
+            // Processes are run and waited upon by the scheduler, off the event loops, once there are enough resources
+            // available for them.
+            let resources = self.resourceEstimator?(request) ?? LLBLocalExecutionResources()
+            let priority = self.durationEstimator.priority(for: request)
+            let description = request.actionSpec.arguments.first ?? "action"
+            let queueSpan = ctx.tracer?.startSpan("queued \(description)", category: .executorQueue)
+            return self.scheduler.schedule(resources: resources, priority: priority, group: ctx.group) {
+                queueSpan?.end()
+                // The build may have been cancelled while the action was queued.
+                try ctx.cancellationToken?.checkCancelled()
+                let executionSpan = ctx.tracer?.startSpan("run \(description)", category: .execution)
+                defer { executionSpan?.end() }
 
-            let resultExitCode: Int
-            switch result.exitStatus {
-            case .terminated(let code):
-                resultExitCode = Int(code)
-            case .signalled(_):
-                resultExitCode = -1
+                let start = Date()
+                let result = try self.runProcesses(request, cancellationToken: ctx.cancellationToken)
+                self.durationEstimator.record(request, duration: Date().timeIntervalSince(start))
+                return result
             }
-
-            return (resultExitCode, try result.output.get())
         }.flatMap { (exitCode, stdout) in
             // Upload the stdout and stderr of the action into the CAS.
             let baseLogContents: LLBFuture<ArraySlice<UInt8>>
@@ -191,11 +218,16 @@ final public class LLBLocalExecutor: LLBExecutor {
                 ctx.db.put(data: .withBytes(baseLogs + stdout[...]), ctx)
             }
 
+            // All of the outputs are imported concurrently through the same database, so that files shared between
+            // outputs are only uploaded once. The known IDs are scoped to this action, since the database of the next
+            // one may be another database, or may have evicted the objects in the meantime.
+            let importDB: LLBCASDatabase = self.deduplicateOutputs ? LLBDeduplicatingCASDatabase(ctx.db) : ctx.db
+
             let outputFutures: [LLBFuture<LLBDataID>]
 
             // Only upload outputs if the action exited successfully.
             if exitCode == 0 {
-                outputFutures = request.outputs.map { self.importOutput(output: $0, ctx) }
+                outputFutures = request.outputs.map { self.importOutput(output: $0, to: importDB, ctx) }
             } else {
                 outputFutures = []
             }
@@ -203,7 +235,7 @@ final public class LLBLocalExecutor: LLBExecutor {
             let outputsFuture = LLBFuture.whenAllSucceed(outputFutures, on: ctx.group.next())
 
             let unconditionalOutputFutures = request.unconditionalOutputs.map {
-                self.importOutput(output: $0, allowNonExistentFiles: true, ctx)
+                self.importOutput(output: $0, to: importDB, allowNonExistentFiles: true, ctx)
             }
             let unconditionalOutputsFuture = LLBFuture.whenAllSucceed(unconditionalOutputFutures, on: ctx.group.next())
 
@@ -217,25 +249,148 @@ final public class LLBLocalExecutor: LLBExecutor {
             }
         }.flatMapErrorThrowing { error in
             // If we found any errors that were not LLBExecutorError, convert them into an LLBExecutorError.
-            if error is LLBLocalExecutor {
+            if error is LLBLocalExecutorError || error is LLBCancellationError {
                 throw error
             }
             throw LLBLocalExecutorError.unexpected(error)
         }
     }
 
-    func importOutput(output: LLBActionOutput, allowNonExistentFiles: Bool = false, _ ctx: Context) -> LLBFuture<LLBDataID> {
+    /// Runs the pre-actions and the main action of the request, blocking until the main action exits. Returns the exit
+    /// code and the output of the main action.
+    private func runProcesses(
+        _ request: LLBActionExecutionRequest,
+        cancellationToken: LLBCancellationToken?
+    ) throws -> (Int, [UInt8]) {
+        let environment = request.actionSpec.environment.reduce(into: [String: String]()) { (dict, pair) in
+            dict[pair.name] = pair.value
+        }
+
+        // Execute the pre-actions of the request.
+        for preActionSpec in request.actionSpec.preActions {
+            let preActionEnvironment = preActionSpec.environment.reduce(into: environment) { (dict, pair) in
+                dict[pair.name] = pair.value
+            }
+
+            let preActionWorkingDir = self.outputBase.appending(RelativePath(request.actionSpec.workingDirectory))
+
+            if preActionSpec.background {
+                // Background pre-actions keep running across actions, so they're only started if they aren't already
+                // running.
+                try backgroundProcesses.ensureRunning(
+                    arguments: preActionSpec.arguments,
+                    environment: preActionEnvironment,
+                    workingDirectory: preActionWorkingDir
+                )
+                continue
+            }
+
+            let preActionProcess = TSCBasic.Process(
+                arguments: preActionSpec.arguments,
+                environment: preActionEnvironment,
+                workingDirectory: preActionWorkingDir,
+                outputRedirection: .collect,
+                verbose: false
+            )
+
+            // If the pre-action is not in background mode, wait until it finishes.
+            let result = try launchAndWait(preActionProcess, cancellationToken)
+            guard case .terminated(code: let code) = result.exitStatus, code == 0 else {
+                throw LLBLocalExecutorError.preActionFailure(try result.utf8stderrOutput())
+            }
+        }
+
+        // Execute the main action of the request.
+        let arguments = request.actionSpec.arguments
+        let workingDir = self.outputBase.appending(RelativePath(request.actionSpec.workingDirectory))
+
+        // Actions that run in persistent workers don't launch a process, so they aren't reported to the delegate.
+        if let workerSpec = workerSelector?(request) {
+            let response = try workerPool.perform(
+                arguments: workerSpec.requestArguments,
+                inputs: request.inputs.map { LLBWorkRequestInput(path: $0.path, digest: "\($0.dataID)") },
+                key: LLBPersistentWorkerKey(
+                    startupArguments: workerSpec.startupArguments,
+                    environment: environment,
+                    workingDirectory: workingDir
+                ),
+                cancellationToken: cancellationToken
+            )
+            return (response.exitCode ?? 0, Array((response.output ?? "").utf8))
+        }
+
+        let process = TSCBasic.Process(
+            arguments: arguments,
+            environment: environment,
+            workingDirectory: workingDir,
+            outputRedirection: .collect(redirectStderr: true),
+            verbose: false
+        )
+
+        self.delegateCallbackQueue.async {
+            self.delegate?.launchingProcess(arguments: arguments, workingDir: workingDir, environment: environment)
+        }
+
+        let result = try launchAndWait(process, cancellationToken)
+
+        self.delegateCallbackQueue.async {
+            self.delegate?.finishedProcess(with: result)
+        }
+
+        let exitCode: Int
+        switch result.exitStatus {
+        case .terminated(let code):
+            exitCode = Int(code)
+        case .signalled(_):
+            exitCode = -1
+        }
+
+        return (exitCode, try result.output.get())
+    }
+
+    /// Launches the process and waits for it to exit. If the build is cancelled in the meantime, the process group is
+    /// sent SIGTERM, then SIGKILL if it is still running after the grace period, and the cancellation is thrown once
+    /// the process exits. Processes are started in their own group, so that terminating the group also stops the
+    /// processes started by the action. Those groups don't receive the SIGINT of the terminal, so they are registered
+    /// with `LLBProcessGroups`, which forwards it to them once the client installs signal forwarding.
+    private func launchAndWait(_ process: TSCBasic.Process, _ cancellationToken: LLBCancellationToken?) throws -> ProcessResult {
+        let groups = LLBProcessGroups.shared
+        try groups.launch(process)
+        let pid = process.processID
+
+        let gracePeriod = terminationGracePeriod
+        let handle = cancellationToken?.onCancel { _ in
+            guard groups.send(SIGTERM, to: pid) else {
+                return
+            }
+            DispatchQueue.global().asyncAfter(deadline: .now() + gracePeriod) {
+                groups.send(SIGKILL, to: pid)
+            }
+        }
+        defer {
+            if let handle = handle {
+                cancellationToken?.remove(handle)
+            }
+        }
+
+        groups.waitForExit(pid)
+        let result = try process.waitUntilExit()
+        try cancellationToken?.checkCancelled()
+        return result
+    }
+
+    func importOutput(output: LLBActionOutput, to db: LLBCASDatabase, allowNonExistentFiles: Bool = false, _ ctx: Context) -> LLBFuture<LLBDataID> {
         let outputPath = self.outputBase.appending(RelativePath(output.path))
         let stats = LLBCASFileTree.ImportProgressStats()
         statsObserver?.startObserving(stats)
-        return LLBCASFileTree.import(path: outputPath, to: ctx.db, stats: stats, ctx).flatMapError { error in
+        return LLBCASFileTree.import(path: outputPath, to: db, stats: stats, ctx).flatMapError { error in
             if let fsError = error as? FileSystemError, fsError.kind == .noEntry {
                 if output.type == .directory {
                     // If we didn't find an output artifact that was a directory, create an empty CASTree to
                     // represent it.
-                    return LLBCASFileTree.create(files: [], in: ctx.db, ctx).map { $0.id }
+                    return LLBCASFileTree.create(files: [], in: db, ctx).map { $0.id }
                 } else if output.type == .file, allowNonExistentFiles {
-                    return ctx.db.put(data: .init(bytes: []), ctx)
+                    return db.put(data: .init(bytes: []), ctx)
                 }
             }
 
@@ -245,3 +400,115 @@ final public class LLBLocalExecutor: LLBExecutor {
         }
     }
 }
+
+/// The process groups of the running actions. Actions run in their own process group so that cancelling them also
+/// stops the processes that they start, but that also keeps them from receiving the SIGINT that the terminal sends on
+/// Ctrl-C. Clients that want the signals of the terminal to reach the actions opt in with `installSignalForwarding()`.
+///
+/// Process IDs are reused once a process is reaped, so groups are only signalled until their leader exits: waiters
+/// wait for the exit without reaping the leader, and unregister the group under the same lock that signals it.
+/// Processes of the group that outlive the leader aren't signalled.
+public final class LLBProcessGroups {
+    static let shared = LLBProcessGroups()
+
+    private let lock = Lock()
+    private var groups = Set<pid_t>()
+
+    /// The number of times each signal was forwarded, so that processes launched concurrently get the signals that
+    /// they missed.
+    private var forwardCounts = [Int32: Int]()
+
+    /// Restores how each forwarded signal was handled before forwarding was installed, or nil if it isn't installed.
+    private var restoreSignals: (() -> Void)?
+
+    private let queue = DispatchQueue(label: "org.swift.llbuild2-\(LLBProcessGroups.self)")
+
+    /// Forwards SIGINT and SIGTERM to the process groups of the running actions, until `removeSignalForwarding()` is
+    /// called. While forwarding is installed, the signals no longer terminate the client: it should observe them with a
+    /// dispatch source of its own, for example to cancel the build. Installing it again has no effect.
+    public static func installSignalForwarding() {
+        shared.installSignalForwarding()
+    }
+
+    /// Stops forwarding the signals, and restores how they were handled before forwarding was installed.
+    public static func removeSignalForwarding() {
+        shared.removeSignalForwarding()
+    }
+
+    /// Launches the process, which must start a new process group, and registers its group. The process is launched
+    /// outside of the lock, so that actions launch concurrently; the signals forwarded in the meantime are sent to the
+    /// group once it is registered. The leader can't be reaped before then, since only the caller waits for it.
+    func launch(_ process: TSCBasic.Process) throws {
+        let countsBefore = lock.withLock { forwardCounts }
+        try process.launch()
+        lock.withLockVoid {
+            let pid = process.processID
+            groups.insert(pid)
+            for (forwarded, count) in forwardCounts where count > countsBefore[forwarded, default: 0] {
+                kill(-pid, forwarded)
+            }
+        }
+    }
+
+    /// Sends the signal to the group of `pid`, unless its leader already exited. Returns whether it was sent.
+    @discardableResult
+    func send(_ signal: Int32, to pid: pid_t) -> Bool {
+        return lock.withLock {
+            guard groups.contains(pid) else {
+                return false
+            }
+            kill(-pid, signal)
+            return true
+        }
+    }
+
+    /// Blocks until the leader of the group exits, without reaping it, and stops signalling the group. The process
+    /// still has to be waited upon afterwards.
+    func waitForExit(_ pid: pid_t) {
+        var info = siginfo_t()
+        while waitid(P_PID, id_t(pid), &info, WEXITED | WNOWAIT) == -1 && errno == EINTR {}
+        lock.withLockVoid {
+            groups.remove(pid)
+        }
+    }
+
+    private func installSignalForwarding() {
+        lock.withLockVoid {
+            guard restoreSignals == nil else {
+                return
+            }
+
+            var restores = [() -> Void]()
+            for forwarded in [SIGINT, SIGTERM] {
+                // The signal is ignored so that it is only delivered to the dispatch sources. Processes are spawned
+                // with the default handling of every signal, so they aren't affected.
+                let previous = signal(forwarded, SIG_IGN)
+                let source = DispatchSource.makeSignalSource(signal: forwarded, queue: queue)
+                source.setEventHandler { [unowned self] in
+                    self.forward(forwarded)
+                }
+                source.resume()
+                restores.append {
+                    source.cancel()
+                    _ = signal(forwarded, previous)
+                }
+            }
+            restoreSignals = { restores.forEach { $0() } }
+        }
+    }
+
+    private func removeSignalForwarding() {
+        let restore: (() -> Void)? = lock.withLock {
+            defer { restoreSignals = nil }
+            return restoreSignals
+        }
+        restore?()
+    }
+
+    private func forward(_ forwarded: Int32) {
+        lock.withLockVoid {
+            forwardCounts[forwarded, default: 0] += 1
+            groups.forEach { kill(-$0, forwarded) }
+        }
+    }
+}
@@ -0,0 +1,474 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+#if canImport(Darwin)
+import Darwin
+#else
+import Glibc
+#endif
+
+import Dispatch
+import Foundation
+import llbuild2
+import NIOConcurrencyHelpers
+import TSCBasic
+
+public enum LLBPersistentWorkerError: Error {
+    /// The worker exited or closed its output before responding.
+    case workerExited([String])
+
+    /// The worker's response could not be decoded.
+    case invalidResponse(String)
+
+    /// The worker didn't respond within the response timeout of the pool, and was terminated.
+    case timedOut([String])
+}
+
+/// Describes how an action runs in a persistent worker instead of a new process.
+public struct LLBPersistentWorkerSpec: Hashable {
+    /// The arguments that start the worker. Actions with the same startup arguments, environment and working directory
+    /// share the same pool of workers.
+    public var startupArguments: [String]
+
+    /// The arguments sent to the worker for each action.
+    public var requestArguments: [String]
+
+    public init(startupArguments: [String], requestArguments: [String]) {
+        self.startupArguments = startupArguments
+        self.requestArguments = requestArguments
+    }
+
+    /// Selects the Bazel conventions for worker-capable tools: if the tool (the basename of the first argument) is one
+    /// of `tools` and the action passes its arguments in `@flagfile`s, the worker is started with the other arguments
+    /// and `--persistent_worker`, and each request contains the flagfiles.
+    public static func flagfileWorkers(
+        for tools: Set<String>
+    ) -> (LLBActionExecutionRequest) -> LLBPersistentWorkerSpec? {
+        return { request in
+            let arguments = request.actionSpec.arguments
+            guard let tool = arguments.first,
+                  tools.contains((tool as NSString).lastPathComponent),
+                  arguments.contains(where: { $0.hasPrefix("@") }) else {
+                return nil
+            }
+            return LLBPersistentWorkerSpec(
+                startupArguments: arguments.filter { !$0.hasPrefix("@") } + ["--persistent_worker"],
+                requestArguments: arguments.filter { $0.hasPrefix("@") }
+            )
+        }
+    }
+}
+
+/// A file made available to a worker request, identified by its path and contents, so that workers can cache the
+/// work derived from their inputs.
+public struct LLBWorkRequestInput: Codable, Equatable {
+    public var path: String
+    public var digest: String
+}
+
+/// A request sent to a persistent worker, in the JSON form of Bazel's `WorkRequest`.
+public struct LLBWorkRequest: Codable, Equatable {
+    public var arguments: [String]
+    public var inputs: [LLBWorkRequestInput]
+    public var requestId: Int
+}
+
+/// The response of a persistent worker, in the JSON form of Bazel's `WorkResponse`. Fields with default values may be
+/// omitted by the worker.
+public struct LLBWorkResponse: Codable, Equatable {
+    public var exitCode: Int?
+    public var output: String?
+    public var requestId: Int?
+}
+
+/// Identifies a set of interchangeable workers.
+struct LLBPersistentWorkerKey: Hashable {
+    let startupArguments: [String]
+    let environment: [String: String]
+    let workingDirectory: AbsolutePath
+}
+
+/// A long-lived worker process. Requests are written to its standard input and responses are read from its standard
+/// output, one JSON object per line. What the worker writes to its standard error while it handles a request is added
+/// to the output of the response, so that it ends up in the log of the action.
+private final class LLBPersistentWorker {
+    let key: LLBPersistentWorkerKey
+    private let process = Foundation.Process()
+    private let input = Pipe()
+    private let output = Pipe()
+    private let errorOutput = Pipe()
+    private var buffer = Data()
+
+    /// The lock protecting the standard error buffer, which is also held while reading from the pipe, so that the
+    /// output of a request can be drained before the next one is sent.
+    private let errorLock = Lock()
+    private var errorBuffer = Data()
+
+    init(key: LLBPersistentWorkerKey) throws {
+        self.key = key
+
+        // Use env to look up the tool in the PATH, like TSCBasic.Process does.
+        process.executableURL = URL(fileURLWithPath: "/usr/bin/env")
+        process.arguments = key.startupArguments
+        process.environment = key.environment
+        process.currentDirectoryURL = URL(fileURLWithPath: key.workingDirectory.pathString)
+        process.standardInput = input
+        process.standardOutput = output
+        process.standardError = errorOutput
+        errorOutput.fileHandleForReading.readabilityHandler = { [weak self] handle in
+            guard let self = self else {
+                handle.readabilityHandler = nil
+                return
+            }
+            let open: Bool = self.errorLock.withLock {
+                guard let data = self.readAvailableErrors() else {
+                    return false
+                }
+                self.errorBuffer.append(data)
+                return true
+            }
+            if !open {
+                handle.readabilityHandler = nil
+            }
+        }
+        try process.run()
+
+        #if canImport(Darwin)
+        // Writes to a worker that exited fail with EPIPE instead of raising SIGPIPE.
+        _ = fcntl(input.fileHandleForWriting.fileDescriptor, F_SETNOSIGPIPE, 1)
+        #endif
+    }
+
+    /// Sends the request and blocks until the worker responds. Throws `workerExited` if the request couldn't be sent,
+    /// or if the worker exited before responding.
+    func perform(_ request: LLBWorkRequest) throws -> LLBWorkResponse {
+        guard process.isRunning else {
+            throw LLBPersistentWorkerError.workerExited(key.startupArguments)
+        }
+        // Whatever the worker wrote before this request belongs to the previous one, including the output still in
+        // the pipe that the readability handler hasn't read yet.
+        errorLock.withLockVoid {
+            _ = readAvailableErrors()
+            errorBuffer.removeAll()
+        }
+
+        var data = try JSONEncoder().encode(request)
+        data.append(UInt8(ascii: "\n"))
+        try send(data)
+
+        let line = try readLine()
+        var response: LLBWorkResponse
+        do {
+            response = try JSONDecoder().decode(LLBWorkResponse.self, from: line)
+        } catch {
+            throw LLBPersistentWorkerError.invalidResponse(String(decoding: line, as: UTF8.self))
+        }
+
+        let errors: Data = errorLock.withLock {
+            if let data = readAvailableErrors() {
+                errorBuffer.append(data)
+            }
+            return errorBuffer
+        }
+        if !errors.isEmpty {
+            response.output = (response.output ?? "") + String(decoding: errors, as: UTF8.self)
+        }
+        return response
+    }
+
+    /// Reads what the worker wrote to its standard error without blocking, or returns nil once the worker closed it.
+    /// Must be called while holding `errorLock`.
+    private func readAvailableErrors() -> Data? {
+        let fd = errorOutput.fileHandleForReading.fileDescriptor
+        var data = Data()
+        var chunk = [UInt8](repeating: 0, count: 4096)
+        while true {
+            var descriptor = pollfd(fd: fd, events: Int16(POLLIN), revents: 0)
+            let ready = poll(&descriptor, 1, 0)
+            if ready < 0 && errno == EINTR {
+                continue
+            }
+            guard ready > 0 else {
+                return data
+            }
+            let count = read(fd, &chunk, chunk.count)
+            if count < 0 {
+                if errno == EINTR {
+                    continue
+                }
+                return data
+            }
+            guard count > 0 else {
+                return data.isEmpty ? nil : data
+            }
+            data.append(contentsOf: chunk[0..<count])
+        }
+    }
+
+    /// Writes to the standard input of the worker. A worker that exited in the meantime makes the write fail with
+    /// EPIPE instead of killing the client with SIGPIPE, which is only suppressed for the writes to the worker.
+    private func send(_ data: Data) throws {
+        let fd = input.fileHandleForWriting.fileDescriptor
+        let error = LLBPersistentWorker.withoutSIGPIPE { () -> Int32 in
+            data.withUnsafeBytes { (bytes: UnsafeRawBufferPointer) in
+                var offset = 0
+                while offset < bytes.count {
+                    let written = write(fd, bytes.baseAddress! + offset, bytes.count - offset)
+                    if written < 0 {
+                        if errno == EINTR {
+                            continue
+                        }
+                        return errno
+                    }
+                    offset += written
+                }
+                return 0
+            }
+        }
+        if error != 0 {
+            throw LLBPersistentWorkerError.workerExited(key.startupArguments)
+        }
+    }
+
+    /// Runs `write`, which returns the errno of its failed write or 0, without delivering the SIGPIPE raised by a
+    /// write to a closed pipe. Darwin suppresses it on the descriptor itself; elsewhere, SIGPIPE is blocked for the
+    /// calling thread while `write` runs, and the signal is only consumed if the write failed with EPIPE and no
+    /// SIGPIPE was pending before, so signals raised for other writes are still delivered once the mask is restored.
+    private static func withoutSIGPIPE(_ write: () -> Int32) -> Int32 {
+        #if canImport(Darwin)
+        return write()
+        #else
+        var sigpipe = sigset_t()
+        sigemptyset(&sigpipe)
+        sigaddset(&sigpipe, SIGPIPE)
+
+        var previousMask = sigset_t()
+        pthread_sigmask(SIG_BLOCK, &sigpipe, &previousMask)
+        defer { pthread_sigmask(SIG_SETMASK, &previousMask, nil) }
+
+        var pending = sigset_t()
+        sigpending(&pending)
+        let wasPending = sigismember(&pending, SIGPIPE) == 1
+
+        let error = write()
+
+        // A SIGPIPE raised by a write is directed at the thread that made it, so with the signal blocked, the pending
+        // one can only be ours if none was pending before the write.
+        if error == EPIPE && !wasPending {
+            var timeout = timespec(tv_sec: 0, tv_nsec: 0)
+            while sigtimedwait(&sigpipe, nil, &timeout) == -1 && errno == EINTR {}
+        }
+        return error
+        #endif
+    }
+
+    private func readLine() throws -> Data {
+        while true {
+            if let newline = buffer.firstIndex(of: UInt8(ascii: "\n")) {
+                let line = buffer[buffer.startIndex..<newline]
+                buffer = Data(buffer[buffer.index(after: newline)...])
+                return Data(line)
+            }
+            let chunk = output.fileHandleForReading.availableData
+            guard !chunk.isEmpty else {
+                throw LLBPersistentWorkerError.workerExited(key.startupArguments)
+            }
+            buffer.append(chunk)
+        }
+    }
+
+    /// Terminates the worker. Safe to call from any thread, including while a request is in progress, which then
+    /// fails once the worker exits.
+    func terminate() {
+        try? input.fileHandleForWriting.close()
+        if process.isRunning {
+            process.terminate()
+        }
+    }
+}
+
+/// A pool of persistent workers, keyed by their startup arguments, environment and working directory.
+///
+/// Workers avoid paying the startup and warmup costs of tools such as compilers for every action. A worker serves a
+/// single request at a time; new workers are started when all of the workers of a key are busy, and up to
+/// `maxIdleWorkersPerKey` of them are kept once they are done. Workers that fail are discarded, and the action fails,
+/// except for idle workers that exited since their last request, which are replaced by a new worker. Workers that
+/// don't respond within `responseTimeout`, or whose action is cancelled, are terminated. Pools can be shared between
+/// executors.
+///
+/// Since a worker can exit at any time, writes to workers don't raise SIGPIPE, and failed writes are treated as exited
+/// workers.
+public final class LLBPersistentWorkerPool {
+    public let maxIdleWorkersPerKey: Int
+
+    /// The maximum time a worker has to respond to a request, or nil to wait for as long as it runs.
+    public let responseTimeout: TimeInterval?
+
+    private let lock = Lock()
+    private var idleWorkers = [LLBPersistentWorkerKey: [LLBPersistentWorker]]()
+    private var busyWorkers = [ObjectIdentifier: LLBPersistentWorker]()
+    private var nextRequestID = 0
+    private var _startedWorkers = 0
+
+    public init(maxIdleWorkersPerKey: Int = 4, responseTimeout: TimeInterval? = nil) {
+        self.maxIdleWorkersPerKey = maxIdleWorkersPerKey
+        self.responseTimeout = responseTimeout
+    }
+
+    deinit {
+        shutdown()
+    }
+
+    /// The number of workers started since the pool was created.
+    public var startedWorkers: Int {
+        return lock.withLock { _startedWorkers }
+    }
+
+    /// Runs a request in a worker for the key, blocking until it responds.
+    func perform(
+        arguments: [String],
+        inputs: [LLBWorkRequestInput],
+        key: LLBPersistentWorkerKey,
+        cancellationToken: LLBCancellationToken? = nil
+    ) throws -> LLBWorkResponse {
+        let (idleWorker, requestID): (LLBPersistentWorker?, Int) = lock.withLock {
+            nextRequestID += 1
+            return (idleWorkers[key]?.popLast(), nextRequestID)
+        }
+        // Each worker handles one request at a time, so the request ID is only informative.
+        let request = LLBWorkRequest(arguments: arguments, inputs: inputs, requestId: requestID)
+
+        if let idleWorker = idleWorker {
+            do {
+                return try perform(request, in: idleWorker, cancellationToken)
+            } catch LLBPersistentWorkerError.workerExited(_) {
+                // The worker may have exited while it was idle, so the request is retried once in a new worker.
+                try cancellationToken?.checkCancelled()
+            }
+        }
+        return try perform(request, in: startWorker(key), cancellationToken)
+    }
+
+    private func startWorker(_ key: LLBPersistentWorkerKey) throws -> LLBPersistentWorker {
+        let worker = try LLBPersistentWorker(key: key)
+        lock.withLockVoid { _startedWorkers += 1 }
+        return worker
+    }
+
+    private func perform(
+        _ request: LLBWorkRequest,
+        in worker: LLBPersistentWorker,
+        _ cancellationToken: LLBCancellationToken?
+    ) throws -> LLBWorkResponse {
+        let key = worker.key
+        lock.withLockVoid { busyWorkers[ObjectIdentifier(worker)] = worker }
+
+        // Terminating the worker makes it close its output, which unblocks the request.
+        let timedOut = NIOAtomic<Bool>.makeAtomic(value: false)
+        let timeout = DispatchWorkItem {
+            timedOut.store(true)
+            worker.terminate()
+        }
+        if let responseTimeout = responseTimeout {
+            DispatchQueue.global().asyncAfter(deadline: .now() + responseTimeout, execute: timeout)
+        }
+        let handle = cancellationToken?.onCancel { _ in
+            worker.terminate()
+        }
+        defer {
+            timeout.cancel()
+            if let handle = handle {
+                cancellationToken?.remove(handle)
+            }
+        }
+
+        do {
+            let response = try worker.perform(request)
+            let keep: Bool = lock.withLock {
+                busyWorkers[ObjectIdentifier(worker)] = nil
+                guard idleWorkers[key, default: []].count < maxIdleWorkersPerKey else {
+                    return false
+                }
+                idleWorkers[key, default: []].append(worker)
+                return true
+            }
+            if !keep {
+                worker.terminate()
+            }
+            return response
+        } catch {
+            lock.withLockVoid { busyWorkers[ObjectIdentifier(worker)] = nil }
+            worker.terminate()
+            try cancellationToken?.checkCancelled()
+            if timedOut.load() {
+                throw LLBPersistentWorkerError.timedOut(key.startupArguments)
+            }
+            throw error
+        }
+    }
+
+    /// Terminates all of the workers. Requests in progress fail, and new requests start new workers.
+    public func shutdown() {
+        let workers: [LLBPersistentWorker] = lock.withLock {
+            let workers = idleWorkers.values.flatMap { $0 } + Array(busyWorkers.values)
+            idleWorkers.removeAll()
+            busyWorkers.removeAll()
+            return workers
+        }
+        workers.forEach { $0.terminate() }
+    }
+}
+
+/// Processes started by background pre-actions, which keep running across actions (for example, a local compilation
+/// server) until the executor shuts them down. A pre-action is started again if its process exited.
+final class LLBBackgroundProcesses {
+    private struct Key: Hashable {
+        let arguments: [String]
+        let environment: [String: String]
+        let workingDirectory: AbsolutePath
+    }
+
+    private let lock = Lock()
+    private var processes = [Key: Foundation.Process]()
+
+    deinit {
+        terminateAll()
+    }
+
+    /// Starts the background process unless the same one is already running.
+    func ensureRunning(arguments: [String], environment: [String: String], workingDirectory: AbsolutePath) throws {
+        let key = Key(arguments: arguments, environment: environment, workingDirectory: workingDirectory)
+        try lock.withLockVoid {
+            if let process = processes[key], process.isRunning {
+                return
+            }
+
+            let process = Foundation.Process()
+            process.executableURL = URL(fileURLWithPath: "/usr/bin/env")
+            process.arguments = arguments
+            process.environment = environment
+            process.currentDirectoryURL = URL(fileURLWithPath: workingDirectory.pathString)
+            process.standardInput = FileHandle.nullDevice
+            process.standardOutput = FileHandle.nullDevice
+            process.standardError = FileHandle.nullDevice
+            try process.run()
+            processes[key] = process
+        }
+    }
+
+    func terminateAll() {
+        let processes: [Foundation.Process] = lock.withLock {
+            let processes = Array(self.processes.values)
+            self.processes.removeAll()
+            return processes
+        }
+        for process in processes where process.isRunning {
+            process.terminate()
+        }
+    }
+}
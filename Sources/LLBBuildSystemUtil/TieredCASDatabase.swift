@@ -0,0 +1,405 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+#if canImport(Darwin)
+import Darwin
+#else
+import Glibc
+#endif
+
+import Dispatch
+import Foundation
+import llbuild2
+import NIOConcurrencyHelpers
+import TSCBasic
+
+public enum LLBTieredCASDatabaseError: Error {
+    case invalidURL(String)
+    case ioError(String, errno: Int32)
+}
+
+/// A CAS database that keeps the objects of a (typically remote) database in memory and on local disk.
+///
+/// Reads are served by the first tier that contains the object: an in-memory LRU cache, then a directory on disk whose
+/// least recently used objects are deleted once it grows past its size limit, and finally the remote database.
+/// Objects read from the remote database are added to the local tiers, and concurrent reads of the same object share a
+/// single remote request. Since objects are immutable, the local tiers never need to be invalidated.
+///
+/// Writes are kept in memory and written through to the remote database, and `put` completes once the remote write
+/// does. Written objects are only stored on disk once the remote database has them, and they are dropped from memory
+/// if the remote write fails, so that the local tiers never claim objects that the remote database doesn't have. Batch
+/// writes are forwarded to the remote database as a single batch, for remote databases that support them. With
+/// `asynchronousWrites`, `put` completes as soon as the object is stored locally and the remote write continues in the
+/// background; `flush()` waits for the remote writes, and reports the first one that failed. Clients that enable them
+/// must flush before handing IDs to other machines (e.g. remote executors) and before exiting.
+///
+/// IDs are the IDs of the remote database, so the local tiers can be shared by databases that use the same remote.
+public final class LLBTieredCASDatabase: LLBBatchPutCASDatabase {
+    /// The database behind the local tiers.
+    public let remote: LLBCASDatabase
+
+    /// The directory where the disk tier stores its objects.
+    public let diskPath: AbsolutePath
+
+    /// Whether writes complete before they reach the remote database.
+    public let asynchronousWrites: Bool
+
+    public var group: LLBFuturesDispatchGroup {
+        return remote.group
+    }
+
+    private let queue = DispatchQueue(label: "org.swift.llbuild2-\(LLBTieredCASDatabase.self)", attributes: .concurrent)
+    private let diskWrites = DispatchGroup()
+
+    private let lock = Lock()
+    /// The objects in memory, whose cost is their size.
+    private let memory: LLBBoundedLRU<LLBDataID, LLBCASObject>
+    /// The objects on disk, whose cost is their file size.
+    private let disk: LLBBoundedLRU<LLBDataID, Void>
+    private var inFlightReads = [LLBDataID: LLBFuture<LLBCASObject?>]()
+    private var pendingWrites = [LLBDataID: LLBFuture<LLBDataID>]()
+    private var writeError: Swift.Error?
+
+    /// - Parameters:
+    ///     - remote: The database behind the local tiers.
+    ///     - diskPath: The directory where objects are stored on disk. Objects stored by previous instances are reused.
+    ///     - memoryCapacity: The maximum total size of the objects kept in memory, in bytes.
+    ///     - diskCapacity: The maximum total size of the objects kept on disk, in bytes.
+    ///     - asynchronousWrites: Whether `put` completes before the object is written to the remote database.
+    public init(
+        remote: LLBCASDatabase,
+        diskPath: AbsolutePath,
+        memoryCapacity: Int = 256 * 1024 * 1024,
+        diskCapacity: Int = 10 * 1024 * 1024 * 1024,
+        asynchronousWrites: Bool = false
+    ) throws {
+        self.remote = remote
+        self.diskPath = diskPath
+        self.asynchronousWrites = asynchronousWrites
+        self.memory = LLBBoundedLRU(capacity: memoryCapacity)
+        self.disk = LLBBoundedLRU(capacity: diskCapacity)
+
+        try localFileSystem.createDirectory(diskPath, recursive: true)
+        try loadDiskIndex()
+    }
+
+    /// Indexes the objects left on disk by previous instances, ordered by their modification time.
+    private func loadDiskIndex() throws {
+        var files = [(id: LLBDataID, size: Int, modified: Date)]()
+        for name in try localFileSystem.getDirectoryContents(diskPath) {
+            let path = diskPath.appending(component: name)
+            // Temporary files are the remains of interrupted writes.
+            guard let id = LLBDataID(string: name) else {
+                try? localFileSystem.removeFileTree(path)
+                continue
+            }
+            let attributes = try FileManager.default.attributesOfItem(atPath: path.pathString)
+            files.append((
+                id: id,
+                size: (attributes[.size] as? NSNumber)?.intValue ?? 0,
+                modified: attributes[.modificationDate] as? Date ?? Date.distantPast
+            ))
+        }
+
+        for file in files.sorted(by: { $0.modified < $1.modified }) {
+            for evicted in disk.insert((), for: file.id, cost: file.size) {
+                try? localFileSystem.removeFileTree(objectPath(evicted.key))
+            }
+        }
+    }
+
+    private func objectPath(_ id: LLBDataID) -> AbsolutePath {
+        return diskPath.appending(component: "\(id)")
+    }
+
+    /// Waits for the pending writes to the remote database and to disk, and fails with the error of the first remote
+    /// write that failed since the previous flush.
+    public func flush() -> LLBFuture<Void> {
+        let writes: [LLBFuture<LLBDataID>] = lock.withLock { Array(pendingWrites.values) }
+        let diskWritesDone = group.next().makePromise(of: Void.self)
+        diskWrites.notify(queue: queue) {
+            diskWritesDone.succeed(())
+        }
+        return LLBFuture.whenAllComplete(writes, on: group.next()).and(diskWritesDone.futureResult).flatMapThrowing { _ in
+            let error: Swift.Error? = self.lock.withLock {
+                let error = self.writeError
+                self.writeError = nil
+                return error
+            }
+            if let error = error {
+                throw error
+            }
+        }
+    }
+
+    public func supportedFeatures() -> LLBFuture<LLBCASFeatures> {
+        return remote.supportedFeatures()
+    }
+
+    public func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> {
+        let (local, pendingWrite): (Bool, LLBFuture<LLBDataID>?) = lock.withLock {
+            if let write = pendingWrites[id] {
+                return (false, write)
+            }
+            return (memory.contains(id) || disk.contains(id), nil)
+        }
+        if let write = pendingWrite {
+            // Objects that are being written are only known to be there if the write succeeds.
+            return write.map { _ in true }.flatMapError { _ in self.remote.contains(id, ctx) }
+        }
+        if local {
+            return group.next().makeSucceededFuture(true)
+        }
+        return remote.contains(id, ctx)
+    }
+
+    public func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        let (cached, onDisk): (LLBCASObject?, Bool) = lock.withLock {
+            if let object = memory[id] {
+                return (object, false)
+            }
+            return (nil, disk[id] != nil)
+        }
+        if let object = cached {
+            return group.next().makeSucceededFuture(object)
+        }
+
+        if onDisk {
+            return readFromDisk(id).flatMap { object in
+                guard let object = object else {
+                    // The file was evicted or damaged since it was looked up.
+                    return self.getFromRemote(id, ctx)
+                }
+                self.storeInMemory(id, object)
+                return self.group.next().makeSucceededFuture(object)
+            }
+        }
+        return getFromRemote(id, ctx)
+    }
+
+    /// Reads an object from the remote database, sharing concurrent reads of the same object.
+    private func getFromRemote(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        let (future, promise): (LLBFuture<LLBCASObject?>, LLBPromise<LLBCASObject?>?) = lock.withLock {
+            if let future = inFlightReads[id] {
+                return (future, nil)
+            }
+            let promise = group.next().makePromise(of: LLBCASObject?.self)
+            inFlightReads[id] = promise.futureResult
+            return (promise.futureResult, promise)
+        }
+
+        guard let newPromise = promise else {
+            return future
+        }
+
+        future.whenComplete { _ in
+            self.lock.withLockVoid {
+                self.inFlightReads[id] = nil
+            }
+        }
+
+        newPromise.completeWith(remote.get(id, ctx).map { object in
+            if let object = object {
+                self.storeLocally(id, object)
+            }
+            return object
+        })
+        return future
+    }
+
+    public func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return remote.identify(refs: refs, data: data, ctx)
+    }
+
+    public func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return remote.identify(refs: refs, data: data, ctx).flatMap { id in
+            self.put(knownID: id, refs: refs, data: data, ctx)
+        }
+    }
+
+    public func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        let (write, promise) = startWrite(id, LLBCASObject(refs: refs, data: data))
+        promise?.completeWith(remote.put(knownID: id, refs: refs, data: data, ctx))
+
+        if asynchronousWrites {
+            return group.next().makeSucceededFuture(id)
+        }
+        return write
+    }
+
+    /// Writes the objects that aren't already being written to the remote database as a single batch (or as
+    /// individual writes, if the remote database doesn't support batches), storing them locally like `put` does.
+    public func batchPut(_ objects: [LLBCASObject], _ ctx: Context) -> LLBFuture<[LLBDataID]> {
+        let identified = objects.map { remote.identify(refs: $0.refs, data: $0.data, ctx) }
+        return LLBFuture.whenAllSucceed(identified, on: group.next()).flatMap { ids in
+            var writes = [LLBFuture<LLBDataID>]()
+            var newWrites = [(object: LLBCASObject, promise: LLBPromise<LLBDataID>)]()
+            for (id, object) in zip(ids, objects) {
+                let (write, promise) = self.startWrite(id, object)
+                writes.append(write)
+                if let promise = promise {
+                    newWrites.append((object, promise))
+                }
+            }
+
+            if !newWrites.isEmpty {
+                let batch = self.remote.put(objects: newWrites.map { $0.object }, ctx)
+                for (index, newWrite) in newWrites.enumerated() {
+                    newWrite.promise.completeWith(batch.map { $0[index] })
+                }
+            }
+
+            if self.asynchronousWrites {
+                return self.group.next().makeSucceededFuture(ids)
+            }
+            return LLBFuture.whenAllSucceed(writes, on: self.group.next())
+        }
+    }
+
+    /// Starts tracking the write of an object, returning the pending write and, if the object wasn't already being
+    /// written, the promise that the caller must complete with the remote write.
+    private func startWrite(_ id: LLBDataID, _ object: LLBCASObject) -> (LLBFuture<LLBDataID>, LLBPromise<LLBDataID>?) {
+        let (write, promise): (LLBFuture<LLBDataID>, LLBPromise<LLBDataID>?) = lock.withLock {
+            if let write = pendingWrites[id] {
+                return (write, nil)
+            }
+            let promise = group.next().makePromise(of: LLBDataID.self)
+            pendingWrites[id] = promise.futureResult
+            return (promise.futureResult, promise)
+        }
+
+        if promise != nil {
+            // Reads of the object are served from memory while it is being written, but it is only stored on disk once
+            // the remote database has it. The disk write is tracked from now on, so that flushing waits for it.
+            storeInMemory(id, object)
+            diskWrites.enter()
+            write.whenComplete { result in
+                self.lock.withLockVoid {
+                    self.pendingWrites[id] = nil
+                    if case .failure(let error) = result {
+                        self.memory.removeValue(forKey: id)
+                        if self.writeError == nil {
+                            self.writeError = error
+                        }
+                    }
+                }
+                if case .success = result {
+                    self.storeOnDisk(id, object)
+                }
+                self.diskWrites.leave()
+            }
+        }
+        return (write, promise)
+    }
+
+    // MARK: - Local tiers
+
+    private func storeInMemory(_ id: LLBDataID, _ object: LLBCASObject) {
+        lock.withLockVoid {
+            memory.insert(object, for: id, cost: object.data.readableBytes)
+        }
+    }
+
+    /// Adds the object to memory, and writes it to disk in the background.
+    private func storeLocally(_ id: LLBDataID, _ object: LLBCASObject) {
+        storeInMemory(id, object)
+        storeOnDisk(id, object)
+    }
+
+    /// Writes the object to disk in the background.
+    private func storeOnDisk(_ id: LLBDataID, _ object: LLBCASObject) {
+        let alreadyOnDisk = lock.withLock { disk.contains(id) }
+        guard !alreadyOnDisk else {
+            return
+        }
+
+        queue.async(group: diskWrites) {
+            // The disk tier is a cache, so objects that can't be written are only missing from it.
+            guard let size = try? self.writeToDisk(id, object) else {
+                return
+            }
+            // Objects that are larger than the disk tier are evicted right away.
+            let evicted = self.lock.withLock {
+                self.disk.insert((), for: id, cost: size)
+            }
+            for (evictedID, _) in evicted {
+                try? localFileSystem.removeFileTree(self.objectPath(evictedID))
+            }
+        }
+    }
+
+    /// Writes the serialized object to disk, returning its size.
+    private func writeToDisk(_ id: LLBDataID, _ object: LLBCASObject) throws -> Int {
+        let contents = try object.toData()
+        // Write to a temporary file and move it into place, so that partially written objects are never visible.
+        let temporaryPath = diskPath.appending(component: "\(id).\(UUID()).tmp")
+        try localFileSystem.writeFileContents(temporaryPath, bytes: ByteString(contents))
+        guard rename(temporaryPath.pathString, objectPath(id).pathString) == 0 else {
+            let error = LLBTieredCASDatabaseError.ioError("rename \(temporaryPath)", errno: errno)
+            try? localFileSystem.removeFileTree(temporaryPath)
+            throw error
+        }
+        return contents.count
+    }
+
+    /// Reads an object from disk, returning nil (and forgetting about the object) if it can't be read.
+    private func readFromDisk(_ id: LLBDataID) -> LLBFuture<LLBCASObject?> {
+        let promise = group.next().makePromise(of: LLBCASObject?.self)
+        queue.async {
+            let path = self.objectPath(id)
+            do {
+                let contents = try localFileSystem.readFileContents(path)
+                promise.succeed(try LLBCASObject(from: LLBByteBuffer.withBytes(contents.contents[...])))
+            } catch {
+                self.lock.withLockVoid {
+                    self.disk.removeValue(forKey: id)
+                }
+                try? localFileSystem.removeFileTree(path)
+                promise.succeed(nil)
+            }
+        }
+        return promise.futureResult
+    }
+}
+
+/// Opens tiered databases from URLs of the form `tiered:///path/to/cache?remote=<URL>`, where `remote` is the
+/// percent-encoded URL of the remote database. The optional `memory` and `disk` parameters set the capacity of the
+/// memory and disk tiers, in bytes, and `async=1` makes writes complete before they reach the remote database, which
+/// then needs to be flushed with `LLBTieredCASDatabase.flush()`.
+public struct LLBTieredCASDatabaseScheme: LLBCASDatabaseScheme {
+    public static let scheme = "tiered"
+
+    public static func isValid(host: String?, port: Int?, path: String, query: String?) -> Bool {
+        return (host ?? "").isEmpty && port == nil && path.hasPrefix("/") && (query?.contains("remote=") ?? false)
+    }
+
+    public static func open(group: LLBFuturesDispatchGroup, url: URL) throws -> LLBCASDatabase {
+        let queryItems = URLComponents(url: url, resolvingAgainstBaseURL: false)?.queryItems ?? []
+        func parameter(_ name: String) -> String? {
+            return queryItems.first(where: { $0.name == name })?.value
+        }
+
+        guard let remoteString = parameter("remote"), let remoteURL = URL(string: remoteString) else {
+            throw LLBTieredCASDatabaseError.invalidURL(url.absoluteString)
+        }
+        let remote = try LLBCASDatabaseSpec(remoteURL).open(group: group)
+
+        return try LLBTieredCASDatabase(
+            remote: remote,
+            diskPath: AbsolutePath(url.path),
+            memoryCapacity: parameter("memory").flatMap { Int($0) } ?? 256 * 1024 * 1024,
+            diskCapacity: parameter("disk").flatMap { Int($0) } ?? 10 * 1024 * 1024 * 1024,
+            asynchronousWrites: parameter("async") == "1"
+        )
+    }
+}
+
+/// Registers the `tiered` scheme with `LLBCASDatabaseSpec`.
+public func registerTieredCASScheme() {
+    LLBCASDatabaseSpec.register(schemeType: LLBTieredCASDatabaseScheme.self)
+}
@@ -28,6 +28,9 @@ public final class LLBCASTool {
     public let group: LLBFuturesDispatchGroup
     private let db: LLBCASDatabase
 
+    /// The database used by bulk transfers, which bounds their concurrency and counts the transferred data.
+    private let transferDB: LLBTransferCASDatabase
+
     let threadPool: NIOThreadPool
     let fileIO: NonBlockingFileIO
 
@@ -40,6 +43,7 @@ public final class LLBCASTool {
         self.options = options
 
         self.db = try LLBCASDatabaseSpec(options.url).open(group: group)
+        self.transferDB = LLBTransferCASDatabase(db, maxConcurrentTransfers: options.maxConcurrentTransfers)
 
         let threadPool = NIOThreadPool(numberOfThreads: 6)
         self.threadPool = threadPool
@@ -107,6 +111,33 @@ public final class LLBCASTool {
         }
     }
 
+    /// Import the given directory into the CAS database, returning the ID of its tree.
+    ///
+    /// Files are uploaded in parallel, up to the `maxConcurrentTransfers` requests of the options, and large files are
+    /// read and uploaded in chunks instead of as a whole.
+    public func casImport(directory: AbsolutePath, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return LLBCASFileTree.import(path: directory, to: transferDB, ctx)
+    }
+
+    /// Export the tree with the given data id from the CAS database into the given directory.
+    public func casExport(id: LLBDataID, to directory: AbsolutePath, _ ctx: Context) -> LLBFuture<Void> {
+        return LLBCASFileTree.export(id, from: transferDB, to: .init(directory.pathString), ctx)
+    }
+
+    /// The data transferred by `casImport` and `casExport` so far.
+    public var transferStats: LLBCASToolTransferStats {
+        return transferDB.stats
+    }
+
+    /// Call `report` with the transfer stats at the given interval, until the returned task is cancelled.
+    public func reportProgress(
+        every interval: TimeAmount = .seconds(1),
+        _ report: @escaping (LLBCASToolTransferStats) -> Void
+    ) -> RepeatedTask {
+        return group.next().scheduleRepeatedTask(initialDelay: interval, delay: interval) { _ in
+            report(self.transferStats)
+        }
+    }
 
     /// Get the server capabilities of the remote endpoint.
     public func getCapabilities() -> LLBFuture<ServerCapabilities> {
@@ -12,10 +12,15 @@ public struct LLBCASToolOptions {
     /// The frontend URL for the CAS
     public var url: URL
 
+    /// The maximum number of requests sent to the CAS at once by bulk transfers
+    public var maxConcurrentTransfers: Int
+
     public init(
-        url: URL
+        url: URL,
+        maxConcurrentTransfers: Int = 64
     ) {
         self.url = url
+        self.maxConcurrentTransfers = maxConcurrentTransfers
     }
 }
 
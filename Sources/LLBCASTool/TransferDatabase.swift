@@ -0,0 +1,147 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import NIO
+import NIOConcurrencyHelpers
+
+import llbuild2
+
+
+/// The amount of data transferred by the tool so far.
+public struct LLBCASToolTransferStats {
+    /// The number of objects written to or read from the database.
+    public var objects: Int
+
+    /// The number of bytes written to or read from the database.
+    public var bytes: Int
+
+    /// The time since the transfer started, in seconds.
+    public var elapsed: TimeInterval
+
+    public var bytesPerSecond: Double {
+        return elapsed > 0 ? Double(bytes) / elapsed : 0
+    }
+}
+
+/// Wraps the database of the tool to bound the number of requests in flight, so that importing or exporting large trees
+/// doesn't send an unbounded number of requests to the server at once, and to count the transferred data.
+///
+/// This doesn't bound memory: the file tree import reads each file before handing its data to `put`, so requests that
+/// are waiting for a slot hold on to their data until they are sent.
+final class LLBTransferCASDatabase: LLBCASDatabase {
+    let db: LLBCASDatabase
+    let maxConcurrentTransfers: Int
+
+    private let lock = Lock()
+    private var running = 0
+    private var waiting = CircularBuffer<() -> Void>()
+    private var objects = 0
+    private var bytes = 0
+    private let start = Date()
+
+    var group: LLBFuturesDispatchGroup {
+        return db.group
+    }
+
+    init(_ db: LLBCASDatabase, maxConcurrentTransfers: Int) {
+        self.db = db
+        self.maxConcurrentTransfers = max(1, maxConcurrentTransfers)
+    }
+
+    var stats: LLBCASToolTransferStats {
+        return lock.withLock {
+            LLBCASToolTransferStats(objects: objects, bytes: bytes, elapsed: Date().timeIntervalSince(start))
+        }
+    }
+
+    /// Runs the request once fewer than `maxConcurrentTransfers` requests are in flight. Requests that are still
+    /// waiting when the context's cancellation token is cancelled fail without being sent.
+    private func limited<T>(_ ctx: Context, _ request: @escaping () -> LLBFuture<T>) -> LLBFuture<T> {
+        let promise = group.next().makePromise(of: T.self)
+        let run = {
+            if let reason = ctx.cancellationToken?.reason {
+                promise.fail(LLBCancellationError.cancelled(reason))
+                self.finished()
+                return
+            }
+            promise.completeWith(request().always { _ in self.finished() })
+        }
+
+        let runNow: Bool = lock.withLock {
+            guard running < maxConcurrentTransfers else {
+                waiting.append(run)
+                return false
+            }
+            running += 1
+            return true
+        }
+        if runNow {
+            run()
+        }
+        return promise.futureResult
+    }
+
+    private func finished() {
+        // Hand the slot over to the next waiting request, if any.
+        let next: (() -> Void)? = lock.withLock {
+            guard !waiting.isEmpty else {
+                running -= 1
+                return nil
+            }
+            return waiting.removeFirst()
+        }
+        // Start it from the event loop, so that requests that complete immediately don't recurse.
+        if let next = next {
+            group.next().execute(next)
+        }
+    }
+
+    private func record(bytes count: Int) {
+        lock.withLockVoid {
+            objects += 1
+            bytes += count
+        }
+    }
+
+    func supportedFeatures() -> LLBFuture<LLBCASFeatures> {
+        return db.supportedFeatures()
+    }
+
+    func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> {
+        return limited(ctx) { self.db.contains(id, ctx) }
+    }
+
+    func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        return limited(ctx) { self.db.get(id, ctx) }.map { object in
+            if let object = object {
+                self.record(bytes: object.data.readableBytes)
+            }
+            return object
+        }
+    }
+
+    func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return db.identify(refs: refs, data: data, ctx)
+    }
+
+    func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return limited(ctx) { self.db.put(refs: refs, data: data, ctx) }.map { id in
+            self.record(bytes: data.readableBytes)
+            return id
+        }
+    }
+
+    func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return limited(ctx) { self.db.put(knownID: id, refs: refs, data: data, ctx) }.map { id in
+            self.record(bytes: data.readableBytes)
+            return id
+        }
+    }
+}
@@ -7,9 +7,12 @@
 // See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
 
 import ArgumentParser
+import Foundation
 
 import llbuild2
+import LLBBuildSystemUtil
 import LLBNinja
+import TSCBasic
 
 public struct NinjaBuildTool: ParsableCommand {
     public static var configuration = CommandConfiguration(
@@ -25,16 +28,72 @@ public struct NinjaBuildTool: ParsableCommand {
     @Option(help: "The name of the target to build")
     var target: String
 
+    @Flag(help: "Run the commands instead of printing them")
+    var execute: Bool = false
+
+    @Option(help: "The CAS database URL used to store the files when running the commands, including tiered:// URLs (defaults to in-memory)")
+    var casURL: String?
+
+    @Option(help: "The directory of the persistent cache of command results, used when running the commands")
+    var cacheDirectory: String?
+
     public init() { }
 
     public func run() throws {
-        let dryRunDelegate = NinjaDryRunDelegate()
-        let nb = try NinjaBuild(manifest: manifest, delegate: dryRunDelegate)
-        let ctx = Context()
-        _ = try nb.build(target: target, as: Int.self, ctx)
+        guard execute else {
+            let dryRunDelegate = NinjaDryRunDelegate()
+            let nb = try NinjaBuild(manifest: manifest, delegate: dryRunDelegate)
+            let ctx = Context()
+            _ = try nb.build(target: target, as: Int.self, ctx)
+            return
+        }
+
+        guard let currentDirectory = localFileSystem.currentWorkingDirectory else {
+            throw StringError("cannot determine the current directory")
+        }
+        let manifestPath = AbsolutePath(manifest, relativeTo: currentDirectory)
+        let buildDirectory = manifestPath.parentDirectory
+
+        let group = LLBMakeDefaultDispatchGroup()
+        let db: LLBCASDatabase
+        if let casURL = casURL {
+            guard let url = URL(string: casURL) else {
+                throw StringError("invalid CAS database URL: \(casURL)")
+            }
+            registerTieredCASScheme()
+            db = try LLBCASDatabaseSpec(url).open(group: group)
+        } else {
+            db = LLBInMemoryCASDatabase(group: group)
+        }
+        let functionCache = cacheDirectory.map {
+            LLBLogStructuredFunctionCache(group: group, path: AbsolutePath($0, relativeTo: currentDirectory))
+        }
+
+        let executionDelegate = NinjaExecutionDelegate(
+            buildDirectory: buildDirectory,
+            executor: LLBLocalExecutor(outputBase: buildDirectory, delegate: verbose ? NinjaVerboseExecutorDelegate() : nil),
+            db: db,
+            functionCache: functionCache
+        )
+        let nb = try NinjaBuild(manifest: manifestPath.pathString, delegate: executionDelegate, group: group)
+        let result = Result { try nb.build(target: target, as: NinjaArtifactValue.self, Context()) }
+
+        // Writes that haven't reached the remote database yet would be lost when the tool exits.
+        if let tiered = db as? LLBTieredCASDatabase {
+            try tiered.flush().wait()
+        }
+        _ = try result.get()
     }
 }
 
+private class NinjaVerboseExecutorDelegate: LLBLocalExecutorDelegate {
+    func launchingProcess(arguments: [String], workingDir: AbsolutePath, environment: [String: String]) {
+        print("run: \(arguments.last ?? "")")
+    }
+
+    func finishedProcess(with result: ProcessResult) {}
+}
+
 extension Int: NinjaValue {}
 
 private class NinjaDryRunDelegate: NinjaBuildDelegate {
@@ -19,20 +19,40 @@ public protocol NinjaValue: LLBValue {}
 public class NinjaBuild {
     let manifest: NinjaManifest
     let delegate: NinjaBuildDelegate
+    let graph: NinjaGraph
+    private let engine: LLBEngine
 
     public enum Error: Swift.Error {
         case internalTypeError
     }
 
-    public init(manifest: String, delegate: NinjaBuildDelegate) throws {
+    /// Loads the manifest and prepares the build graph, which are kept for all of the builds of this instance.
+    ///
+    /// The engine is also kept across builds, but the results of the previous build are dropped at the start of each
+    /// build, since the input files may have changed. Delegates that cache the commands they run across builds (like
+    /// `NinjaExecutionDelegate`) only run again the commands whose inputs changed.
+    public init(
+        manifest: String,
+        delegate: NinjaBuildDelegate,
+        group: LLBFuturesDispatchGroup = LLBMakeDefaultDispatchGroup()
+    ) throws {
         self.manifest = try NinjaManifest(path: manifest)
         self.delegate = delegate
+        self.graph = NinjaGraph(manifest: self.manifest)
+        self.engine = LLBEngine(
+            group: group,
+            delegate: NinjaEngineDelegate(graph: graph, delegate: delegate)
+        )
     }
 
     public func build<V: NinjaValue>(target: String, as: V.Type, _ ctx: Context) throws -> V {
-        let engineDelegate = NinjaEngineDelegate(manifest: manifest, delegate: delegate)
-        let engine = LLBEngine(delegate: engineDelegate)
-        return try engine.build(key: "T" + target, as: V.self, ctx).wait()
+        // A top-level target build request must be the output of a command.
+        guard let node = graph.nodeIndices[target], graph.producers[node] != nil else {
+            throw NinjaEngineDelegateError.commandNotFound(target)
+        }
+
+        engine.invalidateResults()
+        return try engine.build(key: NinjaKey(.node, node), as: V.self, ctx).wait()
     }
 }
 
@@ -61,103 +81,152 @@ private extension LLBFuture where Value == LLBValue {
 }
 
 enum NinjaEngineDelegateError: Error {
-    case unexpectedKey(String)
     case unexpectedKeyType(String)
-    case unexpectedCommandKey(String)
     case invalidKey(String)
     case commandNotFound(String)
 }
 
-private class NinjaEngineDelegate: LLBEngineDelegate {
+/// The build graph of a manifest, in which every path is identified by its index in the node table, so that keys and
+/// dependencies don't need to be looked up by path during the build.
+final class NinjaGraph {
     let manifest: NinjaManifest
-    let commandMap: [String: Int]
-    let delegate: NinjaBuildDelegate
 
-    init(manifest: NinjaManifest, delegate: NinjaBuildDelegate) {
+    /// The path of each node.
+    let paths: [String]
+
+    /// The index of the node of each path.
+    let nodeIndices: [String: Int]
+
+    /// The index of the command that produces each node, or nil if the node is an input file.
+    let producers: [Int?]
+
+    /// The nodes that each command depends on. For now, these merge the explicit, implicit and order-only inputs,
+    /// which isn't really in keeping with the Ninja semantics, but is strong.
+    let commandInputs: [[Int]]
+
+    init(manifest: NinjaManifest) {
         self.manifest = manifest
-        self.delegate = delegate
 
-        // Populate the command map.
-        var commandMap = [String: Int]()
-        for (i,command) in self.manifest.commands.enumerated() {
+        var paths = [String]()
+        var nodeIndices = [String: Int]()
+        func node(_ path: String) -> Int {
+            if let index = nodeIndices[path] {
+                return index
+            }
+            let index = paths.count
+            paths.append(path)
+            nodeIndices[path] = index
+            return index
+        }
+
+        // Number the outputs first, so that the producers can be recorded as they are found.
+        var producers = [Int?]()
+        for (i, command) in manifest.commands.enumerated() {
             for output in command.outputs {
-                commandMap[output] = i
+                let index = node(output)
+                if index == producers.count {
+                    producers.append(i)
+                } else {
+                    producers[index] = i
+                }
             }
         }
-        self.commandMap = commandMap
+
+        self.commandInputs = manifest.commands.map { command in
+            (command.inputs + command.implicitInputs + command.orderOnlyInputs).map(node)
+        }
+        producers += Array(repeating: nil, count: paths.count - producers.count)
+
+        self.paths = paths
+        self.nodeIndices = nodeIndices
+        self.producers = producers
+    }
+}
+
+/// A compact key for the Ninja engine delegate, made of the kind of key and the index of the node or command.
+struct NinjaKey: LLBKey, Hashable {
+    enum Kind: UInt8 {
+        /// A build node, which is either a command output or an input file.
+        case node = 0
+
+        /// A build command. There must be a level of indirection between nodes and commands, because the same command
+        /// may produce multiple outputs.
+        case command = 1
+    }
+
+    let kind: Kind
+    let index: Int
+
+    init(_ kind: Kind, _ index: Int) {
+        self.kind = kind
+        self.index = index
+    }
+
+    var stableHashValue: LLBDataID {
+        var bytes = [kind.rawValue]
+        withUnsafeBytes(of: Int64(index).littleEndian) { bytes += $0 }
+        return LLBDataID(blake3hash: LLBByteBuffer.withBytes(bytes[...]), refs: [])
+    }
+
+    func logDescription() -> String {
+        return "\(kind) \(index)"
+    }
+}
+
+private class NinjaEngineDelegate: LLBEngineDelegate {
+    let graph: NinjaGraph
+    let delegate: NinjaBuildDelegate
+
+    init(graph: NinjaGraph, delegate: NinjaBuildDelegate) {
+        self.graph = graph
+        self.delegate = delegate
     }
     
     func lookupFunction(forKey rawKey: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunction> {
-        guard let key = rawKey as? String else {
+        guard let key = rawKey as? NinjaKey else {
             return ctx.group.next().makeFailedFuture(
                 NinjaEngineDelegateError.unexpectedKeyType(String(describing: type(of: rawKey)))
             )
         }
 
-        guard let code = key.first else {
-            return ctx.group.next().makeFailedFuture(NinjaEngineDelegateError.invalidKey(key))
-        }
-
-        switch code {
-            // A top-level target build request (expected to always be a valid target).
-        case "T":
-            // Must be a target.
-            let target = String(key.dropFirst(1))
-            guard let i = self.commandMap[target] else {
-                return ctx.group.next().makeFailedFuture(NinjaEngineDelegateError.commandNotFound(target))
+        switch key.kind {
+        case .node:
+            guard key.index < graph.paths.count else {
+                return ctx.group.next().makeFailedFuture(NinjaEngineDelegateError.invalidKey(key.logDescription()))
             }
 
-            return ctx.group.next().makeSucceededFuture(
-                LLBSimpleFunction { (fi, key, ctx) in
-                    return fi.request("C" + String(i), ctx)
-                }
-            )
-
-            // A build node.
-        case "N":
-            // If this is a command output, build the command (note that there
-            // must be a level of indirection here, because the same command may
-            // produce multiple outputs).
-            let path = String(key.dropFirst(1))
-            if let i = self.commandMap[path] {
+            // If this is a command output, build the command.
+            if let i = graph.producers[key.index] {
                 return ctx.group.next().makeSucceededFuture(
                     LLBSimpleFunction { (fi, key, ctx) in
-                        return fi.request("C" + String(i), ctx)
+                        return fi.request(NinjaKey(.command, i), ctx)
                     }
                 )
             }
 
             // Otherwise, it is an input file.
+            let path = graph.paths[key.index]
             return ctx.group.next().makeSucceededFuture(
                 LLBSimpleFunction { (fi, key, ctx) in
                     return self.delegate.build(group: ctx.group, path: path).map { $0 as LLBValue }
                 }
             )
 
-            // A build command.
-        case "C":
-            let commandIndexStr = String(key.dropFirst(1))
-            guard let i = Int(commandIndexStr) else {
-                return ctx.group.next().makeFailedFuture(NinjaEngineDelegateError.unexpectedCommandKey(key))
+        case .command:
+            guard key.index < graph.manifest.commands.count else {
+                return ctx.group.next().makeFailedFuture(NinjaEngineDelegateError.invalidKey(key.logDescription()))
             }
 
+            let i = key.index
             return ctx.group.next().makeSucceededFuture(
                 LLBSimpleFunction { (fi, key, ctx) in
-                    // Get the command.
-                    let command = self.manifest.commands[i]
-                    // FIXME: For now, we just merge all the inputs. This isn't
-                    // really in keeping with the Ninja semantics, but is strong.
-                    var inputs = command.inputs.map{ fi.request("N" + $0, ctx).asNinjaValue() }
-                    inputs += command.implicitInputs.map{ fi.request("N" + $0, ctx).asNinjaValue() }
-                    inputs += command.orderOnlyInputs.map{ fi.request("N" + $0, ctx).asNinjaValue() }
+                    let command = self.graph.manifest.commands[i]
+                    let inputs = self.graph.commandInputs[i].map { fi.request(NinjaKey(.node, $0), ctx).asNinjaValue() }
                     return LLBFuture.whenAllSucceed(inputs, on: ctx.group.next()).flatMap { inputs in
                         return self.delegate.build(group: ctx.group.next(), command: command, inputs: inputs).map { $0 as LLBValue }
                     }
                 }
             )
-
-        default:
-            return ctx.group.next().makeFailedFuture(NinjaEngineDelegateError.unexpectedKey(key))
         }
     }
 }
@@ -0,0 +1,259 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+import SwiftProtobuf
+import TSCBasic
+
+public enum NinjaExecutionError: Swift.Error {
+    case invalidValue
+    case unexpectedInput(String)
+    case unsupportedOutputPath(String)
+    case commandFailed(String, exitCode: Int)
+    case missingOutput(String)
+}
+
+/// The value of a node or command built by `NinjaExecutionDelegate`: the files, with their paths as written in the
+/// manifest, and their IDs in the CAS database.
+public struct NinjaArtifactValue: NinjaValue, LLBCASObjectConstructable {
+    public let paths: [String]
+    public let dataIDs: [LLBDataID]
+
+    public init(paths: [String], dataIDs: [LLBDataID]) {
+        precondition(paths.count == dataIDs.count, "each path needs a data ID")
+        self.paths = paths
+        self.dataIDs = dataIDs
+    }
+
+    public init(from casObject: LLBCASObject) throws {
+        var data = casObject.data
+        guard let contents = data.readString(length: data.readableBytes) else {
+            throw NinjaExecutionError.invalidValue
+        }
+        let paths = contents.isEmpty ? [] : contents.split(separator: "\0", omittingEmptySubsequences: false).map(String.init)
+        guard paths.count == casObject.refs.count else {
+            throw NinjaExecutionError.invalidValue
+        }
+        self.paths = paths
+        self.dataIDs = casObject.refs
+    }
+
+    public func asCASObject() throws -> LLBCASObject {
+        return LLBCASObject(refs: dataIDs, data: LLBByteBuffer.withBytes(ArraySlice(paths.joined(separator: "\0").utf8)))
+    }
+}
+
+/// Identifies the execution of a command by the request sent to the executor and the contents of the inputs outside
+/// of the build directory, which can't be part of the request.
+private struct NinjaCommandCacheKey: LLBKey, Hashable {
+    let request: LLBActionExecutionRequest
+    let externalInputs: [LLBDataID]
+
+    var stableHashValue: LLBDataID {
+        let requestData = (try? request.serializedData()) ?? Data()
+        return LLBDataID(blake3hash: LLBByteBuffer.withBytes(ArraySlice(requestData)), refs: externalInputs)
+    }
+}
+
+/// A Ninja build delegate that runs the commands through an executor, typically an `LLBLocalExecutor` whose output
+/// base is the build directory, and stores the input and output files in the CAS database.
+///
+/// If a function cache is provided, the responses of the commands are cached by the request and the contents of the
+/// inputs. Commands whose inputs didn't change since a previous build (possibly in another process, if the cache and
+/// the database are persistent) aren't run again: their outputs are written back from the database instead.
+///
+/// Commands whose rule has a `depfile` or `deps` are never cached, since the inputs they discover (such as included
+/// headers) aren't known to the build and can't be part of the key. As in Ninja, the environment isn't part of the key
+/// either, except for the variables in `keyEnvironment`.
+public final class NinjaExecutionDelegate: NinjaBuildDelegate {
+    /// The directory against which the paths of the manifest are resolved.
+    public let buildDirectory: AbsolutePath
+
+    let executor: LLBExecutor
+    let functionCache: LLBFunctionCache?
+    let environment: [String: String]
+    let keyEnvironment: Set<String>
+    let ctx: Context
+
+    /// - Parameters:
+    ///     - buildDirectory: The directory that contains the manifest, where the commands are run.
+    ///     - executor: The executor that runs the commands, with `buildDirectory` as its working directory.
+    ///     - db: The database where the input and output files are stored.
+    ///     - functionCache: The cache of command responses, or nil to always run the commands.
+    ///     - environment: The environment of the commands.
+    ///     - keyEnvironment: The names of the environment variables that are part of the cache key of the commands, so
+    ///           that changing them runs the commands again.
+    public init(
+        buildDirectory: AbsolutePath,
+        executor: LLBExecutor,
+        db: LLBCASDatabase,
+        functionCache: LLBFunctionCache? = nil,
+        environment: [String: String] = ProcessInfo.processInfo.environment,
+        keyEnvironment: Set<String> = [],
+        ctx: Context = Context()
+    ) {
+        self.buildDirectory = buildDirectory
+        self.executor = executor
+        self.functionCache = functionCache
+        self.environment = environment
+        self.keyEnvironment = keyEnvironment
+
+        var ctx = ctx
+        ctx.group = db.group
+        ctx.db = db
+        self.ctx = ctx
+    }
+
+    public func build(group: LLBFuturesDispatchGroup, path: String) -> LLBFuture<NinjaValue> {
+        let absolutePath = AbsolutePath(path, relativeTo: buildDirectory)
+        return LLBCASFileTree.import(path: absolutePath, to: ctx.db, ctx).map { dataID -> NinjaValue in
+            NinjaArtifactValue(paths: [path], dataIDs: [dataID])
+        }
+    }
+
+    public func build(group: LLBFuturesDispatchGroup, command: Command, inputs: [NinjaValue]) -> LLBFuture<NinjaValue> {
+        var inputPaths = Set<String>()
+        var actionInputs = [LLBActionInput]()
+        var externalInputs = [LLBDataID]()
+        var phonyPaths = [String]()
+        var phonyIDs = [LLBDataID]()
+        for input in inputs {
+            guard let artifact = input as? NinjaArtifactValue else {
+                return group.next().makeFailedFuture(NinjaExecutionError.unexpectedInput(String(describing: type(of: input))))
+            }
+            for (path, dataID) in zip(artifact.paths, artifact.dataIDs) where inputPaths.insert(path).inserted {
+                phonyPaths.append(path)
+                phonyIDs.append(dataID)
+                if path.hasPrefix("/") {
+                    externalInputs.append(dataID)
+                } else {
+                    actionInputs.append(LLBActionInput(path: path, dataID: dataID, type: .file))
+                }
+            }
+        }
+
+        // Phony commands only group their inputs.
+        if command.command.isEmpty {
+            return group.next().makeSucceededFuture(NinjaArtifactValue(paths: phonyPaths, dataIDs: phonyIDs))
+        }
+
+        if let output = command.outputs.first(where: { $0.hasPrefix("/") }) {
+            return group.next().makeFailedFuture(NinjaExecutionError.unsupportedOutputPath(output))
+        }
+
+        let request = LLBActionExecutionRequest(
+            actionSpec: LLBActionSpec(arguments: ["/bin/sh", "-c", command.command], environment: environment),
+            inputs: actionInputs,
+            outputs: command.outputs.map { LLBActionOutput(path: $0, type: .file) }
+        )
+        let cacheKey = discoversInputs(command) ? nil : NinjaCommandCacheKey(
+            request: keyRequest(for: request),
+            externalInputs: externalInputs
+        )
+
+        return cachedResponse(for: cacheKey).flatMap { cached -> LLBFuture<LLBActionExecutionResponse> in
+            if let response = cached {
+                return self.restoreOutputs(of: request, from: response).map { response }
+            }
+            return self.executor.execute(request: request, self.ctx).flatMap { response in
+                guard response.exitCode == 0 else {
+                    return group.next().makeFailedFuture(
+                        NinjaExecutionError.commandFailed(command.command, exitCode: Int(response.exitCode))
+                    )
+                }
+                return self.store(response, for: cacheKey).map { response }
+            }
+        }.map { response -> NinjaValue in
+            NinjaArtifactValue(paths: command.outputs, dataIDs: response.outputs)
+        }
+    }
+
+    /// Whether the command discovers inputs while it runs, through a depfile or the deps of its rule.
+    private func discoversInputs(_ command: Command) -> Bool {
+        let variables = command.rule.variables
+        return !(variables["depfile"] ?? "").isEmpty || !(variables["deps"] ?? "").isEmpty
+    }
+
+    /// The request as it is identified in the cache, with only the environment variables of `keyEnvironment`.
+    private func keyRequest(for request: LLBActionExecutionRequest) -> LLBActionExecutionRequest {
+        var request = request
+        request.actionSpec.environment = request.actionSpec.environment.filter { keyEnvironment.contains($0.name) }
+        return request
+    }
+
+    private func cachedResponse(for key: NinjaCommandCacheKey?) -> LLBFuture<LLBActionExecutionResponse?> {
+        guard let functionCache = functionCache, let key = key else {
+            return ctx.group.next().makeSucceededFuture(nil)
+        }
+
+        return functionCache.get(key: key, ctx).flatMap { responseID -> LLBFuture<LLBCASObject?> in
+            guard let responseID = responseID else {
+                return self.ctx.group.next().makeSucceededFuture(nil)
+            }
+            return self.ctx.db.get(responseID, self.ctx)
+        }.map { object in
+            // Responses that can't be read back are treated as misses, and the command runs again.
+            guard let object = object,
+                  let response = try? LLBActionExecutionResponse(serializedData: Data(object.data.readableBytesView)),
+                  response.outputs.count == key.request.outputs.count else {
+                return nil
+            }
+            return response
+        }
+    }
+
+    private func store(_ response: LLBActionExecutionResponse, for key: NinjaCommandCacheKey?) -> LLBFuture<Void> {
+        guard let functionCache = functionCache, let key = key else {
+            return ctx.group.next().makeSucceededFuture(())
+        }
+
+        let data: Data
+        do {
+            data = try response.serializedData()
+        } catch {
+            return ctx.group.next().makeFailedFuture(error)
+        }
+        return ctx.db.put(data: LLBByteBuffer.withBytes(ArraySlice(data)), ctx).flatMap { responseID in
+            functionCache.update(key: key, value: responseID, self.ctx)
+        }
+    }
+
+    /// Writes the outputs of a cached response into the build directory.
+    private func restoreOutputs(of request: LLBActionExecutionRequest, from response: LLBActionExecutionResponse) -> LLBFuture<Void> {
+        let client = LLBCASFSClient(ctx.db)
+        let outputFutures: [LLBFuture<Void>] = zip(request.outputs, response.outputs).map { (output, dataID) in
+            let outputPath = buildDirectory.appending(RelativePath(output.path))
+            return client.load(dataID, ctx).flatMap { node -> LLBFuture<Void> in
+                do {
+                    try localFileSystem.createDirectory(outputPath.parentDirectory, recursive: true)
+                    if localFileSystem.exists(outputPath, followSymlink: false) {
+                        try localFileSystem.removeFileTree(outputPath)
+                    }
+                } catch {
+                    return self.ctx.group.next().makeFailedFuture(error)
+                }
+
+                if node.type() == .directory {
+                    return LLBCASFileTree.export(dataID, from: self.ctx.db, to: .init(outputPath.pathString), self.ctx)
+                }
+                guard let blob = node.blob else {
+                    return self.ctx.group.next().makeFailedFuture(NinjaExecutionError.missingOutput(output.path))
+                }
+                return blob.read(self.ctx).flatMapThrowing { contents in
+                    try localFileSystem.writeFileContents(outputPath, bytes: ByteString(contents))
+                    if node.type() == .executable {
+                        try localFileSystem.chmod(.executable, path: outputPath)
+                    }
+                }
+            }
+        }
+        return LLBFuture.whenAllSucceed(outputFutures, on: ctx.group.next()).map { _ in () }
+    }
+}
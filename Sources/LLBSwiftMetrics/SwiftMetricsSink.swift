@@ -0,0 +1,52 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+
+import Metrics
+import NIOConcurrencyHelpers
+
+
+/// A metrics sink that forwards the metrics recorded by llbuild2 to swift-metrics, and so to the backend that the
+/// client bootstrapped with `MetricsSystem.bootstrap(_:)`. Counters are exported as `Counter`s and histograms as
+/// aggregating `Recorder`s, with the same labels and dimensions.
+///
+/// The handles are created on first use and reused, since creating them goes through the backend's factory.
+public final class LLBSwiftMetricsSink: LLBMetricsSink {
+    private let lock = Lock()
+    private var counters = [LLBInMemoryMetrics.MetricID: Counter]()
+    private var recorders = [LLBInMemoryMetrics.MetricID: Recorder]()
+
+    public init() {}
+
+    public func increment(counter label: String, by amount: Int64, dimensions: LLBMetricDimensions) {
+        let id = LLBInMemoryMetrics.MetricID(label, dimensions: dimensions)
+        let counter: Counter = lock.withLock {
+            if let counter = counters[id] {
+                return counter
+            }
+            let counter = Counter(label: label, dimensions: dimensions)
+            counters[id] = counter
+            return counter
+        }
+        counter.increment(by: amount)
+    }
+
+    public func record(histogram label: String, value: Double, dimensions: LLBMetricDimensions) {
+        let id = LLBInMemoryMetrics.MetricID(label, dimensions: dimensions)
+        let recorder: Recorder = lock.withLock {
+            if let recorder = recorders[id] {
+                return recorder
+            }
+            let recorder = Recorder(label: label, dimensions: dimensions, aggregate: true)
+            recorders[id] = recorder
+            return recorder
+        }
+        recorder.record(value)
+    }
+}
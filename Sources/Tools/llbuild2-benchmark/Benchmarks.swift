@@ -0,0 +1,193 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Dispatch
+import Foundation
+
+import llbuild2
+import LLBUtil
+import NIOConcurrencyHelpers
+import TSCBasic
+
+extension Int: LLBValue {}
+
+/// Keys of the synthetic graphs built through the engine.
+private struct GraphKey: LLBKey, Hashable {
+    enum Shape: UInt8 {
+        /// The root of a wide graph, which requests all of the leaves.
+        case wideRoot
+
+        /// A leaf of a wide graph.
+        case leaf
+
+        /// A node of a deep chain, which requests the previous node.
+        case chain
+    }
+
+    let shape: Shape
+    let index: Int
+
+    var stableHashValue: LLBDataID {
+        var bytes = [shape.rawValue]
+        withUnsafeBytes(of: Int64(index).littleEndian) { bytes += $0 }
+        return LLBDataID(blake3hash: LLBByteBuffer.withBytes(bytes[...]), refs: [])
+    }
+}
+
+private final class GraphDelegate: LLBEngineDelegate {
+    let width: Int
+
+    init(width: Int) {
+        self.width = width
+    }
+
+    func lookupFunction(forKey key: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunction> {
+        let key = key as! GraphKey
+        let width = self.width
+        let function: LLBFunction
+        switch key.shape {
+        case .wideRoot:
+            function = LLBSimpleFunction { (fi, _, ctx) in
+                let leaves = (0..<width).map { fi.request(GraphKey(shape: .leaf, index: $0), as: Int.self, ctx) }
+                return LLBFuture.whenAllSucceed(leaves, on: ctx.group.next()).map { $0.reduce(0, +) as LLBValue }
+            }
+        case .leaf:
+            function = LLBSimpleFunction { (_, key, ctx) in
+                ctx.group.next().makeSucceededFuture((key as! GraphKey).index as LLBValue)
+            }
+        case .chain:
+            function = LLBSimpleFunction { (fi, key, ctx) in
+                let index = (key as! GraphKey).index
+                guard index > 0 else {
+                    return ctx.group.next().makeSucceededFuture(0 as LLBValue)
+                }
+                return fi.request(GraphKey(shape: .chain, index: index - 1), as: Int.self, ctx).map { ($0 + 1) as LLBValue }
+            }
+        }
+        return ctx.group.next().makeSucceededFuture(function)
+    }
+}
+
+/// A key for the dependency graph benchmark, which avoids the cost of serializing strings.
+private struct EdgeKey: LLBKey, Hashable {
+    let index: Int
+
+    var stableHashValue: LLBDataID {
+        return withUnsafeBytes(of: Int64(index).littleEndian) { LLBDataID(directHash: Array($0)) }
+    }
+}
+
+enum Benchmarks {
+    static func engine(group: LLBFuturesDispatchGroup, width: Int, depth: Int) -> [Benchmark] {
+        return [
+            Benchmark("engine/wide/\(width)", operations: width + 1) { recorder in
+                let engine = LLBEngine(group: group, delegate: GraphDelegate(width: width))
+                try recorder.time {
+                    _ = try engine.build(key: GraphKey(shape: .wideRoot, index: 0), as: Int.self, Context()).wait()
+                }
+            },
+            Benchmark("engine/deep/\(depth)", operations: depth + 1) { recorder in
+                let engine = LLBEngine(group: group, delegate: GraphDelegate(width: 0))
+                try recorder.time {
+                    _ = try engine.build(key: GraphKey(shape: .chain, index: depth), as: Int.self, Context()).wait()
+                }
+            },
+        ]
+    }
+
+    /// Each thread adds a chain of edges to a shared graph, so that the threads contend on the graph but never form
+    /// cycles.
+    static func keyDependencyGraph(threads: Int, edgesPerThread: Int) -> [Benchmark] {
+        return [
+            Benchmark("dependency-graph/add-edge/\(threads)-threads", operations: threads * edgesPerThread) { recorder in
+                let graph = LLBKeyDependencyGraph()
+                let keys = (0..<(threads * (edgesPerThread + 1))).map { EdgeKey(index: $0) }
+                let failures = NIOAtomic<Int>.makeAtomic(value: 0)
+                recorder.time {
+                    DispatchQueue.concurrentPerform(iterations: threads) { thread in
+                        let base = thread * (edgesPerThread + 1)
+                        for i in 0..<edgesPerThread {
+                            if (try? graph.addEdge(from: keys[base + i], to: keys[base + i + 1])) == nil {
+                                _ = failures.add(1)
+                            }
+                        }
+                    }
+                }
+                precondition(failures.load() == 0, "unexpected cycle")
+            },
+        ]
+    }
+
+    static func functionCaches(group: LLBFuturesDispatchGroup, directory: AbsolutePath, count: Int) -> [Benchmark] {
+        let caches: [(String, () -> LLBFunctionCache)] = [
+            ("in-memory", { LLBInMemoryFunctionCache(group: group) }),
+            ("file-backed", { LLBFileBackedFunctionCache(group: group, path: directory.appending(component: "file-backed")) }),
+            ("log-structured", { LLBLogStructuredFunctionCache(group: group, path: directory.appending(component: "log-structured")) }),
+        ]
+
+        let keys = (0..<count).map { "key\($0)" }
+        let value = LLBDataID(blake3hash: "value")
+
+        return caches.flatMap { (name, makeCache) -> [Benchmark] in
+            var cache = makeCache()
+            return [
+                Benchmark("function-cache/\(name)/update", operations: count, setUp: { cache = makeCache() }) { recorder in
+                    let ctx = Context()
+                    for key in keys {
+                        try recorder.time { try cache.update(key: key, value: value, ctx).wait() }
+                    }
+                },
+                // The get benchmark fills its own cache, so that it only measures hits even when it runs alone.
+                Benchmark("function-cache/\(name)/get", operations: count, setUp: {
+                    cache = makeCache()
+                    let ctx = Context()
+                    for key in keys {
+                        try cache.update(key: key, value: value, ctx).wait()
+                    }
+                }) { recorder in
+                    let ctx = Context()
+                    for key in keys {
+                        _ = try recorder.time { try cache.get(key: key, ctx).wait() }
+                    }
+                },
+            ]
+        }
+    }
+
+    static func cas(_ name: String, db: LLBCASDatabase, count: Int, size: Int) -> [Benchmark] {
+        precondition(size >= MemoryLayout<Int64>.size, "objects must be large enough to be unique")
+
+        // Each object is different, so that the database can't deduplicate the puts.
+        let objects = (0..<count).map { i -> LLBByteBuffer in
+            var bytes = [UInt8](repeating: 0, count: size)
+            withUnsafeBytes(of: Int64(i).littleEndian) { bytes.replaceSubrange(0..<$0.count, with: $0) }
+            return LLBByteBuffer.withBytes(bytes[...])
+        }
+        var ids = [LLBDataID]()
+
+        return [
+            Benchmark("cas/\(name)/put/\(size)B", operations: count) { recorder in
+                let ctx = Context()
+                for object in objects {
+                    _ = try recorder.time { try db.put(data: object, ctx).wait() }
+                }
+            },
+            // The get benchmark stores its own objects, outside of the timed iterations, so that it doesn't depend on
+            // the put benchmark having run.
+            Benchmark("cas/\(name)/get/\(size)B", operations: count, setUp: {
+                let ctx = Context()
+                ids = try objects.map { try db.put(data: $0, ctx).wait() }
+            }) { recorder in
+                let ctx = Context()
+                for id in ids {
+                    _ = try recorder.time { try db.get(id, ctx).wait() }
+                }
+            },
+        ]
+    }
+}
@@ -0,0 +1,173 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Dispatch
+import Foundation
+
+#if canImport(Darwin)
+import Darwin
+#else
+import Glibc
+#endif
+
+/// A benchmark, which runs `body` once per iteration. Each iteration performs `operations` operations, and records
+/// the latency of each of them (or of the whole iteration, for benchmarks that can't time operations individually)
+/// through the recorder.
+struct Benchmark {
+    let name: String
+    let operations: Int
+    let setUp: () throws -> Void
+    let body: (BenchmarkRecorder) throws -> Void
+
+    init(
+        _ name: String,
+        operations: Int,
+        setUp: @escaping () throws -> Void = {},
+        body: @escaping (BenchmarkRecorder) throws -> Void
+    ) {
+        self.name = name
+        self.operations = operations
+        self.setUp = setUp
+        self.body = body
+    }
+}
+
+/// Collects the latency samples of a benchmark.
+final class BenchmarkRecorder {
+    fileprivate var samples = [UInt64]()
+
+    /// Runs and times a single operation (or batch of operations).
+    @discardableResult
+    func time<T>(_ body: () throws -> T) rethrows -> T {
+        let start = DispatchTime.now().uptimeNanoseconds
+        let result = try body()
+        samples.append(DispatchTime.now().uptimeNanoseconds - start)
+        return result
+    }
+}
+
+/// The measurements of a benchmark across all of its iterations.
+struct BenchmarkResult: Codable {
+    let name: String
+    let operations: Int
+
+    /// Operations per second over the total duration of the iterations.
+    let throughput: Double
+
+    /// Latency percentiles of the recorded samples, in nanoseconds.
+    let p50: UInt64
+    let p99: UInt64
+
+    /// Average number of bytes per operation that were still allocated at the end of each iteration. This is the net
+    /// growth of the heap, which catches leaks and retained caches, and not the number or size of the allocations made
+    /// by the operations (counting those needs malloc hooks or allocator statistics that aren't portable).
+    let retainedHeapBytesPerOperation: Double
+}
+
+/// The number of bytes currently allocated by malloc, including the large allocations that it serves with mmap.
+struct HeapUsage {
+    let bytes: Int
+
+    static func current() -> HeapUsage {
+        #if canImport(Darwin)
+        var statistics = malloc_statistics_t()
+        malloc_zone_statistics(nil, &statistics)
+        return HeapUsage(bytes: Int(statistics.size_in_use))
+        #else
+        // mallinfo2() needs glibc 2.33, so this uses mallinfo(), whose fields are ints that wrap around past 2GB. The
+        // difference of two readings is still exact as long as the heap changes by less than that in between.
+        let info = mallinfo()
+        return HeapUsage(bytes: Int(UInt32(bitPattern: info.uordblks &+ info.hblkhd)))
+        #endif
+    }
+
+    /// The number of bytes allocated since `earlier`.
+    func growth(since earlier: HeapUsage) -> Int {
+        #if canImport(Darwin)
+        return bytes - earlier.bytes
+        #else
+        return Int(Int32(truncatingIfNeeded: bytes &- earlier.bytes))
+        #endif
+    }
+}
+
+/// Runs benchmarks and reports their results.
+struct BenchmarkRunner {
+    let iterations: Int
+    let warmupIterations: Int
+
+    func run(_ benchmark: Benchmark) throws -> BenchmarkResult {
+        try benchmark.setUp()
+
+        for _ in 0..<warmupIterations {
+            try benchmark.body(BenchmarkRecorder())
+        }
+
+        let recorder = BenchmarkRecorder()
+        var totalDuration: UInt64 = 0
+        var heapBytes = 0
+        for _ in 0..<iterations {
+            let heapBefore = HeapUsage.current()
+            let start = DispatchTime.now().uptimeNanoseconds
+            try benchmark.body(recorder)
+            totalDuration += DispatchTime.now().uptimeNanoseconds - start
+            let heapAfter = HeapUsage.current()
+            heapBytes += heapAfter.growth(since: heapBefore)
+        }
+
+        let samples = recorder.samples.sorted()
+        let operations = Double(benchmark.operations * iterations)
+        return BenchmarkResult(
+            name: benchmark.name,
+            operations: benchmark.operations,
+            throughput: totalDuration == 0 ? 0 : operations / (Double(totalDuration) / 1_000_000_000),
+            p50: BenchmarkRunner.percentile(samples, 0.50),
+            p99: BenchmarkRunner.percentile(samples, 0.99),
+            retainedHeapBytesPerOperation: Double(heapBytes) / operations
+        )
+    }
+
+    private static func percentile(_ sortedSamples: [UInt64], _ fraction: Double) -> UInt64 {
+        guard !sortedSamples.isEmpty else {
+            return 0
+        }
+        let index = Int((Double(sortedSamples.count - 1) * fraction).rounded())
+        return sortedSamples[index]
+    }
+
+    static func printHeader() {
+        print(pad("benchmark", 40) + pad("ops/s", 14) + pad("p50", 12) + pad("p99", 12) + "retained B/op")
+    }
+
+    static func printResult(_ result: BenchmarkResult) {
+        print(
+            pad(result.name, 40)
+                + pad(String(format: "%.0f", result.throughput), 14)
+                + pad(formatDuration(result.p50), 12)
+                + pad(formatDuration(result.p99), 12)
+                + String(format: "%.1f", result.retainedHeapBytesPerOperation)
+        )
+    }
+
+    private static func pad(_ string: String, _ width: Int) -> String {
+        return string.count >= width ? string + " " : string + String(repeating: " ", count: width - string.count)
+    }
+
+    private static func formatDuration(_ nanoseconds: UInt64) -> String {
+        switch nanoseconds {
+        case ..<1_000:
+            return "\(nanoseconds)ns"
+        case ..<1_000_000:
+            return String(format: "%.1fus", Double(nanoseconds) / 1_000)
+        case ..<1_000_000_000:
+            return String(format: "%.1fms", Double(nanoseconds) / 1_000_000)
+        default:
+            return String(format: "%.2fs", Double(nanoseconds) / 1_000_000_000)
+        }
+    }
+}
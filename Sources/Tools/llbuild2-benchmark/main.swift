@@ -0,0 +1,90 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import ArgumentParser
+import Foundation
+
+import llbuild2
+import LLBBazelBackend
+import TSCBasic
+
+struct llbuild2Benchmark: ParsableCommand {
+    static var configuration = CommandConfiguration(
+        commandName: "llbuild2-benchmark",
+        abstract: "llbuild2 microbenchmarks for the engine, the dependency graph, the function caches and the CAS")
+
+    @Option(help: "Only run the benchmarks whose name contains this string")
+    var filter: String?
+
+    @Option(help: "The number of measured iterations of each benchmark")
+    var iterations: Int = 10
+
+    @Option(help: "The number of unmeasured iterations run before the measured ones")
+    var warmupIterations: Int = 2
+
+    @Option(help: "The number of keys requested by the wide engine graph")
+    var width: Int = 10_000
+
+    @Option(help: "The length of the deep engine graph")
+    var depth: Int = 1_000
+
+    @Option(help: "The number of threads adding edges to the dependency graph")
+    var threads: Int = 8
+
+    @Option(help: "The number of operations of the function cache and CAS benchmarks")
+    var count: Int = 1_000
+
+    @Option(help: "The size of the CAS objects, in bytes")
+    var objectSize: Int = 1024
+
+    @Option(help: "The URL of a CAS database to benchmark besides the in-memory one, e.g. bazel://localhost:8980")
+    var casURL: String?
+
+    @Option(help: "Write the results as JSON to this path, to compare them across runs")
+    var json: String?
+
+    func run() throws {
+        let group = LLBMakeDefaultDispatchGroup()
+
+        try withTemporaryDirectory(removeTreeOnDeinit: true) { directory in
+            var benchmarks = Benchmarks.engine(group: group, width: width, depth: depth)
+            benchmarks += Benchmarks.keyDependencyGraph(threads: threads, edgesPerThread: count)
+            benchmarks += Benchmarks.functionCaches(group: group, directory: directory, count: count)
+            benchmarks += Benchmarks.cas("in-memory", db: LLBInMemoryCASDatabase(group: group), count: count, size: objectSize)
+            if let casURL = casURL {
+                guard let url = URL(string: casURL) else {
+                    throw StringError("invalid CAS database URL: \(casURL)")
+                }
+                let db = try LLBCASDatabaseSpec(url).open(group: group)
+                benchmarks += Benchmarks.cas(url.scheme ?? "remote", db: db, count: count, size: objectSize)
+            }
+            if let filter = filter {
+                benchmarks = benchmarks.filter { $0.name.contains(filter) }
+            }
+
+            let runner = BenchmarkRunner(iterations: iterations, warmupIterations: warmupIterations)
+            var results = [BenchmarkResult]()
+            BenchmarkRunner.printHeader()
+            for benchmark in benchmarks {
+                let result = try runner.run(benchmark)
+                BenchmarkRunner.printResult(result)
+                results.append(result)
+            }
+
+            if let json = json {
+                let encoder = JSONEncoder()
+                encoder.outputFormatting = .prettyPrinted
+                try encoder.encode(results).write(to: URL(fileURLWithPath: json))
+            }
+        }
+    }
+}
+
+LLBBazelBackend.registerCASSchemes()
+
+llbuild2Benchmark.main()
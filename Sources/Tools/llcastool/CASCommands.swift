@@ -69,6 +69,78 @@ struct CASGet: ParsableCommand {
     }
 }
 
+struct CASImport: ParsableCommand {
+    static let configuration: CommandConfiguration = CommandConfiguration(
+        commandName: "import",
+        abstract: "Import a directory tree into the CAS database"
+    )
+
+    @OptionGroup()
+    var options: CommonOptions
+
+    @Argument()
+    var path: AbsolutePath
+
+    func run() throws {
+        let group = LLBMakeDefaultDispatchGroup()
+        let ctx = Context()
+        let toolOptions = self.options.toToolOptions()
+        let tool = try LLBCASTool(group: group, toolOptions)
+
+        let dataID = try withProgress(of: tool, verb: "uploaded") {
+            try tool.casImport(directory: path, ctx).wait()
+        }
+        print(dataID)
+    }
+}
+
+struct CASExport: ParsableCommand {
+    static let configuration: CommandConfiguration = CommandConfiguration(
+        commandName: "export",
+        abstract: "Export a directory tree from the CAS database given its data id"
+    )
+
+    @OptionGroup()
+    var options: CommonOptions
+
+    @Option()
+    var id: String
+
+    @Argument()
+    var path: AbsolutePath
+
+    func run() throws {
+        guard let id = LLBDataID(string: self.id) else {
+            throw StringError("Invalid data id \(self.id)")
+        }
+
+        let group = LLBMakeDefaultDispatchGroup()
+        let ctx = Context()
+        let toolOptions = self.options.toToolOptions()
+        let tool = try LLBCASTool(group: group, toolOptions)
+        try withProgress(of: tool, verb: "downloaded") {
+            try tool.casExport(id: id, to: path, ctx).wait()
+        }
+    }
+}
+
+/// Runs a bulk transfer while reporting its progress on stderr, followed by a summary of its throughput.
+private func withProgress<T>(of tool: LLBCASTool, verb: String, _ body: () throws -> T) rethrows -> T {
+    func report(_ stats: LLBCASToolTransferStats, terminator: String) {
+        let bytes = prettyFileSize(UInt64(stats.bytes))
+        let rate = prettyFileSize(UInt64(stats.bytesPerSecond))
+        stderrStream <<< "\r\(verb) \(stats.objects) objects, \(bytes) in \(Int(stats.elapsed))s (\(rate)/s)" <<< terminator
+        stderrStream.flush()
+    }
+
+    let progress = tool.reportProgress { report($0, terminator: "") }
+    defer {
+        progress.cancel()
+        report(tool.transferStats, terminator: "\n")
+    }
+    return try body()
+}
+
 func prettyFileSize(_ size: UInt64) -> String {
     if size < 100_000 {
         return "\(size) bytes"
@@ -14,12 +14,16 @@ import TSCUtility
 struct CommonOptions: ParsableArguments {
     @Option(help: "The CAS database URL to use")
     var url: Foundation.URL
+
+    @Option(help: "The maximum number of CAS requests in flight during imports and exports")
+    var maxConcurrentTransfers: Int = 64
 }
 
 extension CommonOptions {
     func toToolOptions() -> LLBCASToolOptions {
         return LLBCASToolOptions(
-            url: url
+            url: url,
+            maxConcurrentTransfers: maxConcurrentTransfers
         )
     }
 }
@@ -17,7 +17,9 @@ struct llcastoolCommand: ParsableCommand {
         abstract: "llcastool — cas manipulation tools",
         subcommands: [
             Capabilities.self,
+            CASExport.self,
             CASGet.self,
+            CASImport.self,
             CASPut.self,
         ]
     )
@@ -0,0 +1,191 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import NIOConcurrencyHelpers
+
+/// The record of the last evaluation of a key, used to skip evaluations whose dependencies haven't changed.
+struct LLBEvaluationTrace {
+    /// The value produced by the evaluation.
+    let value: LLBValue
+
+    /// The ID of the value, as identified by the CAS database.
+    let valueID: LLBDataID
+
+    /// The keys requested by the evaluation, in request order, with the IDs of the values they had at the time. Empty
+    /// if the evaluation had no dependencies or if some of them didn't complete, in which case it can't be cut off.
+    let dependencies: [(key: LLBInternedKey, valueID: LLBDataID)]
+}
+
+/// The evaluation traces of an engine running in early cutoff mode.
+///
+/// With `maxTraces`, the least recently used traces are dropped once there are that many. Keys without a trace (or
+/// whose dependencies lost theirs) are evaluated again, so this only costs evaluations.
+final class LLBEvaluationTraces {
+    let maxTraces: Int?
+
+    private let lock = Lock()
+    private let traces: LLBBoundedLRU<LLBInternedKey, LLBEvaluationTrace>
+    private var cutoffs = 0
+
+    init(maxTraces: Int? = nil) {
+        self.maxTraces = maxTraces
+        self.traces = LLBBoundedLRU(capacity: maxTraces)
+    }
+
+    /// The number of evaluations that were skipped because their dependencies hadn't changed.
+    var cutoffCount: Int {
+        return lock.withLock { cutoffs }
+    }
+
+    subscript(key: LLBInternedKey) -> LLBEvaluationTrace? {
+        get {
+            return lock.withLock { traces[key] }
+        }
+        set {
+            lock.withLockVoid {
+                if let trace = newValue {
+                    traces.insert(trace, for: key)
+                } else {
+                    traces.removeValue(forKey: key)
+                }
+            }
+        }
+    }
+
+    /// The number of keys with a trace.
+    var count: Int {
+        return lock.withLock { traces.count }
+    }
+
+    func removeAll() {
+        lock.withLockVoid { traces.removeAll() }
+    }
+
+    func recordCutoff() {
+        lock.withLockVoid { cutoffs += 1 }
+    }
+}
+
+/// Records the keys requested by a function evaluation, in the order they were first requested.
+final class LLBDependencyRecorder {
+    private let lock = Lock()
+    private var keys = [LLBInternedKey]()
+    private var requested = Set<LLBInternedKey>()
+    private var completed = Set<LLBInternedKey>()
+
+    func recordRequest(_ key: LLBInternedKey) {
+        lock.withLockVoid {
+            if requested.insert(key).inserted {
+                keys.append(key)
+            }
+        }
+    }
+
+    func recordCompletion(_ key: LLBInternedKey) {
+        lock.withLockVoid {
+            _ = completed.insert(key)
+        }
+    }
+
+    /// The requested keys, or nil if some of them haven't completed successfully, since the values they will have
+    /// are unknown.
+    var dependencies: [LLBInternedKey]? {
+        return lock.withLock {
+            completed.count == keys.count ? keys : nil
+        }
+    }
+}
+
+extension LLBEngine {
+    /// Evaluates the key, reusing the value of its last evaluation if all of the values it requested are unchanged.
+    ///
+    /// Dependencies are verified in the order they were requested, and verification stops at the first one that
+    /// changed, since later requests may depend on the values of earlier ones. Keys without dependencies (which are the
+    /// ones that read the state outside of the engine) are always evaluated.
+    func computeWithEarlyCutoff(
+        _ function: LLBFunction,
+        key: LLBInternedKey,
+        traces: LLBEvaluationTraces,
+        _ ctx: Context
+    ) -> LLBFuture<LLBValue> {
+        guard let trace = traces[key], !trace.dependencies.isEmpty else {
+            return computeAndTrace(function, key: key, traces: traces, ctx)
+        }
+
+        let fi = LLBFunctionInterface(engine: self, key: key)
+        return verify(trace.dependencies[...], fi, traces: traces, ctx).flatMap { unchanged in
+            if unchanged {
+                ctx.logger?.trace("    unchanged \(key.key.logDescription())")
+                traces.recordCutoff()
+                return ctx.group.next().makeSucceededFuture(trace.value)
+            }
+            return self.computeAndTrace(function, key: key, traces: traces, ctx)
+        }
+    }
+
+    private func verify(
+        _ dependencies: ArraySlice<(key: LLBInternedKey, valueID: LLBDataID)>,
+        _ fi: LLBFunctionInterface,
+        traces: LLBEvaluationTraces,
+        _ ctx: Context
+    ) -> LLBFuture<Bool> {
+        guard let dependency = dependencies.first else {
+            return ctx.group.next().makeSucceededFuture(true)
+        }
+
+        return fi.request(dependency.key, ctx).map { _ in
+            traces[dependency.key]?.valueID == dependency.valueID
+        }.recover { _ in
+            // Failing dependencies are treated as changed, so that the error is surfaced by the evaluation itself.
+            false
+        }.flatMap { unchanged in
+            guard unchanged else {
+                return ctx.group.next().makeSucceededFuture(false)
+            }
+            return self.verify(dependencies.dropFirst(), fi, traces: traces, ctx)
+        }
+    }
+
+    private func computeAndTrace(
+        _ function: LLBFunction,
+        key: LLBInternedKey,
+        traces: LLBEvaluationTraces,
+        _ ctx: Context
+    ) -> LLBFuture<LLBValue> {
+        let recorder = LLBDependencyRecorder()
+        let fi = LLBFunctionInterface(engine: self, key: key, recorder: recorder)
+
+        return function.compute(key: key.key, fi, ctx).flatMap { value -> LLBFuture<LLBValue> in
+            let object: LLBCASObject
+            do {
+                object = try value.asCASObject()
+            } catch {
+                return ctx.group.next().makeFailedFuture(error)
+            }
+
+            return ctx.db.identify(refs: object.refs, data: object.data, ctx).map { valueID -> LLBValue in
+                var dependencies = [(key: LLBInternedKey, valueID: LLBDataID)]()
+                for dependency in recorder.dependencies ?? [] {
+                    guard let dependencyID = traces[dependency]?.valueID else {
+                        dependencies = []
+                        break
+                    }
+                    dependencies.append((key: dependency, valueID: dependencyID))
+                }
+
+                // The trace must be recorded before the value is returned, since the keys that requested it read the
+                // value ID from the trace when they complete.
+                traces[key] = LLBEvaluationTrace(value: value, valueID: valueID, dependencies: dependencies)
+                return value
+            }
+        }.flatMapErrorThrowing { error in
+            traces[key] = nil
+            throw error
+        }
+    }
+}
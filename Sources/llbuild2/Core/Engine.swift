@@ -8,6 +8,7 @@
 
 import Foundation
 
+import NIO
 import NIOConcurrencyHelpers
 import TSCUtility
 
@@ -39,7 +40,11 @@ public class LLBFunctionInterface {
     @usableFromInline
     let engine: LLBEngine
 
-    let key: LLBKey
+    /// The interned key being evaluated by the function using this interface.
+    let key: LLBInternedKey
+
+    /// Records the keys requested through this interface, when the engine runs in early cutoff mode.
+    private let recorder: LLBDependencyRecorder?
 
     /// The function execution cache
     @inlinable
@@ -49,37 +54,55 @@ public class LLBFunctionInterface {
     @inlinable
     public var registry: LLBSerializableLookup { return engine.registry }
 
-    init(engine: LLBEngine, key: LLBKey) {
+    init(engine: LLBEngine, key: LLBInternedKey, recorder: LLBDependencyRecorder? = nil) {
         self.engine = engine
         self.key = key
+        self.recorder = recorder
     }
 
     public func request(_ key: LLBKey, _ ctx: Context) -> LLBFuture<LLBValue> {
-        do {
-            try engine.keyDependencyGraph.addEdge(from: self.key, to: key)
-        } catch {
-            return ctx.group.next().makeFailedFuture(error)
+        // Once the build is cancelled, requests fail right away instead of waiting on evaluations that are winding down.
+        if let reason = ctx.cancellationToken?.reason {
+            return ctx.group.next().makeFailedFuture(LLBCancellationError.cancelled(reason))
         }
-        let future = engine.build(key: key, ctx)
-        future.whenComplete { _ in
-            self.engine.keyDependencyGraph.removeEdge(from: self.key, to: key)
+        let internedKey = LLBInternedKey(key)
+        guard let recorder = recorder else {
+            return request(internedKey: internedKey, ctx)
+        }
+        recorder.recordRequest(internedKey)
+        let future = request(internedKey: internedKey, ctx)
+        future.whenSuccess { _ in
+            recorder.recordCompletion(internedKey)
         }
         return future
     }
 
-    public func request<V: LLBValue>(_ key: LLBKey, as type: V.Type = V.self, _ ctx: Context) -> LLBFuture<V> {
+    private func request(internedKey: LLBInternedKey, _ ctx: Context) -> LLBFuture<LLBValue> {
+        ctx.tracer?.recordDependency(from: self.key, to: internedKey)
+        guard let keyDependencyGraph = engine.keyDependencyGraph else {
+            return engine.build(internedKey: internedKey, ctx)
+        }
         do {
-            try engine.keyDependencyGraph.addEdge(from: self.key, to: key)
+            try keyDependencyGraph.addEdge(from: self.key, to: internedKey)
         } catch {
             return ctx.group.next().makeFailedFuture(error)
         }
-        let future = engine.build(key: key, as: type, ctx)
+        let future = engine.build(internedKey: internedKey, ctx)
         future.whenComplete { _ in
-            self.engine.keyDependencyGraph.removeEdge(from: self.key, to: key)
+            keyDependencyGraph.removeEdge(from: self.key, to: internedKey)
         }
         return future
     }
 
+    public func request<V: LLBValue>(_ key: LLBKey, as type: V.Type = V.self, _ ctx: Context) -> LLBFuture<V> {
+        return request(key, ctx).flatMapThrowing {
+            guard let value = $0 as? V else {
+                throw LLBError.invalidValueType("Expected value of type \(V.self)")
+            }
+            return value
+        }
+    }
+
     public func spawn(_ action: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse> {
         return engine.executor.execute(request: action, ctx)
     }
@@ -89,9 +112,37 @@ public protocol LLBFunction {
     func compute(key: LLBKey, _ fi: LLBFunctionInterface, _ ctx: Context) -> LLBFuture<LLBValue>
 }
 
+/// A function cache entry, which contains the ID of the value and optionally the value itself, for caches that can
+/// store small values inline and save the round trip to the CAS database.
+public struct LLBFunctionCacheEntry {
+    public var id: LLBDataID
+    public var object: LLBCASObject?
+
+    public init(id: LLBDataID, object: LLBCASObject? = nil) {
+        self.id = id
+        self.object = object
+    }
+}
+
 public protocol LLBFunctionCache {
     func get(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBDataID?>
     func update(key: LLBKey, value: LLBDataID, _ ctx: Context) -> LLBFuture<Void>
+
+    /// Returns the entry for the key, which includes the value itself if the cache stored it inline.
+    func getEntry(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunctionCacheEntry?>
+
+    /// Updates the entry for the key. The cache may store the object inline, but is not required to.
+    func update(key: LLBKey, entry: LLBFunctionCacheEntry, _ ctx: Context) -> LLBFuture<Void>
+}
+
+public extension LLBFunctionCache {
+    func getEntry(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunctionCacheEntry?> {
+        return get(key: key, ctx).map { $0.map { LLBFunctionCacheEntry(id: $0) } }
+    }
+
+    func update(key: LLBKey, entry: LLBFunctionCacheEntry, _ ctx: Context) -> LLBFuture<Void> {
+        return update(key: key, value: entry.id, ctx)
+    }
 }
 
 open class LLBTypedCachingFunction<K: LLBKey, V: LLBValue>: LLBFunction {
@@ -99,21 +150,52 @@ open class LLBTypedCachingFunction<K: LLBKey, V: LLBValue>: LLBFunction {
 
     private func computeAndUpdate(key: K, _ fi: LLBFunctionInterface, _ ctx: Context) -> LLBFuture<LLBValue> {
         return self.compute(key: key, fi, ctx).flatMap { (value: LLBValue) in
+            let object: LLBCASObject
             do {
-                return ctx.db.put(try value.asCASObject(), ctx).flatMap { resultID in
-                    return fi.functionCache.update(key: key, value: resultID, ctx).map {
-                        return value
-                    }
-                }
+                object = try value.asCASObject()
             } catch {
                 return ctx.group.next().makeFailedFuture(error)
             }
+            return ctx.traced("CAS put", category: .cas) {
+                self.store(object, ctx)
+            }.flatMap { resultID in
+                let entry = LLBFunctionCacheEntry(id: resultID, object: object)
+                return ctx.traced("function cache update", category: .functionCache) {
+                    fi.functionCache.update(key: fi.key, entry: entry, ctx)
+                }.map {
+                    return value
+                }
+            }
         }.map { (value: LLBValue) in
             ctx.logger?.trace("    evaluated \(key.logDescription())")
             return value
         }
     }
 
+    /// Stores the object in the database unless it is already there. Values are frequently recomputed with the same
+    /// result (e.g. after an upstream change that doesn't affect them), in which case this avoids uploading them again.
+    private func store(_ object: LLBCASObject, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return ctx.db.identify(refs: object.refs, data: object.data, ctx).flatMap { id in
+            return ctx.db.contains(id, ctx).flatMap { contained in
+                if contained {
+                    return ctx.group.next().makeSucceededFuture(id)
+                }
+                return ctx.db.put(knownID: id, refs: object.refs, data: object.data, ctx)
+            }
+        }
+    }
+
+    /// Decodes a cached value, reusing the value decoded for the same object by earlier evaluations (e.g. of keys that
+    /// were evicted from memory, or before the results were invalidated) if the value type is `LLBCachedDecodedValue`.
+    private func unpack(_ object: LLBCASObject, id: LLBDataID, _ fi: LLBFunctionInterface) throws -> V {
+        guard V.self is LLBCachedDecodedValue.Type, let cache = fi.registry.decodedValues else {
+            return try unpack(object, fi)
+        }
+        return try cache.value(for: id) {
+            try unpack(object, fi)
+        }
+    }
+
     private func unpack(_ object: LLBCASObject, _ fi: LLBFunctionInterface) throws -> V {
         if
             let type = V.self as? LLBPolymorphicSerializable.Type,
@@ -138,22 +220,46 @@ open class LLBTypedCachingFunction<K: LLBKey, V: LLBValue>: LLBFunction {
 
         ctx.logger?.trace("evaluating \(key.logDescription())")
 
-        return fi.functionCache.get(key: key, ctx).flatMap { result -> LLBFuture<LLBValue> in
-            if let resultID = result {
-                return ctx.db.get(resultID, ctx).flatMap { objectOpt in
-                    guard let object = objectOpt else {
-                        return self.computeAndUpdate(key: typedKey, fi, ctx)
-                    }
-                    do {
-                        let value: V = try self.unpack(object, fi)
-                        ctx.logger?.trace("    cached \(key.logDescription())")
-                        return ctx.group.next().makeSucceededFuture(value)
-                    } catch {
-                        return ctx.group.next().makeFailedFuture(error)
-                    }
+        // Use the interned key from the function interface so that the function cache doesn't need to rehash the key.
+        let dimensions = [("key_type", String(describing: K.self))]
+        return ctx.traced("function cache get", category: .functionCache) {
+            guard let metrics = ctx.metrics else {
+                return fi.functionCache.getEntry(key: fi.key, ctx)
+            }
+            return metrics.time(LLBMetricLabel.functionCacheLookupDuration, dimensions: dimensions) {
+                fi.functionCache.getEntry(key: fi.key, ctx)
+            }
+        }.flatMap { result -> LLBFuture<LLBValue> in
+            guard let entry = result else {
+                ctx.metrics?.increment(counter: LLBMetricLabel.functionCacheMisses, dimensions: dimensions)
+                return self.computeAndUpdate(key: typedKey, fi, ctx)
+            }
+
+            // Values stored inline in the function cache don't need to be fetched from the database.
+            let objectFuture: LLBFuture<LLBCASObject?>
+            if let object = entry.object {
+                objectFuture = ctx.group.next().makeSucceededFuture(object)
+            } else {
+                objectFuture = ctx.traced("CAS get", category: .cas) {
+                    ctx.db.get(entry.id, ctx)
+                }
+            }
+
+            return objectFuture.flatMap { objectOpt in
+                guard let object = objectOpt else {
+                    // The value is no longer in the database, which needs a new evaluation just like a miss.
+                    ctx.metrics?.increment(counter: LLBMetricLabel.functionCacheMisses, dimensions: dimensions)
+                    return self.computeAndUpdate(key: typedKey, fi, ctx)
+                }
+                ctx.metrics?.increment(counter: LLBMetricLabel.functionCacheHits, dimensions: dimensions)
+                do {
+                    let value: V = try self.unpack(object, id: entry.id, fi)
+                    ctx.logger?.trace("    cached \(key.logDescription())")
+                    return ctx.group.next().makeSucceededFuture(value)
+                } catch {
+                    return ctx.group.next().makeFailedFuture(error)
                 }
             }
-            return self.computeAndUpdate(key: typedKey, fi, ctx)
         }
     }
 
@@ -177,32 +283,20 @@ public enum LLBError: Error {
     case unexpectedKeyType(String)
 }
 
-internal struct Key {
-    let key: LLBKey
-
-    init(_ key: LLBKey) {
-        self.key = key
-    }
-}
-extension Key: Hashable {
-    func hash(into hasher: inout Hasher) {
-        key.hash(into: &hasher)
-    }
-    static func ==(lhs: Key, rhs: Key) -> Bool {
-        return lhs.key.hashValue == rhs.key.hashValue
-    }
-}
-
-
 public class LLBEngine {
     private let group: LLBFuturesDispatchGroup
     private let delegate: LLBEngineDelegate
     private let db: LLBCASDatabase
+    private let metricsDB: LLBMetricsCASDatabase
     fileprivate let executor: LLBExecutor
-    fileprivate let pendingResults: LLBEventualResultsCache<Key, LLBValue>
-    fileprivate let keyDependencyGraph = LLBKeyDependencyGraph()
+    fileprivate let pendingResults: LLBEngineResultsCache
+    fileprivate let keyDependencyGraph: LLBKeyDependencyGraph?
+    private let traces: LLBEvaluationTraces?
+    private let scheduler: LLBEngineScheduler
+    private let schedulerHops = NIOAtomic<Int>.makeAtomic(value: 0)
     @usableFromInline internal let registry = LLBSerializableRegistry()
     @usableFromInline internal let functionCache: LLBFunctionCache
+    private let keepGoing: Bool
 
 
     public enum InternalError: Swift.Error {
@@ -216,34 +310,164 @@ public class LLBEngine {
         delegate: LLBEngineDelegate,
         db: LLBCASDatabase? = nil,
         executor: LLBExecutor = LLBNullExecutor(),
-        functionCache: LLBFunctionCache? = nil
+        functionCache: LLBFunctionCache? = nil,
+        detectCycles: Bool = true,
+        maxResidentEntries: Int? = nil,
+        earlyCutoff: Bool = false,
+        maxEvaluationTraces: Int? = nil,
+        scheduler: LLBEngineScheduler = LLBRoundRobinEngineScheduler(),
+        keepGoing: Bool = false
     ) {
         self.group = group
+        self.scheduler = scheduler
         self.delegate = delegate
         self.db = db ?? LLBInMemoryCASDatabase(group: group)
+        // In metrics mode, evaluations use a wrapper that records the operations in the metrics of their context.
+        self.metricsDB = LLBMetricsCASDatabase(self.db)
         self.executor = executor
-        self.pendingResults = LLBEventualResultsCache<Key, LLBValue>(group: group)
+        // Completed results are kept in memory so that repeated requests don't need to go through the function cache.
+        // Long-lived engines can bound how many are kept, with the evicted ones being reloaded from the function cache
+        // (or recomputed, for functions that aren't cached) on their next request.
+        self.pendingResults = LLBEngineResultsCache(group: group, maxResidentEntries: maxResidentEntries)
         self.functionCache = functionCache ?? LLBInMemoryFunctionCache(group: group)
+        // Cycle detection can be disabled for trusted builds that are known to be acyclic, which avoids all of the
+        // dependency graph bookkeeping on each request.
+        self.keyDependencyGraph = detectCycles ? LLBKeyDependencyGraph() : nil
+        // In early cutoff mode, the engine records the dependencies of each evaluation and the IDs of their values, so
+        // that evaluations whose dependencies are unchanged can be skipped after the results are invalidated. Traces
+        // keep the last value of each key, so this mode trades memory for evaluations; long-lived engines can bound how
+        // many are kept.
+        self.traces = earlyCutoff ? LLBEvaluationTraces(maxTraces: maxEvaluationTraces) : nil
+        // Unless the engine keeps going, a failed build cancels the context's cancellation token (if any), so that the
+        // rest of the build stops instead of evaluating keys whose results won't be used.
+        self.keepGoing = keepGoing
 
         delegate.registerTypes(registry: registry)
     }
 
-    /// Populate context with engine provided values
-    private func engineContext(_ ctx: Context) -> Context {
+    /// Populate context with engine provided values. The futures of the evaluation use the group of the engine, or are
+    /// pinned to the event loop of the evaluation if the scheduler asks for it.
+    private func engineContext(_ ctx: Context, on eventLoop: EventLoop) -> Context {
         var ctx = ctx
         ctx.group = self.group
-        ctx.db = self.db
+        ctx.evaluationEventLoop = eventLoop
+        if scheduler.pinsEvaluations {
+            ctx.group = LLBPinnedEventLoopGroup(eventLoop)
+        }
+        ctx.db = ctx.metrics == nil ? self.db : self.metricsDB
         return ctx
     }
 
+    /// Statistics about the results currently held in memory by the engine.
+    public var stats: LLBEngineStats {
+        var stats = pendingResults.stats
+        stats.earlyCutoffs = traces?.cutoffCount ?? 0
+        stats.evaluationTraces = traces?.count ?? 0
+        stats.schedulerHops = schedulerHops.load()
+        return stats
+    }
+
+    /// Drops all of the completed results, so that keys are evaluated again on their next request. This is meant for
+    /// long-lived engines whose functions read state that can change between builds. In early cutoff mode, only the
+    /// keys without dependencies and the ones whose dependencies changed are evaluated again.
+    public func invalidateResults() {
+        pendingResults.removeAllCompleted()
+    }
+
+    /// Drops the evaluation traces of early cutoff mode, releasing the values they hold. Keys are evaluated again on
+    /// their next request instead of being cut off, so this is only meant for freeing memory between builds.
+    public func clearEvaluationTraces() {
+        traces?.removeAll()
+    }
+
     public func build(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBValue> {
-        let ctx = engineContext(ctx)
-        return self.pendingResults.value(for: Key(key)) { _ in
-            return self.delegate.lookupFunction(forKey: key, ctx).flatMap { function in
-                let fi = LLBFunctionInterface(engine: self, key: key)
-                return function.compute(key: key, fi, ctx)
+        let future = build(internedKey: LLBInternedKey(key), ctx)
+        if !keepGoing, let token = ctx.cancellationToken {
+            future.whenFailure { error in
+                token.cancel(reason: "building \(key) failed: \(error)")
             }
         }
+        return future
+    }
+
+    internal func build(internedKey: LLBInternedKey, _ ctx: Context) -> LLBFuture<LLBValue> {
+        let requester = ctx.evaluationEventLoop
+        let requesterToken = ctx.cancellationToken
+
+        // Requests for a key that is already being evaluated share the evaluation, which has its own token that is only
+        // cancelled once all of the requesters are.
+        let future = self.pendingResults.value(for: internedKey, requester: requesterToken) { _, token in
+            let placed = self.scheduler.eventLoop(for: internedKey.key, requester: requester, group: self.group)
+            if let requester = requester, requester !== placed {
+                self.schedulerHops.add(1)
+            }
+
+            // The scheduler may delay the start of the evaluation, or move it to another loop before it starts.
+            let promise = placed.makePromise(of: LLBValue.self)
+            self.scheduler.start(internedKey.key, on: placed) { eventLoop in
+                if eventLoop !== placed {
+                    self.schedulerHops.add(1)
+                }
+                promise.completeWith(self.evaluate(internedKey, on: eventLoop, token: token, ctx))
+            }
+            return promise.futureResult
+        }
+
+        guard let token = requesterToken else {
+            return future
+        }
+
+        // A cancelled requester stops waiting right away, even if the evaluation goes on for other requesters.
+        let promise = ctx.group.next().makePromise(of: LLBValue.self)
+        let completed = NIOAtomic<Bool>.makeAtomic(value: false)
+        let handle = token.onCancel { reason in
+            if completed.compareAndExchange(expected: false, desired: true) {
+                promise.fail(LLBCancellationError.cancelled(reason))
+            }
+        }
+        future.whenComplete { result in
+            token.remove(handle)
+            if completed.compareAndExchange(expected: false, desired: true) {
+                promise.completeWith(result)
+            }
+        }
+        return promise.futureResult
+    }
+
+    /// Evaluates the key on the event loop chosen by the scheduler, which runs inline if the caller is already on it.
+    private func evaluate(
+        _ internedKey: LLBInternedKey,
+        on eventLoop: EventLoop,
+        token: LLBCancellationToken?,
+        _ ctx: Context
+    ) -> LLBFuture<LLBValue> {
+        var ctx = self.engineContext(ctx, on: eventLoop)
+        ctx.cancellationToken = token
+
+        let span = ctx.tracer?.startEvaluation(of: internedKey)
+        let start = DispatchTime.now().uptimeNanoseconds
+        let future = eventLoop.makeSucceededFuture(()).flatMapThrowing {
+            try token?.checkCancelled()
+        }.flatMap {
+            self.delegate.lookupFunction(forKey: internedKey.key, ctx)
+        }.flatMap { function -> LLBFuture<LLBValue> in
+            if let traces = self.traces {
+                return self.computeWithEarlyCutoff(function, key: internedKey, traces: traces, ctx)
+            }
+            let fi = LLBFunctionInterface(engine: self, key: internedKey)
+            return function.compute(key: internedKey.key, fi, ctx)
+        }
+        future.whenComplete { _ in
+            span?.end()
+            self.scheduler.evaluationCompleted(on: eventLoop)
+            if let metrics = ctx.metrics {
+                let dimensions = [("key_type", String(describing: type(of: internedKey.key)))]
+                let elapsed = Double(DispatchTime.now().uptimeNanoseconds - start) / 1_000_000_000
+                metrics.increment(counter: LLBMetricLabel.evaluations, dimensions: dimensions)
+                metrics.record(histogram: LLBMetricLabel.evaluationDuration, value: elapsed, dimensions: dimensions)
+            }
+        }
+        return future
     }
 }
 
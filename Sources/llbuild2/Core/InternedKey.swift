@@ -0,0 +1,46 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+
+/// A key paired with its stable identity. The stable hash value of the key is computed exactly once, when the key
+/// enters the engine, and is then used for equality, hashing, cycle detection and function cache lookups instead of
+/// re-serializing the key each time.
+///
+/// LLBInternedKey conforms to LLBKey so that it can be handed to LLBFunctionCache implementations directly; those will
+/// read the memoized `stableHashValue` instead of recomputing it. Functions always receive the original key.
+public struct LLBInternedKey: LLBKey {
+    /// The original key.
+    public let key: LLBKey
+
+    /// The memoized stable hash value of the original key.
+    public let stableHashValue: LLBDataID
+
+    public init(_ key: LLBKey) {
+        // Avoid wrapping (and rehashing) keys that have already been interned.
+        if let internedKey = key as? LLBInternedKey {
+            self = internedKey
+            return
+        }
+        self.key = key
+        self.stableHashValue = key.stableHashValue
+    }
+
+    public func logDescription() -> String {
+        return key.logDescription()
+    }
+}
+
+extension LLBInternedKey: Hashable {
+    public func hash(into hasher: inout Hasher) {
+        stableHashValue.hash(into: &hasher)
+    }
+
+    public static func ==(lhs: LLBInternedKey, rhs: LLBInternedKey) -> Bool {
+        return lhs.stableHashValue == rhs.stableHashValue
+    }
+}
@@ -13,154 +13,257 @@ public enum LLBKeyDependencyGraphError: Error {
 }
 
 /// Key -> Key dependency graph maintainer. Currently used for cycle detection during the request of keys.
+///
+/// The graph maintains a topological order of all the nodes it has seen (using Pearce and Kelly's dynamic topological
+/// sort algorithm). Adding an edge that agrees with the current order can't introduce a cycle and requires no search
+/// at all, which is the common case since newly requested keys are appended at the end of the order. Edges that go
+/// against the order only search the region of the graph between both nodes, instead of the whole graph, and then
+/// reorder that region.
+///
+/// Node state is spread over lock-striped shards, so that concurrent requests only contend on the same shard lock.
+/// Order-preserving edges can be added and removed concurrently (they hold the order lock in reader mode), and only
+/// edges that require the order to be updated take exclusive access to the graph.
 public class LLBKeyDependencyGraph {
-    // Use Ints containing the hashValue values for each key. They should be stable during the execution of this
-    // process, and we're not storing them for usage in future process invocations. If that changes, this should
-    // probably be refactored.
-    private var edges: [Int: Set<Int>]
-
-    // A map of the hashValue to the key. This allows us to preserve key information if paths are founds, so that
-    // they can be useful when debugging.
-    private var knownKeys: [Int: LLBKey]
-
-    private struct ActiveEdge: Hashable {
-        let originID: Int
-        let destinationID: Int
+    private final class Node {
+        /// The key for this node. This allows us to preserve key information if paths are founds, so that they can be
+        /// useful when debugging.
+        let key: LLBKey
+
+        /// The lock of the shard containing this node, protecting the edge maps while in reader mode.
+        let lock: Lock
+
+        /// The position of the node in the topological order. Only mutated while holding the order lock in writer
+        /// mode, so it is stable while holding it in reader mode.
+        var order: Int
+
+        /// Outgoing edges, with the count of how many times each edge has been recorded. An active edge is one where
+        /// its future is not completed yet.
+        var successors = [LLBDataID: Int]()
+
+        /// Incoming edges, mirroring the counts recorded in the successors of the origin nodes.
+        var predecessors = [LLBDataID: Int]()
+
+        init(key: LLBKey, lock: Lock, order: Int) {
+            self.key = key
+            self.lock = lock
+            self.order = order
+        }
     }
 
-    /// Keeps track of the active edges. The value is the count of how many times the edge has been recorded.
-    /// An active edge is one where its future is not completed yet.
-    private var activeEdges: [ActiveEdge: Int] = [:]
+    private final class Shard {
+        let lock = Lock()
+        var nodes = [LLBDataID: Node]()
+    }
+
+    private let shards: [Shard]
+    private let shardMask: Int
+
+    /// Readers may add order-preserving edges and remove edges, writers may search the graph and reorder nodes.
+    private let orderLock = ReadWriteLock()
 
-    private let lock = Lock()
+    /// The next position in the topological order, assigned to newly seen nodes.
+    private let nextOrder = NIOAtomic<Int>.makeAtomic(value: 0)
 
-    public init() {
-        self.edges = [:]
-        self.knownKeys = [:]
+    /// Creates a new graph, with node state spread over `shardCount` shards (rounded up to the next power of two).
+    public init(shardCount: Int = 64) {
+        var count = 1
+        while count < shardCount {
+            count <<= 1
+        }
+        self.shards = (0..<count).map { _ in Shard() }
+        self.shardMask = count - 1
     }
 
     /// Attempts to add a detected dependency edge to the graph, but throws if a cycle is detected.
     public func addEdge(from origin: LLBKey, to destination: LLBKey) throws {
-        // This is the biggest expense in this method. We need to find a way to identify keys in a faster way than
-        // serializing and hashing.
-        let originID = origin.hashValue
-        let destinationID = destination.hashValue
-
-        // Check if the direct dependency is already known, in which case, skip the check since the edge is already
-        // been proven to not have a cycle.
-        lock.lock()
-        activeEdges[ActiveEdge(originID: originID, destinationID: destinationID), default: 0] += 1
-        if self.edges[originID]?.contains(destinationID) == true {
-            defer { lock.unlock() }
-            return
+        try addEdge(from: LLBInternedKey(origin), to: LLBInternedKey(destination))
+    }
+
+    /// Attempts to add a detected dependency edge to the graph, but throws if a cycle is detected. The interned keys
+    /// already carry their stable identity, so no hashing of the keys happens in this method.
+    func addEdge(from internedOrigin: LLBInternedKey, to internedDestination: LLBInternedKey) throws {
+        let originID = internedOrigin.stableHashValue
+        let destinationID = internedDestination.stableHashValue
+
+        // Fast path: if the direct dependency is already known, skip the check since the edge has already been proven
+        // to not have a cycle. If the origin precedes the destination in the topological order, the edge can't
+        // introduce a cycle either. This works because the graph starts by definition without cycles, so cycles can
+        // only be introduced if a new edge would create it.
+        let added: Bool = orderLock.withReaderLock {
+            let origin = node(for: internedOrigin)
+            let destination = node(for: internedDestination)
+
+            let added: Bool = origin.lock.withLock {
+                if let count = origin.successors[destinationID] {
+                    origin.successors[destinationID] = count + 1
+                    return true
+                }
+                guard originID != destinationID, origin.order < destination.order else {
+                    return false
+                }
+                origin.successors[destinationID] = 1
+                return true
+            }
+
+            if added {
+                destination.lock.withLock {
+                    destination.predecessors[originID, default: 0] += 1
+                }
+            }
+            return added
         }
-        lock.unlock()
 
-        // Populate the knownKeys store with the new edge nodes, in case it doesn't exist.
-        lock.lock()
-        if self.knownKeys[originID] == nil {
-            self.knownKeys[originID] = origin
+        if added {
+            return
         }
-        if self.knownKeys[destinationID] == nil {
-            self.knownKeys[destinationID] = destination
+
+        // Slow path: the edge goes against the current order. Take exclusive access to the graph to check whether
+        // there's a path from the destination to the origin, and to reorder the affected region if there isn't. The
+        // state may have changed while waiting for the lock, so the checks are repeated.
+        try orderLock.withWriterLock {
+            let origin = node(for: internedOrigin)
+            let destination = node(for: internedDestination)
+
+            if origin.successors[destinationID] == nil {
+                try checkCycleAndReorder(origin: origin, originID: originID, destination: destination, destinationID: destinationID)
+            }
+
+            origin.successors[destinationID, default: 0] += 1
+            destination.predecessors[originID, default: 0] += 1
         }
-        lock.unlock()
-
-        // Check if there's a path from the destination to the origin, as that would be a clear indication that adding
-        // the edge from the origin to the destination would introduce a cycle. This works because the graph starts
-        // by definition without cycles, so cycles can only be introduced if a new edge would create it. The edges are
-        // updated within the same lock to avoid a race condition where 2 threads might add edges that would conflict.
-        lock.lock()
-        if let path = anyPath(from: destinationID, to: originID) {
-            let keyPath = path.map { self.knownKeys[$0]! }
-            lock.unlock()
-            throw LLBKeyDependencyGraphError.cycleDetected([origin] + keyPath)
+    }
+
+    public func removeEdge(from origin: LLBKey, to destination: LLBKey) {
+        removeEdge(from: LLBInternedKey(origin), to: LLBInternedKey(destination))
+    }
+
+    func removeEdge(from internedOrigin: LLBInternedKey, to internedDestination: LLBInternedKey) {
+        let originID = internedOrigin.stableHashValue
+        let destinationID = internedDestination.stableHashValue
+
+        // Removing edges can never invalidate the topological order, so this only needs reader access.
+        orderLock.withReaderLock {
+            let origin = existingNode(originID)
+            let destination = existingNode(destinationID)
+
+            origin.lock.withLock {
+                let count = origin.successors[destinationID]!
+                precondition(count > 0)
+                origin.successors[destinationID] = count == 1 ? nil : count - 1
+            }
+
+            destination.lock.withLock {
+                let count = destination.predecessors[originID, default: 0]
+                precondition(count > 0)
+                destination.predecessors[originID] = count == 1 ? nil : count - 1
+            }
         }
+    }
 
-        var destinations = self.edges[originID, default: Set()]
-        destinations.insert(destinationID)
-        self.edges[originID] = destinations
-        lock.unlock()
+    private func shard(for id: LLBDataID) -> Shard {
+        return shards[id.hashValue & shardMask]
     }
 
-    public func removeEdge(from origin: LLBKey, to destination: LLBKey) {
-        let originID = origin.hashValue
-        let destinationID = destination.hashValue
-        let actEdge = ActiveEdge(originID: originID, destinationID: destinationID)
-
-        lock.lock()
-        var num = activeEdges[actEdge]!
-        precondition(num > 0)
-        num -= 1
-        if num == 0 {
-            activeEdges.removeValue(forKey: actEdge)
-            var destinations = self.edges[originID]!
-            destinations.remove(destinationID)
-            if destinations.isEmpty {
-                self.edges.removeValue(forKey: originID)
-            } else {
-                self.edges[originID] = destinations
+    /// Returns the node for the given key, appending it at the end of the topological order if it was not known.
+    /// Must be called while holding the order lock (in either mode).
+    private func node(for key: LLBInternedKey) -> Node {
+        let shard = self.shard(for: key.stableHashValue)
+        return shard.lock.withLock {
+            if let node = shard.nodes[key.stableHashValue] {
+                return node
             }
-        } else {
-            activeEdges[actEdge] = num
+            let node = Node(key: key.key, lock: shard.lock, order: nextOrder.add(1))
+            shard.nodes[key.stableHashValue] = node
+            return node
         }
-        lock.unlock()
     }
 
-    /// Simple mechanism to find a path between 2 nodes. It doesn't care if its the shortest path, only whether a path
-    /// exists. If a path is found, it returns it.
-    /// Must be called inside the lock.
-    private func anyPath(from origin: Int, to destination: Int) -> [Int]? {
-        // If the origin is the destination, then the path is itself.
-        if origin == destination {
-            return [origin]
+    /// Returns the node for an ID that is known to be in the graph. Must be called while holding the order lock (in
+    /// either mode).
+    private func existingNode(_ id: LLBDataID) -> Node {
+        let shard = self.shard(for: id)
+        return shard.lock.withLock { shard.nodes[id]! }
+    }
+
+    /// Checks whether adding the edge from origin to destination would introduce a cycle, throwing if it would.
+    /// Otherwise, it reorders the affected region of the graph so that the origin precedes the destination.
+    /// Must be called while holding the order lock in writer mode.
+    private func checkCycleAndReorder(origin: Node, originID: LLBDataID, destination: Node, destinationID: LLBDataID) throws {
+        if originID == destinationID {
+            throw LLBKeyDependencyGraphError.cycleDetected([origin.key, origin.key])
         }
 
-        // Keeps track of the path between the nodes as it searches through.
-        var path = [Int]()
+        // The edge agrees with the current order, so no search or reordering is needed.
+        if origin.order < destination.order {
+            return
+        }
 
-        // Stack with the unprocessed nodes.
-        var stack = [Int?]()
+        let upperBound = origin.order
+        let lowerBound = destination.order
 
-        // Set of visited nodes to skip if found again.
-        var visited = Set<Int>()
+        // Search forward from the destination, only through nodes that precede the origin in the order, since those
+        // are the only ones that could reach it. If the origin is found, adding the edge would introduce a cycle.
+        var forward = [Node]()
+        var parents = [LLBDataID: LLBDataID]()
+        var visited: Set<LLBDataID> = [destinationID]
+        var stack = [(destinationID, destination)]
 
-        stack.append(origin)
+        while let entry = stack.popLast() {
+            let (currentID, current) = entry
+            forward.append(current)
 
-        // While there are nodes to process, keep on going.
-        while !stack.isEmpty {
-            // If we find a sentinel, pop the last path node from the stack.
-            guard let current = stack.removeLast() else {
-                path.removeLast()
-                continue
-            }
+            for successorID in current.successors.keys {
+                if successorID == originID {
+                    // Reconstruct the path from the destination to the origin.
+                    var path = [originID, currentID]
+                    var pathID = currentID
+                    while let parentID = parents[pathID] {
+                        path.append(parentID)
+                        pathID = parentID
+                    }
+                    let keyPath = path.reversed().map { existingNode($0).key }
+                    throw LLBKeyDependencyGraphError.cycleDetected([origin.key] + keyPath)
+                }
 
-            // If we have seen the node before, skip it, since it means that we didn't find a path through that node.
-            if visited.contains(current) {
-                continue
-            } else {
-                visited.insert(current)
-            }
+                guard !visited.contains(successorID) else {
+                    continue
+                }
 
-            // If the current key does not have dependencies, skip it.
-            guard let dependencies = self.edges[current] else {
-                continue
+                let successor = existingNode(successorID)
+                if successor.order < upperBound {
+                    visited.insert(successorID)
+                    parents[successorID] = currentID
+                    stack.append((successorID, successor))
+                }
             }
+        }
 
-            // Add the current node to the path stack.
-            path.append(current)
+        // Search backward from the origin, only through nodes that follow the destination in the order.
+        var backward = [Node]()
+        visited = [originID]
+        stack = [(originID, origin)]
 
-            if dependencies.contains(destination) {
-                return path + [destination]
-            } else {
-                // Insert nil sentinel that signals where the current path ends, to pop it from the path stack.
-                stack.append(nil)
+        while let entry = stack.popLast() {
+            let current = entry.1
+            backward.append(current)
 
-                // Add the dependencies to scan.
-                stack.append(contentsOf: dependencies)
+            for predecessorID in current.predecessors.keys where !visited.contains(predecessorID) {
+                let predecessor = existingNode(predecessorID)
+                if predecessor.order > lowerBound {
+                    visited.insert(predecessorID)
+                    stack.append((predecessorID, predecessor))
+                }
             }
         }
 
-        return nil
+        // Reassign the order positions used by the affected nodes, placing all of the nodes that reach the origin
+        // before all of the nodes reachable from the destination, preserving the relative order within each set.
+        backward.sort { $0.order < $1.order }
+        forward.sort { $0.order < $1.order }
+        let affectedNodes = backward + forward
+        let orders = affectedNodes.map { $0.order }.sorted()
+        for (node, order) in zip(affectedNodes, orders) {
+            node.order = order
+        }
     }
 }
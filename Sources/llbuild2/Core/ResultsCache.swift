@@ -0,0 +1,146 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import NIOConcurrencyHelpers
+
+/// Statistics about the results held in memory by an `LLBEngine`.
+public struct LLBEngineStats: Equatable {
+    /// The number of completed results that are held in memory.
+    public var residentEntries: Int
+
+    /// The number of results that are still being computed.
+    public var pendingEntries: Int
+
+    /// The number of completed results that have been evicted from memory since the engine was created.
+    public var evictions: Int
+
+    /// The number of evaluations skipped in early cutoff mode since the engine was created.
+    public var earlyCutoffs: Int
+
+    /// The number of keys whose evaluation traces are held in memory in early cutoff mode.
+    public var evaluationTraces: Int
+
+    /// The number of evaluations that the scheduler placed on a different event loop than the one of the evaluation
+    /// that requested them, plus the number of evaluations that were stolen by another loop before they started.
+    public var schedulerHops: Int
+
+    public init(
+        residentEntries: Int = 0,
+        pendingEntries: Int = 0,
+        evictions: Int = 0,
+        earlyCutoffs: Int = 0,
+        evaluationTraces: Int = 0,
+        schedulerHops: Int = 0
+    ) {
+        self.residentEntries = residentEntries
+        self.pendingEntries = pendingEntries
+        self.evictions = evictions
+        self.earlyCutoffs = earlyCutoffs
+        self.evaluationTraces = evaluationTraces
+        self.schedulerHops = schedulerHops
+    }
+}
+
+/// The cache of results for the keys requested from the engine.
+///
+/// Results that are still being computed are always kept, so that concurrent requests for the same key share a single
+/// evaluation. A shared evaluation has its own cancellation token, which is only cancelled once every request that is
+/// waiting for it has been cancelled; requests that arrive after that start a new evaluation.
+///
+/// Completed results are kept in least recently used order and, if the cache is bounded, the least recently used ones
+/// are evicted once the limit is reached. An evicted key is evaluated again on its next request, which for
+/// `LLBTypedCachingFunction`s only reloads the value through the function cache.
+final class LLBEngineResultsCache {
+    private let group: LLBFuturesDispatchGroup
+
+    /// The maximum number of completed results to keep, or nil if completed results are never evicted.
+    let maxResidentEntries: Int?
+
+    /// An evaluation that is still running, with the cancellation token shared by the requests waiting for it.
+    private struct Pending {
+        let future: LLBFuture<LLBValue>
+        let cancellation: LLBSharedCancellationToken
+    }
+
+    private let lock = Lock()
+    private var pending = [LLBInternedKey: Pending]()
+    private let resident: LLBBoundedLRU<LLBInternedKey, LLBFuture<LLBValue>>
+    private var evictions = 0
+
+    init(group: LLBFuturesDispatchGroup, maxResidentEntries: Int?) {
+        precondition(maxResidentEntries.map { $0 >= 0 } ?? true, "the resident entry limit can't be negative")
+        self.group = group
+        self.maxResidentEntries = maxResidentEntries
+        self.resident = LLBBoundedLRU(capacity: maxResidentEntries)
+    }
+
+    var stats: LLBEngineStats {
+        return lock.withLock {
+            LLBEngineStats(residentEntries: resident.count, pendingEntries: pending.count, evictions: evictions)
+        }
+    }
+
+    /// Returns the result for the key, using `compute` to evaluate it if it isn't already in memory. `compute` is given
+    /// the cancellation token of the evaluation, or nil if the requester has no token. Failures of cancelled
+    /// evaluations aren't kept, so that the key is evaluated again on its next request.
+    func value(
+        for key: LLBInternedKey,
+        requester token: LLBCancellationToken?,
+        compute: @escaping (LLBInternedKey, LLBCancellationToken?) -> LLBFuture<LLBValue>
+    ) -> LLBFuture<LLBValue> {
+        let (future, cancellation, promise): (LLBFuture<LLBValue>, LLBSharedCancellationToken?, LLBPromise<LLBValue>?) = lock.withLock {
+            if let future = resident[key] {
+                return (future, nil, nil)
+            }
+            if let running = pending[key], !running.cancellation.isCancelled {
+                running.cancellation.reserve(token)
+                return (running.future, running.cancellation, nil)
+            }
+            // Evaluations that were cancelled are left to wind down, and replaced by a new one.
+            let promise = group.next().makePromise(of: LLBValue.self)
+            let cancellation = LLBSharedCancellationToken()
+            cancellation.reserve(token)
+            pending[key] = Pending(future: promise.futureResult, cancellation: cancellation)
+            return (promise.futureResult, cancellation, promise)
+        }
+
+        // The token is observed outside the lock, since an already cancelled token runs its handlers right away.
+        cancellation?.attach(token)
+
+        guard let newPromise = promise, let evaluation = cancellation else {
+            return future
+        }
+
+        // The computation is started outside the lock, since it may request other keys (or complete) synchronously.
+        future.whenComplete { result in
+            evaluation.finish()
+            var shouldRetain = true
+            if case .failure = result, evaluation.isCancelled {
+                shouldRetain = false
+            }
+            self.lock.withLockVoid {
+                if self.pending[key]?.future === future {
+                    self.pending[key] = nil
+                }
+                // A cancelled evaluation that still succeeded may complete after the one that replaced it.
+                if shouldRetain && !self.resident.contains(key) {
+                    self.evictions += self.resident.insert(future, for: key).count
+                }
+            }
+        }
+        newPromise.completeWith(compute(key, token == nil ? nil : evaluation.token))
+        return future
+    }
+
+    /// Removes all of the completed results. Results that are being computed are kept, and are added once complete.
+    func removeAllCompleted() {
+        lock.withLockVoid {
+            resident.removeAll()
+        }
+    }
+}
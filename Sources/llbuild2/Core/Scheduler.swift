@@ -0,0 +1,309 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Dispatch
+import NIO
+import NIOConcurrencyHelpers
+
+/// Chooses the event loops on which the engine evaluates keys, and when the evaluations start.
+///
+/// Each evaluation starts on the chosen event loop. Schedulers that place work for locality can also pin the
+/// evaluations to their loops: the context passed to the function then has a group that always returns the chosen
+/// loop, so that all of the continuations of the evaluation stay on it instead of hopping between threads.
+public protocol LLBEngineScheduler {
+    /// Whether the futures of each evaluation are kept on its event loop. Pinning keeps the work of an evaluation where
+    /// its values are consumed, but serializes any fan-out of the evaluation on a single loop.
+    var pinsEvaluations: Bool { get }
+
+    /// Returns the event loop on which to evaluate the key. `requester` is the event loop of the evaluation that
+    /// requested the key, or nil if the key was requested from outside of the engine.
+    func eventLoop(for key: LLBKey, requester: EventLoop?, group: LLBFuturesDispatchGroup) -> EventLoop
+
+    /// Starts the evaluation of the key placed on the event loop by calling `start` with the loop to run it on, which
+    /// may be another loop if the evaluation was stolen. Schedulers can delay the start to order the evaluations that
+    /// wait for a busy loop; by default, evaluations start right away on the loop they were placed on.
+    func start(_ key: LLBKey, on eventLoop: EventLoop, _ start: @escaping (EventLoop) -> Void)
+
+    /// Called when an evaluation started on the event loop completes.
+    func evaluationCompleted(on eventLoop: EventLoop)
+}
+
+public extension LLBEngineScheduler {
+    var pinsEvaluations: Bool {
+        return false
+    }
+
+    func start(_ key: LLBKey, on eventLoop: EventLoop, _ start: @escaping (EventLoop) -> Void) {
+        start(eventLoop)
+    }
+
+    func evaluationCompleted(on eventLoop: EventLoop) {}
+}
+
+/// Schedules each evaluation on the next event loop of the group, in round-robin order.
+public struct LLBRoundRobinEngineScheduler: LLBEngineScheduler {
+    public init() {}
+
+    public func eventLoop(for key: LLBKey, requester: EventLoop?, group: LLBFuturesDispatchGroup) -> EventLoop {
+        return group.next()
+    }
+}
+
+/// Schedules evaluations on the event loop of the evaluation that requested them, and pins them there, so that values
+/// are produced where they are consumed. Once a loop has `maxLocalEvaluations` evaluations in flight, each new
+/// evaluation goes to the less loaded of its requester and another loop of the group (the "power of two choices").
+///
+/// Evaluations placed on a loop that already has `maxLocalEvaluations` evaluations in flight don't start right away:
+/// they wait in a queue of the loop, which starts them one task at a time so that they interleave with the rest of the
+/// work of the loop. Keys for which `isHighPriority` returns true (for example, the actions on the critical path of the
+/// build) go to the least loaded of two loops instead of their requester, and start before the other evaluations
+/// waiting in the queue. A loop that has nothing left in its queue steals the evaluations waiting on the most loaded
+/// loop, as long as that loop has at least two more evaluations in flight than the thief.
+///
+/// Evaluations are only moved before they start: once an evaluation has started, its futures stay pinned to its loop.
+public final class LLBLocalityEngineScheduler: LLBEngineScheduler {
+    /// An evaluation that waits to start.
+    private struct QueuedEvaluation {
+        let start: (EventLoop) -> Void
+    }
+
+    /// A first-in first-out queue that reuses the storage of the evaluations it removed.
+    private struct Queue {
+        private var elements = [QueuedEvaluation]()
+        private var head = 0
+
+        var count: Int {
+            return elements.count - head
+        }
+
+        mutating func append(_ element: QueuedEvaluation) {
+            elements.append(element)
+        }
+
+        mutating func popFirst() -> QueuedEvaluation? {
+            guard head < elements.count else {
+                return nil
+            }
+            let element = elements[head]
+            head += 1
+            if head == elements.count {
+                elements.removeAll(keepingCapacity: true)
+                head = 0
+            } else if head >= 64 && head * 2 >= elements.count {
+                elements.removeFirst(head)
+                head = 0
+            }
+            return element
+        }
+    }
+
+    /// The evaluations of an event loop.
+    private final class LoopState {
+        let eventLoop: EventLoop
+
+        /// The number of evaluations placed on the loop that haven't completed, including the queued ones.
+        var load = 0
+
+        /// The evaluations that wait to start on the loop, by priority.
+        var highPriority = Queue()
+        var normalPriority = Queue()
+
+        /// Whether a task of the loop is starting the queued evaluations.
+        var draining = false
+
+        init(_ eventLoop: EventLoop) {
+            self.eventLoop = eventLoop
+        }
+
+        var queued: Int {
+            return highPriority.count + normalPriority.count
+        }
+
+        func popFirst() -> QueuedEvaluation? {
+            return highPriority.popFirst() ?? normalPriority.popFirst()
+        }
+    }
+
+    public let maxLocalEvaluations: Int
+
+    private let isHighPriority: ((LLBKey) -> Bool)?
+
+    private let lock = Lock()
+    private var loops = [ObjectIdentifier: LoopState]()
+
+    public init(maxLocalEvaluations: Int = 16, isHighPriority: ((LLBKey) -> Bool)? = nil) {
+        self.maxLocalEvaluations = maxLocalEvaluations
+        self.isHighPriority = isHighPriority
+    }
+
+    public var pinsEvaluations: Bool {
+        return true
+    }
+
+    public func eventLoop(for key: LLBKey, requester: EventLoop?, group: LLBFuturesDispatchGroup) -> EventLoop {
+        let highPriority = isHighPriority?(key) ?? false
+
+        return lock.withLock {
+            let chosen: EventLoop
+            if let requester = requester, !highPriority {
+                if load(requester) < maxLocalEvaluations {
+                    chosen = requester
+                } else {
+                    chosen = leastLoaded(requester, group.next())
+                }
+            } else {
+                // Pick the less loaded of two loops, which balances the load well without tracking every loop.
+                chosen = leastLoaded(group.next(), group.next())
+            }
+            state(chosen).load += 1
+            return chosen
+        }
+    }
+
+    public func start(_ key: LLBKey, on eventLoop: EventLoop, _ start: @escaping (EventLoop) -> Void) {
+        let highPriority = isHighPriority?(key) ?? false
+
+        let (startNow, drain): (Bool, LoopState?) = lock.withLock {
+            let state = self.state(eventLoop)
+            // The load already counts this evaluation.
+            if state.load <= maxLocalEvaluations && state.queued == 0 {
+                return (true, nil)
+            }
+            if highPriority {
+                state.highPriority.append(QueuedEvaluation(start: start))
+            } else {
+                state.normalPriority.append(QueuedEvaluation(start: start))
+            }
+            return (false, startDraining(state))
+        }
+
+        if startNow {
+            start(eventLoop)
+        }
+        if let state = drain {
+            state.eventLoop.execute { self.drain(state) }
+        }
+    }
+
+    public func evaluationCompleted(on eventLoop: EventLoop) {
+        let drain: LoopState? = lock.withLock {
+            let state = self.state(eventLoop)
+            state.load -= 1
+            guard victim(for: state) != nil else {
+                return nil
+            }
+            return startDraining(state)
+        }
+        if let state = drain {
+            state.eventLoop.execute { self.drain(state) }
+        }
+    }
+
+    /// The number of evaluations in flight on the event loop, including the ones waiting to start.
+    public func load(on eventLoop: EventLoop) -> Int {
+        return lock.withLock { load(eventLoop) }
+    }
+
+    /// Starts the next evaluation queued on the loop, or stolen from another loop, and schedules the next one.
+    private func drain(_ state: LoopState) {
+        let next: QueuedEvaluation? = lock.withLock {
+            if let next = state.popFirst() {
+                return next
+            }
+            if let victim = victim(for: state), let stolen = victim.popFirst() {
+                victim.load -= 1
+                state.load += 1
+                return stolen
+            }
+            state.draining = false
+            return nil
+        }
+
+        guard let evaluation = next else {
+            return
+        }
+        evaluation.start(state.eventLoop)
+        state.eventLoop.execute { self.drain(state) }
+    }
+
+    /// Marks the loop as draining, returning it if it wasn't already.
+    private func startDraining(_ state: LoopState) -> LoopState? {
+        guard !state.draining else {
+            return nil
+        }
+        state.draining = true
+        return state
+    }
+
+    /// The loop with the most queued evaluations that the loop may steal from, if any.
+    private func victim(for thief: LoopState) -> LoopState? {
+        var victim: LoopState? = nil
+        for candidate in loops.values where candidate !== thief && candidate.queued > 0 {
+            if candidate.load >= thief.load + 2 && candidate.queued > (victim?.queued ?? 0) {
+                victim = candidate
+            }
+        }
+        return victim
+    }
+
+    private func state(_ eventLoop: EventLoop) -> LoopState {
+        if let state = loops[ObjectIdentifier(eventLoop)] {
+            return state
+        }
+        let state = LoopState(eventLoop)
+        loops[ObjectIdentifier(eventLoop)] = state
+        return state
+    }
+
+    private func load(_ eventLoop: EventLoop) -> Int {
+        return loops[ObjectIdentifier(eventLoop)]?.load ?? 0
+    }
+
+    private func leastLoaded(_ first: EventLoop, _ second: EventLoop) -> EventLoop {
+        return load(second) < load(first) ? second : first
+    }
+}
+
+/// An event loop group that always returns the same event loop, used to keep the futures of an evaluation on the loop
+/// chosen by the scheduler. The group doesn't own the loop, so shutting it down does nothing.
+final class LLBPinnedEventLoopGroup: EventLoopGroup {
+    let eventLoop: EventLoop
+
+    init(_ eventLoop: EventLoop) {
+        self.eventLoop = eventLoop
+    }
+
+    func next() -> EventLoop {
+        return eventLoop
+    }
+
+    func makeIterator() -> EventLoopIterator {
+        return EventLoopIterator([eventLoop])
+    }
+
+    func shutdownGracefully(queue: DispatchQueue, _ callback: @escaping (Error?) -> Void) {
+        queue.async {
+            callback(nil)
+        }
+    }
+}
+
+private final class LLBEvaluationEventLoopKey {}
+
+/// The event loop chosen for the evaluation that a context belongs to, which is the requester of the keys that the
+/// evaluation requests.
+extension Context {
+    var evaluationEventLoop: EventLoop? {
+        get {
+            return self[ObjectIdentifier(LLBEvaluationEventLoopKey.self)] as? EventLoop
+        }
+        set {
+            self[ObjectIdentifier(LLBEvaluationEventLoopKey.self)] = newValue
+        }
+    }
+}
@@ -0,0 +1,81 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import NIOConcurrencyHelpers
+import SwiftProtobuf
+
+
+/// A cache of action execution results, keyed by the contents of the execution requests (the action spec, the inputs
+/// and the outputs). Unlike the function cache, which is keyed by the engine keys and their versions, entries are
+/// shared by every request that runs the same process on the same inputs, so it can be shared between clients with
+/// different configurations and cache versions to avoid executing the same action more than once.
+public protocol LLBActionResultCache: AnyObject {
+    /// Returns the response of an earlier execution of an identical request, or nil if there is none. Caches that
+    /// can't be reached should report a miss, so that the action is executed instead of failing the build.
+    func lookup(_ request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse?>
+
+    /// Stores the response of a successful execution of the request. The build doesn't wait for the update, and
+    /// failures are reported to the build event delegate instead of failing the build.
+    func update(_ request: LLBActionExecutionRequest, response: LLBActionExecutionResponse, _ ctx: Context) -> LLBFuture<Void>
+}
+
+public extension LLBActionExecutionRequest {
+    /// The key of the request in action result caches, which identifies the request by its contents, without the
+    /// additional data (such as the description of the action) that doesn't affect its result.
+    func actionResultCacheKey() throws -> LLBDataID {
+        var request = self
+        request.additionalData = []
+        let data = try request.serializedData()
+        return LLBDataID(blake3hash: LLBByteBuffer.withBytes(ArraySlice(data)), refs: [])
+    }
+}
+
+/// A simple in-memory implementation of the `LLBActionResultCache` protocol, for sharing results between the engines of
+/// a process.
+///
+/// The responses only contain the data IDs of the outputs, not their contents, so the cache only works for engines
+/// that share the same database. An engine with another database gets responses whose outputs it can't find.
+public final class LLBInMemoryActionResultCache: LLBActionResultCache {
+    /// Threads capable of running futures.
+    public let group: LLBFuturesDispatchGroup
+
+    /// The maximum number of cached responses, after which the least recently used ones are evicted.
+    public let maxEntries: Int
+
+    private let lock = Lock()
+    private let responses: LLBBoundedLRU<LLBDataID, LLBActionExecutionResponse>
+
+    public init(group: LLBFuturesDispatchGroup, maxEntries: Int = 100_000) {
+        self.group = group
+        self.maxEntries = maxEntries
+        self.responses = LLBBoundedLRU(capacity: maxEntries)
+    }
+
+    public func lookup(_ request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse?> {
+        do {
+            let key = try request.actionResultCacheKey()
+            return group.next().makeSucceededFuture(lock.withLock { responses[key] })
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
+    }
+
+    public func update(_ request: LLBActionExecutionRequest, response: LLBActionExecutionResponse, _ ctx: Context) -> LLBFuture<Void> {
+        do {
+            let key = try request.actionResultCacheKey()
+            lock.withLockVoid {
+                responses.insert(response, for: key)
+            }
+            return group.next().makeSucceededFuture(())
+        } catch {
+            return group.next().makeFailedFuture(error)
+        }
+    }
+}
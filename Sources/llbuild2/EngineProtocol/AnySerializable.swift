@@ -27,10 +27,33 @@ public protocol LLBPolymorphicSerializable: LLBSerializable {
 /// instead to make this more robust.
 extension LLBPolymorphicSerializable {
     public static var polymorphicIdentifier: String {
-        return String(describing: Self.self)
+        return polymorphicIdentifiers.identifier(for: Self.self)
     }
 }
 
+/// Memoizes the described names of the polymorphic types, since describing a
+/// type at runtime is much more expensive than looking it up, and identifiers
+/// are needed every time a value is serialized or looked up by type.
+private final class PolymorphicIdentifierCache {
+    private let lock = Lock()
+    private var identifiers = [ObjectIdentifier: String]()
+
+    func identifier(for type: Any.Type) -> String {
+        let key = ObjectIdentifier(type)
+        if let identifier = lock.withLock({ identifiers[key] }) {
+            return identifier
+        }
+
+        let identifier = String(describing: type)
+        lock.withLockVoid {
+            identifiers[key] = identifier
+        }
+        return identifier
+    }
+}
+
+private let polymorphicIdentifiers = PolymorphicIdentifierCache()
+
 // Convenience internal initializer.
 extension LLBAnySerializable {
     public init(from polymorphicSerializable: LLBPolymorphicSerializable) throws {
@@ -44,6 +67,15 @@ extension LLBAnySerializable {
 
 public protocol LLBSerializableLookup {
     func lookupType(identifier: String) -> LLBPolymorphicSerializable.Type?
+
+    /// The cache of values decoded through this lookup, if any.
+    var decodedValues: LLBDecodedValueCache? { get }
+}
+
+extension LLBSerializableLookup {
+    public var decodedValues: LLBDecodedValueCache? {
+        return nil
+    }
 }
 
 /// Container for mapping registered identifiers to their runtime types.
@@ -51,7 +83,13 @@ public class LLBSerializableRegistry: LLBSerializableLookup {
     /// Types registered at runtime that are allowed to be deserialized.
     private var registeredTypes: [String: LLBPolymorphicSerializable.Type] = [:]
 
-    public init() { }
+    /// The values decoded through the registry, shared by everything that uses
+    /// the registry (e.g. all the functions of an engine).
+    public let decodedValues: LLBDecodedValueCache?
+
+    public init(decodedValues: LLBDecodedValueCache? = LLBDecodedValueCache()) {
+        self.decodedValues = decodedValues
+    }
 
     /// Register a new type for use in polymorphic serialization
     ///
@@ -85,6 +123,23 @@ extension LLBAnySerializable {
             throw LLBAnySerializableError.unknownType(typeIdentifier)
         }
 
+        // Only the types that opt into the cache pay for hashing their bytes.
+        guard serializableType is LLBCachedDecodedValue.Type, let cache = registry.decodedValues else {
+            return try decode(serializableType)
+        }
+
+        // The type is part of the key, since different types can have the
+        // same serialized bytes (e.g. when all of their fields are empty).
+        var keyBytes = Array(typeIdentifier.utf8)
+        keyBytes.append(0)
+        keyBytes.append(contentsOf: serializedBytes)
+        let id = LLBDataID(blake3hash: LLBByteBuffer.withBytes(keyBytes[...]), refs: [])
+        return try cache.value(for: id) {
+            try decode(serializableType)
+        }
+    }
+
+    private func decode<T>(_ serializableType: LLBPolymorphicSerializable.Type) throws -> T {
         // FIXME: this extra buffer copy is unfortunate
         let buffer = LLBByteBuffer.withBytes(ArraySlice<UInt8>(serializedBytes))
         guard let deserialized = try serializableType.init(from: buffer) as? T else {
@@ -0,0 +1,61 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import NIOConcurrencyHelpers
+
+
+/// Marks the types whose decoded values are kept in the registry's `LLBDecodedValueCache`. Caching costs a hash of the
+/// serialized form on every decode, so only immutable types that are decoded many times and are expensive to decode
+/// (such as configured targets) should adopt it.
+public protocol LLBCachedDecodedValue {}
+
+/// Caches decoded values by the data ID of their serialized form, so that values that are decoded many times (such as
+/// the configured targets and cached function results of analysis) are only decoded once. Since data IDs identify
+/// their contents, cached values never need to be invalidated.
+///
+/// Values are shared by all of the callers that decode the same data, so only immutable values should be cached.
+public final class LLBDecodedValueCache {
+    /// The maximum number of cached values, after which the least recently used ones are evicted.
+    public let maxEntries: Int
+
+    private let lock = Lock()
+    private let values: LLBBoundedLRU<LLBDataID, Any>
+    private var _hits = 0
+    private var _misses = 0
+
+    public init(maxEntries: Int = 100_000) {
+        self.maxEntries = maxEntries
+        self.values = LLBBoundedLRU(capacity: maxEntries)
+    }
+
+    /// The number of values that were found in the cache, and that had to be decoded.
+    public var counts: (hits: Int, misses: Int) {
+        return lock.withLock { (_hits, _misses) }
+    }
+
+    /// Returns the cached value for the ID, or decodes and caches it. Cached values of other types are replaced.
+    public func value<T>(for id: LLBDataID, _ decode: () throws -> T) rethrows -> T {
+        let cached: T? = lock.withLock {
+            guard let value = values[id] as? T else {
+                _misses += 1
+                return nil
+            }
+            _hits += 1
+            return value
+        }
+        if let value = cached {
+            return value
+        }
+
+        let value = try decode()
+        lock.withLockVoid {
+            values.insert(value, for: id)
+        }
+        return value
+    }
+}
@@ -0,0 +1,50 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+
+/// Resolves lazy outputs: action outputs that an executor left in remote storage instead of importing their contents
+/// into the database ("build without the bytes"). Lazy outputs have data IDs like any other artifact, so they can be
+/// passed to further actions of the same executor, but they don't refer to file tree contents until they are
+/// materialized.
+public protocol LLBLazyOutputResolver: AnyObject {
+    /// Returns the type of the lazy output with the given ID, or nil if the ID refers to regular contents.
+    func lazyOutputType(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBArtifactType?>
+
+    /// Returns the ID of the regular contents of the lazy output, fetching them into the database if needed. IDs that
+    /// refer to regular contents are returned as they are.
+    func materialize(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBDataID>
+}
+
+/// An executor that materializes the lazy inputs of the requests before passing them to an executor that needs their
+/// contents, such as the local executor. Use it as the executor of actions that run locally when other actions run
+/// remotely with lazy outputs, so that only the outputs that local actions consume are fetched.
+public final class LLBMaterializingExecutor: LLBExecutor {
+    public let executor: LLBExecutor
+    public let resolver: LLBLazyOutputResolver
+
+    public init(_ executor: LLBExecutor, resolver: LLBLazyOutputResolver) {
+        self.executor = executor
+        self.resolver = resolver
+    }
+
+    public func execute(request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse> {
+        let inputFutures = request.inputs.map { input in
+            resolver.materialize(input.dataID, ctx).map { dataID -> LLBActionInput in
+                var input = input
+                input.dataID = dataID
+                return input
+            }
+        }
+
+        return LLBFuture.whenAllSucceed(inputFutures, on: ctx.group.next()).flatMap { inputs in
+            var request = request
+            request.inputs = inputs
+            return self.executor.execute(request: request, ctx)
+        }
+    }
+}
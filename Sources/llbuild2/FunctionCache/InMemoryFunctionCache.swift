@@ -12,24 +12,41 @@ import NIOConcurrencyHelpers
 /// A simple in-memory implementation of the `LLBFunctionCache` protocol.
 public final class LLBInMemoryFunctionCache: LLBFunctionCache {
     /// The cache.
-    private var cache = [Key: LLBDataID]()
+    private var cache = [LLBInternedKey: LLBFunctionCacheEntry]()
 
     /// Threads capable of running futures.
     public let group: LLBFuturesDispatchGroup
 
+    /// The maximum size of the values that are kept inline with their IDs. Values in the CAS database are not owned by
+    /// the cache, so this is 0 by default to avoid keeping a second copy in memory.
+    public let inlineValueLimit: Int
+
     /// The lock protecting content.
     let lock = NIOConcurrencyHelpers.Lock()
 
     /// Create an in-memory database.
-    public init(group: LLBFuturesDispatchGroup) {
+    public init(group: LLBFuturesDispatchGroup, inlineValueLimit: Int = 0) {
         self.group = group
+        self.inlineValueLimit = inlineValueLimit
     }
 
     public func get(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBDataID?> {
-        return group.next().makeSucceededFuture(lock.withLock { cache[Key(key)] })
+        return group.next().makeSucceededFuture(lock.withLock { cache[LLBInternedKey(key)]?.id })
     }
 
     public func update(key: LLBKey, value: LLBDataID, _ ctx: Context) -> LLBFuture<Void> {
-        return group.next().makeSucceededFuture(lock.withLockVoid { cache[Key(key)] = value })
+        return update(key: key, entry: LLBFunctionCacheEntry(id: value), ctx)
+    }
+
+    public func getEntry(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunctionCacheEntry?> {
+        return group.next().makeSucceededFuture(lock.withLock { cache[LLBInternedKey(key)] })
+    }
+
+    public func update(key: LLBKey, entry: LLBFunctionCacheEntry, _ ctx: Context) -> LLBFuture<Void> {
+        var entry = entry
+        if let object = entry.object, object.data.readableBytes > inlineValueLimit {
+            entry.object = nil
+        }
+        return group.next().makeSucceededFuture(lock.withLockVoid { cache[LLBInternedKey(key)] = entry })
     }
 }
@@ -0,0 +1,375 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+#if canImport(Darwin)
+import Darwin
+#else
+import Glibc
+#endif
+
+import Foundation
+import NIO
+import NIOConcurrencyHelpers
+import TSCBasic
+
+
+/// A persistent implementation of the `LLBFunctionCache` protocol, backed by a single append-only log file.
+///
+/// All entries are kept in an in-memory index which is loaded from the log when the cache is created, so lookups never
+/// touch the disk. Updates are appended to the log in batches: all updates received within `syncInterval` are written
+/// and synced with a single fsync, and the returned futures complete once their batch is durable. When the log
+/// accumulates too many superseded records, it is compacted by rewriting the live entries into a new log. Records are
+/// checksummed, and the ones that were corrupted on disk are skipped when the log is loaded.
+public final class LLBLogStructuredFunctionCache: LLBFunctionCache {
+    public enum Error: Swift.Error {
+        case ioError(String, errno: Int32)
+    }
+
+    /// The content root path.
+    public let path: AbsolutePath
+
+    /// Threads capable of running futures.
+    public let group: LLBFuturesDispatchGroup
+
+    /// The time window during which updates are batched into a single write and fsync.
+    public let syncInterval: TimeAmount
+
+    /// The minimum number of records in the log before it is considered for compaction.
+    public let compactionThreshold: Int
+
+    /// A single thread, so that all of the disk operations are serialized.
+    private let threadPool: NIOThreadPool
+
+    /// Completes once the log has been loaded into the index.
+    private let loaded: LLBFuture<Void>
+
+    /// The lock protecting the index and the pending batch.
+    private let lock = Lock()
+    private var index = [LLBDataID: LLBDataID]()
+    private var pendingRecords = ByteBufferAllocator().buffer(capacity: 0)
+    private var pendingPromises = [LLBPromise<Void>]()
+    private var flushScheduled = false
+
+    /// The number of records in the log file, including superseded ones. Only accessed from the thread pool.
+    private var logRecordCount = 0
+
+    /// The file descriptor of the log, opened for appending. Only accessed from the thread pool.
+    private var logFD: CInt = -1
+
+    private var logPath: AbsolutePath {
+        return path.appending(component: "functioncache.log")
+    }
+
+    /// Create a log-structured function cache in `path`. Caches with different versions are stored independently.
+    public init(
+        group: LLBFuturesDispatchGroup,
+        path: AbsolutePath,
+        version: String = "default",
+        syncInterval: TimeAmount = .milliseconds(10),
+        compactionThreshold: Int = 100_000
+    ) {
+        self.group = group
+        self.path = path.appending(component: version)
+        self.syncInterval = syncInterval
+        self.compactionThreshold = compactionThreshold
+        self.threadPool = NIOThreadPool(numberOfThreads: 1)
+        threadPool.start()
+        try? localFileSystem.createDirectory(self.path, recursive: true)
+
+        let loadPromise = group.next().makePromise(of: Void.self)
+        self.loaded = loadPromise.futureResult
+        loadPromise.completeWith(threadPool.runIfActive(eventLoop: group.next()) {
+            try self.load()
+        })
+    }
+
+    deinit {
+        try? threadPool.syncShutdownGracefully()
+        if logFD >= 0 {
+            close(logFD)
+        }
+    }
+
+    public func get(key: LLBKey, _ ctx: Context) -> LLBFuture<LLBDataID?> {
+        let keyID = LLBInternedKey(key).stableHashValue
+        return loaded.map {
+            self.lock.withLock { self.index[keyID] }
+        }
+    }
+
+    public func update(key: LLBKey, value: LLBDataID, _ ctx: Context) -> LLBFuture<Void> {
+        let keyID = LLBInternedKey(key).stableHashValue
+        return loaded.flatMapThrowing { () -> LLBFuture<Void>? in
+            try self.lock.withLock {
+                // Avoid growing the log with records that don't change anything.
+                if self.index[keyID] == value {
+                    return nil
+                }
+                self.index[keyID] = value
+
+                try LLBLogStructuredFunctionCache.writeRecord(key: keyID, value: value, into: &self.pendingRecords)
+                let promise = self.group.next().makePromise(of: Void.self)
+                self.pendingPromises.append(promise)
+
+                if !self.flushScheduled {
+                    self.flushScheduled = true
+                    self.group.next().scheduleTask(in: self.syncInterval) {
+                        self.flush()
+                    }
+                }
+                return promise.futureResult
+            }
+        }.flatMap { future in
+            future ?? self.group.next().makeSucceededFuture(())
+        }
+    }
+
+    /// Rewrites the log so that it only contains the live entries.
+    public func compact() -> LLBFuture<Void> {
+        return loaded.flatMap {
+            self.threadPool.runIfActive(eventLoop: self.group.next()) {
+                try self.compactLog()
+            }
+        }
+    }
+
+    // MARK: - Log management
+
+    /// Appends the pending batch to the log and syncs it, completing the promises of the batch afterwards.
+    private func flush() {
+        let (records, promises): (LLBByteBuffer, [LLBPromise<Void>]) = lock.withLock {
+            defer {
+                pendingRecords.clear()
+                pendingPromises = []
+                flushScheduled = false
+            }
+            return (pendingRecords, pendingPromises)
+        }
+
+        guard !promises.isEmpty else {
+            return
+        }
+
+        threadPool.runIfActive(eventLoop: group.next()) {
+            try self.append(records)
+            self.logRecordCount += promises.count
+            try LLBLogStructuredFunctionCache.sync(self.logFD, self.logPath)
+
+            let liveCount = self.lock.withLock { self.index.count }
+            if self.logRecordCount > self.compactionThreshold && self.logRecordCount > 2 * liveCount {
+                try self.compactLog()
+            }
+        }.whenComplete { result in
+            promises.forEach { $0.completeWith(result) }
+        }
+    }
+
+    /// Loads the log into the index. Records that fail their checksums are skipped, and the log is only truncated after
+    /// the last record that can be read: either a record that runs past the end of the log (e.g. after a crash during
+    /// a write), or a corrupted tail that contains no valid record. Must run on the thread pool.
+    private func load() throws {
+        var entries = [LLBDataID: LLBDataID]()
+        var recordCount = 0
+        var validLength = 0
+
+        if let data = FileManager.default.contents(atPath: logPath.pathString) {
+            var buffer = LLBByteBuffer.withBytes(ArraySlice(data))
+            loop: while true {
+                switch LLBLogStructuredFunctionCache.readRecord(from: &buffer) {
+                case .entry(let key, let value):
+                    entries[key] = value
+                case .corrupted:
+                    // Corrupted records still count towards the log size, so that compaction drops them.
+                    break
+                case .truncated:
+                    break loop
+                }
+                recordCount += 1
+                validLength = buffer.readerIndex
+            }
+        }
+
+        logFD = open(logPath.pathString, O_WRONLY | O_CREAT | O_APPEND, 0o644)
+        guard logFD >= 0 else {
+            throw Error.ioError("open \(logPath)", errno: errno)
+        }
+        guard ftruncate(logFD, off_t(validLength)) == 0 else {
+            throw Error.ioError("truncate \(logPath)", errno: errno)
+        }
+
+        logRecordCount = recordCount
+        lock.withLockVoid {
+            index = entries
+        }
+
+        if logRecordCount > compactionThreshold && logRecordCount > 2 * entries.count {
+            try compactLog()
+        }
+    }
+
+    /// Writes the live entries into a new log, which atomically replaces the old one. Must run on the thread pool.
+    private func compactLog() throws {
+        let entries = lock.withLock { index }
+
+        var records = ByteBufferAllocator().buffer(capacity: entries.count * 100)
+        for (key, value) in entries {
+            try LLBLogStructuredFunctionCache.writeRecord(key: key, value: value, into: &records)
+        }
+
+        let compactedPath = path.appending(component: "functioncache.log.compacting")
+        let fd = open(compactedPath.pathString, O_WRONLY | O_CREAT | O_TRUNC, 0o644)
+        guard fd >= 0 else {
+            throw Error.ioError("open \(compactedPath)", errno: errno)
+        }
+        do {
+            try LLBLogStructuredFunctionCache.writeAll(records, to: fd, compactedPath)
+            try LLBLogStructuredFunctionCache.sync(fd, compactedPath)
+        } catch {
+            close(fd)
+            throw error
+        }
+        close(fd)
+
+        // Updates that arrive during compaction are either already part of the snapshot, or pending and will be
+        // appended to the new log once this completes, since all disk operations are serialized.
+        guard rename(compactedPath.pathString, logPath.pathString) == 0 else {
+            throw Error.ioError("rename \(compactedPath)", errno: errno)
+        }
+
+        close(logFD)
+        logFD = open(logPath.pathString, O_WRONLY | O_APPEND, 0o644)
+        guard logFD >= 0 else {
+            throw Error.ioError("open \(logPath)", errno: errno)
+        }
+        logRecordCount = entries.count
+    }
+
+    private func append(_ records: LLBByteBuffer) throws {
+        try LLBLogStructuredFunctionCache.writeAll(records, to: logFD, logPath)
+    }
+
+    private static func writeAll(_ records: LLBByteBuffer, to fd: CInt, _ path: AbsolutePath) throws {
+        try records.withUnsafeReadableBytes { bytes in
+            var offset = 0
+            while offset < bytes.count {
+                let written = write(fd, bytes.baseAddress! + offset, bytes.count - offset)
+                if written < 0 {
+                    if errno == EINTR {
+                        continue
+                    }
+                    throw Error.ioError("write \(path)", errno: errno)
+                }
+                offset += written
+            }
+        }
+    }
+
+    private static func sync(_ fd: CInt, _ path: AbsolutePath) throws {
+        guard fsync(fd) == 0 else {
+            throw Error.ioError("fsync \(path)", errno: errno)
+        }
+    }
+
+    // MARK: - Record format
+
+    // Each record starts with a header of four 32 bit integers: a magic number, the payload length, the CRC-32 of the
+    // payload, and the CRC-32 of the first three fields. The payload follows: the key and value IDs, each prefixed by
+    // its length as a 32 bit integer. Since the header has its own checksum, a corrupted length is never trusted, and
+    // the magic number lets the reader find the next record after a corrupted header.
+
+    private static let recordMagic: UInt32 = 0x4C42_4643
+
+    private static let headerLength = 16
+
+    /// The size of the largest payload, which is far larger than any pair of IDs. Larger lengths can only come from a
+    /// corrupted header.
+    private static let maxPayloadLength = 1 << 20
+
+    private enum Record {
+        case entry(LLBDataID, LLBDataID)
+
+        /// A record whose header or payload fails its checksum, or whose payload doesn't decode. The reader is moved
+        /// to the next valid header.
+        case corrupted
+
+        /// The end of the log: a record that runs past it, or bytes after which no valid header can be found.
+        case truncated
+    }
+
+    private static func writeRecord(key: LLBDataID, value: LLBDataID, into buffer: inout LLBByteBuffer) throws {
+        var keyBytes = try key.toBytes()
+        var valueBytes = try value.toBytes()
+        var payload = ByteBufferAllocator().buffer(capacity: 8 + keyBytes.readableBytes + valueBytes.readableBytes)
+        payload.writeInteger(UInt32(keyBytes.readableBytes))
+        payload.writeBuffer(&keyBytes)
+        payload.writeInteger(UInt32(valueBytes.readableBytes))
+        payload.writeBuffer(&valueBytes)
+
+        let headerStart = buffer.writerIndex
+        buffer.writeInteger(recordMagic)
+        buffer.writeInteger(UInt32(payload.readableBytes))
+        buffer.writeInteger(payload.withUnsafeReadableBytes { LLBCRC32.checksum($0) })
+        let headerChecksum = buffer.getSlice(at: headerStart, length: headerLength - 4)!.withUnsafeReadableBytes {
+            LLBCRC32.checksum($0)
+        }
+        buffer.writeInteger(headerChecksum)
+        buffer.writeBuffer(&payload)
+    }
+
+    /// Returns the payload length and checksum of the header at the offset, or nil if there isn't a valid header there.
+    private static func header(in buffer: LLBByteBuffer, at offset: Int) -> (length: Int, checksum: UInt32)? {
+        guard offset + headerLength <= buffer.writerIndex,
+              buffer.getInteger(at: offset, as: UInt32.self) == recordMagic,
+              let length = buffer.getInteger(at: offset + 4, as: UInt32.self),
+              let checksum = buffer.getInteger(at: offset + 8, as: UInt32.self),
+              let headerChecksum = buffer.getInteger(at: offset + 12, as: UInt32.self),
+              length <= maxPayloadLength else {
+            return nil
+        }
+        let expectedChecksum = buffer.getSlice(at: offset, length: headerLength - 4)!.withUnsafeReadableBytes {
+            LLBCRC32.checksum($0)
+        }
+        guard headerChecksum == expectedChecksum else {
+            return nil
+        }
+        return (Int(length), checksum)
+    }
+
+    private static func readRecord(from buffer: inout LLBByteBuffer) -> Record {
+        let start = buffer.readerIndex
+        guard buffer.readableBytes >= headerLength else {
+            return .truncated
+        }
+
+        guard let recordHeader = header(in: buffer, at: start) else {
+            // Skip to the next valid header. Without one, the rest of the log holds no record that could be kept.
+            guard let next = (start + 1..<buffer.writerIndex).first(where: { header(in: buffer, at: $0) != nil }) else {
+                return .truncated
+            }
+            buffer.moveReaderIndex(to: next)
+            return .corrupted
+        }
+
+        buffer.moveReaderIndex(forwardBy: headerLength)
+        guard var payload = buffer.readSlice(length: recordHeader.length) else {
+            buffer.moveReaderIndex(to: start)
+            return .truncated
+        }
+
+        guard payload.withUnsafeReadableBytes({ LLBCRC32.checksum($0) }) == recordHeader.checksum,
+              let keyLength = payload.readInteger(as: UInt32.self),
+              let keyBytes = payload.readSlice(length: Int(keyLength)),
+              let valueLength = payload.readInteger(as: UInt32.self),
+              let valueBytes = payload.readSlice(length: Int(valueLength)),
+              let key = try? LLBDataID(from: keyBytes),
+              let value = try? LLBDataID(from: valueBytes) else {
+            return .corrupted
+        }
+        return .entry(key, value)
+    }
+}
@@ -0,0 +1,29 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+/// A CAS database that can write multiple objects with fewer round trips than writing each of them on its own, for
+/// example by grouping them into batch requests to a remote server.
+public protocol LLBBatchPutCASDatabase: LLBCASDatabase {
+    /// Writes the objects to the database, returning their IDs in the same order as the objects.
+    func batchPut(_ objects: [LLBCASObject], _ ctx: Context) -> LLBFuture<[LLBDataID]>
+}
+
+public extension LLBCASDatabase {
+    /// Writes the objects to the database, returning their IDs in the same order as the objects. Databases that
+    /// conform to `LLBBatchPutCASDatabase` write them together, while others write each object concurrently.
+    func put(objects: [LLBCASObject], _ ctx: Context) -> LLBFuture<[LLBDataID]> {
+        if objects.isEmpty {
+            return group.next().makeSucceededFuture([])
+        }
+        if let database = self as? LLBBatchPutCASDatabase {
+            return database.batchPut(objects, ctx)
+        }
+        let futures = objects.map { put(refs: $0.refs, data: $0.data, ctx) }
+        return LLBFuture.whenAllSucceed(futures, on: group.next())
+    }
+}
@@ -0,0 +1,158 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+
+/// A map that keeps its entries in least recently used order, and evicts the least recently used ones once the total
+/// cost of the entries exceeds its capacity. Each entry costs 1 unless a cost is given when it is inserted, so the
+/// capacity is the maximum number of entries by default.
+///
+/// The map isn't synchronized, so it must be used while holding the lock of its owner.
+public final class LLBBoundedLRU<Key: Hashable, Value> {
+    private final class Entry {
+        let key: Key
+        let value: Value
+        let cost: Int
+
+        /// The next more recently used entry.
+        weak var previous: Entry?
+
+        /// The next less recently used entry.
+        var next: Entry?
+
+        init(key: Key, value: Value, cost: Int) {
+            self.key = key
+            self.value = value
+            self.cost = cost
+        }
+    }
+
+    /// The maximum total cost of the entries, or nil if entries are never evicted.
+    public let capacity: Int?
+
+    /// The total cost of the entries.
+    public private(set) var totalCost = 0
+
+    private var entries = [Key: Entry]()
+    private var mostRecentlyUsed: Entry?
+    private var leastRecentlyUsed: Entry?
+
+    public init(capacity: Int?) {
+        precondition(capacity.map { $0 >= 0 } ?? true, "the capacity can't be negative")
+        self.capacity = capacity
+    }
+
+    deinit {
+        releaseList()
+    }
+
+    /// The number of entries.
+    public var count: Int {
+        return entries.count
+    }
+
+    public func contains(_ key: Key) -> Bool {
+        return entries[key] != nil
+    }
+
+    /// Returns the value for the key, marking it as the most recently used.
+    public subscript(key: Key) -> Value? {
+        guard let entry = entries[key] else {
+            return nil
+        }
+        if entry !== mostRecentlyUsed {
+            unlink(entry)
+            pushFront(entry)
+        }
+        return entry.value
+    }
+
+    /// Inserts the value as the most recently used, replacing the current value for the key. Returns the entries that
+    /// were evicted to make room for it, which is the new entry itself if its cost exceeds the capacity.
+    @discardableResult
+    public func insert(_ value: Value, for key: Key, cost: Int = 1) -> [(key: Key, value: Value)] {
+        precondition(cost >= 0, "the cost can't be negative")
+        removeValue(forKey: key)
+
+        if let capacity = capacity, cost > capacity {
+            return [(key: key, value: value)]
+        }
+
+        let entry = Entry(key: key, value: value, cost: cost)
+        entries[key] = entry
+        pushFront(entry)
+        totalCost += cost
+
+        var evicted = [(key: Key, value: Value)]()
+        if let capacity = capacity {
+            while totalCost > capacity, let last = leastRecentlyUsed {
+                removeValue(forKey: last.key)
+                evicted.append((key: last.key, value: last.value))
+            }
+        }
+        return evicted
+    }
+
+    @discardableResult
+    public func removeValue(forKey key: Key) -> Value? {
+        guard let entry = entries.removeValue(forKey: key) else {
+            return nil
+        }
+        unlink(entry)
+        totalCost -= entry.cost
+        return entry.value
+    }
+
+    /// Removes the entries for which `shouldBeRemoved` returns true.
+    public func removeAll(where shouldBeRemoved: (Key, Value) throws -> Bool) rethrows {
+        for (key, entry) in entries where try shouldBeRemoved(key, entry.value) {
+            removeValue(forKey: key)
+        }
+    }
+
+    public func removeAll() {
+        releaseList()
+        entries.removeAll()
+        mostRecentlyUsed = nil
+        leastRecentlyUsed = nil
+        totalCost = 0
+    }
+
+    /// Breaks the chain iteratively, since releasing a long list recursively can overflow the stack.
+    private func releaseList() {
+        var entry = mostRecentlyUsed
+        while let current = entry {
+            entry = current.next
+            current.next = nil
+        }
+    }
+
+    private func pushFront(_ entry: Entry) {
+        entry.previous = nil
+        entry.next = mostRecentlyUsed
+        mostRecentlyUsed?.previous = entry
+        mostRecentlyUsed = entry
+        if leastRecentlyUsed == nil {
+            leastRecentlyUsed = entry
+        }
+    }
+
+    private func unlink(_ entry: Entry) {
+        if let previous = entry.previous {
+            previous.next = entry.next
+        } else if mostRecentlyUsed === entry {
+            mostRecentlyUsed = entry.next
+        }
+        if let next = entry.next {
+            next.previous = entry.previous
+        } else if leastRecentlyUsed === entry {
+            leastRecentlyUsed = entry.previous
+        }
+        entry.previous = nil
+        entry.next = nil
+    }
+}
@@ -0,0 +1,171 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import NIOConcurrencyHelpers
+
+
+public enum LLBCancellationError: Error {
+    /// The work was cancelled before it completed, with the reason given to `LLBCancellationToken.cancel(reason:)`.
+    case cancelled(String)
+}
+
+/// A handler registered with `LLBCancellationToken.onCancel(_:)`, which can be removed once the work it cancels is
+/// done.
+public struct LLBCancellationHandle {
+    fileprivate let id: Int
+}
+
+/// Cancels the work of a build. The token is stored in the context of the build, and observed by the engine (which
+/// stops starting new evaluations), the executors (which stop launching actions and terminate the ones that are
+/// running) and long transfers. Cancelled work fails with `LLBCancellationError`.
+///
+/// A token is cancelled at most once, and stays cancelled; use a new token for each build.
+public final class LLBCancellationToken {
+    private let lock = Lock()
+    private var _reason: String?
+    private var handlers = [Int: (String) -> Void]()
+    private var nextHandlerID = 0
+
+    public init() {}
+
+    public var isCancelled: Bool {
+        return lock.withLock { _reason != nil }
+    }
+
+    /// The reason given when the token was cancelled, or nil if it wasn't cancelled.
+    public var reason: String? {
+        return lock.withLock { _reason }
+    }
+
+    /// Cancels the token and runs its handlers. Only the first call has an effect.
+    public func cancel(reason: String) {
+        let handlers: [(String) -> Void] = lock.withLock {
+            guard _reason == nil else {
+                return []
+            }
+            _reason = reason
+            let handlers = Array(self.handlers.values)
+            self.handlers.removeAll()
+            return handlers
+        }
+        handlers.forEach { $0(reason) }
+    }
+
+    /// Throws `LLBCancellationError` if the token was cancelled.
+    public func checkCancelled() throws {
+        if let reason = reason {
+            throw LLBCancellationError.cancelled(reason)
+        }
+    }
+
+    /// Registers a handler to run when the token is cancelled, or runs it right away if it already is. Handlers run on
+    /// the thread that cancels the token, so they should only signal the work to stop.
+    @discardableResult
+    public func onCancel(_ handler: @escaping (String) -> Void) -> LLBCancellationHandle {
+        let (handle, reason): (LLBCancellationHandle, String?) = lock.withLock {
+            let handle = LLBCancellationHandle(id: nextHandlerID)
+            nextHandlerID += 1
+            if _reason == nil {
+                handlers[handle.id] = handler
+            }
+            return (handle, _reason)
+        }
+        if let reason = reason {
+            handler(reason)
+        }
+        return handle
+    }
+
+    /// Removes a handler that is no longer needed.
+    public func remove(_ handle: LLBCancellationHandle) {
+        lock.withLockVoid {
+            handlers[handle.id] = nil
+        }
+    }
+}
+
+/// The cancellation token of work that is shared by several requesters, such as an evaluation that concurrent builds
+/// are waiting for. Each requester joins with its own token, and the shared token is only cancelled once every
+/// requester has cancelled its own. Requesters without a token can't cancel, so the work they joined is never cancelled.
+final class LLBSharedCancellationToken {
+    let token = LLBCancellationToken()
+
+    private let lock = Lock()
+    private var activeRequesters = 0
+    private var hasUncancellableRequester = false
+    private var handles = [(LLBCancellationToken, LLBCancellationHandle)]()
+    private var finished = false
+
+    var isCancelled: Bool {
+        return token.isCancelled
+    }
+
+    /// Counts a requester, before it is attached with `attach(_:)`. Reserving first allows a requester to join while
+    /// holding a lock, since reserving never runs cancellation handlers.
+    func reserve(_ requester: LLBCancellationToken?) {
+        lock.withLockVoid {
+            if requester == nil {
+                hasUncancellableRequester = true
+            } else {
+                activeRequesters += 1
+            }
+        }
+    }
+
+    /// Observes the token of a reserved requester, which may cancel the shared token right away if it was the last
+    /// active requester and is already cancelled.
+    func attach(_ requester: LLBCancellationToken?) {
+        guard let requester = requester else {
+            return
+        }
+        let handle = requester.onCancel { reason in
+            let cancel: Bool = self.lock.withLock {
+                self.activeRequesters -= 1
+                return self.activeRequesters == 0 && !self.hasUncancellableRequester && !self.finished
+            }
+            if cancel {
+                self.token.cancel(reason: reason)
+            }
+        }
+        let remove: Bool = lock.withLock {
+            guard !finished else {
+                return true
+            }
+            handles.append((requester, handle))
+            return false
+        }
+        if remove {
+            requester.remove(handle)
+        }
+    }
+
+    /// Stops observing the requesters once the shared work is done.
+    func finish() {
+        let handles: [(LLBCancellationToken, LLBCancellationHandle)] = lock.withLock {
+            finished = true
+            let handles = self.handles
+            self.handles.removeAll()
+            return handles
+        }
+        for (requester, handle) in handles {
+            requester.remove(handle)
+        }
+    }
+}
+
+/// Support storing and retrieving a cancellation token from a Context.
+public extension Context {
+    var cancellationToken: LLBCancellationToken? {
+        get {
+            return self[ObjectIdentifier(LLBCancellationToken.self)] as? LLBCancellationToken
+        }
+        set {
+            self[ObjectIdentifier(LLBCancellationToken.self)] = newValue
+        }
+    }
+}
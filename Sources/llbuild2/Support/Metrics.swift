@@ -0,0 +1,227 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Dispatch
+
+import NIOConcurrencyHelpers
+import TSCUtility
+
+/// The dimensions of a metric, as (name, value) pairs.
+public typealias LLBMetricDimensions = [(String, String)]
+
+/// A destination for the metrics recorded by the engine, the function caches and the CAS databases.
+///
+/// The model follows swift-metrics (labelled counters and recorders with dimensions); `LLBSwiftMetricsSink` in the
+/// llbuild2Metrics library forwards the metrics to the bootstrapped `MetricsSystem` backend.
+public protocol LLBMetricsSink {
+    /// Increments the counter with the given label and dimensions.
+    func increment(counter label: String, by amount: Int64, dimensions: LLBMetricDimensions)
+
+    /// Records a value in the histogram with the given label and dimensions.
+    func record(histogram label: String, value: Double, dimensions: LLBMetricDimensions)
+}
+
+public extension LLBMetricsSink {
+    func increment(counter label: String, dimensions: LLBMetricDimensions = []) {
+        increment(counter: label, by: 1, dimensions: dimensions)
+    }
+
+    /// Records the time taken by the future returned by `body` in the histogram, in seconds.
+    func time<T>(_ label: String, dimensions: LLBMetricDimensions = [], _ body: () -> LLBFuture<T>) -> LLBFuture<T> {
+        let start = DispatchTime.now().uptimeNanoseconds
+        let future = body()
+        future.whenComplete { _ in
+            let elapsed = DispatchTime.now().uptimeNanoseconds - start
+            self.record(histogram: label, value: Double(elapsed) / 1_000_000_000, dimensions: dimensions)
+        }
+        return future
+    }
+}
+
+/// The labels of the metrics recorded by llbuild2.
+public enum LLBMetricLabel {
+    /// Evaluations of keys by the engine, with a `key_type` dimension.
+    public static let evaluations = "llbuild2.engine.evaluations"
+
+    /// The duration of key evaluations, in seconds, with a `key_type` dimension.
+    public static let evaluationDuration = "llbuild2.engine.evaluation_duration_seconds"
+
+    /// Function cache hits and misses, with a `key_type` dimension.
+    public static let functionCacheHits = "llbuild2.function_cache.hits"
+    public static let functionCacheMisses = "llbuild2.function_cache.misses"
+
+    /// The duration of function cache lookups, in seconds, with a `key_type` dimension.
+    public static let functionCacheLookupDuration = "llbuild2.function_cache.lookup_duration_seconds"
+
+    /// CAS database operations, with an `operation` dimension.
+    public static let casOperations = "llbuild2.cas.operations"
+
+    /// The bytes read from or written to the CAS database, with an `operation` dimension.
+    public static let casBytes = "llbuild2.cas.bytes"
+
+    /// The duration of CAS operations, in seconds, with an `operation` dimension.
+    public static let casDuration = "llbuild2.cas.duration_seconds"
+}
+
+/// A metrics sink that aggregates the metrics in memory, for tests and for reporting at the end of a build.
+public final class LLBInMemoryMetrics: LLBMetricsSink {
+    public struct Histogram: Equatable {
+        public var count = 0
+        public var sum = 0.0
+        public var min = Double.infinity
+        public var max = -Double.infinity
+
+        public var mean: Double {
+            return count == 0 ? 0 : sum / Double(count)
+        }
+    }
+
+    /// Identifies a metric by label and dimensions.
+    public struct MetricID: Hashable {
+        public let label: String
+        public let dimensions: [String]
+
+        public init(_ label: String, dimensions: LLBMetricDimensions = []) {
+            self.label = label
+            self.dimensions = dimensions.map { "\($0.0)=\($0.1)" }
+        }
+    }
+
+    private let lock = Lock()
+    private var counters = [MetricID: Int64]()
+    private var histograms = [MetricID: Histogram]()
+
+    public init() {}
+
+    public func increment(counter label: String, by amount: Int64, dimensions: LLBMetricDimensions) {
+        let id = MetricID(label, dimensions: dimensions)
+        lock.withLockVoid {
+            counters[id, default: 0] += amount
+        }
+    }
+
+    public func record(histogram label: String, value: Double, dimensions: LLBMetricDimensions) {
+        let id = MetricID(label, dimensions: dimensions)
+        lock.withLockVoid {
+            var histogram = histograms[id, default: Histogram()]
+            histogram.count += 1
+            histogram.sum += value
+            histogram.min = Swift.min(histogram.min, value)
+            histogram.max = Swift.max(histogram.max, value)
+            histograms[id] = histogram
+        }
+    }
+
+    public func counter(_ label: String, dimensions: LLBMetricDimensions = []) -> Int64 {
+        let id = MetricID(label, dimensions: dimensions)
+        return lock.withLock { counters[id] ?? 0 }
+    }
+
+    public func histogram(_ label: String, dimensions: LLBMetricDimensions = []) -> Histogram? {
+        let id = MetricID(label, dimensions: dimensions)
+        return lock.withLock { histograms[id] }
+    }
+
+    /// All of the counters recorded so far.
+    public var allCounters: [MetricID: Int64] {
+        return lock.withLock { counters }
+    }
+
+    /// All of the histograms recorded so far.
+    public var allHistograms: [MetricID: Histogram] {
+        return lock.withLock { histograms }
+    }
+}
+
+/// A CAS database wrapper that records the number, size and duration of the operations on the underlying database.
+public final class LLBMetricsCASDatabase: LLBBatchPutCASDatabase {
+    public let database: LLBCASDatabase
+
+    /// The sink that the operations are recorded in, or nil to record them in the metrics of their contexts (which is
+    /// how the engine wraps its database once for all of its evaluations).
+    public let metrics: LLBMetricsSink?
+
+    public var group: LLBFuturesDispatchGroup {
+        return database.group
+    }
+
+    public init(_ database: LLBCASDatabase, metrics: LLBMetricsSink? = nil) {
+        self.database = database
+        self.metrics = metrics
+    }
+
+    public func supportedFeatures() -> LLBFuture<LLBCASFeatures> {
+        return database.supportedFeatures()
+    }
+
+    public func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> {
+        return measure("contains", ctx) { database.contains(id, ctx) }
+    }
+
+    public func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        return measure("get", ctx) { database.get(id, ctx) }.map { object in
+            self.sink(ctx)?.increment(
+                counter: LLBMetricLabel.casBytes, by: Int64(object?.data.readableBytes ?? 0),
+                dimensions: [("operation", "get")]
+            )
+            return object
+        }
+    }
+
+    public func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return database.identify(refs: refs, data: data, ctx)
+    }
+
+    public func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        countPut(data, ctx)
+        return measure("put", ctx) { database.put(refs: refs, data: data, ctx) }
+    }
+
+    public func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        countPut(data, ctx)
+        return measure("put", ctx) { database.put(knownID: id, refs: refs, data: data, ctx) }
+    }
+
+    /// Batches are forwarded as a whole, so that wrapping a database doesn't lose its batching.
+    public func batchPut(_ objects: [LLBCASObject], _ ctx: Context) -> LLBFuture<[LLBDataID]> {
+        objects.forEach { countPut($0.data, ctx) }
+        return measure("batch_put", ctx) { database.put(objects: objects, ctx) }
+    }
+
+    private func sink(_ ctx: Context) -> LLBMetricsSink? {
+        return metrics ?? ctx.metrics
+    }
+
+    private func countPut(_ data: LLBByteBuffer, _ ctx: Context) {
+        sink(ctx)?.increment(counter: LLBMetricLabel.casBytes, by: Int64(data.readableBytes), dimensions: [("operation", "put")])
+    }
+
+    private func measure<T>(_ operation: String, _ ctx: Context, _ body: () -> LLBFuture<T>) -> LLBFuture<T> {
+        guard let metrics = sink(ctx) else {
+            return body()
+        }
+        let dimensions = [("operation", operation)]
+        metrics.increment(counter: LLBMetricLabel.casOperations, dimensions: dimensions)
+        return metrics.time(LLBMetricLabel.casDuration, dimensions: dimensions, body)
+    }
+}
+
+/// Support storing and retrieving a metrics sink from a Context.
+public extension Context {
+    var metrics: LLBMetricsSink? {
+        get {
+            guard let metrics = self[ObjectIdentifier(LLBMetricsSink.self)] as? LLBMetricsSink else {
+                return nil
+            }
+            return metrics
+        }
+        set {
+            self[ObjectIdentifier(LLBMetricsSink.self)] = newValue
+        }
+    }
+}
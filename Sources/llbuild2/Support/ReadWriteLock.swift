@@ -0,0 +1,47 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+#if canImport(Darwin)
+import Darwin
+#else
+import Glibc
+#endif
+
+
+/// A thin wrapper around pthread_rwlock_t, allowing multiple concurrent readers or a single writer.
+final class ReadWriteLock {
+    private let rwlock: UnsafeMutablePointer<pthread_rwlock_t>
+
+    init() {
+        self.rwlock = UnsafeMutablePointer<pthread_rwlock_t>.allocate(capacity: 1)
+        let err = pthread_rwlock_init(self.rwlock, nil)
+        precondition(err == 0, "pthread_rwlock_init failed with error \(err)")
+    }
+
+    deinit {
+        let err = pthread_rwlock_destroy(self.rwlock)
+        precondition(err == 0, "pthread_rwlock_destroy failed with error \(err)")
+        self.rwlock.deallocate()
+    }
+
+    @inline(__always)
+    func withReaderLock<T>(_ body: () throws -> T) rethrows -> T {
+        let err = pthread_rwlock_rdlock(self.rwlock)
+        precondition(err == 0, "pthread_rwlock_rdlock failed with error \(err)")
+        defer { pthread_rwlock_unlock(self.rwlock) }
+        return try body()
+    }
+
+    @inline(__always)
+    func withWriterLock<T>(_ body: () throws -> T) rethrows -> T {
+        let err = pthread_rwlock_wrlock(self.rwlock)
+        precondition(err == 0, "pthread_rwlock_wrlock failed with error \(err)")
+        defer { pthread_rwlock_unlock(self.rwlock) }
+        return try body()
+    }
+}
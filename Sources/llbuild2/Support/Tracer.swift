@@ -0,0 +1,273 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Dispatch
+import Foundation
+
+import NIOConcurrencyHelpers
+import TSCBasic
+import TSCUtility
+
+/// The kinds of work recorded by an `LLBTracer`.
+public enum LLBTraceCategory: String, CaseIterable {
+    /// The evaluation of a key by the engine, including the time spent waiting on its dependencies.
+    case evaluation
+
+    /// Build system analysis, such as the evaluation of a target.
+    case analysis
+
+    /// Function cache lookups and updates.
+    case functionCache
+
+    /// CAS database reads and writes.
+    case cas
+
+    /// Time spent by actions waiting for the executor to run them.
+    case executorQueue
+
+    /// Action execution.
+    case execution
+}
+
+/// A completed span of work recorded by an `LLBTracer`.
+public struct LLBTraceEvent {
+    public let name: String
+    public let category: LLBTraceCategory
+
+    /// The start and end of the span, in nanoseconds since the tracer was created.
+    public let start: UInt64
+    public let end: UInt64
+
+    public let arguments: [String: String]
+
+    public var duration: UInt64 {
+        return end - start
+    }
+}
+
+/// An in-progress span of work, which is recorded when ended.
+public struct LLBTraceSpan {
+    fileprivate let tracer: LLBTracer
+    fileprivate let name: String
+    fileprivate let category: LLBTraceCategory
+    fileprivate let start: UInt64
+    fileprivate let arguments: [String: String]
+    fileprivate let evaluationKey: LLBInternedKey?
+
+    public func end() {
+        tracer.record(self, end: tracer.now())
+    }
+}
+
+/// Records timed spans of work during a build, for profiling. Tracing is opt-in: the engine and the functions only
+/// record spans when a tracer is set on the context (`ctx.tracer`).
+///
+/// The recorded events can be exported in the Chrome trace event format (which Perfetto and chrome://tracing can open),
+/// summarized by category to find out whether a build is bound by analysis, CAS access or execution, and used to
+/// compute the critical path of the key evaluations.
+public final class LLBTracer {
+    private let origin = DispatchTime.now().uptimeNanoseconds
+
+    private let lock = Lock()
+    private var events = [LLBTraceEvent]()
+
+    /// The evaluation event of each key, and the keys requested by each evaluation, for the critical path.
+    private var evaluationEvents = [LLBInternedKey: Int]()
+    private var dependencies = [LLBInternedKey: [LLBInternedKey]]()
+
+    public init() {}
+
+    /// The events recorded so far, in completion order.
+    public var recordedEvents: [LLBTraceEvent] {
+        return lock.withLock { events }
+    }
+
+    public func startSpan(_ name: String, category: LLBTraceCategory, arguments: [String: String] = [:]) -> LLBTraceSpan {
+        return LLBTraceSpan(
+            tracer: self, name: name, category: category, start: now(), arguments: arguments, evaluationKey: nil
+        )
+    }
+
+    /// Records a span covering the execution of the future returned by `body`.
+    public func trace<T>(
+        _ name: String,
+        category: LLBTraceCategory,
+        arguments: [String: String] = [:],
+        _ body: () -> LLBFuture<T>
+    ) -> LLBFuture<T> {
+        let span = startSpan(name, category: category, arguments: arguments)
+        let future = body()
+        future.whenComplete { _ in span.end() }
+        return future
+    }
+
+    func startEvaluation(of key: LLBInternedKey) -> LLBTraceSpan {
+        return LLBTraceSpan(
+            tracer: self, name: key.key.logDescription(), category: .evaluation, start: now(), arguments: [:],
+            evaluationKey: key
+        )
+    }
+
+    func recordDependency(from requester: LLBInternedKey, to key: LLBInternedKey) {
+        lock.withLockVoid {
+            dependencies[requester, default: []].append(key)
+        }
+    }
+
+    fileprivate func now() -> UInt64 {
+        return DispatchTime.now().uptimeNanoseconds - origin
+    }
+
+    fileprivate func record(_ span: LLBTraceSpan, end: UInt64) {
+        let event = LLBTraceEvent(
+            name: span.name, category: span.category, start: span.start, end: max(end, span.start),
+            arguments: span.arguments
+        )
+        lock.withLockVoid {
+            if let key = span.evaluationKey {
+                evaluationEvents[key] = events.count
+            }
+            events.append(event)
+        }
+    }
+
+    // MARK: - Analysis
+
+    /// The wall-clock time during which at least one span of each category was in progress, in nanoseconds. Comparing
+    /// the categories shows what the build was mostly waiting on.
+    public func busyTime() -> [LLBTraceCategory: UInt64] {
+        let events = recordedEvents
+        var result = [LLBTraceCategory: UInt64]()
+        for category in LLBTraceCategory.allCases {
+            let intervals = events.filter { $0.category == category }.sorted { $0.start < $1.start }
+            var total: UInt64 = 0
+            var current: (start: UInt64, end: UInt64)? = nil
+            for event in intervals {
+                if let interval = current, event.start <= interval.end {
+                    current = (interval.start, max(interval.end, event.end))
+                } else {
+                    if let interval = current {
+                        total += interval.end - interval.start
+                    }
+                    current = (event.start, event.end)
+                }
+            }
+            if let interval = current {
+                total += interval.end - interval.start
+            }
+            result[category] = total
+        }
+        return result
+    }
+
+    /// The critical path of the key evaluations: starting from the evaluation that completed last, each step follows
+    /// the dependency that completed last, since that's the one the evaluation was waiting on.
+    public func criticalPath() -> [LLBTraceEvent] {
+        let (events, evaluationEvents, dependencies) = lock.withLock { (self.events, self.evaluationEvents, self.dependencies) }
+
+        guard var current = evaluationEvents.max(by: { events[$0.value].end < events[$1.value].end })?.key else {
+            return []
+        }
+
+        var path = [LLBTraceEvent]()
+        var visited = Set<LLBInternedKey>()
+        while let index = evaluationEvents[current], visited.insert(current).inserted {
+            path.append(events[index])
+            let last = dependencies[current, default: []].compactMap { key -> (LLBInternedKey, UInt64)? in
+                guard let dependencyIndex = evaluationEvents[key] else {
+                    return nil
+                }
+                return (key, events[dependencyIndex].end)
+            }.max { $0.1 < $1.1 }
+            guard let next = last else {
+                break
+            }
+            current = next.0
+        }
+        return path
+    }
+
+    // MARK: - Export
+
+    /// Serializes the events in the Chrome trace event format. Overlapping events are spread across tracks so that
+    /// they always nest, and the critical path is added as a separate process.
+    public func chromeTraceData() throws -> Data {
+        let events = recordedEvents.sorted { $0.start < $1.start }
+
+        var traceEvents = [[String: Any]]()
+        var trackEnds = [UInt64]()
+        for event in events {
+            let track: Int
+            if let free = trackEnds.firstIndex(where: { $0 <= event.start }) {
+                track = free
+                trackEnds[free] = event.end
+            } else {
+                track = trackEnds.count
+                trackEnds.append(event.end)
+            }
+            traceEvents.append(LLBTracer.chromeEvent(event, pid: 1, tid: track))
+        }
+
+        for event in criticalPath() {
+            traceEvents.append(LLBTracer.chromeEvent(event, pid: 2, tid: 0))
+        }
+
+        traceEvents.append([
+            "name": "process_name", "ph": "M", "pid": 2, "args": ["name": "Critical path"],
+        ])
+
+        return try JSONSerialization.data(
+            withJSONObject: ["traceEvents": traceEvents, "displayTimeUnit": "ms"], options: []
+        )
+    }
+
+    /// Writes the events in the Chrome trace event format to the given path.
+    public func writeChromeTrace(to path: AbsolutePath) throws {
+        try chromeTraceData().write(to: URL(fileURLWithPath: path.pathString))
+    }
+
+    private static func chromeEvent(_ event: LLBTraceEvent, pid: Int, tid: Int) -> [String: Any] {
+        return [
+            "name": event.name,
+            "cat": event.category.rawValue,
+            "ph": "X",
+            "ts": Double(event.start) / 1000,
+            "dur": Double(event.duration) / 1000,
+            "pid": pid,
+            "tid": tid,
+            "args": event.arguments,
+        ]
+    }
+}
+
+/// Support storing and retrieving a tracer instance from a Context.
+public extension Context {
+    var tracer: LLBTracer? {
+        get {
+            guard let tracer = self[ObjectIdentifier(LLBTracer.self)] as? LLBTracer else {
+                return nil
+            }
+            return tracer
+        }
+        set {
+            self[ObjectIdentifier(LLBTracer.self)] = newValue
+        }
+    }
+
+    /// Records a span covering the execution of the future returned by `body` if a tracer is set on the context.
+    func traced<T>(
+        _ name: @autoclosure () -> String,
+        category: LLBTraceCategory,
+        _ body: () -> LLBFuture<T>
+    ) -> LLBFuture<T> {
+        guard let tracer = tracer else {
+            return body()
+        }
+        return tracer.trace(name(), category: category, body)
+    }
+}
@@ -0,0 +1,149 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import BazelRemoteAPI
+import llbuild2
+@testable import LLBBazelBackend
+import NIO
+import XCTest
+
+final class BazelCASDatabaseTests: XCTestCase {
+    private var server: FakeRemoteServer! = nil
+    private var group: MultiThreadedEventLoopGroup! = nil
+    private var databases = [LLBBazelCASDatabase]()
+
+    override func tearDownWithError() throws {
+        for db in databases {
+            try db.connection.close().wait()
+        }
+        databases = []
+        try group?.syncShutdownGracefully()
+        try server?.shutdown()
+    }
+
+    private func makeDatabase(
+        maxBatchTotalSize: Int64 = 0,
+        batchWindow: TimeAmount? = .milliseconds(50)
+    ) throws -> LLBBazelCASDatabase {
+        server = try FakeRemoteServer(maxBatchTotalSize: maxBatchTotalSize)
+        group = MultiThreadedEventLoopGroup(numberOfThreads: 2)
+        let db = try LLBBazelCASDatabase(group: group, url: server.url, batchWindow: batchWindow, useCompression: false)
+        databases.append(db)
+        return db
+    }
+
+    private func object(_ index: Int, size: Int) -> LLBByteBuffer {
+        return LLBByteBuffer.withString(String(repeating: "\(index % 10)", count: size))
+    }
+
+    func testCoalescesConcurrentRequests() throws {
+        let db = try makeDatabase()
+        let ctx = Context()
+
+        let ids = try LLBFuture.whenAllSucceed((0..<10).map { db.put(data: object($0, size: 10), ctx) }, on: group.next()).wait()
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchUpdateBlobsCalls }, [10])
+
+        let contains = try LLBFuture.whenAllSucceed(ids.map { db.contains($0, ctx) }, on: group.next()).wait()
+        XCTAssertEqual(contains, Array(repeating: true, count: 10))
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.findMissingBlobsCalls }, [10])
+
+        let objects = try LLBFuture.whenAllSucceed(ids.map { db.get($0, ctx) }, on: group.next()).wait()
+        XCTAssertEqual(objects.map { $0?.data }, (0..<10).map { Optional(object($0, size: 10)) })
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchReadBlobsCalls }, [10])
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.byteStreamWrites.count }, 0)
+    }
+
+    func testSplitsBatchesByTheServerLimit() throws {
+        // Each object takes a bit over 700 bytes of the batch, so only two fit in the 2000 bytes allowed by the server.
+        let db = try makeDatabase(maxBatchTotalSize: 2000)
+        let ctx = Context()
+
+        let ids = try LLBFuture.whenAllSucceed((0..<6).map { db.put(data: object($0, size: 600), ctx) }, on: group.next()).wait()
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchUpdateBlobsCalls }, [2, 2, 2])
+
+        let objects = try LLBFuture.whenAllSucceed(ids.map { db.get($0, ctx) }, on: group.next()).wait()
+        XCTAssertEqual(objects.map { $0?.data }, (0..<6).map { Optional(object($0, size: 600)) })
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchReadBlobsCalls }, [2, 2, 2])
+    }
+
+    func testOversizedBlobsUseByteStream() throws {
+        let db = try makeDatabase(maxBatchTotalSize: 2000)
+        let ctx = Context()
+
+        let small = try db.put(data: object(0, size: 100), ctx).wait()
+        let large = try db.put(data: object(1, size: 3000), ctx).wait()
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchUpdateBlobsCalls }, [1])
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.byteStreamWrites.count }, 1)
+
+        XCTAssertEqual(try db.get(large, ctx).wait()?.data, object(1, size: 3000))
+        XCTAssertEqual(try db.get(small, ctx).wait()?.data, object(0, size: 100))
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchReadBlobsCalls }, [1])
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.byteStreamReads.count }, 1)
+
+        // Batch puts send the objects that fit in as few calls as possible, and stream the others.
+        let objects = [object(2, size: 100), object(3, size: 3000), object(4, size: 100)].map { LLBCASObject(refs: [], data: $0) }
+        let ids = try db.batchPut(objects, ctx).wait()
+        XCTAssertEqual(try ids.map { try db.get($0, ctx).wait()?.data }, objects.map { Optional($0.data) })
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchUpdateBlobsCalls }, [1, 2])
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.byteStreamWrites.count }, 2)
+    }
+
+    func testMapsErrorsToEachDigest() throws {
+        let db = try makeDatabase()
+        let ctx = Context()
+
+        let failingID = try db.identify(data: object(0, size: 10), ctx).wait()
+        let failingHash = try failingID.asBazelDigest().hash
+        server.storage.lock.withLockVoid { server.storage.failingHashes.insert(failingHash) }
+
+        let failingPut = db.put(data: object(0, size: 10), ctx)
+        let put = db.put(data: object(1, size: 10), ctx)
+        XCTAssertThrowsError(try failingPut.wait()) { error in
+            guard case LLBBazelCASDatabase.Error.batchRequestFailed(let status) = error else {
+                XCTFail("Unexpected error \(error)")
+                return
+            }
+            XCTAssertEqual(status.code, Int32(Google_Rpc_Code.internal.rawValue))
+        }
+        let id = try put.wait()
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchUpdateBlobsCalls }, [2])
+
+        // Reads of the same batch are failed, found or missing on their own.
+        server.storage.lock.withLockVoid { server.storage.blobs[failingHash] = Data() }
+        let missingID = try db.identify(data: object(2, size: 10), ctx).wait()
+        let failingGet = db.get(failingID, ctx)
+        let get = db.get(id, ctx)
+        let missingGet = db.get(missingID, ctx)
+        XCTAssertThrowsError(try failingGet.wait())
+        XCTAssertEqual(try get.wait()?.data, object(1, size: 10))
+        XCTAssertNil(try missingGet.wait())
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.batchReadBlobsCalls }, [3])
+    }
+
+    func testFailsReadsLeftOutOfTheResponse() throws {
+        let db = try makeDatabase()
+        let ctx = Context()
+
+        let omittedID = try db.put(data: object(0, size: 10), ctx).wait()
+        let id = try db.put(data: object(1, size: 10), ctx).wait()
+        let omittedHash = try omittedID.asBazelDigest().hash
+        server.storage.lock.withLockVoid { server.storage.omittedHashes.insert(omittedHash) }
+
+        let omittedGet = db.get(omittedID, ctx)
+        let get = db.get(id, ctx)
+        XCTAssertThrowsError(try omittedGet.wait()) { error in
+            guard case LLBBazelCASDatabase.Error.incompleteRead = error else {
+                XCTFail("Unexpected error \(error)")
+                return
+            }
+        }
+        XCTAssertEqual(try get.wait()?.data, object(1, size: 10))
+    }
+}
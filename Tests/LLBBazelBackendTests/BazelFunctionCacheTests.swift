@@ -0,0 +1,45 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+@testable import LLBBazelBackend
+import NIO
+import XCTest
+
+private struct TestKey: LLBKey, Hashable {
+    let name: String
+
+    var stableHashValue: LLBDataID {
+        return LLBDataID(blake3hash: ArraySlice(name.utf8))
+    }
+}
+
+final class BazelFunctionCacheTests: XCTestCase {
+    func testFetchesStdoutThatIsNotInlined() throws {
+        let server = try FakeRemoteServer()
+        defer { XCTAssertNoThrow(try server.shutdown()) }
+        let group = MultiThreadedEventLoopGroup(numberOfThreads: 1)
+        defer { XCTAssertNoThrow(try group.syncShutdownGracefully()) }
+        let ctx = Context()
+
+        let value = LLBDataID(blake3hash: ArraySlice("value".utf8))
+        let writer = try LLBBazelFunctionCache(group: group, url: server.url)
+        try writer.update(key: TestKey(name: "key"), value: value, ctx).wait()
+        try writer.close().wait()
+
+        server.storage.lock.withLockVoid { server.storage.inlinesStdout = false }
+
+        // A new cache has an empty local cache, so it can only find the value in the remote cache.
+        let reader = try LLBBazelFunctionCache(group: group, url: server.url)
+        defer { XCTAssertNoThrow(try reader.close().wait()) }
+        XCTAssertEqual(try reader.get(key: TestKey(name: "key"), ctx).wait(), value)
+        XCTAssertNil(try reader.get(key: TestKey(name: "other"), ctx).wait())
+    }
+}
@@ -0,0 +1,124 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+@testable import LLBBazelBackend
+import NIO
+import NIOConcurrencyHelpers
+import XCTest
+
+private enum BatchError: Error, Equatable {
+    case failed(Int)
+}
+
+final class BlobBatcherTests: XCTestCase {
+    private var group: MultiThreadedEventLoopGroup! = nil
+
+    override func setUp() {
+        group = MultiThreadedEventLoopGroup(numberOfThreads: 1)
+    }
+
+    override func tearDown() {
+        try? group.syncShutdownGracefully()
+        group = nil
+    }
+
+    /// Returns a batcher that doubles its requests, failing the odd ones if `failOdd` is set, and records its batches.
+    private func makeBatcher(
+        window: TimeAmount = .milliseconds(50),
+        maxBatchSize: Int = 1000,
+        maxBatchCount: Int = 1000,
+        failOdd: Bool = false
+    ) -> (LLBBlobBatcher<Int, Int>, () -> [[Int]]) {
+        let lock = Lock()
+        var batches = [[Int]]()
+        let batcher = LLBBlobBatcher<Int, Int>(
+            group: group,
+            window: window,
+            maxBatchSize: maxBatchSize,
+            maxBatchCount: maxBatchCount
+        ) { requests in
+            lock.withLockVoid { batches.append(requests) }
+            return self.group.next().makeSucceededFuture(requests.map { request in
+                failOdd && request % 2 == 1 ? .failure(BatchError.failed(request)) : .success(request * 2)
+            })
+        }
+        return (batcher, { lock.withLock { batches } })
+    }
+
+    func testCoalescesRequestsWithinTheWindow() throws {
+        let (batcher, batches) = makeBatcher()
+
+        let responses = (0..<5).map { batcher.submit($0, size: 1) }
+        XCTAssertEqual(try LLBFuture.whenAllSucceed(responses, on: group.next()).wait(), [0, 2, 4, 6, 8])
+        XCTAssertEqual(batches(), [[0, 1, 2, 3, 4]])
+    }
+
+    func testSplitsBatchesBySize() throws {
+        let (batcher, batches) = makeBatcher(maxBatchSize: 10)
+
+        // A request that doesn't fit sends the pending batch first, and a batch that reaches the limit is sent right
+        // away.
+        let responses = [4, 4, 4, 6, 3].map { batcher.submit($0, size: $0) }
+        XCTAssertEqual(try LLBFuture.whenAllSucceed(responses, on: group.next()).wait(), [8, 8, 8, 12, 6])
+        XCTAssertEqual(batches(), [[4, 4], [4, 6], [3]])
+    }
+
+    func testSplitsBatchesByCount() throws {
+        let (batcher, batches) = makeBatcher(maxBatchCount: 3)
+
+        let responses = (0..<7).map { batcher.submit($0, size: 1) }
+        _ = try LLBFuture.whenAllSucceed(responses, on: group.next()).wait()
+        XCTAssertEqual(batches(), [[0, 1, 2], [3, 4, 5], [6]])
+    }
+
+    func testMapsResultsToEachRequest() throws {
+        let (batcher, batches) = makeBatcher(failOdd: true)
+
+        let responses = (0..<4).map { batcher.submit($0, size: 1) }
+        XCTAssertEqual(try responses[0].wait(), 0)
+        XCTAssertEqual(try responses[2].wait(), 4)
+        for index in [1, 3] {
+            XCTAssertThrowsError(try responses[index].wait()) { error in
+                XCTAssertEqual(error as? BatchError, .failed(index))
+            }
+        }
+        XCTAssertEqual(batches().count, 1)
+    }
+
+    func testFailedBatchesFailEveryRequest() throws {
+        let batcher = LLBBlobBatcher<Int, Int>(group: group, window: .milliseconds(10), maxBatchSize: 100) { _ in
+            self.group.next().makeFailedFuture(BatchError.failed(-1))
+        }
+
+        let responses = (0..<3).map { batcher.submit($0, size: 1) }
+        for response in responses {
+            XCTAssertThrowsError(try response.wait()) { error in
+                XCTAssertEqual(error as? BatchError, .failed(-1))
+            }
+        }
+    }
+
+    func testUnexpectedResponseCount() throws {
+        let batcher = LLBBlobBatcher<Int, Int>(group: group, window: .milliseconds(10), maxBatchSize: 100) { _ in
+            self.group.next().makeSucceededFuture([.success(0)])
+        }
+
+        let responses = (0..<2).map { batcher.submit($0, size: 1) }
+        for response in responses {
+            XCTAssertThrowsError(try response.wait()) { error in
+                guard case LLBBlobBatcher<Int, Int>.Error.unexpectedResponseCount(expected: 2, actual: 1) = error else {
+                    XCTFail("Unexpected error \(error)")
+                    return
+                }
+            }
+        }
+    }
+}
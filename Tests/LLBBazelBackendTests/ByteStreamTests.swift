@@ -0,0 +1,142 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import GRPC
+import llbuild2
+@testable import LLBBazelBackend
+import NIO
+import TSCBasic
+import XCTest
+
+final class ByteStreamTests: XCTestCase {
+    private var server: FakeRemoteServer! = nil
+    private var group: MultiThreadedEventLoopGroup! = nil
+    private var db: LLBBazelCASDatabase! = nil
+
+    override func setUpWithError() throws {
+        server = try FakeRemoteServer(readChunkSize: 1000)
+        group = MultiThreadedEventLoopGroup(numberOfThreads: 2)
+        // Without batching, every object is transferred with ByteStream.
+        db = try LLBBazelCASDatabase(
+            group: group,
+            url: server.url,
+            batchWindow: nil,
+            byteStreamChunkSize: 1000,
+            useCompression: false
+        )
+    }
+
+    override func tearDownWithError() throws {
+        try db.connection.close().wait()
+        db = nil
+        try group.syncShutdownGracefully()
+        try server.shutdown()
+    }
+
+    private func contents(size: Int) -> LLBByteBuffer {
+        return LLBByteBuffer.withBytes(ArraySlice((0..<size).map { UInt8(truncatingIfNeeded: $0 * 7) }))
+    }
+
+    func testChunkedTransfers() throws {
+        let ctx = Context()
+        let data = contents(size: 10_000)
+
+        let id = try db.put(data: data, ctx).wait()
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.writeOffsets }, [0])
+
+        XCTAssertEqual(try db.get(id, ctx).wait()?.data, data)
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.readOffsets }, [0])
+    }
+
+    func testWritesResumeFromTheCommittedSize() throws {
+        let ctx = Context()
+        let data = contents(size: 10_000)
+        server.storage.lock.withLockVoid { server.storage.dropWriteAfter = 4000 }
+
+        let id = try db.put(data: data, ctx).wait()
+
+        // The second write starts where QueryWriteStatus reported the first one stopped, on the same upload.
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.writeOffsets }, [0, 4000])
+        let resources = server.storage.lock.withLock { server.storage.byteStreamWrites }
+        XCTAssertEqual(resources.count, 2)
+        XCTAssertEqual(resources.first, resources.last)
+
+        let hash = try id.asBazelDigest().hash
+        let stored = try XCTUnwrap(server.storage.lock.withLock { server.storage.blobs[hash] })
+        XCTAssertEqual(stored, try LLBCASObject(refs: [], data: data).toData())
+        XCTAssertEqual(try db.get(id, ctx).wait()?.data, data)
+    }
+
+    func testReadsResumeFromTheReceivedSize() throws {
+        let ctx = Context()
+        let data = contents(size: 10_000)
+        let id = try db.put(data: data, ctx).wait()
+        server.storage.lock.withLockVoid { server.storage.dropReadAfter = 3000 }
+
+        XCTAssertEqual(try db.get(id, ctx).wait()?.data, data)
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.readOffsets }, [0, 3000])
+    }
+
+    func testReadsFailFastOnPermanentErrors() throws {
+        let ctx = Context()
+        let id = try db.put(data: contents(size: 10_000), ctx).wait()
+        server.storage.lock.withLockVoid {
+            server.storage.dropReadAfter = 3000
+            server.storage.dropReadStatus = .permissionDenied
+        }
+
+        XCTAssertThrowsError(try db.get(id, ctx).wait()) { error in
+            guard case LLBBazelCASDatabase.Error.callFailed(let status) = error, status.code == .permissionDenied else {
+                XCTFail("Unexpected error \(error)")
+                return
+            }
+        }
+        XCTAssertEqual(server.storage.lock.withLock { server.storage.readOffsets }, [0])
+    }
+
+    func testDownloads() throws {
+        try withTemporaryDirectory(removeTreeOnDeinit: true) { tempDirectory in
+            let ctx = Context()
+            let data = contents(size: 10_000)
+            let ref = try db.put(data: LLBByteBuffer.withString("ref"), ctx).wait()
+            let id = try db.put(refs: [ref], data: data, ctx).wait()
+            server.storage.lock.withLockVoid { server.storage.dropReadAfter = 5000 }
+
+            // Objects are downloaded as their data, including when the download is resumed.
+            let path = tempDirectory.appending(component: "object")
+            XCTAssertTrue(try db.download(id, to: path, ctx).wait())
+            XCTAssertEqual(try localFileSystem.readFileContents(path).contents, Array(data.readableBytesView))
+
+            // Raw blobs are downloaded as they are stored.
+            let rawPath = tempDirectory.appending(component: "raw")
+            XCTAssertTrue(try db.downloadRawBlob(digest: try id.asBazelDigest(), to: rawPath, ctx).wait())
+            let stored = try LLBCASObject(refs: [ref], data: data).toData()
+            XCTAssertEqual(try localFileSystem.readFileContents(rawPath).contents, Array(stored))
+
+            let missing = try db.identify(data: LLBByteBuffer.withString("missing"), ctx).wait()
+            XCTAssertFalse(try db.download(missing, to: tempDirectory.appending(component: "missing"), ctx).wait())
+        }
+    }
+
+    func testCancelledTransfers() throws {
+        var ctx = Context()
+        let token = LLBCancellationToken()
+        ctx.cancellationToken = token
+        let id = try db.put(data: contents(size: 10_000), ctx).wait()
+
+        token.cancel(reason: "stopped")
+        XCTAssertThrowsError(try db.get(id, ctx).wait()) { error in
+            guard case LLBCancellationError.cancelled("stopped") = error else {
+                XCTFail("Unexpected error \(error)")
+                return
+            }
+        }
+    }
+}
@@ -0,0 +1,51 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+@testable import LLBBazelBackend
+import XCTest
+
+final class CASObjectDecoderTests: XCTestCase {
+    private func decode(_ serialized: Data, chunkSize: Int) throws -> (Data, [LLBDataID]) {
+        var data = Data()
+        let decoder = LLBCASObjectStreamDecoder { data.append($0) }
+        for start in stride(from: 0, to: serialized.count, by: chunkSize) {
+            try decoder.decode(serialized[start..<min(start + chunkSize, serialized.count)])
+        }
+        return (data, try decoder.finish())
+    }
+
+    func testDecodesChunkedObjects() throws {
+        let refs = [
+            LLBDataID(blake3hash: LLBByteBuffer.withString("first"), refs: []),
+            LLBDataID(blake3hash: LLBByteBuffer.withString("second"), refs: []),
+        ]
+        let data = LLBByteBuffer.withBytes(ArraySlice((0..<300).map { UInt8(truncatingIfNeeded: $0) }))
+        let serialized = try LLBCASObject(refs: refs, data: data).toData()
+
+        for chunkSize in [1, 2, 3, 7, 64, serialized.count] {
+            let (decodedData, decodedRefs) = try decode(serialized, chunkSize: chunkSize)
+            XCTAssertEqual(Array(decodedData), Array(data.readableBytesView), "chunk size \(chunkSize)")
+            XCTAssertEqual(decodedRefs, refs, "chunk size \(chunkSize)")
+        }
+    }
+
+    func testDecodesEmptyObjects() throws {
+        let serialized = try LLBCASObject(refs: [], data: LLBByteBuffer.withBytes([])).toData()
+        let (data, refs) = try decode(serialized, chunkSize: 1)
+        XCTAssertTrue(data.isEmpty)
+        XCTAssertEqual(refs, [])
+    }
+
+    func testRejectsTruncatedObjects() throws {
+        let serialized = try LLBCASObject(refs: [], data: LLBByteBuffer.withString("contents")).toData()
+        XCTAssertThrowsError(try decode(serialized.dropLast(2), chunkSize: 3))
+    }
+}
@@ -0,0 +1,330 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import BazelRemoteAPI
+import GRPC
+@testable import LLBBazelBackend
+import NIO
+import NIOConcurrencyHelpers
+
+/// The blobs of a `FakeRemoteServer`, along with the calls that it received.
+final class FakeRemoteStorage {
+    let lock = Lock()
+
+    var blobs = [String: Data]()
+
+    /// Blobs whose batch reads and writes fail with an INTERNAL status.
+    var failingHashes = Set<String>()
+
+    /// Blobs that are left out of the responses to batch reads.
+    var omittedHashes = Set<String>()
+
+    /// The number of digests in each FindMissingBlobs, BatchReadBlobs and BatchUpdateBlobs call.
+    var findMissingBlobsCalls = [Int]()
+    var batchReadBlobsCalls = [Int]()
+    var batchUpdateBlobsCalls = [Int]()
+
+    /// The resources of the ByteStream reads and writes.
+    var byteStreamReads = [String]()
+    var byteStreamWrites = [String]()
+
+    /// The offsets that each ByteStream read and write started at.
+    var readOffsets = [Int64]()
+    var writeOffsets = [Int64]()
+
+    /// If set, the next ByteStream write fails with an UNAVAILABLE status once this many bytes are committed, as if
+    /// the connection dropped.
+    var dropWriteAfter: Int?
+
+    /// If set, the next ByteStream read fails with `dropReadStatus` once this many bytes are sent.
+    var dropReadAfter: Int?
+
+    /// The status of the reads that fail because of `dropReadAfter`.
+    var dropReadStatus = GRPCStatus.Code.unavailable
+
+    /// The action results, by the hash of their action digest.
+    var actionResults = [String: ActionResult]()
+
+    /// Whether action results are returned with their stdout inline when it is requested. Servers are free not to
+    /// inline it, in which case only its digest is returned.
+    var inlinesStdout = true
+
+    func contains(_ hash: String) -> Bool {
+        return lock.withLock { blobs[hash] != nil }
+    }
+}
+
+/// An in-process server implementing the parts of the remote execution API used by `LLBBazelCASDatabase` and
+/// `LLBBazelFunctionCache`: the server capabilities, the batch CAS calls, ByteStream and the action cache. Blobs and
+/// action results are stored in memory, by hash.
+final class FakeRemoteServer {
+    let group: MultiThreadedEventLoopGroup
+    let storage = FakeRemoteStorage()
+    private var server: Server! = nil
+
+    /// The URL of the server, for `LLBBazelCASDatabase`.
+    var url: URL {
+        return URL(string: "bazel://127.0.0.1:\(server.channel.localAddress!.port!)")!
+    }
+
+    /// Starts the server. A `maxBatchTotalSize` of 0 means that the server doesn't limit batch requests, and
+    /// `readChunkSize` is the size of the chunks in which ByteStream reads are sent.
+    init(maxBatchTotalSize: Int64 = 0, readChunkSize: Int = 1024) throws {
+        self.group = MultiThreadedEventLoopGroup(numberOfThreads: 1)
+        self.server = try Server.insecure(group: group)
+            .withServiceProviders([
+                CapabilitiesProvider(maxBatchTotalSize: maxBatchTotalSize),
+                CASProvider(storage),
+                ByteStreamProvider(storage, readChunkSize: readChunkSize),
+                ActionCacheProvider(storage),
+            ])
+            .bind(host: "127.0.0.1", port: 0)
+            .wait()
+    }
+
+    func shutdown() throws {
+        try server.close().wait()
+        try group.syncShutdownGracefully()
+    }
+}
+
+private final class CapabilitiesProvider: Build_Bazel_Remote_Execution_V2_CapabilitiesProvider {
+    let interceptors: Build_Bazel_Remote_Execution_V2_CapabilitiesServerInterceptorFactoryProtocol? = nil
+    let maxBatchTotalSize: Int64
+
+    init(maxBatchTotalSize: Int64) {
+        self.maxBatchTotalSize = maxBatchTotalSize
+    }
+
+    func getCapabilities(request: GetCapabilitiesRequest, context: StatusOnlyCallContext) -> EventLoopFuture<ServerCapabilities> {
+        return context.eventLoop.makeSucceededFuture(ServerCapabilities.with {
+            $0.cacheCapabilities.maxBatchTotalSizeBytes = maxBatchTotalSize
+        })
+    }
+}
+
+private final class CASProvider: Build_Bazel_Remote_Execution_V2_ContentAddressableStorageProvider {
+    let interceptors: Build_Bazel_Remote_Execution_V2_ContentAddressableStorageServerInterceptorFactoryProtocol? = nil
+    let storage: FakeRemoteStorage
+
+    init(_ storage: FakeRemoteStorage) {
+        self.storage = storage
+    }
+
+    func findMissingBlobs(
+        request: FindMissingBlobsRequest,
+        context: StatusOnlyCallContext
+    ) -> EventLoopFuture<Build_Bazel_Remote_Execution_V2_FindMissingBlobsResponse> {
+        let missing: [Digest] = storage.lock.withLock {
+            storage.findMissingBlobsCalls.append(request.blobDigests.count)
+            return request.blobDigests.filter { storage.blobs[$0.hash] == nil }
+        }
+        return context.eventLoop.makeSucceededFuture(.with { $0.missingBlobDigests = missing })
+    }
+
+    func batchUpdateBlobs(
+        request: BatchUpdateBlobsRequest,
+        context: StatusOnlyCallContext
+    ) -> EventLoopFuture<Build_Bazel_Remote_Execution_V2_BatchUpdateBlobsResponse> {
+        let responses: [Build_Bazel_Remote_Execution_V2_BatchUpdateBlobsResponse.Response] = storage.lock.withLock {
+            storage.batchUpdateBlobsCalls.append(request.requests.count)
+            return request.requests.map { blob in
+                let code: Google_Rpc_Code
+                if storage.failingHashes.contains(blob.digest.hash) {
+                    code = .internal
+                } else {
+                    storage.blobs[blob.digest.hash] = blob.data
+                    code = .ok
+                }
+                return .with {
+                    $0.digest = blob.digest
+                    $0.status.code = Int32(code.rawValue)
+                }
+            }
+        }
+        return context.eventLoop.makeSucceededFuture(.with { $0.responses = responses })
+    }
+
+    func batchReadBlobs(
+        request: BatchReadBlobsRequest,
+        context: StatusOnlyCallContext
+    ) -> EventLoopFuture<Build_Bazel_Remote_Execution_V2_BatchReadBlobsResponse> {
+        let responses: [Build_Bazel_Remote_Execution_V2_BatchReadBlobsResponse.Response] = storage.lock.withLock {
+            storage.batchReadBlobsCalls.append(request.digests.count)
+            // Respond in the reverse order, which servers are allowed to do.
+            return request.digests.reversed().filter { !storage.omittedHashes.contains($0.hash) }.map { digest in
+                .with {
+                    $0.digest = digest
+                    if storage.failingHashes.contains(digest.hash) {
+                        $0.status.code = Int32(Google_Rpc_Code.internal.rawValue)
+                    } else if let data = storage.blobs[digest.hash] {
+                        $0.data = data
+                        $0.status.code = Int32(Google_Rpc_Code.ok.rawValue)
+                    } else {
+                        $0.status.code = Int32(Google_Rpc_Code.notFound.rawValue)
+                    }
+                }
+            }
+        }
+        return context.eventLoop.makeSucceededFuture(.with { $0.responses = responses })
+    }
+
+    func getTree(
+        request: Build_Bazel_Remote_Execution_V2_GetTreeRequest,
+        context: StreamingResponseCallContext<Build_Bazel_Remote_Execution_V2_GetTreeResponse>
+    ) -> EventLoopFuture<GRPCStatus> {
+        return context.eventLoop.makeSucceededFuture(GRPCStatus(code: .unimplemented, message: nil))
+    }
+}
+
+private final class ActionCacheProvider: Build_Bazel_Remote_Execution_V2_ActionCacheProvider {
+    let interceptors: Build_Bazel_Remote_Execution_V2_ActionCacheServerInterceptorFactoryProtocol? = nil
+    let storage: FakeRemoteStorage
+
+    init(_ storage: FakeRemoteStorage) {
+        self.storage = storage
+    }
+
+    func getActionResult(request: GetActionResultRequest, context: StatusOnlyCallContext) -> EventLoopFuture<ActionResult> {
+        let result: ActionResult? = storage.lock.withLock {
+            guard var result = storage.actionResults[request.actionDigest.hash] else {
+                return nil
+            }
+            if !request.inlineStdout || !storage.inlinesStdout {
+                result.stdoutRaw = Data()
+            }
+            return result
+        }
+        guard let found = result else {
+            return context.eventLoop.makeFailedFuture(GRPCStatus(code: .notFound, message: nil))
+        }
+        return context.eventLoop.makeSucceededFuture(found)
+    }
+
+    func updateActionResult(request: UpdateActionResultRequest, context: StatusOnlyCallContext) -> EventLoopFuture<ActionResult> {
+        storage.lock.withLockVoid {
+            storage.actionResults[request.actionDigest.hash] = request.actionResult
+        }
+        return context.eventLoop.makeSucceededFuture(request.actionResult)
+    }
+}
+
+private final class ByteStreamProvider: Google_Bytestream_ByteStreamProvider {
+    let interceptors: Google_Bytestream_ByteStreamServerInterceptorFactoryProtocol? = nil
+    let storage: FakeRemoteStorage
+    let readChunkSize: Int
+
+    /// The data committed so far for each upload resource.
+    private var uploads = [String: Data]()
+
+    init(_ storage: FakeRemoteStorage, readChunkSize: Int) {
+        self.storage = storage
+        self.readChunkSize = readChunkSize
+    }
+
+    /// Returns the hash in a `.../blobs/<hash>/<size>` resource name.
+    private func hash(of resource: String) -> String {
+        let components = resource.split(separator: "/")
+        return String(components[components.count - 2])
+    }
+
+    func read(
+        request: Google_Bytestream_ReadRequest,
+        context: StreamingResponseCallContext<Google_Bytestream_ReadResponse>
+    ) -> EventLoopFuture<GRPCStatus> {
+        let (data, dropAfter, dropStatus): (Data?, Int?, GRPCStatus.Code) = storage.lock.withLock {
+            storage.byteStreamReads.append(request.resourceName)
+            storage.readOffsets.append(request.readOffset)
+            defer { storage.dropReadAfter = nil }
+            return (storage.blobs[hash(of: request.resourceName)], storage.dropReadAfter, storage.dropReadStatus)
+        }
+        guard let blob = data else {
+            return context.eventLoop.makeSucceededFuture(GRPCStatus(code: .notFound, message: nil))
+        }
+
+        var sent = context.eventLoop.makeSucceededFuture(())
+        var sentSize = 0
+        for start in stride(from: Int(request.readOffset), to: blob.count, by: readChunkSize) {
+            if let dropAfter = dropAfter, sentSize >= dropAfter {
+                return sent.map { GRPCStatus(code: dropStatus, message: "dropped") }
+            }
+            let chunk = blob[(blob.startIndex + start)..<(blob.startIndex + min(start + readChunkSize, blob.count))]
+            sentSize += chunk.count
+            sent = sent.flatMap {
+                context.sendResponse(.with { $0.data = chunk })
+            }
+        }
+        return sent.map { GRPCStatus.ok }
+    }
+
+    func write(
+        context: UnaryResponseCallContext<Google_Bytestream_WriteResponse>
+    ) -> EventLoopFuture<(StreamEvent<Google_Bytestream_WriteRequest>) -> Void> {
+        var resource: String?
+        var dropped = false
+        return context.eventLoop.makeSucceededFuture({ event in
+            guard !dropped else {
+                return
+            }
+            switch event {
+            case .message(let request):
+                if resource == nil {
+                    resource = request.resourceName
+                    self.storage.lock.withLockVoid {
+                        self.storage.byteStreamWrites.append(request.resourceName)
+                        self.storage.writeOffsets.append(request.writeOffset)
+                    }
+                }
+                let (committed, drop) = self.storage.lock.withLock { () -> (Data, Bool) in
+                    var upload = self.uploads[resource!, default: Data()]
+                    if request.writeOffset == Int64(upload.count) {
+                        upload.append(request.data)
+                        self.uploads[resource!] = upload
+                    }
+                    if let dropAfter = self.storage.dropWriteAfter, upload.count >= dropAfter, !request.finishWrite {
+                        self.storage.dropWriteAfter = nil
+                        return (upload, true)
+                    }
+                    return (upload, false)
+                }
+                if drop {
+                    dropped = true
+                    context.responsePromise.fail(GRPCStatus(code: .unavailable, message: "dropped"))
+                    return
+                }
+                if request.finishWrite {
+                    self.storage.lock.withLockVoid { self.storage.blobs[self.hash(of: resource!)] = committed }
+                }
+            case .end:
+                let committedSize = self.storage.lock.withLock { self.uploads[resource ?? "", default: Data()].count }
+                context.responsePromise.succeed(.with { $0.committedSize = Int64(committedSize) })
+            }
+        })
+    }
+
+    func queryWriteStatus(
+        request: Google_Bytestream_QueryWriteStatusRequest,
+        context: StatusOnlyCallContext
+    ) -> EventLoopFuture<Google_Bytestream_QueryWriteStatusResponse> {
+        let response: Google_Bytestream_QueryWriteStatusResponse? = storage.lock.withLock {
+            guard let upload = uploads[request.resourceName] else {
+                return nil
+            }
+            return .with {
+                $0.committedSize = Int64(upload.count)
+                $0.complete = storage.blobs[hash(of: request.resourceName)] != nil
+            }
+        }
+        guard let status = response else {
+            return context.eventLoop.makeFailedFuture(GRPCStatus(code: .notFound, message: nil))
+        }
+        return context.eventLoop.makeSucceededFuture(status)
+    }
+}
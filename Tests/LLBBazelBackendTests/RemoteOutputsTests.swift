@@ -0,0 +1,59 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+@testable import LLBBazelBackend
+import NIO
+import XCTest
+
+final class RemoteOutputsTests: XCTestCase {
+    private var server: FakeRemoteServer! = nil
+    private var group: MultiThreadedEventLoopGroup! = nil
+    private var db: LLBBazelCASDatabase! = nil
+
+    override func setUpWithError() throws {
+        server = try FakeRemoteServer()
+        group = MultiThreadedEventLoopGroup(numberOfThreads: 2)
+        db = try LLBBazelCASDatabase(group: group, url: server.url, useCompression: false)
+    }
+
+    override func tearDownWithError() throws {
+        try db.connection.close().wait()
+        db = nil
+        try group.syncShutdownGracefully()
+        try server.shutdown()
+    }
+
+    func testLazyOutputsAreResolvedFromTheirMarkers() throws {
+        var ctx = Context()
+        ctx.group = group
+        ctx.db = LLBInMemoryCASDatabase(group: group)
+
+        let contents = Data("lazy contents".utf8)
+        let digest = Digest(with: contents)
+        server.storage.lock.withLockVoid { server.storage.blobs[digest.hash] = contents }
+
+        let id = try LLBRemoteOutputs(database: db).makeLazyFile(digest: digest, isExecutable: false, ctx).wait()
+        let regularID = try ctx.db.put(data: LLBByteBuffer.withString("regular contents"), ctx).wait()
+
+        // A resolver that didn't create the lazy output, such as one created after a restart, reads its marker.
+        let outputs = LLBRemoteOutputs(database: db)
+        XCTAssertEqual(try outputs.lazyOutputType(id, ctx).wait(), .file)
+        XCTAssertNil(try outputs.lazyOutputType(regularID, ctx).wait())
+
+        let materializedID = try outputs.materialize(id, ctx).wait()
+        let materialized = try XCTUnwrap(try LLBCASFSClient(ctx.db).load(materializedID, ctx).wait().blob)
+        XCTAssertEqual(Data(try materialized.read(ctx).wait()), contents)
+        XCTAssertEqual(try outputs.materialize(regularID, ctx).wait(), regularID)
+
+        // Consumers that don't resolve lazy outputs can't mistake the marker for the contents of a file.
+        XCTAssertThrowsError(try LLBCASFSClient(ctx.db).load(id, ctx).wait())
+    }
+}
@@ -0,0 +1,72 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import BazelRemoteAPI
+@testable import LLBBazelBackend
+import XCTest
+
+final class ZstdTests: XCTestCase {
+    func testSupportedCompressors() throws {
+        typealias CacheCapabilities = Build_Bazel_Remote_Execution_V2_CacheCapabilities
+
+        // supported_compressors (field 6) as a packed list of IDENTITY and ZSTD, after max_batch_total_size_bytes.
+        let packed = try CacheCapabilities(serializedData: Data([0x20, 0x80, 0x80, 0x01, 0x32, 0x02, 0x00, 0x01]))
+        XCTAssertEqual(packed.maxBatchTotalSizeBytes, 16384)
+        XCTAssertTrue(packed.supportsZstdCompression)
+
+        // The same field, unpacked.
+        let unpacked = try CacheCapabilities(serializedData: Data([0x30, 0x00, 0x30, 0x01]))
+        XCTAssertTrue(unpacked.supportsZstdCompression)
+
+        let identityOnly = try CacheCapabilities(serializedData: Data([0x32, 0x01, 0x00]))
+        XCTAssertFalse(identityOnly.supportsZstdCompression)
+
+        XCTAssertFalse(CacheCapabilities().supportsZstdCompression)
+    }
+
+    #if LLBUILD2_ZSTD
+    func testRoundtrip() throws {
+        // Compressible data that is larger than zstd's output buffers, so both sides need several passes per part.
+        var generator = SystemRandomNumberGenerator()
+        let words = (0..<64).map { _ in Data((0..<16).map { _ in UInt8.random(in: 0...255, using: &generator) }) }
+        let input = (0..<(1 << 16)).reduce(into: Data()) { data, _ in
+            data.append(words.randomElement(using: &generator)!)
+        }
+
+        let compressor = try LLBZstdCompressor()
+        let chunkSize = 300_000
+        var compressed = Data()
+        for start in stride(from: 0, to: input.count, by: chunkSize) {
+            let end = min(start + chunkSize, input.count)
+            compressed.append(try compressor.compress(input[start..<end], finish: end == input.count))
+        }
+        XCTAssertLessThan(compressed.count, input.count)
+
+        // Decompress in parts that don't line up with the compressed ones.
+        let decompressor = try LLBZstdDecompressor()
+        var output = Data()
+        for start in stride(from: 0, to: compressed.count, by: 7_777) {
+            let end = min(start + 7_777, compressed.count)
+            output.append(try decompressor.decompress(compressed[start..<end]))
+        }
+        XCTAssertEqual(output, input)
+    }
+
+    func testRoundtripEmpty() throws {
+        let compressed = try LLBZstdCompressor().compress(Data(), finish: true)
+        XCTAssertFalse(compressed.isEmpty)
+        XCTAssertEqual(try LLBZstdDecompressor().decompress(compressed), Data())
+    }
+
+    func testDecompressInvalidData() throws {
+        XCTAssertThrowsError(try LLBZstdDecompressor().decompress(Data(repeating: 0xff, count: 64)))
+    }
+    #endif
+}
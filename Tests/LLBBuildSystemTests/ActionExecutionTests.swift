@@ -49,6 +49,66 @@ private class ActionExecutionDummyExecutor: LLBExecutor {
     }
 }
 
+/// Resolves the lazy outputs registered by the test into regular contents.
+private final class TestLazyOutputs: LLBLazyOutputResolver {
+    var contents = [LLBDataID: LLBDataID]()
+
+    func lazyOutputType(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBArtifactType?> {
+        return ctx.group.next().makeSucceededFuture(contents[id] == nil ? nil : .directory)
+    }
+
+    func materialize(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return ctx.group.next().makeSucceededFuture(contents[id] ?? id)
+    }
+}
+
+/// Counts the requests that reach the executor.
+private final class CountingExecutor: LLBExecutor {
+    let executor: LLBExecutor
+    var executions = 0
+
+    init(_ executor: LLBExecutor) {
+        self.executor = executor
+    }
+
+    func execute(request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse> {
+        executions += 1
+        return executor.execute(request: request, ctx)
+    }
+}
+
+/// Records the results of the action result cache lookups, and the failed updates.
+private final class CacheLookupRecorder: LLBBuildEventDelegate {
+    var lookups = [Bool]()
+    var updateFailed: ((Error) -> Void)?
+
+    func targetEvaluationRequested(label: LLBLabel) {}
+    func targetEvaluationCompleted(label: LLBLabel) {}
+    func actionScheduled(action: LLBBuildEventActionDescription) {}
+    func actionCompleted(action: LLBBuildEventActionDescription, result: LLBActionResult) {}
+    func actionExecutionStarted(action: LLBBuildEventActionDescription) {}
+    func actionExecutionCompleted(action: LLBBuildEventActionDescription) {}
+
+    func actionResultCacheLookupCompleted(action: LLBBuildEventActionDescription, hit: Bool) {
+        lookups.append(hit)
+    }
+
+    func actionResultCacheUpdateFailed(action: LLBBuildEventActionDescription, error: Error) {
+        updateFailed?(error)
+    }
+}
+
+/// An action result cache that never has results, and fails to store them.
+private final class FailingActionResultCache: LLBActionResultCache {
+    func lookup(_ request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse?> {
+        return ctx.group.next().makeSucceededFuture(nil)
+    }
+
+    func update(_ request: LLBActionExecutionRequest, response: LLBActionExecutionResponse, _ ctx: Context) -> LLBFuture<Void> {
+        return ctx.group.next().makeFailedFuture(ActionExecutionDummyError.expectedError)
+    }
+}
+
 class ActionExecutionTests: XCTestCase {
     private var testExecutor: LLBExecutor! = nil
     private var testCtx: Context! = nil
@@ -97,6 +157,169 @@ class ActionExecutionTests: XCTestCase {
         XCTAssertEqual(stdout, "Success")
     }
 
+    func testKnownInputsAreNotValidatedAgain() throws {
+        let ctx = Context()
+        let metrics = LLBInMemoryMetrics()
+        let db = LLBMetricsCASDatabase(testCtx.db, metrics: metrics)
+        let engine = LLBTestBuildEngine(group: testCtx.group, db: db, executor: testExecutor)
+
+        let dataID = try db.put(data: LLBByteBuffer.withString("Hello, world!"), ctx).wait()
+
+        func makeKey(_ outputPath: String) -> LLBActionExecutionKey {
+            return LLBActionExecutionKey.with {
+                $0.actionExecutionType = .command(.with {
+                    $0.actionSpec = .with {
+                        $0.arguments = ["success"]
+                    }
+                    $0.inputs = [
+                        .with {
+                            $0.dataID = dataID
+                            $0.path = "some/path"
+                            $0.type = .file
+                        },
+                    ]
+                    $0.outputs = [
+                        .with {
+                            $0.path = outputPath
+                            $0.type = .file
+                        },
+                    ]
+                })
+            }
+        }
+
+        func gets() -> Int64 {
+            return metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", "get")])
+        }
+
+        let _: LLBActionExecutionValue = try engine.build(makeKey("first/output"), ctx).wait()
+        let getsAfterFirstAction = gets()
+        XCTAssertGreaterThan(getsAfterFirstAction, 0)
+
+        // The input was validated by the first action, so the second one doesn't load it again.
+        let _: LLBActionExecutionValue = try engine.build(makeKey("second/output"), ctx).wait()
+        XCTAssertEqual(gets(), getsAfterFirstAction)
+    }
+
+    func testLazyInputs() throws {
+        let ctx = Context()
+        let lazyOutputs = TestLazyOutputs()
+        let engine = LLBTestBuildEngine(
+            group: testCtx.group,
+            db: testCtx.db,
+            executor: LLBMaterializingExecutor(testExecutor, resolver: lazyOutputs),
+            lazyOutputResolver: lazyOutputs
+        )
+
+        // The lazy output isn't a tree, but the resolver knows that it stands for one.
+        let lazyID = try testCtx.db.put(data: LLBByteBuffer.withString("lazy directory"), ctx).wait()
+        let treeID = try LLBCASFileTree.create(files: [], in: testCtx.db, ctx).wait().id
+        lazyOutputs.contents[lazyID] = treeID
+
+        let actionExecutionKey = LLBActionExecutionKey.with {
+            $0.actionExecutionType = .command(.with {
+                $0.actionSpec = .with {
+                    $0.arguments = ["success"]
+                }
+                $0.inputs = [
+                    .with {
+                        $0.dataID = lazyID
+                        $0.path = "some/path"
+                        $0.type = .directory
+                    },
+                ]
+                $0.outputs = [
+                    .with {
+                        $0.path = "some/other/path"
+                        $0.type = .directory
+                    },
+                ]
+            })
+        }
+
+        // The executor receives the materialized input, which it maps as the output.
+        let actionExecutionValue: LLBActionExecutionValue = try engine.build(actionExecutionKey, ctx).wait()
+        XCTAssertEqual(actionExecutionValue.outputs, [treeID])
+
+        XCTAssertEqual(try engine.materialize(LLBArtifactValue.with { $0.dataID = lazyID }, ctx).wait(), treeID)
+    }
+
+    func testActionResultCache() throws {
+        let recorder = CacheLookupRecorder()
+        var ctx = Context()
+        ctx.buildEventDelegate = recorder
+
+        let executor = CountingExecutor(testExecutor)
+        let actionResultCache = LLBInMemoryActionResultCache(group: testCtx.group)
+        func makeEngine() -> LLBTestBuildEngine {
+            return LLBTestBuildEngine(
+                group: testCtx.group,
+                db: testCtx.db,
+                executor: executor,
+                actionResultCache: actionResultCache
+            )
+        }
+
+        let dataID = try testCtx.db.put(data: LLBByteBuffer.withString("Hello, world!"), ctx).wait()
+        func makeKey(_ description: String) -> LLBActionExecutionKey {
+            return .command(
+                actionSpec: .with { $0.arguments = ["success"] },
+                inputs: [.with {
+                    $0.dataID = dataID
+                    $0.path = "some/path"
+                    $0.type = .file
+                }],
+                outputs: [.with {
+                    $0.path = "some/other/path"
+                    $0.type = .file
+                }],
+                mnemonic: "Test",
+                description: description
+            )
+        }
+
+        let value: LLBActionExecutionValue = try makeEngine().build(makeKey("first"), ctx).wait()
+        XCTAssertEqual(executor.executions, 1)
+
+        // Another engine with its own function cache, running an action with a different description, gets the
+        // result of the first execution.
+        let cachedValue: LLBActionExecutionValue = try makeEngine().build(makeKey("second"), ctx).wait()
+        XCTAssertEqual(executor.executions, 1)
+        XCTAssertEqual(cachedValue.outputs, value.outputs)
+        XCTAssertEqual(cachedValue.stdoutID, value.stdoutID)
+        XCTAssertEqual(recorder.lookups, [false, true])
+    }
+
+    func testActionResultCacheUpdateFailure() throws {
+        let recorder = CacheLookupRecorder()
+        let reported = expectation(description: "update failure reported")
+        recorder.updateFailed = { error in
+            XCTAssertEqual(error as? ActionExecutionDummyError, .expectedError)
+            reported.fulfill()
+        }
+        var ctx = Context()
+        ctx.buildEventDelegate = recorder
+
+        let engine = LLBTestBuildEngine(
+            group: testCtx.group,
+            db: testCtx.db,
+            executor: testExecutor,
+            actionResultCache: FailingActionResultCache()
+        )
+        let key = LLBActionExecutionKey.command(
+            actionSpec: .with { $0.arguments = ["success"] },
+            inputs: [],
+            outputs: [],
+            mnemonic: "Test",
+            description: "update failure"
+        )
+
+        // The build succeeds even though its result isn't cached.
+        let _: LLBActionExecutionValue = try engine.build(key, ctx).wait()
+        wait(for: [reported], timeout: 10)
+        XCTAssertEqual(recorder.lookups, [false])
+    }
+
     func testActionExecutionFailure() throws {
         let ctx = Context()
         let actionExecutionKey = LLBActionExecutionKey.with {
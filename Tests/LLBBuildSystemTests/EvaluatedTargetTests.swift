@@ -69,7 +69,94 @@ private final class DummyRuleLookupDelegate: LLBRuleLookupDelegate {
     }
 }
 
+// Configured target for which `//some:top` depends on `//some:dep`.
+private struct PrefetchConfiguredTarget: LLBConfiguredTarget {
+    let name: String
+
+    init(name: String) {
+        self.name = name
+    }
+
+    var targetDependencies: [String: LLBTargetDependency] {
+        return name == "top" ? ["dep": .single(try! LLBLabel("//some:dep"))] : [:]
+    }
+
+    init(from bytes: LLBByteBuffer) throws {
+        self.name = try String(from: bytes)
+    }
+
+    func toBytes(into buffer: inout LLBByteBuffer) throws {
+        buffer.writeString(name)
+    }
+}
+
+private final class PrefetchBuildRule: LLBBuildRule<PrefetchConfiguredTarget> {
+    override func evaluate(configuredTarget: PrefetchConfiguredTarget, _ ruleContext: LLBRuleContext) throws -> LLBFuture<[LLBProvider]> {
+        guard configuredTarget.name == "top" else {
+            return ruleContext.group.next().makeSucceededFuture([DummyProvider(simpleString: "dep")])
+        }
+        // Repeated lookups are served from the providers decoded by the rule context.
+        let first = try ruleContext.getProvider(for: "dep", as: DummyProvider.self)
+        let second = try ruleContext.getProvider(for: "dep", as: DummyProvider.self)
+        return ruleContext.group.next().makeSucceededFuture([
+            DummyProvider(simpleString: "top+\(first.simpleString)+\(second.simpleString)"),
+        ])
+    }
+}
+
+private final class PrefetchConfiguredTargetDelegate: LLBConfiguredTargetDelegate {
+    let dependencyRequested: LLBPromise<Void>
+
+    init(dependencyRequested: LLBPromise<Void>) {
+        self.dependencyRequested = dependencyRequested
+    }
+
+    func configuredTarget(for key: LLBConfiguredTargetKey, _ fi: LLBBuildFunctionInterface, _ ctx: Context) -> LLBFuture<LLBConfiguredTarget> {
+        if key.label.targetName == "top" {
+            // The top target is only available once its dependency started evaluating, which only happens if the
+            // dependency was prefetched.
+            return dependencyRequested.futureResult.map { PrefetchConfiguredTarget(name: "top") }
+        }
+        dependencyRequested.succeed(())
+        return ctx.group.next().makeSucceededFuture(PrefetchConfiguredTarget(name: key.label.targetName))
+    }
+
+    func prefetchedDependencies(for key: LLBConfiguredTargetKey, _ ctx: Context) -> [LLBTargetDependency] {
+        return key.label.targetName == "top" ? [.single(try! LLBLabel("//some:dep"))] : []
+    }
+}
+
+private final class PrefetchRuleLookupDelegate: LLBRuleLookupDelegate {
+    func rule(for configuredTargetType: LLBConfiguredTarget.Type) -> LLBRule? {
+        return PrefetchBuildRule()
+    }
+}
+
 class EvaluatedTargetTests: XCTestCase {
+    func testPrefetchedDependencies() throws {
+        try withTemporaryDirectory { tempDir in
+            let ctx = LLBMakeTestContext()
+            let configuredTargetDelegate = PrefetchConfiguredTargetDelegate(
+                dependencyRequested: ctx.group.next().makePromise()
+            )
+            let testEngine = LLBTestBuildEngine(
+                group: ctx.group,
+                db: ctx.db,
+                configuredTargetDelegate: configuredTargetDelegate,
+                ruleLookupDelegate: PrefetchRuleLookupDelegate()
+            ) { registry in
+                registry.register(type: PrefetchConfiguredTarget.self)
+            }
+
+            let dataID = try LLBCASFileTree.import(path: tempDir, to: ctx.db, ctx).wait()
+            let configuredTargetKey = LLBConfiguredTargetKey(rootID: dataID, label: try LLBLabel("//some:top"))
+            let evaluatedTargetKey = LLBEvaluatedTargetKey(configuredTargetKey: configuredTargetKey)
+
+            let evaluatedTargetValue: LLBEvaluatedTargetValue = try testEngine.build(evaluatedTargetKey, ctx).wait()
+            XCTAssertEqual(try evaluatedTargetValue.providerMap.get(DummyProvider.self).simpleString, "top+dep+dep")
+        }
+    }
+
     func testEvaluatedTarget() throws {
         try withTemporaryDirectory { tempDir in
             let configuredTargetDelegate = DummyConfiguredTargetDelegate()
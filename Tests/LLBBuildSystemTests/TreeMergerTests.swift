@@ -0,0 +1,131 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import LLBBuildSystem
+import LLBBuildSystemTestHelpers
+import TSFCASFileTree
+import XCTest
+
+class TreeMergerTests: XCTestCase {
+    private func contents(of path: [String], in treeID: LLBDataID, _ ctx: Context) throws -> String {
+        let client = LLBCASFSClient(ctx.db)
+        var id = treeID
+        for component in path {
+            let tree = try XCTUnwrap(client.load(id, ctx).wait().tree)
+            id = try XCTUnwrap(tree.lookup(component)).id
+        }
+        return try client.fileContents(for: id, ctx)
+    }
+
+    func testMergeOverridesAndMemoizes() throws {
+        var ctx = LLBMakeTestContext()
+        let metrics = LLBInMemoryMetrics()
+        ctx.db = LLBMetricsCASDatabase(ctx.db, metrics: metrics)
+
+        let fileA = try ctx.db.put(data: LLBByteBuffer.withString("a"), ctx).wait()
+        let fileB = try ctx.db.put(data: LLBByteBuffer.withString("b"), ctx).wait()
+        let fileC = try ctx.db.put(data: LLBByteBuffer.withString("c"), ctx).wait()
+
+        let inputs = [
+            LLBActionInput(path: "sdk/include/a.h", dataID: fileA, type: .file),
+            LLBActionInput(path: "sdk/include/b.h", dataID: fileB, type: .file),
+            LLBActionInput(path: "sdk/include/a.h", dataID: fileC, type: .file),
+        ]
+
+        let merger = LLBTreeMerger()
+        let mergedID = try merger.merge(inputs, ctx).wait()
+
+        // Later inputs override earlier ones, and directories with the same name are merged.
+        XCTAssertEqual(try contents(of: ["sdk", "include", "a.h"], in: mergedID, ctx), "c")
+        XCTAssertEqual(try contents(of: ["sdk", "include", "b.h"], in: mergedID, ctx), "b")
+
+        // Merging the same inputs again reuses the memoized merges, without writing anything.
+        let puts = metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", "put")])
+        XCTAssertEqual(try merger.merge(inputs, ctx).wait(), mergedID)
+        XCTAssertEqual(metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", "put")]), puts)
+
+        // A separate merger produces the same tree.
+        XCTAssertEqual(try LLBTreeMerger().merge(inputs, ctx).wait(), mergedID)
+    }
+
+    func testMergeWritesEachDirectoryOnce() throws {
+        var ctx = LLBMakeTestContext()
+        let metrics = LLBInMemoryMetrics()
+        ctx.db = LLBMetricsCASDatabase(ctx.db, metrics: metrics)
+
+        let inputs = try ["a", "b", "c"].map { name in
+            LLBActionInput(
+                path: "sdk/include/\(name).h",
+                dataID: try ctx.db.put(data: LLBByteBuffer.withString(name), ctx).wait(),
+                type: .file
+            )
+        }
+
+        // Merging a single input only wraps it, which memoizes the wrapped trees.
+        let merger = LLBTreeMerger()
+        for input in inputs {
+            _ = try merger.merge([input], ctx).wait()
+        }
+
+        // All the layers are merged at once, so only the merged root, sdk and include directories are written.
+        let puts = metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", "put")])
+        let mergedID = try merger.merge(inputs, ctx).wait()
+        XCTAssertEqual(metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", "put")]), puts + 3)
+
+        for name in ["a", "b", "c"] {
+            XCTAssertEqual(try contents(of: ["sdk", "include", "\(name).h"], in: mergedID, ctx), name)
+        }
+    }
+
+    func testMergeReplacesDirectoriesWithFiles() throws {
+        let ctx = LLBMakeTestContext()
+
+        let fileA = try ctx.db.put(data: LLBByteBuffer.withString("a"), ctx).wait()
+        let fileB = try ctx.db.put(data: LLBByteBuffer.withString("b"), ctx).wait()
+        let fileC = try ctx.db.put(data: LLBByteBuffer.withString("c"), ctx).wait()
+
+        // The file replaces the first directory, so the last directory isn't merged with it.
+        let inputs = [
+            LLBActionInput(path: "out/a", dataID: fileA, type: .file),
+            LLBActionInput(path: "out", dataID: fileB, type: .file),
+            LLBActionInput(path: "out/c", dataID: fileC, type: .file),
+        ]
+
+        let mergedID = try LLBTreeMerger().merge(inputs, ctx).wait()
+        let client = LLBCASFSClient(ctx.db)
+        let out = try XCTUnwrap(client.load(mergedID, ctx).wait().tree?.lookup("out"))
+        let outTree = try XCTUnwrap(client.load(out.id, ctx).wait().tree)
+        XCTAssertEqual(outTree.files.map { $0.name }, ["c"])
+        XCTAssertEqual(try contents(of: ["out", "c"], in: mergedID, ctx), "c")
+    }
+
+    func testMergeInSeparateDatabases() throws {
+        let ctx = LLBMakeTestContext()
+        var otherCtx = ctx
+        otherCtx.db = LLBTestCASDatabase(group: ctx.group)
+
+        let merger = LLBTreeMerger()
+        var mergedIDs = [LLBDataID]()
+        for ctx in [ctx, otherCtx] {
+            let fileA = try ctx.db.put(data: LLBByteBuffer.withString("a"), ctx).wait()
+            let fileB = try ctx.db.put(data: LLBByteBuffer.withString("b"), ctx).wait()
+            let inputs = [
+                LLBActionInput(path: "dir/a", dataID: fileA, type: .file),
+                LLBActionInput(path: "dir/b", dataID: fileB, type: .file),
+            ]
+
+            // The merges in the first database aren't reused for the second one, where their trees don't exist.
+            let mergedID = try merger.merge(inputs, ctx).wait()
+            XCTAssertEqual(try contents(of: ["dir", "a"], in: mergedID, ctx), "a")
+            XCTAssertEqual(try contents(of: ["dir", "b"], in: mergedID, ctx), "b")
+            mergedIDs.append(mergedID)
+        }
+        XCTAssertEqual(mergedIDs[0], mergedIDs[1])
+    }
+}
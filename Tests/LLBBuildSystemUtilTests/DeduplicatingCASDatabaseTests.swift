@@ -0,0 +1,69 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import LLBBuildSystemUtil
+import LLBBuildSystemTestHelpers
+import NIOConcurrencyHelpers
+import XCTest
+
+/// Counts the writes that reach the wrapped database.
+private final class PutCountingDatabase: LLBCASDatabase {
+    let group: LLBFuturesDispatchGroup
+    let db: LLBCASDatabase
+    let puts = NIOAtomic<Int>.makeAtomic(value: 0)
+
+    init(group: LLBFuturesDispatchGroup) {
+        self.group = group
+        self.db = LLBInMemoryCASDatabase(group: group)
+    }
+
+    func supportedFeatures() -> LLBFuture<LLBCASFeatures> { db.supportedFeatures() }
+
+    func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> { db.contains(id, ctx) }
+
+    func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> { db.get(id, ctx) }
+
+    func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        db.identify(refs: refs, data: data, ctx)
+    }
+
+    func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        puts.add(1)
+        return db.put(refs: refs, data: data, ctx)
+    }
+
+    func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        puts.add(1)
+        return db.put(knownID: id, refs: refs, data: data, ctx)
+    }
+}
+
+class DeduplicatingCASDatabaseTests: XCTestCase {
+    func testSkipsExistingObjects() throws {
+        let ctx = LLBMakeTestContext()
+        let countingDB = PutCountingDatabase(group: ctx.group)
+        let db = LLBDeduplicatingCASDatabase(countingDB)
+
+        let bytes = LLBByteBuffer.withString("hands up, don't shoot")
+        let existingID = try countingDB.put(data: bytes, ctx).wait()
+        XCTAssertEqual(countingDB.puts.load(), 1)
+
+        // The object is already in the database, so it isn't written again.
+        XCTAssertEqual(try db.put(data: bytes, ctx).wait(), existingID)
+        XCTAssertEqual(countingDB.puts.load(), 1)
+
+        // Concurrent writes of a new object only write it once.
+        let newBytes = LLBByteBuffer.withString("no justice, no peace")
+        let futures = (0..<10).map { _ in db.put(data: newBytes, ctx) }
+        let ids = try LLBFuture.whenAllSucceed(futures, on: ctx.group.next()).wait()
+        XCTAssertEqual(Set(ids).count, 1)
+        XCTAssertEqual(countingDB.puts.load(), 2)
+        XCTAssertEqual(try countingDB.get(ids[0], ctx).wait()?.data, newBytes)
+    }
+}
@@ -0,0 +1,124 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import LLBBuildSystemUtil
+import NIOConcurrencyHelpers
+import XCTest
+
+class LocalExecutionSchedulerTests: XCTestCase {
+    let group = LLBMakeDefaultDispatchGroup()
+
+    func testConcurrencyLimit() throws {
+        let scheduler = LLBLocalExecutionScheduler(capacity: LLBLocalExecutionResources(cpus: 2, memory: 100))
+
+        let lock = Lock()
+        var running = 0
+        var maxRunning = 0
+
+        let futures = (0..<10).map { _ in
+            scheduler.schedule(group: group) { () -> Void in
+                lock.withLockVoid {
+                    running += 1
+                    maxRunning = max(maxRunning, running)
+                }
+                usleep(10_000)
+                lock.withLockVoid {
+                    running -= 1
+                }
+            }
+        }
+
+        try LLBFuture.whenAllSucceed(futures, on: group.next()).wait()
+        XCTAssertEqual(maxRunning, 2)
+    }
+
+    func testMemoryLimit() throws {
+        let scheduler = LLBLocalExecutionScheduler(capacity: LLBLocalExecutionResources(cpus: 8, memory: 100))
+
+        let lock = Lock()
+        var running = 0
+        var maxRunning = 0
+
+        // Requests larger than the capacity are clamped, so they run one at a time.
+        let futures = (0..<4).map { _ in
+            scheduler.schedule(resources: LLBLocalExecutionResources(cpus: 1, memory: 1000), group: group) { () -> Void in
+                lock.withLockVoid {
+                    running += 1
+                    maxRunning = max(maxRunning, running)
+                }
+                usleep(10_000)
+                lock.withLockVoid {
+                    running -= 1
+                }
+            }
+        }
+
+        try LLBFuture.whenAllSucceed(futures, on: group.next()).wait()
+        XCTAssertEqual(maxRunning, 1)
+    }
+
+    func testUnscheduledWorkDoesNotWaitForResources() throws {
+        let scheduler = LLBLocalExecutionScheduler(capacity: LLBLocalExecutionResources(cpus: 1, memory: 0))
+
+        // Block the only slot; work that doesn't take resources still runs.
+        let gate = DispatchSemaphore(value: 0)
+        let blocker = scheduler.schedule(group: group) {
+            gate.wait()
+        }
+
+        XCTAssertEqual(try scheduler.run(group: group) { 42 }.wait(), 42)
+        gate.signal()
+        try blocker.wait()
+    }
+
+    func testPriorityOrder() throws {
+        let scheduler = LLBLocalExecutionScheduler(capacity: LLBLocalExecutionResources(cpus: 1, memory: 0))
+
+        let lock = Lock()
+        var order = [Int]()
+
+        // Block the only slot, so that the remaining work is queued.
+        let gate = DispatchSemaphore(value: 0)
+        let blocker = scheduler.schedule(group: group) {
+            gate.wait()
+        }
+
+        let futures = [(1, 0), (2, 5), (3, 1), (4, 5)].map { (id, priority) in
+            scheduler.schedule(priority: priority, group: group) {
+                lock.withLockVoid { order.append(id) }
+            }
+        }
+        XCTAssertEqual(scheduler.pendingCount, 4)
+
+        gate.signal()
+        try blocker.wait()
+        try LLBFuture.whenAllSucceed(futures, on: group.next()).wait()
+
+        XCTAssertEqual(order, [2, 4, 3, 1])
+    }
+
+    func testDurationEstimatorEvictsLeastRecentlyUsed() throws {
+        let estimator = LLBActionDurationEstimator(maxEntries: 4)
+        func request(_ name: String) -> LLBActionExecutionRequest {
+            return LLBActionExecutionRequest(actionSpec: LLBActionSpec(arguments: [name]), inputs: [], outputs: [])
+        }
+
+        for name in ["a", "b", "c", "d"] {
+            estimator.record(request(name), duration: 1)
+        }
+        // Using "a" makes "b" the least recently used command.
+        XCTAssertEqual(estimator.priority(for: request("a")), 1000)
+
+        estimator.record(request("e"), duration: 2)
+        XCTAssertEqual(estimator.count, 4)
+        XCTAssertEqual(estimator.priority(for: request("b")), Int.max)
+        XCTAssertEqual(estimator.priority(for: request("a")), 1000)
+        XCTAssertEqual(estimator.priority(for: request("e")), 2000)
+    }
+}
@@ -59,6 +59,64 @@ class LocalExecutorTests: XCTestCase {
         }
     }
 
+    func testCancellationKillsProcessesThatIgnoreSIGTERM() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let localExecutor = LLBLocalExecutor(outputBase: tempDirectory, terminationGracePeriod: .milliseconds(100))
+            var ctx = LLBMakeTestContext()
+            let token = LLBCancellationToken()
+            ctx.cancellationToken = token
+
+            let request = LLBActionExecutionRequest.with {
+                $0.actionSpec = .with {
+                    $0.arguments = ["/bin/bash", "-c", "trap '' TERM; touch started; sleep 60"]
+                }
+            }
+
+            let start = Date()
+            let response = localExecutor.execute(request: request, ctx)
+            while !localFileSystem.exists(tempDirectory.appending(component: "started")) {
+                usleep(10_000)
+            }
+            token.cancel(reason: "test")
+
+            XCTAssertThrowsError(try response.wait()) { error in
+                guard case LLBCancellationError.cancelled("test") = error else {
+                    XCTFail("Unexpected error \(error)")
+                    return
+                }
+            }
+            XCTAssertLessThan(Date().timeIntervalSince(start), 30)
+        }
+    }
+
+    func testSignalForwarding() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let localExecutor = LLBLocalExecutor(outputBase: tempDirectory)
+            let ctx = LLBMakeTestContext()
+
+            let request = LLBActionExecutionRequest.with {
+                $0.actionSpec = .with {
+                    $0.arguments = [
+                        "/bin/bash", "-c", "trap 'kill $!; exit 3' INT; sleep 60 >/dev/null 2>&1 & touch started; wait",
+                    ]
+                }
+            }
+
+            // The action runs in its own process group, so it only receives the SIGINT of the client once forwarding
+            // is installed, which also keeps the signal from terminating the client.
+            LLBProcessGroups.installSignalForwarding()
+            defer { LLBProcessGroups.removeSignalForwarding() }
+
+            let response = localExecutor.execute(request: request, ctx)
+            while !localFileSystem.exists(tempDirectory.appending(component: "started")) {
+                usleep(10_000)
+            }
+            kill(getpid(), SIGINT)
+
+            XCTAssertEqual(try response.wait().exitCode, 3)
+        }
+    }
+
     func testActionFailure() throws {
         try withTemporaryDirectory { tempDirectory in
             let localExecutor = LLBLocalExecutor(outputBase: tempDirectory)
@@ -190,4 +248,196 @@ class LocalExecutorTests: XCTestCase {
             XCTAssertEqual(contents, "I can't breathe")
         }
     }
+
+    func testExecutionWithCachedInputs() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let blobCache = try LLBLocalBlobCache(path: tempDirectory.appending(component: "cache"))
+            let ctx = LLBMakeTestContext()
+
+            let bytes = LLBByteBuffer.withString("I can't breathe")
+            let dataID = try ctx.db.put(data: bytes, ctx).wait()
+
+            let request = LLBActionExecutionRequest.with {
+                $0.actionSpec = .with {
+                    $0.arguments = ["/bin/bash", "-c", "cat some/input > some/path"]
+                }
+                $0.inputs = [
+                    .with {
+                        $0.path = "some/input"
+                        $0.type = .file
+                        $0.dataID = dataID
+                    }
+                ]
+                $0.outputs = [
+                    .with {
+                        $0.path = "some/path"
+                        $0.type = .file
+                    }
+                ]
+            }
+
+            // Run the same action in two output bases, which share the cached copy of the input.
+            for outputBase in ["base1", "base2"] {
+                let localExecutor = LLBLocalExecutor(
+                    outputBase: tempDirectory.appending(component: outputBase),
+                    blobCache: blobCache
+                )
+                let response = try localExecutor.execute(request: request, ctx).wait()
+                let contents = try LLBCASFSClient(ctx.db).fileContents(for: response.outputs[0], ctx)
+                XCTAssertEqual(contents, "I can't breathe")
+            }
+
+            XCTAssertEqual(try localFileSystem.getDirectoryContents(blobCache.path), ["\(dataID)"])
+        }
+    }
+
+    func testPersistentWorkers() throws {
+        try withTemporaryDirectory { tempDirectory in
+            // A worker that answers each request with the number of requests it has served.
+            let worker = tempDirectory.appending(component: "worker.sh")
+            try localFileSystem.writeFileContents(worker, bytes: """
+                count=0
+                while read request; do
+                    count=$((count + 1))
+                    echo "{\\"exitCode\\":0,\\"output\\":\\"request $count\\"}"
+                done
+                """)
+
+            let workerPool = LLBPersistentWorkerPool()
+            let localExecutor = LLBLocalExecutor(
+                outputBase: tempDirectory,
+                workerSelector: { request in
+                    LLBPersistentWorkerSpec(startupArguments: ["/bin/sh", worker.pathString], requestArguments: request.actionSpec.arguments)
+                },
+                workerPool: workerPool
+            )
+            let ctx = LLBMakeTestContext()
+
+            let request = LLBActionExecutionRequest.with {
+                $0.actionSpec = .with {
+                    $0.arguments = ["compile", "@flagfile"]
+                }
+            }
+
+            for expectedOutput in ["request 1", "request 2"] {
+                let response = try localExecutor.execute(request: request, ctx).wait()
+                XCTAssertEqual(response.exitCode, 0)
+                let output = try XCTUnwrap(ctx.db.get(response.stdoutID, ctx).wait())
+                XCTAssertEqual(String(decoding: output.data.readableBytesView, as: UTF8.self), expectedOutput)
+            }
+            XCTAssertEqual(workerPool.startedWorkers, 1)
+            workerPool.shutdown()
+        }
+    }
+
+    func testPersistentWorkerFailures() throws {
+        try withTemporaryDirectory { tempDirectory in
+            // A worker that serves a single request, logging to its standard error first.
+            let worker = tempDirectory.appending(component: "worker.sh")
+            try localFileSystem.writeFileContents(worker, bytes: """
+                read request
+                echo "warning" >&2
+                sleep 0.5
+                echo "{\\"exitCode\\":0,\\"output\\":\\"done \\"}"
+                """)
+            // A worker that never responds.
+            let stuckWorker = tempDirectory.appending(component: "stuck.sh")
+            try localFileSystem.writeFileContents(stuckWorker, bytes: "while read request; do :; done")
+
+            let workerPool = LLBPersistentWorkerPool(responseTimeout: 2)
+            defer { workerPool.shutdown() }
+            let localExecutor = LLBLocalExecutor(
+                outputBase: tempDirectory,
+                workerSelector: { request in
+                    LLBPersistentWorkerSpec(startupArguments: ["/bin/sh"] + request.actionSpec.arguments, requestArguments: [])
+                },
+                workerPool: workerPool
+            )
+            let ctx = LLBMakeTestContext()
+
+            // The worker exits after each request, so the second request is retried in a new worker.
+            for _ in 0..<2 {
+                let request = LLBActionExecutionRequest.with {
+                    $0.actionSpec = .with { $0.arguments = [worker.pathString] }
+                }
+                let response = try localExecutor.execute(request: request, ctx).wait()
+                XCTAssertEqual(response.exitCode, 0)
+                let output = try XCTUnwrap(ctx.db.get(response.stdoutID, ctx).wait())
+                XCTAssertEqual(String(decoding: output.data.readableBytesView, as: UTF8.self), "done warning\n")
+            }
+            XCTAssertEqual(workerPool.startedWorkers, 2)
+
+            let stuckRequest = LLBActionExecutionRequest.with {
+                $0.actionSpec = .with { $0.arguments = [stuckWorker.pathString] }
+            }
+            XCTAssertThrowsError(try localExecutor.execute(request: stuckRequest, ctx).wait())
+        }
+    }
+
+    func testPersistentWorkerOutputIsScopedToItsRequest() throws {
+        try withTemporaryDirectory { tempDirectory in
+            // A worker that keeps logging to its standard error after it responded.
+            let worker = tempDirectory.appending(component: "worker.sh")
+            try localFileSystem.writeFileContents(worker, bytes: """
+                count=0
+                while read request; do
+                    count=$((count + 1))
+                    echo "{\\"exitCode\\":0,\\"output\\":\\"request $count\\"}"
+                    sleep 0.2
+                    echo "late $count" >&2
+                done
+                """)
+
+            let workerPool = LLBPersistentWorkerPool()
+            defer { workerPool.shutdown() }
+            let localExecutor = LLBLocalExecutor(
+                outputBase: tempDirectory,
+                workerSelector: { request in
+                    LLBPersistentWorkerSpec(startupArguments: ["/bin/sh", worker.pathString], requestArguments: [])
+                },
+                workerPool: workerPool
+            )
+            let ctx = LLBMakeTestContext()
+            let request = LLBActionExecutionRequest.with {
+                $0.actionSpec = .with { $0.arguments = ["compile"] }
+            }
+
+            // The output logged after the first response isn't attached to the second one.
+            for expectedOutput in ["request 1", "request 2"] {
+                let response = try localExecutor.execute(request: request, ctx).wait()
+                let output = try XCTUnwrap(ctx.db.get(response.stdoutID, ctx).wait())
+                XCTAssertEqual(String(decoding: output.data.readableBytesView, as: UTF8.self), expectedOutput)
+                Thread.sleep(forTimeInterval: 0.5)
+            }
+            XCTAssertEqual(workerPool.startedWorkers, 1)
+        }
+    }
+
+    func testBackgroundPreAction() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let localExecutor = LLBLocalExecutor(outputBase: tempDirectory)
+            defer { localExecutor.shutdown() }
+            let ctx = LLBMakeTestContext()
+
+            let request = LLBActionExecutionRequest.with {
+                $0.actionSpec = .with {
+                    $0.arguments = ["/bin/bash", "-c", "true"]
+                    $0.preActions = [
+                        .with {
+                            $0.arguments = ["/bin/bash", "-c", "echo started >> server.log; sleep 30"]
+                            $0.background = true
+                        }
+                    ]
+                }
+            }
+
+            // The background process is only started once, and keeps running across actions.
+            for _ in 0..<2 {
+                let response = try localExecutor.execute(request: request, ctx).wait()
+                XCTAssertEqual(response.exitCode, 0)
+            }
+            Thread.sleep(forTimeInterval: 0.5)
+            XCTAssertEqual(try localFileSystem.readFileContents(tempDirectory.appending(component: "server.log")), "started\n")
+        }
+    }
 }
@@ -0,0 +1,197 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import LLBBuildSystemUtil
+import LLBBuildSystemTestHelpers
+import TSCBasic
+import XCTest
+
+/// A database whose writes fail.
+private final class ReadOnlyDatabase: LLBCASDatabase {
+    struct WriteError: Error {}
+
+    let group: LLBFuturesDispatchGroup
+    let db: LLBCASDatabase
+
+    init(group: LLBFuturesDispatchGroup) {
+        self.group = group
+        self.db = LLBInMemoryCASDatabase(group: group)
+    }
+
+    func supportedFeatures() -> LLBFuture<LLBCASFeatures> { db.supportedFeatures() }
+
+    func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> { db.contains(id, ctx) }
+
+    func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> { db.get(id, ctx) }
+
+    func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        db.identify(refs: refs, data: data, ctx)
+    }
+
+    func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        group.next().makeFailedFuture(WriteError())
+    }
+
+    func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        group.next().makeFailedFuture(WriteError())
+    }
+}
+
+class TieredCASDatabaseTests: XCTestCase {
+    private func remoteOperations(_ operation: String, _ metrics: LLBInMemoryMetrics) -> Int64 {
+        return metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", operation)])
+    }
+
+    func testReadsAreServedLocally() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let ctx = LLBMakeTestContext()
+            let metrics = LLBInMemoryMetrics()
+            let remote = LLBMetricsCASDatabase(LLBInMemoryCASDatabase(group: ctx.group), metrics: metrics)
+            let id = try remote.put(data: LLBByteBuffer.withString("cached"), ctx).wait()
+
+            let db = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory.appending(component: "cas"))
+
+            // Concurrent reads share a single remote read.
+            let futures = (0..<10).map { _ in db.get(id, ctx) }
+            let objects = try LLBFuture.whenAllSucceed(futures, on: ctx.group.next()).wait()
+            XCTAssertEqual(Set(objects.map { $0?.data }), [LLBByteBuffer.withString("cached")])
+            XCTAssertEqual(remoteOperations("get", metrics), 1)
+
+            // Later reads are served from memory.
+            XCTAssertEqual(try db.get(id, ctx).wait()?.data, LLBByteBuffer.withString("cached"))
+            XCTAssertTrue(try db.contains(id, ctx).wait())
+            XCTAssertEqual(remoteOperations("get", metrics), 1)
+
+            // A new instance finds the object on disk.
+            try db.flush().wait()
+            let newDB = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory.appending(component: "cas"))
+            XCTAssertEqual(try newDB.get(id, ctx).wait()?.data, LLBByteBuffer.withString("cached"))
+            XCTAssertEqual(remoteOperations("get", metrics), 1)
+        }
+    }
+
+    func testWritesReachRemote() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let ctx = LLBMakeTestContext()
+            let remote = LLBInMemoryCASDatabase(group: ctx.group)
+            let db = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory)
+
+            // Writes are synchronous by default, so they have reached the remote database once they complete.
+            let id = try db.put(data: LLBByteBuffer.withString("written"), ctx).wait()
+            XCTAssertEqual(id, try remote.identify(data: LLBByteBuffer.withString("written"), ctx).wait())
+            XCTAssertEqual(try remote.get(id, ctx).wait()?.data, LLBByteBuffer.withString("written"))
+            XCTAssertEqual(try db.get(id, ctx).wait()?.data, LLBByteBuffer.withString("written"))
+        }
+    }
+
+    func testBatchWritesReachRemoteAsABatch() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let ctx = LLBMakeTestContext()
+            let metrics = LLBInMemoryMetrics()
+            let remote = LLBMetricsCASDatabase(LLBInMemoryCASDatabase(group: ctx.group), metrics: metrics)
+            let db = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory)
+
+            let objects = (0..<3).map { LLBCASObject(refs: [], data: LLBByteBuffer.withString("object \($0)")) }
+            let ids = try db.put(objects: objects, ctx).wait()
+            XCTAssertEqual(remoteOperations("batch_put", metrics), 1)
+            XCTAssertEqual(remoteOperations("put", metrics), 0)
+
+            for (id, object) in zip(ids, objects) {
+                XCTAssertEqual(try remote.get(id, ctx).wait()?.data, object.data)
+                XCTAssertEqual(try db.get(id, ctx).wait()?.data, object.data)
+            }
+            XCTAssertEqual(remoteOperations("get", metrics), 0)
+        }
+    }
+
+    func testAsynchronousWritesReachRemoteWhenFlushed() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let ctx = LLBMakeTestContext()
+            let remote = LLBInMemoryCASDatabase(group: ctx.group)
+            let db = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory, asynchronousWrites: true)
+
+            let id = try db.put(data: LLBByteBuffer.withString("written"), ctx).wait()
+            XCTAssertEqual(try db.get(id, ctx).wait()?.data, LLBByteBuffer.withString("written"))
+
+            try db.flush().wait()
+            XCTAssertEqual(try remote.get(id, ctx).wait()?.data, LLBByteBuffer.withString("written"))
+        }
+    }
+
+    func testFailedWritesAreNotKeptLocally() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let ctx = LLBMakeTestContext()
+            let remote = ReadOnlyDatabase(group: ctx.group)
+            let db = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory, asynchronousWrites: true)
+
+            // The write completes locally, but the failure of the remote write is reported by the flush.
+            let id = try db.put(data: LLBByteBuffer.withString("lost"), ctx).wait()
+            XCTAssertThrowsError(try db.flush().wait()) { error in
+                XCTAssert(error is ReadOnlyDatabase.WriteError)
+            }
+
+            // The object isn't claimed by any of the local tiers, so it would be written again.
+            XCTAssertFalse(try db.contains(id, ctx).wait())
+            XCTAssertNil(try db.get(id, ctx).wait())
+            let newDB = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory)
+            XCTAssertFalse(try newDB.contains(id, ctx).wait())
+        }
+    }
+
+    func testDiskTierEvictsLeastRecentlyUsed() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let ctx = LLBMakeTestContext()
+            let metrics = LLBInMemoryMetrics()
+            let remote = LLBMetricsCASDatabase(LLBInMemoryCASDatabase(group: ctx.group), metrics: metrics)
+
+            // Each object takes a bit more than its 100 bytes of data on disk, so only two of them fit.
+            let ids = try (0..<3).map { i in
+                try remote.put(data: LLBByteBuffer.withString(String(repeating: "\(i)", count: 100)), ctx).wait()
+            }
+            let db = try LLBTieredCASDatabase(remote: remote, diskPath: tempDirectory, memoryCapacity: 0, diskCapacity: 250)
+
+            for id in ids {
+                _ = try db.get(id, ctx).wait()
+                try db.flush().wait()
+            }
+            XCTAssertEqual(remoteOperations("get", metrics), 3)
+
+            // The first object was evicted, and the others are still on disk.
+            _ = try db.get(ids[2], ctx).wait()
+            _ = try db.get(ids[1], ctx).wait()
+            XCTAssertEqual(remoteOperations("get", metrics), 3)
+            _ = try db.get(ids[0], ctx).wait()
+            XCTAssertEqual(remoteOperations("get", metrics), 4)
+            try db.flush().wait()
+            XCTAssertEqual(try localFileSystem.getDirectoryContents(tempDirectory).count, 2)
+        }
+    }
+
+    func testOpensFromURL() throws {
+        try withTemporaryDirectory { tempDirectory in
+            let ctx = LLBMakeTestContext()
+            registerTieredCASScheme()
+
+            let remotePath = tempDirectory.appending(component: "remote")
+            let remoteURL = "file://\(remotePath)".addingPercentEncoding(withAllowedCharacters: .alphanumerics)!
+            let cachePath = tempDirectory.appending(component: "cache")
+            let url = try XCTUnwrap(URL(string: "tiered://\(cachePath)?remote=\(remoteURL)&memory=1024&async=1"))
+            let db = try LLBCASDatabaseSpec(url).open(group: ctx.group)
+            XCTAssertTrue(db is LLBTieredCASDatabase)
+
+            let id = try db.put(data: LLBByteBuffer.withString("opened"), ctx).wait()
+            XCTAssertEqual(try db.get(id, ctx).wait()?.data, LLBByteBuffer.withString("opened"))
+
+            // Writes reach the remote database once flushed.
+            try (db as? LLBTieredCASDatabase)?.flush().wait()
+            let remote = try LLBCASDatabaseSpec(URL(fileURLWithPath: remotePath.pathString)).open(group: ctx.group)
+            XCTAssertTrue(try remote.contains(id, ctx).wait())
+        }
+    }
+}
@@ -0,0 +1,120 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import Foundation
+
+import llbuild2
+@testable import LLBCASTool
+import LLBUtil
+import NIO
+import NIOConcurrencyHelpers
+import TSCBasic
+import XCTest
+
+/// Delays every put, recording the largest number of puts in flight at once.
+private final class SlowCASDatabase: LLBCASDatabase {
+    let db: LLBCASDatabase
+
+    private let lock = Lock()
+    private var running = 0
+    private(set) var maxRunning = 0
+
+    var group: LLBFuturesDispatchGroup {
+        return db.group
+    }
+
+    init(_ db: LLBCASDatabase) {
+        self.db = db
+    }
+
+    func supportedFeatures() -> LLBFuture<LLBCASFeatures> {
+        return db.supportedFeatures()
+    }
+
+    func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> {
+        return db.contains(id, ctx)
+    }
+
+    func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        return db.get(id, ctx)
+    }
+
+    func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return db.identify(refs: refs, data: data, ctx)
+    }
+
+    func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return slowly { self.db.put(refs: refs, data: data, ctx) }
+    }
+
+    func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return slowly { self.db.put(knownID: id, refs: refs, data: data, ctx) }
+    }
+
+    private func slowly(_ put: @escaping () -> LLBFuture<LLBDataID>) -> LLBFuture<LLBDataID> {
+        lock.withLockVoid {
+            running += 1
+            maxRunning = max(maxRunning, running)
+        }
+        return group.next().scheduleTask(in: .milliseconds(10)) {}.futureResult.flatMap {
+            put()
+        }.always { _ in
+            self.lock.withLockVoid { self.running -= 1 }
+        }
+    }
+}
+
+final class TransferTests: XCTestCase {
+    func testTransfersAreBounded() throws {
+        let ctx = Context()
+        let group = LLBMakeDefaultDispatchGroup()
+        let slowDB = SlowCASDatabase(LLBInMemoryCASDatabase(group: group))
+        let db = LLBTransferCASDatabase(slowDB, maxConcurrentTransfers: 3)
+
+        let puts = (0..<20).map { db.put(data: LLBByteBuffer.withString("object \($0)"), ctx) }
+        let ids = try LLBFuture.whenAllSucceed(puts, on: group.next()).wait()
+
+        XCTAssertEqual(Set(ids).count, 20)
+        XCTAssertEqual(slowDB.maxRunning, 3)
+        XCTAssertEqual(db.stats.objects, 20)
+    }
+
+    func testImportAndExport() throws {
+        try withTemporaryDirectory(removeTreeOnDeinit: true) { tempDirectory in
+            let ctx = Context()
+            let group = LLBMakeDefaultDispatchGroup()
+
+            let source = tempDirectory.appending(component: "source")
+            var files = [RelativePath: String]()
+            for index in 0..<50 {
+                let path = RelativePath("dir\(index % 5)/file\(index)")
+                files[path] = String(repeating: "content \(index) ", count: index * 100)
+                try localFileSystem.createDirectory(source.appending(path).parentDirectory, recursive: true)
+                try localFileSystem.writeFileContents(source.appending(path), bytes: ByteString(encodingAsUTF8: files[path]!))
+            }
+
+            let options = LLBCASToolOptions(
+                url: URL(fileURLWithPath: tempDirectory.appending(component: "cas").pathString),
+                maxConcurrentTransfers: 4
+            )
+            let tool = try LLBCASTool(group: group, options)
+
+            let id = try tool.casImport(directory: source, ctx).wait()
+            let imported = tool.transferStats
+            XCTAssertGreaterThanOrEqual(imported.objects, files.count)
+
+            let destination = tempDirectory.appending(component: "destination")
+            try tool.casExport(id: id, to: destination, ctx).wait()
+            XCTAssertGreaterThan(tool.transferStats.objects, imported.objects)
+
+            for (path, contents) in files {
+                XCTAssertEqual(try localFileSystem.readFileContents(destination.appending(path)), ByteString(encodingAsUTF8: contents))
+            }
+        }
+    }
+}
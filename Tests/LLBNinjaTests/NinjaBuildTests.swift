@@ -9,6 +9,7 @@
 import XCTest
 
 import llbuild2
+import LLBBuildSystemUtil
 import LLBNinja
 
 import NIOConcurrencyHelpers
@@ -51,6 +52,165 @@ final class NinjaBuildTests: XCTestCase {
                 "build command 'touch a b'",
                 "build command 'cat a b > all'"])
     }
+
+    func testRepeatedBuilds() throws {
+        try withTemporaryFile { tmp in
+            try localFileSystem.writeFileContents(tmp.path, bytes: """
+                rule TOUCH
+                    command = touch $out
+                build a: TOUCH
+                build all: phony a
+                """)
+            let logger = LoggingNinjaDelegate()
+            let nb = try NinjaBuild(manifest: tmp.path.pathString, delegate: logger)
+            let ctx = Context()
+            _ = try nb.build(target: "all", as: Int.self, ctx)
+            _ = try nb.build(target: "a", as: Int.self, ctx)
+
+            // Each build starts from scratch, since the delegate doesn't cache anything.
+            XCTAssertEqual(logger.log, [
+                "build command 'touch a'",
+                "build command ''",
+                "build command 'touch a'"])
+            XCTAssertThrowsError(try nb.build(target: "missing", as: Int.self, ctx))
+        }
+    }
+
+    func testExecutionDelegate() throws {
+        try withTemporaryDirectory(removeTreeOnDeinit: true) { buildDirectory in
+            let manifestPath = buildDirectory.appending(component: "build.ninja")
+            try localFileSystem.writeFileContents(manifestPath, bytes: """
+                rule CAT
+                    command = cat $in > $out
+                build out: CAT in
+                build all: phony out
+
+                """)
+            let inputPath = buildDirectory.appending(component: "in")
+            let outputPath = buildDirectory.appending(component: "out")
+            try localFileSystem.writeFileContents(inputPath, bytes: "contents")
+
+            let group = LLBMakeDefaultDispatchGroup()
+            let launches = CountingExecutor(LLBLocalExecutor(outputBase: buildDirectory))
+            let delegate = NinjaExecutionDelegate(
+                buildDirectory: buildDirectory,
+                executor: launches,
+                db: LLBInMemoryCASDatabase(group: group),
+                functionCache: LLBInMemoryFunctionCache(group: group)
+            )
+            let nb = try NinjaBuild(manifest: manifestPath.pathString, delegate: delegate, group: group)
+            let ctx = Context()
+
+            let value = try nb.build(target: "all", as: NinjaArtifactValue.self, ctx)
+            XCTAssertEqual(value.paths, ["out"])
+            XCTAssertEqual(try localFileSystem.readFileContents(outputPath), "contents")
+            XCTAssertEqual(launches.count, 1)
+
+            // The output is restored from the cache, without running the command again.
+            try localFileSystem.removeFileTree(outputPath)
+            _ = try nb.build(target: "all", as: NinjaArtifactValue.self, ctx)
+            XCTAssertEqual(try localFileSystem.readFileContents(outputPath), "contents")
+            XCTAssertEqual(launches.count, 1)
+
+            // Changing the input runs the command again.
+            try localFileSystem.writeFileContents(inputPath, bytes: "new contents")
+            _ = try nb.build(target: "all", as: NinjaArtifactValue.self, ctx)
+            XCTAssertEqual(try localFileSystem.readFileContents(outputPath), "new contents")
+            XCTAssertEqual(launches.count, 2)
+        }
+    }
+
+    func testExecutionDelegateDiscoveredInputs() throws {
+        try withTemporaryDirectory(removeTreeOnDeinit: true) { buildDirectory in
+            let manifestPath = buildDirectory.appending(component: "build.ninja")
+            try localFileSystem.writeFileContents(manifestPath, bytes: """
+                rule CC
+                    command = cat $in > $out && touch $out.d
+                    depfile = $out.d
+                build out: CC in
+                build all: phony out
+
+                """)
+            try localFileSystem.writeFileContents(buildDirectory.appending(component: "in"), bytes: "contents")
+
+            let group = LLBMakeDefaultDispatchGroup()
+            let launches = CountingExecutor(LLBLocalExecutor(outputBase: buildDirectory))
+            let delegate = NinjaExecutionDelegate(
+                buildDirectory: buildDirectory,
+                executor: launches,
+                db: LLBInMemoryCASDatabase(group: group),
+                functionCache: LLBInMemoryFunctionCache(group: group)
+            )
+            let nb = try NinjaBuild(manifest: manifestPath.pathString, delegate: delegate, group: group)
+            let ctx = Context()
+
+            // The inputs listed in the depfile aren't part of the cache key, so the command always runs.
+            _ = try nb.build(target: "all", as: NinjaArtifactValue.self, ctx)
+            _ = try nb.build(target: "all", as: NinjaArtifactValue.self, ctx)
+            XCTAssertEqual(launches.count, 2)
+        }
+    }
+
+    func testExecutionDelegateKeyEnvironment() throws {
+        try withTemporaryDirectory(removeTreeOnDeinit: true) { buildDirectory in
+            let manifestPath = buildDirectory.appending(component: "build.ninja")
+            try localFileSystem.writeFileContents(manifestPath, bytes: """
+                rule CAT
+                    command = cat $in > $out
+                build out: CAT in
+                build all: phony out
+
+                """)
+            try localFileSystem.writeFileContents(buildDirectory.appending(component: "in"), bytes: "contents")
+
+            let group = LLBMakeDefaultDispatchGroup()
+            let db = LLBInMemoryCASDatabase(group: group)
+            let functionCache = LLBInMemoryFunctionCache(group: group)
+            let launches = CountingExecutor(LLBLocalExecutor(outputBase: buildDirectory))
+            func build(_ environment: [String: String]) throws {
+                var environment = environment
+                environment["PATH"] = ProcessInfo.processInfo.environment["PATH"]
+                let delegate = NinjaExecutionDelegate(
+                    buildDirectory: buildDirectory,
+                    executor: launches,
+                    db: db,
+                    functionCache: functionCache,
+                    environment: environment,
+                    keyEnvironment: ["CC"]
+                )
+                let nb = try NinjaBuild(manifest: manifestPath.pathString, delegate: delegate, group: group)
+                _ = try nb.build(target: "all", as: NinjaArtifactValue.self, Context())
+            }
+
+            try build(["CC": "cc", "TERM": "a"])
+            XCTAssertEqual(launches.count, 1)
+
+            // Only the variables of the key environment invalidate the cached response.
+            try build(["CC": "cc", "TERM": "b"])
+            XCTAssertEqual(launches.count, 1)
+            try build(["CC": "clang", "TERM": "b"])
+            XCTAssertEqual(launches.count, 2)
+        }
+    }
+}
+
+/// Counts the executions when they are requested, so that the count is up to date once a build completes.
+private final class CountingExecutor: LLBExecutor {
+    private let executor: LLBExecutor
+    private let executions = NIOAtomic<Int>.makeAtomic(value: 0)
+
+    init(_ executor: LLBExecutor) {
+        self.executor = executor
+    }
+
+    var count: Int {
+        return executions.load()
+    }
+
+    func execute(request: LLBActionExecutionRequest, _ ctx: Context) -> LLBFuture<LLBActionExecutionResponse> {
+        _ = executions.add(1)
+        return executor.execute(request: request, ctx)
+    }
 }
 
 private class LoggingNinjaDelegate: NinjaBuildDelegate {
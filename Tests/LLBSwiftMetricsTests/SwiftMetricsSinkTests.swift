@@ -0,0 +1,146 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import XCTest
+
+import llbuild2
+import LLBSwiftMetrics
+import Metrics
+import NIOConcurrencyHelpers
+
+/// A swift-metrics backend that keeps the values of its handles, and counts how many handles it created.
+private final class TestMetricsFactory: MetricsFactory {
+    final class TestCounter: CounterHandler {
+        private let lock = Lock()
+        private var _value: Int64 = 0
+
+        var value: Int64 {
+            return lock.withLock { _value }
+        }
+
+        func increment(by amount: Int64) {
+            lock.withLockVoid { _value += amount }
+        }
+
+        func reset() {
+            lock.withLockVoid { _value = 0 }
+        }
+    }
+
+    final class TestRecorder: RecorderHandler {
+        let aggregate: Bool
+        private let lock = Lock()
+        private var _values = [Double]()
+
+        init(aggregate: Bool) {
+            self.aggregate = aggregate
+        }
+
+        var values: [Double] {
+            return lock.withLock { _values }
+        }
+
+        func record(_ value: Int64) {
+            record(Double(value))
+        }
+
+        func record(_ value: Double) {
+            lock.withLockVoid { _values.append(value) }
+        }
+    }
+
+    final class TestTimer: TimerHandler {
+        func recordNanoseconds(_ duration: Int64) {}
+    }
+
+    private let lock = Lock()
+    private var counters = [String: [TestCounter]]()
+    private var recorders = [String: [TestRecorder]]()
+
+    private static func key(_ label: String, _ dimensions: [(String, String)]) -> String {
+        return ([label] + dimensions.map { "\($0.0)=\($0.1)" }).joined(separator: ",")
+    }
+
+    /// The counters created for the label and dimensions.
+    func counters(_ label: String, dimensions: [(String, String)] = []) -> [TestCounter] {
+        return lock.withLock { counters[Self.key(label, dimensions)] ?? [] }
+    }
+
+    /// The recorders created for the label and dimensions.
+    func recorders(_ label: String, dimensions: [(String, String)] = []) -> [TestRecorder] {
+        return lock.withLock { recorders[Self.key(label, dimensions)] ?? [] }
+    }
+
+    func makeCounter(label: String, dimensions: [(String, String)]) -> CounterHandler {
+        let counter = TestCounter()
+        lock.withLockVoid { counters[Self.key(label, dimensions), default: []].append(counter) }
+        return counter
+    }
+
+    func makeRecorder(label: String, dimensions: [(String, String)], aggregate: Bool) -> RecorderHandler {
+        let recorder = TestRecorder(aggregate: aggregate)
+        lock.withLockVoid { recorders[Self.key(label, dimensions), default: []].append(recorder) }
+        return recorder
+    }
+
+    func makeTimer(label: String, dimensions: [(String, String)]) -> TimerHandler {
+        return TestTimer()
+    }
+
+    func destroyCounter(_ handler: CounterHandler) {}
+    func destroyRecorder(_ handler: RecorderHandler) {}
+    func destroyTimer(_ handler: TimerHandler) {}
+}
+
+final class SwiftMetricsSinkTests: XCTestCase {
+    /// The metrics system can only be bootstrapped once per process, so the tests share the factory and use labels of
+    /// their own.
+    private static let factory: TestMetricsFactory = {
+        let factory = TestMetricsFactory()
+        MetricsSystem.bootstrap(factory)
+        return factory
+    }()
+
+    private var factory: TestMetricsFactory {
+        return Self.factory
+    }
+
+    func testForwardsCounters() {
+        let sink = LLBSwiftMetricsSink()
+        sink.increment(counter: "test.counter")
+        sink.increment(counter: "test.counter", by: 4, dimensions: [])
+        sink.increment(counter: "test.counter", dimensions: [("kind", "a")])
+
+        XCTAssertEqual(factory.counters("test.counter").map { $0.value }, [5])
+        XCTAssertEqual(factory.counters("test.counter", dimensions: [("kind", "a")]).map { $0.value }, [1])
+    }
+
+    func testForwardsHistogramsToAggregatingRecorders() {
+        let sink = LLBSwiftMetricsSink()
+        sink.record(histogram: "test.histogram", value: 0.5, dimensions: [("kind", "a")])
+        sink.record(histogram: "test.histogram", value: 1.5, dimensions: [("kind", "a")])
+
+        let recorders = factory.recorders("test.histogram", dimensions: [("kind", "a")])
+        XCTAssertEqual(recorders.map { $0.values }, [[0.5, 1.5]])
+        XCTAssertEqual(recorders.map { $0.aggregate }, [true])
+    }
+
+    func testCachesHandlesPerLabelAndDimensions() {
+        let sink = LLBSwiftMetricsSink()
+        for _ in 0..<10 {
+            sink.increment(counter: "test.cached", dimensions: [("kind", "a")])
+            sink.increment(counter: "test.cached", dimensions: [("kind", "b")])
+            sink.record(histogram: "test.cached", value: 1, dimensions: [("kind", "a")])
+        }
+
+        // One handle is created per label and dimensions, however many times they are used.
+        XCTAssertEqual(factory.counters("test.cached", dimensions: [("kind", "a")]).map { $0.value }, [10])
+        XCTAssertEqual(factory.counters("test.cached", dimensions: [("kind", "b")]).map { $0.value }, [10])
+        XCTAssertEqual(factory.recorders("test.cached", dimensions: [("kind", "a")]).count, 1)
+    }
+}
@@ -0,0 +1,92 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import llbuild2
+import XCTest
+
+private struct Greeting: LLBPolymorphicSerializable, LLBCachedDecodedValue, Equatable {
+    let text: String
+
+    init(text: String) {
+        self.text = text
+    }
+
+    init(from bytes: LLBByteBuffer) throws {
+        self.text = String(decoding: bytes.readableBytesView, as: UTF8.self)
+    }
+
+    func toBytes(into buffer: inout LLBByteBuffer) throws {
+        buffer.writeString(text)
+    }
+}
+
+private struct Farewell: LLBPolymorphicSerializable, Equatable {
+    let text: String
+
+    init(text: String) {
+        self.text = text
+    }
+
+    init(from bytes: LLBByteBuffer) throws {
+        self.text = String(decoding: bytes.readableBytesView, as: UTF8.self)
+    }
+
+    func toBytes(into buffer: inout LLBByteBuffer) throws {
+        buffer.writeString(text)
+    }
+}
+
+class AnySerializableTests: XCTestCase {
+    func testPolymorphicIdentifier() {
+        XCTAssertEqual(Greeting.polymorphicIdentifier, "Greeting")
+        XCTAssertEqual(Greeting.polymorphicIdentifier, String(describing: Greeting.self))
+    }
+
+    func testDeserializeCachesDecodedValues() throws {
+        let registry = LLBSerializableRegistry()
+        registry.register(type: Greeting.self)
+        registry.register(type: Farewell.self)
+
+        let greeting = try LLBAnySerializable(from: Greeting(text: "hello"))
+        let first: LLBPolymorphicSerializable = try greeting.deserialize(registry: registry)
+        let second: LLBPolymorphicSerializable = try greeting.deserialize(registry: registry)
+        XCTAssertEqual(first as? Greeting, Greeting(text: "hello"))
+        XCTAssertEqual(second as? Greeting, Greeting(text: "hello"))
+
+        let counts = try XCTUnwrap(registry.decodedValues).counts
+        XCTAssertEqual(counts.hits, 1)
+        XCTAssertEqual(counts.misses, 1)
+
+        // Types that don't opt into the cache are decoded every time, without touching the cache.
+        let farewell = try LLBAnySerializable(from: Farewell(text: "hello"))
+        for _ in 0..<2 {
+            let decodedFarewell: LLBPolymorphicSerializable = try farewell.deserialize(registry: registry)
+            XCTAssertEqual(decodedFarewell as? Farewell, Farewell(text: "hello"))
+        }
+        let newCounts = try XCTUnwrap(registry.decodedValues).counts
+        XCTAssertEqual(newCounts.hits, 1)
+        XCTAssertEqual(newCounts.misses, 1)
+    }
+
+    func testDeserializeRequiresRegisteredType() throws {
+        let registry = LLBSerializableRegistry()
+        let greeting = try LLBAnySerializable(from: Greeting(text: "hello"))
+
+        // Even when the expected type matches, only registered types are deserialized.
+        XCTAssertThrowsError(try greeting.deserialize(registry: registry) as Greeting) { error in
+            guard case LLBAnySerializableError.unknownType("Greeting") = error else {
+                return XCTFail("unexpected error: \(error)")
+            }
+        }
+        XCTAssertThrowsError(try greeting.deserialize(registry: registry) as LLBPolymorphicSerializable)
+
+        registry.register(type: Greeting.self)
+        let decoded: Greeting = try greeting.deserialize(registry: registry)
+        XCTAssertEqual(decoded, Greeting(text: "hello"))
+    }
+}
@@ -0,0 +1,100 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import XCTest
+
+import llbuild2
+import NIOConcurrencyHelpers
+
+/// Writes batches to an in-memory database, counting the batches and the individual writes.
+private final class CountingBatchDatabase: LLBBatchPutCASDatabase {
+    let database: LLBCASDatabase
+    private let batchCount = NIOAtomic<Int>.makeAtomic(value: 0)
+    private let putCount = NIOAtomic<Int>.makeAtomic(value: 0)
+
+    var group: LLBFuturesDispatchGroup {
+        return database.group
+    }
+
+    var batches: Int {
+        return batchCount.load()
+    }
+
+    var puts: Int {
+        return putCount.load()
+    }
+
+    init(group: LLBFuturesDispatchGroup) {
+        self.database = LLBInMemoryCASDatabase(group: group)
+    }
+
+    func supportedFeatures() -> LLBFuture<LLBCASFeatures> {
+        return database.supportedFeatures()
+    }
+
+    func contains(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<Bool> {
+        return database.contains(id, ctx)
+    }
+
+    func get(_ id: LLBDataID, _ ctx: Context) -> LLBFuture<LLBCASObject?> {
+        return database.get(id, ctx)
+    }
+
+    func identify(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        return database.identify(refs: refs, data: data, ctx)
+    }
+
+    func put(refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        _ = putCount.add(1)
+        return database.put(refs: refs, data: data, ctx)
+    }
+
+    func put(knownID id: LLBDataID, refs: [LLBDataID], data: LLBByteBuffer, _ ctx: Context) -> LLBFuture<LLBDataID> {
+        _ = putCount.add(1)
+        return database.put(knownID: id, refs: refs, data: data, ctx)
+    }
+
+    func batchPut(_ objects: [LLBCASObject], _ ctx: Context) -> LLBFuture<[LLBDataID]> {
+        _ = batchCount.add(1)
+        return database.put(objects: objects, ctx)
+    }
+}
+
+final class BatchCASDatabaseTests: XCTestCase {
+    let group = LLBMakeDefaultDispatchGroup()
+
+    private func makeObjects() -> [LLBCASObject] {
+        return (0..<10).map { LLBCASObject(refs: [], data: LLBByteBuffer.withBytes(ArraySlice("object\($0)".utf8))) }
+    }
+
+    func testPutObjectsPreservesOrder() throws {
+        let ctx = Context()
+        let db = LLBInMemoryCASDatabase(group: group)
+        let objects = makeObjects()
+
+        let ids = try db.put(objects: objects, ctx).wait()
+        XCTAssertEqual(ids.count, objects.count)
+        for (object, id) in zip(objects, ids) {
+            XCTAssertEqual(try db.get(id, ctx).wait()?.data, object.data)
+        }
+        XCTAssertEqual(try db.put(objects: [], ctx).wait(), [])
+    }
+
+    func testBatchesAreForwardedThroughMetrics() throws {
+        let ctx = Context()
+        let batchingDB = CountingBatchDatabase(group: group)
+        let metrics = LLBInMemoryMetrics()
+        let db = LLBMetricsCASDatabase(batchingDB, metrics: metrics)
+
+        let ids = try db.put(objects: makeObjects(), ctx).wait()
+        XCTAssertEqual(ids.count, 10)
+        XCTAssertEqual(batchingDB.batches, 1)
+        XCTAssertEqual(batchingDB.puts, 0)
+        XCTAssertEqual(metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", "batch_put")]), 1)
+    }
+}
@@ -0,0 +1,73 @@
+// This source file is part of the Swift.org open source project
+//
+// Copyright (c) 2020 Apple Inc. and the Swift project authors
+// Licensed under Apache License v2.0 with Runtime Library Exception
+//
+// See http://swift.org/LICENSE.txt for license information
+// See http://swift.org/CONTRIBUTORS.txt for the list of Swift project authors
+
+import XCTest
+
+import llbuild2
+
+final class BoundedLRUTests: XCTestCase {
+    func testEvictsLeastRecentlyUsed() {
+        let lru = LLBBoundedLRU<String, Int>(capacity: 3)
+        lru.insert(1, for: "a")
+        lru.insert(2, for: "b")
+        lru.insert(3, for: "c")
+
+        // Reading "a" makes "b" the least recently used entry.
+        XCTAssertEqual(lru["a"], 1)
+
+        let evicted = lru.insert(4, for: "d")
+        XCTAssertEqual(evicted.map { $0.key }, ["b"])
+        XCTAssertEqual(lru.count, 3)
+        XCTAssertNil(lru["b"])
+        XCTAssertEqual(lru["a"], 1)
+        XCTAssertEqual(lru["c"], 3)
+        XCTAssertEqual(lru["d"], 4)
+    }
+
+    func testCosts() {
+        let lru = LLBBoundedLRU<String, Int>(capacity: 10)
+        lru.insert(1, for: "a", cost: 4)
+        lru.insert(2, for: "b", cost: 4)
+        XCTAssertEqual(lru.totalCost, 8)
+
+        // Replacing an entry replaces its cost.
+        lru.insert(3, for: "a", cost: 2)
+        XCTAssertEqual(lru.totalCost, 6)
+
+        // Entries larger than the capacity are evicted right away.
+        let evicted = lru.insert(4, for: "c", cost: 11)
+        XCTAssertEqual(evicted.map { $0.key }, ["c"])
+        XCTAssertFalse(lru.contains("c"))
+        XCTAssertEqual(lru.totalCost, 6)
+
+        // Inserting "d" evicts "b", the least recently used entry, which is enough to fit it.
+        XCTAssertEqual(lru.insert(5, for: "d", cost: 8).map { $0.key }, ["b"])
+        XCTAssertEqual(lru.totalCost, 10)
+        XCTAssertEqual(lru["a"], 3)
+    }
+
+    func testRemoval() {
+        let lru = LLBBoundedLRU<Int, Int>(capacity: nil)
+        for i in 0..<100 {
+            lru.insert(i, for: i)
+        }
+        XCTAssertEqual(lru.count, 100)
+
+        XCTAssertEqual(lru.removeValue(forKey: 42), 42)
+        XCTAssertNil(lru.removeValue(forKey: 42))
+
+        lru.removeAll { key, _ in key % 2 == 0 }
+        XCTAssertEqual(lru.count, 50)
+        XCTAssertNil(lru[10])
+        XCTAssertEqual(lru[11], 11)
+
+        lru.removeAll()
+        XCTAssertEqual(lru.count, 0)
+        XCTAssertEqual(lru.totalCost, 0)
+    }
+}
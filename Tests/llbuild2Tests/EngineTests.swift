@@ -10,6 +10,65 @@ import XCTest
 
 import llbuild2
 import LLBUtil
+import NIO
+import NIOConcurrencyHelpers
+
+private final class CountingIntFunction: LLBTypedCachingFunction<String, Int> {
+    private let lock = Lock()
+    private var _computeCount = 0
+
+    var computeCount: Int {
+        return lock.withLock { _computeCount }
+    }
+
+    override func compute(key: String, _ fi: LLBFunctionInterface, _ ctx: Context) -> LLBFuture<Int> {
+        lock.withLockVoid { _computeCount += 1 }
+        return ctx.group.next().makeSucceededFuture(Int(key.dropFirst())!)
+    }
+}
+
+private final class CachingFunctionDelegate: LLBEngineDelegate {
+    let function: LLBFunction
+
+    init(function: LLBFunction) {
+        self.function = function
+    }
+
+    func registerTypes(registry: LLBSerializableRegistry) {
+        registry.register(type: Int.self)
+    }
+
+    func lookupFunction(forKey key: LLBKey, _ ctx: Context) -> LLBFuture<LLBFunction> {
+        return ctx.group.next().makeSucceededFuture(function)
+    }
+}
+
+/// A group of two event loops whose `next()` returns the loop that the caller isn't running on, so that the choices of
+/// the locality scheduler are deterministic.
+private final class AlternatingEventLoopGroup: EventLoopGroup {
+    let first: EventLoop
+    let second: EventLoop
+
+    init(_ group: EventLoopGroup) {
+        var loops = group.makeIterator()
+        self.first = loops.next()!
+        self.second = loops.next()!
+    }
+
+    func next() -> EventLoop {
+        return first.inEventLoop ? second : first
+    }
+
+    func makeIterator() -> EventLoopIterator {
+        return EventLoopIterator([first, second])
+    }
+
+    func shutdownGracefully(queue: DispatchQueue, _ callback: @escaping (Error?) -> Void) {
+        queue.async {
+            callback(nil)
+        }
+    }
+}
 
 final class EngineTests: XCTestCase {
     func testBasicMath() {
@@ -77,6 +136,476 @@ final class EngineTests: XCTestCase {
             XCTAssertEqual(["0", "1", "2", "3", "0"], cycle as! [String])
         }
     }
+
+    func testDisabledCycleDetection() throws {
+        let intFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return ctx.group.next().makeSucceededFuture(Int((key as! String).dropFirst())!)
+        }
+        let sumFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return fi.request("v1", as: Int.self, ctx).and(fi.request("v2", as: Int.self, ctx)).map {
+                ($0.0 + $0.1) as LLBValue
+            }
+        }
+
+        let delegate = LLBStaticFunctionDelegate(keyMap: ["v1": intFunction, "v2": intFunction, "sum": sumFunction])
+        let engine = LLBEngine(delegate: delegate, detectCycles: false)
+
+        XCTAssertEqual(try engine.build(key: "sum", as: Int.self, Context()).wait(), 3)
+    }
+
+    func testResidentEntryEviction() throws {
+        let function = CountingIntFunction()
+        let engine = LLBEngine(delegate: CachingFunctionDelegate(function: function), maxResidentEntries: 1)
+        let ctx = Context()
+
+        XCTAssertEqual(try engine.build(key: "v1", as: Int.self, ctx).wait(), 1)
+        XCTAssertEqual(engine.stats, LLBEngineStats(residentEntries: 1, pendingEntries: 0, evictions: 0))
+
+        XCTAssertEqual(try engine.build(key: "v2", as: Int.self, ctx).wait(), 2)
+        XCTAssertEqual(engine.stats, LLBEngineStats(residentEntries: 1, pendingEntries: 0, evictions: 1))
+
+        // The evicted key is reloaded from the function cache instead of being computed again.
+        XCTAssertEqual(try engine.build(key: "v1", as: Int.self, ctx).wait(), 1)
+        XCTAssertEqual(engine.stats, LLBEngineStats(residentEntries: 1, pendingEntries: 0, evictions: 2))
+        XCTAssertEqual(function.computeCount, 2)
+    }
+
+    func testUnboundedResidentEntries() throws {
+        let function = CountingIntFunction()
+        let engine = LLBEngine(delegate: CachingFunctionDelegate(function: function))
+        let ctx = Context()
+
+        XCTAssertEqual(try engine.build(key: "v1", as: Int.self, ctx).wait(), 1)
+        XCTAssertEqual(try engine.build(key: "v2", as: Int.self, ctx).wait(), 2)
+        XCTAssertEqual(try engine.build(key: "v1", as: Int.self, ctx).wait(), 1)
+        XCTAssertEqual(engine.stats, LLBEngineStats(residentEntries: 2, pendingEntries: 0, evictions: 0))
+        XCTAssertEqual(function.computeCount, 2)
+    }
+
+    func testEarlyCutoff() throws {
+        let lock = Lock()
+        var input = 1
+        var evaluations = [String: Int]()
+        func recordEvaluation(_ key: LLBKey) {
+            lock.withLockVoid { evaluations[key as! String, default: 0] += 1 }
+        }
+
+        // The parity only changes when the input changes between odd and even numbers.
+        let inputFunction = LLBSimpleFunction { (fi, key, ctx) in
+            recordEvaluation(key)
+            return ctx.group.next().makeSucceededFuture(lock.withLock { input })
+        }
+        let parityFunction = LLBSimpleFunction { (fi, key, ctx) in
+            recordEvaluation(key)
+            return fi.request("input", as: Int.self, ctx).map { ($0 % 2) as LLBValue }
+        }
+        let describeFunction = LLBSimpleFunction { (fi, key, ctx) in
+            recordEvaluation(key)
+            return fi.request("parity", as: Int.self, ctx).map { ($0 + 100) as LLBValue }
+        }
+
+        let keyMap: [String: LLBFunction] = [
+            "input": inputFunction,
+            "parity": parityFunction,
+            "describe": describeFunction,
+        ]
+        let engine = LLBEngine(delegate: LLBStaticFunctionDelegate(keyMap: keyMap), earlyCutoff: true)
+        let ctx = Context()
+
+        XCTAssertEqual(try engine.build(key: "describe", as: Int.self, ctx).wait(), 101)
+
+        // The parity is recomputed but doesn't change, so its dependents aren't evaluated again.
+        lock.withLockVoid { input = 3 }
+        engine.invalidateResults()
+        XCTAssertEqual(try engine.build(key: "describe", as: Int.self, ctx).wait(), 101)
+        XCTAssertEqual(lock.withLock { evaluations }, ["input": 2, "parity": 2, "describe": 1])
+        XCTAssertEqual(engine.stats.earlyCutoffs, 1)
+
+        lock.withLockVoid { input = 4 }
+        engine.invalidateResults()
+        XCTAssertEqual(try engine.build(key: "describe", as: Int.self, ctx).wait(), 100)
+        XCTAssertEqual(lock.withLock { evaluations }, ["input": 3, "parity": 3, "describe": 2])
+        XCTAssertEqual(engine.stats.evaluationTraces, 3)
+
+        // Without traces, every key is evaluated again.
+        engine.clearEvaluationTraces()
+        XCTAssertEqual(engine.stats.evaluationTraces, 0)
+        engine.invalidateResults()
+        XCTAssertEqual(try engine.build(key: "describe", as: Int.self, ctx).wait(), 100)
+        XCTAssertEqual(lock.withLock { evaluations }, ["input": 4, "parity": 4, "describe": 3])
+    }
+
+    func testRoundRobinSchedulerDoesNotPinEvaluations() throws {
+        let threads = MultiThreadedEventLoopGroup(numberOfThreads: 2)
+        defer { try? threads.syncShutdownGracefully() }
+        let group = AlternatingEventLoopGroup(threads)
+
+        let intFunction = LLBSimpleFunction { (fi, key, ctx) in
+            // The evaluation isn't pinned to its loop, so its fan-out can use the other loops of the group.
+            XCTAssertFalse(ctx.group.next().inEventLoop)
+            return ctx.group.next().makeSucceededFuture(Int((key as! String).dropFirst())!)
+        }
+        let sumFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return fi.request("v1", as: Int.self, ctx).and(fi.request("v2", as: Int.self, ctx)).map {
+                ($0.0 + $0.1) as LLBValue
+            }
+        }
+
+        let delegate = LLBStaticFunctionDelegate(keyMap: ["v1": intFunction, "v2": intFunction, "sum": sumFunction])
+        let engine = LLBEngine(group: group, delegate: delegate)
+
+        var ctx = Context()
+        ctx.group = group
+        XCTAssertEqual(try engine.build(key: "sum", as: Int.self, ctx).wait(), 3)
+    }
+
+    func testLocalityScheduler() throws {
+        let group = MultiThreadedEventLoopGroup(numberOfThreads: 4)
+        defer { try? group.syncShutdownGracefully() }
+
+        let intFunction = LLBSimpleFunction { (fi, key, ctx) in
+            // All of the futures of an evaluation are pinned to the same event loop.
+            XCTAssert(ctx.group.next() === ctx.group.next())
+            return ctx.group.next().makeSucceededFuture(Int((key as! String).dropFirst())!)
+        }
+        let sumFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return fi.request("v1", as: Int.self, ctx).and(fi.request("v2", as: Int.self, ctx)).map {
+                ($0.0 + $0.1) as LLBValue
+            }
+        }
+
+        let delegate = LLBStaticFunctionDelegate(keyMap: ["v1": intFunction, "v2": intFunction, "sum": sumFunction])
+        let scheduler = LLBLocalityEngineScheduler()
+        let engine = LLBEngine(group: group, delegate: delegate, scheduler: scheduler)
+
+        XCTAssertEqual(try engine.build(key: "sum", as: Int.self, Context()).wait(), 3)
+
+        // The dependencies are evaluated on the loop of the key that requested them.
+        XCTAssertEqual(engine.stats.schedulerHops, 0)
+    }
+
+    func testLocalitySchedulerOverflow() throws {
+        let threads = MultiThreadedEventLoopGroup(numberOfThreads: 2)
+        defer { try? threads.syncShutdownGracefully() }
+        let group = AlternatingEventLoopGroup(threads)
+
+        // The values are held back until all of them were requested, so that the loads seen by the scheduler are
+        // known.
+        let promises = ["v1", "v2", "v3"].map { ($0, group.first.makePromise(of: Int.self)) }
+        let requested = DispatchSemaphore(value: 0)
+
+        let valueFunction = LLBSimpleFunction { (fi, key, ctx) in
+            let promise = promises.first { $0.0 == key as! String }!.1
+            return promise.futureResult.map { $0 as LLBValue }
+        }
+        let sumFunction = LLBSimpleFunction { (fi, key, ctx) in
+            let values = promises.map { fi.request($0.0, as: Int.self, ctx) }
+            requested.signal()
+            return LLBFuture.whenAllSucceed(values, on: ctx.group.next()).map { $0.reduce(0, +) as LLBValue }
+        }
+
+        let delegate = LLBStaticFunctionDelegate(keyMap: [
+            "v1": valueFunction, "v2": valueFunction, "v3": valueFunction, "sum": sumFunction,
+        ])
+        let scheduler = LLBLocalityEngineScheduler(maxLocalEvaluations: 1)
+        let engine = LLBEngine(group: group, delegate: delegate, scheduler: scheduler)
+
+        let result = engine.build(key: "sum", as: Int.self, Context())
+        requested.wait()
+
+        // "sum" fills its loop, so "v1" moves to the idle loop, "v2" stays (both loops are equally loaded) and "v3"
+        // moves to the other loop again.
+        XCTAssertEqual(scheduler.load(on: group.first), 2)
+        XCTAssertEqual(scheduler.load(on: group.second), 2)
+        XCTAssertEqual(engine.stats.schedulerHops, 2)
+
+        for (index, (_, promise)) in promises.enumerated() {
+            promise.succeed(index + 1)
+        }
+        XCTAssertEqual(try result.wait(), 6)
+    }
+
+    func testLocalitySchedulerHighPriority() throws {
+        let threads = MultiThreadedEventLoopGroup(numberOfThreads: 2)
+        defer { try? threads.syncShutdownGracefully() }
+        let group = AlternatingEventLoopGroup(threads)
+
+        let lock = Lock()
+        var loops = [String: EventLoop]()
+        let intFunction = LLBSimpleFunction { (fi, key, ctx) in
+            lock.withLockVoid { loops[key as! String] = ctx.group.next() }
+            return ctx.group.next().makeSucceededFuture(Int((key as! String).dropFirst())!)
+        }
+        let sumFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return fi.request("v1", as: Int.self, ctx).and(fi.request("v2", as: Int.self, ctx)).map {
+                ($0.0 + $0.1) as LLBValue
+            }
+        }
+
+        let delegate = LLBStaticFunctionDelegate(keyMap: ["v1": intFunction, "v2": intFunction, "sum": sumFunction])
+        let scheduler = LLBLocalityEngineScheduler(isHighPriority: { ($0 as? String) == "v1" })
+        let engine = LLBEngine(group: group, delegate: delegate, scheduler: scheduler)
+
+        XCTAssertEqual(try engine.build(key: "sum", as: Int.self, Context()).wait(), 3)
+
+        // The high priority key is placed on the least loaded loop even though its requester has room for it.
+        lock.withLockVoid {
+            XCTAssert(loops["v1"] === group.second)
+            XCTAssert(loops["v2"] === group.first)
+        }
+        XCTAssertEqual(engine.stats.schedulerHops, 1)
+    }
+
+    func testLocalitySchedulerStartsHighPriorityFirst() throws {
+        let group = MultiThreadedEventLoopGroup(numberOfThreads: 1)
+        defer { try? group.syncShutdownGracefully() }
+
+        let lock = Lock()
+        var started = [String]()
+        let intFunction = LLBSimpleFunction { (fi, key, ctx) in
+            lock.withLockVoid { started.append(key as! String) }
+            return ctx.group.next().makeSucceededFuture(Int((key as! String).dropFirst())!)
+        }
+        let sumFunction = LLBSimpleFunction { (fi, key, ctx) in
+            let values = ["v1", "v2", "v3"].map { fi.request($0, as: Int.self, ctx) }
+            return LLBFuture.whenAllSucceed(values, on: ctx.group.next()).map { $0.reduce(0, +) as LLBValue }
+        }
+
+        let delegate = LLBStaticFunctionDelegate(keyMap: [
+            "v1": intFunction, "v2": intFunction, "v3": intFunction, "sum": sumFunction,
+        ])
+        let scheduler = LLBLocalityEngineScheduler(maxLocalEvaluations: 1, isHighPriority: { ($0 as? String) == "v3" })
+        let engine = LLBEngine(group: group, delegate: delegate, scheduler: scheduler)
+
+        XCTAssertEqual(try engine.build(key: "sum", as: Int.self, Context()).wait(), 6)
+
+        // "sum" fills the only loop, so its dependencies wait in its queue, where the high priority key goes first.
+        lock.withLockVoid {
+            XCTAssertEqual(started, ["v3", "v1", "v2"])
+        }
+    }
+
+    func testTracing() throws {
+        let intFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return ctx.group.next().makeSucceededFuture(Int((key as! String).dropFirst())!)
+        }
+        let sumFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return fi.request("v1", as: Int.self, ctx).and(fi.request("v2", as: Int.self, ctx)).map {
+                ($0.0 + $0.1) as LLBValue
+            }
+        }
+
+        let delegate = LLBStaticFunctionDelegate(keyMap: ["v1": intFunction, "v2": intFunction, "sum": sumFunction])
+        let engine = LLBEngine(delegate: delegate)
+        let tracer = LLBTracer()
+        var ctx = Context()
+        ctx.tracer = tracer
+
+        XCTAssertEqual(try engine.build(key: "sum", as: Int.self, ctx).wait(), 3)
+
+        let evaluations = tracer.recordedEvents.filter { $0.category == .evaluation }
+        XCTAssertEqual(evaluations.count, 3)
+
+        // The critical path goes from the requested key to one of its dependencies.
+        let criticalPath = tracer.criticalPath()
+        XCTAssertEqual(criticalPath.count, 2)
+        XCTAssertGreaterThanOrEqual(criticalPath[0].end, criticalPath[1].end)
+
+        let trace = try JSONSerialization.jsonObject(with: tracer.chromeTraceData()) as? [String: Any]
+        let traceEvents = trace?["traceEvents"] as? [[String: Any]]
+        XCTAssertEqual(traceEvents?.filter { $0["ph"] as? String == "X" }.count, 5)
+        XCTAssertNotNil(tracer.busyTime()[.evaluation])
+    }
+
+    func testMetrics() throws {
+        let function = CountingIntFunction()
+        let engine = LLBEngine(delegate: CachingFunctionDelegate(function: function), maxResidentEntries: 0)
+        let metrics = LLBInMemoryMetrics()
+        var ctx = Context()
+        ctx.metrics = metrics
+
+        // Without resident entries, the second request goes back to the function cache.
+        XCTAssertEqual(try engine.build(key: "v1", as: Int.self, ctx).wait(), 1)
+        XCTAssertEqual(try engine.build(key: "v1", as: Int.self, ctx).wait(), 1)
+
+        let keyType = [("key_type", "String")]
+        XCTAssertEqual(metrics.counter(LLBMetricLabel.evaluations, dimensions: keyType), 2)
+        XCTAssertEqual(metrics.histogram(LLBMetricLabel.evaluationDuration, dimensions: keyType)?.count, 2)
+        XCTAssertEqual(metrics.counter(LLBMetricLabel.functionCacheMisses, dimensions: keyType), 1)
+        XCTAssertEqual(metrics.counter(LLBMetricLabel.functionCacheHits, dimensions: keyType), 1)
+        XCTAssertEqual(metrics.counter(LLBMetricLabel.casOperations, dimensions: [("operation", "put")]), 1)
+        XCTAssertGreaterThan(metrics.counter(LLBMetricLabel.casBytes, dimensions: [("operation", "put")]), 0)
+    }
+
+    /// Returns a delegate where "all" requests a "slow" key, which waits on `release` before requesting "late", and a
+    /// "fail" key that fails right away.
+    private func failingBuildDelegate(release: LLBPromise<Void>, evaluated: @escaping (String) -> Void) -> LLBEngineDelegate {
+        let failFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return ctx.group.next().makeFailedFuture(LLBError.invalidValueType("failed"))
+        }
+        let slowFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return release.futureResult.flatMap {
+                fi.request("late", as: Int.self, ctx)
+            }.map { $0 as LLBValue }
+        }
+        let lateFunction = LLBSimpleFunction { (fi, key, ctx) in
+            evaluated(key as! String)
+            return ctx.group.next().makeSucceededFuture(1)
+        }
+        let allFunction = LLBSimpleFunction { (fi, key, ctx) in
+            return fi.request("slow", as: Int.self, ctx).and(fi.request("fail", as: Int.self, ctx)).map {
+                ($0.0 + $0.1) as LLBValue
+            }
+        }
+
+        let keyMap: [String: LLBFunction] = [
+            "all": allFunction,
+            "slow": slowFunction,
+            "late": lateFunction,
+            "fail": failFunction,
+            "other": slowFunction,
+        ]
+        return LLBStaticFunctionDelegate(keyMap: keyMap)
+    }
+
+    func testFailedBuildCancelsRemainingWork() throws {
+        let group = MultiThreadedEventLoopGroup(numberOfThreads: 1)
+        defer { try? group.syncShutdownGracefully() }
+
+        let lock = Lock()
+        var evaluated = [String]()
+        let release = group.next().makePromise(of: Void.self)
+        let delegate = failingBuildDelegate(release: release) { key in
+            lock.withLockVoid { evaluated.append(key) }
+        }
+        let engine = LLBEngine(group: group, delegate: delegate)
+
+        let token = LLBCancellationToken()
+        var ctx = Context()
+        ctx.cancellationToken = token
+
+        XCTAssertThrowsError(try engine.build(key: "all", ctx).wait())
+        XCTAssertTrue(token.isCancelled)
+
+        // The slow branch is still running, but can't request new keys once the build is cancelled.
+        release.succeed(())
+        XCTAssertThrowsError(try engine.build(key: "slow", ctx).wait()) { error in
+            guard case LLBCancellationError.cancelled = error else {
+                XCTFail("Unexpected error \(error)")
+                return
+            }
+        }
+        XCTAssertEqual(lock.withLock { evaluated }, [])
+
+        // Cancelled results aren't kept, so the key is evaluated again by the next build.
+        var newCtx = Context()
+        newCtx.cancellationToken = LLBCancellationToken()
+        XCTAssertEqual(try engine.build(key: "slow", as: Int.self, newCtx).wait(), 1)
+        XCTAssertEqual(lock.withLock { evaluated }, ["late"])
+    }
+
+    func testKeepGoing() throws {
+        let group = MultiThreadedEventLoopGroup(numberOfThreads: 1)
+        defer { try? group.syncShutdownGracefully() }
+
+        let lock = Lock()
+        var evaluated = [String]()
+        let release = group.next().makePromise(of: Void.self)
+        let delegate = failingBuildDelegate(release: release) { key in
+            lock.withLockVoid { evaluated.append(key) }
+        }
+        let engine = LLBEngine(group: group, delegate: delegate, keepGoing: true)
+
+        let token = LLBCancellationToken()
+        var ctx = Context()
+        ctx.cancellationToken = token
+
+        XCTAssertThrowsError(try engine.build(key: "all", ctx).wait())
+        XCTAssertFalse(token.isCancelled)
+
+        release.succeed(())
+        XCTAssertEqual(try engine.build(key: "slow", as: Int.self, ctx).wait(), 1)
+        XCTAssertEqual(lock.withLock { evaluated }, ["late"])
+    }
+
+    func testSharedEvaluationsOutliveCancelledRequesters() throws {
+        let group = MultiThreadedEventLoopGroup(numberOfThreads: 1)
+        defer { try? group.syncShutdownGracefully() }
+
+        let lock = Lock()
+        var evaluated = [String]()
+        let release = group.next().makePromise(of: Void.self)
+        let delegate = failingBuildDelegate(release: release) { key in
+            lock.withLockVoid { evaluated.append(key) }
+        }
+        let engine = LLBEngine(group: group, delegate: delegate)
+
+        func context() -> (Context, LLBCancellationToken) {
+            var ctx = Context()
+            let token = LLBCancellationToken()
+            ctx.cancellationToken = token
+            return (ctx, token)
+        }
+
+        // Cancelling one of the builds that share an evaluation fails that build right away, but the evaluation goes
+        // on for the other one.
+        let (firstCtx, firstToken) = context()
+        let (secondCtx, _) = context()
+        let first = engine.build(key: "slow", as: Int.self, firstCtx)
+        let second = engine.build(key: "slow", as: Int.self, secondCtx)
+        firstToken.cancel(reason: "first build stopped")
+        XCTAssertThrowsError(try first.wait()) { error in
+            guard case LLBCancellationError.cancelled("first build stopped") = error else {
+                XCTFail("Unexpected error \(error)")
+                return
+            }
+        }
+
+        // Once every build waiting for an evaluation is cancelled, a later build starts a new one instead of joining
+        // the cancelled evaluation.
+        let (thirdCtx, thirdToken) = context()
+        let third = engine.build(key: "other", as: Int.self, thirdCtx)
+        thirdToken.cancel(reason: "third build stopped")
+        XCTAssertThrowsError(try third.wait())
+        let (fourthCtx, _) = context()
+        let fourth = engine.build(key: "other", as: Int.self, fourthCtx)
+
+        release.succeed(())
+        XCTAssertEqual(try second.wait(), 1)
+        XCTAssertEqual(try fourth.wait(), 1)
+        XCTAssertEqual(lock.withLock { evaluated }, ["late"])
+    }
+
+    func testCancellationToken() {
+        let token = LLBCancellationToken()
+        var reasons = [String]()
+        token.onCancel { reasons.append("first: \($0)") }
+        let removed = token.onCancel { reasons.append("removed: \($0)") }
+        token.remove(removed)
+        XCTAssertNoThrow(try token.checkCancelled())
+
+        token.cancel(reason: "stop")
+        token.cancel(reason: "ignored")
+        XCTAssertEqual(token.reason, "stop")
+        XCTAssertThrowsError(try token.checkCancelled())
+
+        // Handlers registered after cancellation run right away.
+        token.onCancel { reasons.append("late: \($0)") }
+        XCTAssertEqual(reasons, ["first: stop", "late: stop"])
+    }
+
+    func testInternedKeyIdentity() {
+        let internedKey = LLBInternedKey("key")
+        XCTAssertEqual(internedKey.stableHashValue, "key".stableHashValue)
+        XCTAssertEqual(internedKey.key as? String, "key")
+
+        // Re-interning an interned key should not wrap it again.
+        let reinternedKey = LLBInternedKey(internedKey)
+        XCTAssertEqual(reinternedKey, internedKey)
+        XCTAssertEqual(reinternedKey.key as? String, "key")
+
+        XCTAssertNotEqual(LLBInternedKey("otherKey"), internedKey)
+    }
 }
 
 extension Int: LLBValue {}
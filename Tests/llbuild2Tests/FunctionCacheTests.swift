@@ -33,6 +33,29 @@ final class FunctionCacheTests: XCTestCase {
         try doFunctionCacheTests(cache: cache)
     }
 
+    func testInMemoryFunctionCacheInlineValues() throws {
+        let ctx = Context()
+        let cache = LLBInMemoryFunctionCache(group: group, inlineValueLimit: 8)
+
+        let smallObject = LLBCASObject(refs: [], data: LLBByteBuffer.withBytes(ArraySlice("small".utf8)))
+        let smallID = LLBDataID(blake3hash: smallObject.data, refs: [])
+        try cache.update(key: "small", entry: LLBFunctionCacheEntry(id: smallID, object: smallObject), ctx).wait()
+
+        let largeObject = LLBCASObject(refs: [], data: LLBByteBuffer.withBytes(ArraySlice("large value".utf8)))
+        let largeID = LLBDataID(blake3hash: largeObject.data, refs: [])
+        try cache.update(key: "large", entry: LLBFunctionCacheEntry(id: largeID, object: largeObject), ctx).wait()
+
+        let smallEntry = try cache.getEntry(key: "small", ctx).wait()
+        XCTAssertEqual(smallEntry?.id, smallID)
+        XCTAssertEqual(smallEntry?.object?.data, smallObject.data)
+
+        // Values over the limit only keep their ID.
+        let largeEntry = try cache.getEntry(key: "large", ctx).wait()
+        XCTAssertEqual(largeEntry?.id, largeID)
+        XCTAssertNil(largeEntry?.object)
+        XCTAssertEqual(try cache.get(key: "large", ctx).wait(), largeID)
+    }
+
     func testFileBackedFunctionCache() throws {
         try withTemporaryDirectory(dir: temporaryPath, prefix: "LLBFunctionCacheTests" + #function, removeTreeOnDeinit: true) { tmpDir in
             let cache = LLBFileBackedFunctionCache(group: group, path: tmpDir)
@@ -40,4 +63,106 @@ final class FunctionCacheTests: XCTestCase {
         }
 
     }
+
+    func testLogStructuredFunctionCache() throws {
+        try withTemporaryDirectory(dir: temporaryPath, prefix: "LLBFunctionCacheTests" + #function, removeTreeOnDeinit: true) { tmpDir in
+            let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+            try doFunctionCacheTests(cache: cache)
+        }
+    }
+
+    func testLogStructuredFunctionCachePersistence() throws {
+        let ctx = Context()
+        let id1 = LLBDataID(blake3hash: LLBByteBuffer.withBytes(ArraySlice("value1".utf8)), refs: [])
+        let id2 = LLBDataID(blake3hash: LLBByteBuffer.withBytes(ArraySlice("value2".utf8)), refs: [])
+
+        try withTemporaryDirectory(dir: temporaryPath, prefix: "LLBFunctionCacheTests" + #function, removeTreeOnDeinit: true) { tmpDir in
+            do {
+                let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir, compactionThreshold: 2)
+                try cache.update(key: "key1", value: id1, ctx).wait()
+                try cache.update(key: "key2", value: id1, ctx).wait()
+                // Superseding entries grows the log past the compaction threshold.
+                try cache.update(key: "key1", value: id2, ctx).wait()
+                try cache.update(key: "key2", value: id2, ctx).wait()
+                try cache.update(key: "key2", value: id1, ctx).wait()
+                try cache.compact().wait()
+            }
+
+            let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+            XCTAssertEqual(id2, try cache.get(key: "key1", ctx).wait())
+            XCTAssertEqual(id1, try cache.get(key: "key2", ctx).wait())
+            XCTAssertNil(try cache.get(key: "key3", ctx).wait())
+        }
+    }
+
+    func testLogStructuredFunctionCacheSkipsCorruptedRecords() throws {
+        let ctx = Context()
+        let id1 = LLBDataID(blake3hash: LLBByteBuffer.withBytes(ArraySlice("value1".utf8)), refs: [])
+        let id2 = LLBDataID(blake3hash: LLBByteBuffer.withBytes(ArraySlice("value2".utf8)), refs: [])
+
+        try withTemporaryDirectory(dir: temporaryPath, prefix: "LLBFunctionCacheTests" + #function, removeTreeOnDeinit: true) { tmpDir in
+            do {
+                let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+                try cache.update(key: "key1", value: id1, ctx).wait()
+                try cache.update(key: "key2", value: id1, ctx).wait()
+                try cache.update(key: "key3", value: id1, ctx).wait()
+            }
+
+            // All of the records have the same size, so the last byte of the second one is in its value. Flip it,
+            // and leave a partial record at the end of the log as if a write was interrupted.
+            let logPath = tmpDir.appending(components: "default", "functioncache.log")
+            var bytes = try localFileSystem.readFileContents(logPath).contents
+            let recordLength = bytes.count / 3
+            bytes[2 * recordLength - 1] ^= 0xff
+            bytes += bytes[0..<(recordLength / 2)]
+            try localFileSystem.writeFileContents(logPath, bytes: ByteString(bytes))
+
+            do {
+                let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+                XCTAssertEqual(id1, try cache.get(key: "key1", ctx).wait())
+                XCTAssertNil(try cache.get(key: "key2", ctx).wait())
+                XCTAssertEqual(id1, try cache.get(key: "key3", ctx).wait())
+                try cache.update(key: "key2", value: id2, ctx).wait()
+            }
+
+            // Only the partial record was discarded, so the records appended afterwards are found.
+            let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+            XCTAssertEqual(id1, try cache.get(key: "key1", ctx).wait())
+            XCTAssertEqual(id2, try cache.get(key: "key2", ctx).wait())
+            XCTAssertEqual(id1, try cache.get(key: "key3", ctx).wait())
+        }
+    }
+
+    func testLogStructuredFunctionCacheSkipsCorruptedHeaders() throws {
+        let ctx = Context()
+        let id1 = LLBDataID(blake3hash: LLBByteBuffer.withBytes(ArraySlice("value1".utf8)), refs: [])
+
+        try withTemporaryDirectory(dir: temporaryPath, prefix: "LLBFunctionCacheTests" + #function, removeTreeOnDeinit: true) { tmpDir in
+            do {
+                let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+                try cache.update(key: "key1", value: id1, ctx).wait()
+                try cache.update(key: "key2", value: id1, ctx).wait()
+                try cache.update(key: "key3", value: id1, ctx).wait()
+            }
+
+            // Corrupt the payload length in the header of the second record, which must not be mistaken for the end
+            // of the log.
+            let logPath = tmpDir.appending(components: "default", "functioncache.log")
+            var bytes = try localFileSystem.readFileContents(logPath).contents
+            let recordLength = bytes.count / 3
+            bytes[recordLength + 5] ^= 0xff
+            try localFileSystem.writeFileContents(logPath, bytes: ByteString(bytes))
+
+            do {
+                let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+                XCTAssertEqual(id1, try cache.get(key: "key1", ctx).wait())
+                XCTAssertNil(try cache.get(key: "key2", ctx).wait())
+                XCTAssertEqual(id1, try cache.get(key: "key3", ctx).wait())
+            }
+
+            // The records after the corrupted one were kept on disk.
+            let cache = LLBLogStructuredFunctionCache(group: group, path: tmpDir)
+            XCTAssertEqual(id1, try cache.get(key: "key3", ctx).wait())
+        }
+    }
 }
@@ -40,5 +40,69 @@ final class KeyDependencyGraphTests: XCTestCase {
             XCTAssertEqual([4, 1, 2, 3, 4], cycle as! [Int])
         }
     }
-}
 
+    func testReorderWithoutCycle() throws {
+        let keyDependencyGraph = LLBKeyDependencyGraph()
+
+        // Add edges so that the later edges go against the order in which the keys were first seen.
+        XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: 3, to: 4))
+        XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: 1, to: 2))
+        XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: 4, to: 1))
+        XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: 5, to: 3))
+
+        // After reordering, closing the loop must still be detected.
+        XCTAssertThrowsError(try keyDependencyGraph.addEdge(from: 2, to: 5)) { error in
+            guard case let LLBKeyDependencyGraphError.cycleDetected(cycle) = error else {
+                XCTFail("Unexpected error type")
+                return
+            }
+
+            XCTAssertEqual([2, 5, 3, 4, 1, 2], cycle as! [Int])
+        }
+    }
+
+    func testRemovedEdgesAllowNewEdges() throws {
+        let keyDependencyGraph = LLBKeyDependencyGraph()
+
+        XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: 1, to: 2))
+        XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: 1, to: 2))
+        XCTAssertThrowsError(try keyDependencyGraph.addEdge(from: 2, to: 1))
+
+        // The edge is recorded twice, so it is still active after the first removal.
+        keyDependencyGraph.removeEdge(from: 1, to: 2)
+        XCTAssertThrowsError(try keyDependencyGraph.addEdge(from: 2, to: 1))
+
+        keyDependencyGraph.removeEdge(from: 1, to: 2)
+        XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: 2, to: 1))
+    }
+
+    func testSelfCycle() throws {
+        let keyDependencyGraph = LLBKeyDependencyGraph()
+
+        XCTAssertThrowsError(try keyDependencyGraph.addEdge(from: 1, to: 1)) { error in
+            guard case let LLBKeyDependencyGraphError.cycleDetected(cycle) = error else {
+                XCTFail("Unexpected error type")
+                return
+            }
+
+            XCTAssertEqual([1, 1], cycle as! [Int])
+        }
+    }
+
+    func testConcurrentEdges() throws {
+        let keyDependencyGraph = LLBKeyDependencyGraph(shardCount: 4)
+
+        // Build many independent chains concurrently, in an order that forces reordering within each chain.
+        DispatchQueue.concurrentPerform(iterations: 64) { chain in
+            let base = chain * 100
+            for i in (0..<10).reversed() {
+                XCTAssertNoThrow(try keyDependencyGraph.addEdge(from: base + i, to: base + i + 1))
+            }
+        }
+
+        for chain in 0..<64 {
+            let base = chain * 100
+            XCTAssertThrowsError(try keyDependencyGraph.addEdge(from: base + 10, to: base))
+        }
+    }
+}